@@ -0,0 +1,392 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * pool of apply threads for pipelined scans (option -w)
+ *
+ * The scanning threads don't change the owners of the entries they find themselves. They
+ * collect change records per directory into batches of up to APPLY_BATCH entries and publish
+ * full batches, round robin, to the inboxes of the apply threads. An inbox is a lock-free
+ * stack: a producer pushes a batch with a compare-and-swap, the apply thread takes all of it
+ * at once with an exchange and reverses it, so batches are applied in the order they were
+ * published and there's no ABA problem. A producer only takes the mutex of an inbox to wake
+ * its apply thread when the inbox was empty. The apply thread sorts the entries of a batch by
+ * inode number, which keeps the metadata writes within a directory close together, and
+ * changes them with the same code a scanning thread uses otherwise: logging, journal, metrics
+ * and rate limit included. If more than APPLY_QUEUED batches per apply thread are pending the
+ * scanning threads wait, so the backlog stays bounded.
+ */
+
+#include "chuid.h"
+
+#ifdef HAVE_STDATOMIC_H
+
+#define APPLY_BATCH     256
+#define APPLY_QUEUED    64
+
+typedef struct apply_rec {
+    dev_t               dev;
+    ino_t               ino;
+    uid_t               uid;
+    gid_t               gid;
+    size_t              name;
+    const char          *type;
+    const idmap_entry_t *uptr;
+    const idmap_entry_t *gptr;
+} apply_rec_t;
+
+typedef struct apply_batch {
+    struct apply_batch  *next;
+    char                *dirname;
+    rate_bucket_t       *bucket;
+    apply_rec_t         *recs;
+    size_t              count;
+    size_t              size;
+    char                *names;
+    size_t              nlen;
+    size_t              nsize;
+} apply_batch_t;
+
+/*
+ * inbox of an apply thread, padded so that two inboxes never share a cache line
+ */
+typedef struct apply_inbox {
+    _Atomic(apply_batch_t *) head;
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    pthread_t           thread;
+    unsigned int        tid;
+    char                pad[CACHE_LINE];
+} apply_inbox_t;
+
+/*
+ * batch a scanning thread is filling
+ */
+typedef struct apply_pending {
+    apply_batch_t       *batch;
+    size_t              next;
+    char                pad[CACHE_LINE];
+} apply_pending_t;
+
+static apply_inbox_t    *inboxes = NULL;
+static size_t           ninboxes = 0;
+static apply_pending_t  *pending = NULL;
+static size_t           npending = 0;
+static const apply_fn_t *apply_fn = NULL;
+static short int        apply_fdrelative = 0;
+static atomic_long      apply_queued;
+static atomic_ulong     apply_waits;
+static atomic_ulong     apply_done;
+static atomic_int       apply_stop;
+
+static int
+        apply_cmp(const void *a, const void *b) {
+
+    const apply_rec_t *x = (const apply_rec_t *) a;
+    const apply_rec_t *y = (const apply_rec_t *) b;
+
+    return (x->ino < y->ino) ? -1 : (x->ino > y->ino);
+}
+
+static void
+        apply_batch(const unsigned int tid, apply_batch_t *b) {
+
+/*
+ * Description:
+ * Changes the entries of a batch in the order of their inode numbers.
+ *
+ */
+    tile_entry_t    te;
+    struct stat     statbuf;
+    apply_rec_t     *r;
+    apply_fn_t      fn = apply_fn[b->bucket != NULL];
+    size_t          i;
+
+    if (b->count > 1)
+        qsort(b->recs, b->count, sizeof (apply_rec_t), apply_cmp);
+    memset(&te, 0, sizeof (tile_entry_t));
+    memset(&statbuf, 0, sizeof (struct stat));
+    te.dfd = AT_FDCWD;
+    te.dirname = b->dirname;
+    te.bucket = b->bucket;
+    if (apply_fdrelative) {
+        errno = 0;
+        if ((te.dfd = open(b->dirname, O_RDONLY | O_DIRECTORY)) < 0) {
+            print_errno_r(WARNING, errno, "couldn't open", b->dirname);
+            te.dfd = AT_FDCWD;
+        }
+    }
+    for (i = 0; i < b->count; i++) {
+        r = &b->recs[i];
+        statbuf.st_dev = r->dev;
+        statbuf.st_ino = r->ino;
+        statbuf.st_uid = r->uid;
+        statbuf.st_gid = r->gid;
+        te.name = b->names + r->name;
+        te.pathvalid = 0;
+        fn(tid, &te, &statbuf, r->type, r->uptr, r->gptr);
+    }
+    if (te.dfd != AT_FDCWD)
+        close(te.dfd);
+    free(te.path);
+    atomic_fetch_add(&apply_done, b->count);
+}
+
+static void
+        apply_free(apply_batch_t *b) {
+
+    free(b->dirname);
+    free(b->recs);
+    free(b->names);
+    free(b);
+}
+
+static void *
+        apply_worker(void *arg) {
+
+/*
+ * Description:
+ * Apply thread: takes the batches of its inbox until the pool is stopped and the inbox is
+ * empty.
+ *
+ */
+    apply_inbox_t   *in = (apply_inbox_t *) arg;
+    apply_batch_t   *list, *fifo, *b;
+    struct timespec ts;
+
+    log_register(in->tid);
+    for (;;) {
+        if ((list = atomic_exchange(&in->head, NULL)) == NULL) {
+            if (atomic_load(&apply_stop))
+                break;
+            pthread_mutex_lock(&in->lock);
+            if (atomic_load(&in->head) == NULL && !atomic_load(&apply_stop)) {
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_nsec += 100000000L;
+                if (ts.tv_nsec >= 1000000000L) {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&in->cond, &in->lock, &ts);
+            }
+            pthread_mutex_unlock(&in->lock);
+            continue;
+        }
+        for (fifo = NULL; list != NULL; list = b) {
+            b = list->next;
+            list->next = fifo;
+            fifo = list;
+        }
+        while ((b = fifo) != NULL) {
+            fifo = b->next;
+            apply_batch(in->tid, b);
+            apply_free(b);
+            atomic_fetch_sub(&apply_queued, 1);
+        }
+    }
+    return NULL;
+}
+
+void
+        apply_init(const size_t nthreads, const size_t producers, const unsigned int base, const short int fdrelative, const apply_fn_t *fn) {
+
+/*
+ * Description:
+ * Starts the apply threads. Exits if they can't be started.
+ *
+ * Parameters:
+ * nthreads:    number of apply threads
+ * producers:   number of scanning threads
+ * base:        thread id of the first apply thread, the others follow
+ * fdrelative:  change the entries relative to their directory (option -f)
+ * fn:          functions changing the owner of an entry, fn[1] for entries with a rate limit
+ *
+ */
+    size_t  i;
+
+    if ((inboxes = (apply_inbox_t *) calloc(nthreads, sizeof (apply_inbox_t))) == NULL ||
+        (pending = (apply_pending_t *) calloc(producers, sizeof (apply_pending_t))) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for apply threads\n");
+        exit(ENOMEM);
+    }
+    ninboxes = nthreads;
+    npending = producers;
+    apply_fn = fn;
+    apply_fdrelative = fdrelative;
+    atomic_init(&apply_queued, 0);
+    atomic_init(&apply_waits, 0);
+    atomic_init(&apply_done, 0);
+    atomic_init(&apply_stop, 0);
+    for (i = 0; i < producers; i++)
+        pending[i].next = i % nthreads;
+    for (i = 0; i < nthreads; i++) {
+        atomic_init(&inboxes[i].head, NULL);
+        pthread_mutex_init(&inboxes[i].lock, NULL);
+        pthread_cond_init(&inboxes[i].cond, NULL);
+        inboxes[i].tid = base + (unsigned int) i;
+        errno = 0;
+        if (pthread_create(&inboxes[i].thread, NULL, apply_worker, (void *) &inboxes[i]) != 0) {
+            fprintf(stderr, "ERROR: Apply thread did not start!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void
+        apply_flush(const unsigned int tid) {
+
+/*
+ * Description:
+ * Publishes the batch scanning thread tid is filling. Waits while too many batches are
+ * pending.
+ *
+ */
+    apply_pending_t *p = &pending[tid];
+    apply_inbox_t   *in;
+    apply_batch_t   *b = p->batch, *old;
+    short int       waited = 0;
+
+    if (b == NULL)
+        return;
+    p->batch = NULL;
+    while (atomic_load(&apply_queued) >= (long) (APPLY_QUEUED * ninboxes)) {
+        waited = 1;
+        usleep(1000);
+    }
+    if (waited)
+        atomic_fetch_add(&apply_waits, 1);
+    atomic_fetch_add(&apply_queued, 1);
+    in = &inboxes[p->next];
+    p->next = (p->next + 1) % ninboxes;
+    old = atomic_load(&in->head);
+    do {
+        b->next = old;
+    } while (!atomic_compare_exchange_weak(&in->head, &old, b));
+    if (old == NULL) {
+        pthread_mutex_lock(&in->lock);
+        pthread_cond_signal(&in->cond);
+        pthread_mutex_unlock(&in->lock);
+    }
+}
+
+void
+        apply_queue(const unsigned int tid, const tile_entry_t *te, const struct stat *statbuf, const char *type, const idmap_entry_t *uptr, const idmap_entry_t *gptr) {
+
+/*
+ * Description:
+ * Adds the change of a directory entry to the batch of scanning thread tid. A batch holds the
+ * entries of one directory; it is published when it's full or an entry of another directory
+ * is added.
+ *
+ * Parameters:
+ * tid:         thread id
+ * te:          directory entry
+ * statbuf:     data returned by lstat for the entry
+ * type:        entry type used for reporting
+ * uptr, gptr:  mappings of the uid and gid of the entry, NULL if they aren't changed
+ *
+ */
+    apply_pending_t *p = &pending[tid];
+    apply_batch_t   *b = p->batch;
+    apply_rec_t     *r;
+    size_t          len = strlen(te->name) + 1;
+
+    if (b != NULL && (b->count == APPLY_BATCH || strcmp(b->dirname, te->dirname) != 0)) {
+        apply_flush(tid);
+        b = NULL;
+    }
+    if (b == NULL) {
+        if ((b = (apply_batch_t *) malloc(sizeof (apply_batch_t))) == NULL ||
+            (b->dirname = strdup(te->dirname)) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for apply batch\n");
+            exit(ENOMEM);
+        }
+        b->next = NULL;
+        b->bucket = te->bucket;
+        b->recs = NULL;
+        b->count = b->size = 0;
+        b->names = NULL;
+        b->nlen = b->nsize = 0;
+        p->batch = b;
+    }
+    if (b->count == b->size) {
+        b->size = (b->size == 0) ? 16 : 2 * b->size;
+        if ((b->recs = (apply_rec_t *) realloc(b->recs, b->size * sizeof (apply_rec_t))) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for apply batch\n");
+            exit(ENOMEM);
+        }
+    }
+    if (b->nlen + len > b->nsize) {
+        b->nsize = (b->nsize == 0) ? 256 : 2 * b->nsize;
+        if (b->nsize < b->nlen + len)
+            b->nsize = b->nlen + len;
+        if ((b->names = (char *) realloc(b->names, b->nsize)) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for apply batch\n");
+            exit(ENOMEM);
+        }
+    }
+    r = &b->recs[b->count++];
+    r->dev = statbuf->st_dev;
+    r->ino = statbuf->st_ino;
+    r->uid = statbuf->st_uid;
+    r->gid = statbuf->st_gid;
+    r->name = b->nlen;
+    r->type = type;
+    r->uptr = uptr;
+    r->gptr = gptr;
+    memcpy(b->names + b->nlen, te->name, len);
+    b->nlen += len;
+}
+
+unsigned long
+        apply_close(unsigned long *waits) {
+
+/*
+ * Description:
+ * Publishes the batches left by the scanning threads, which have to be finished, waits until
+ * the apply threads have applied all batches and stops them.
+ *
+ * Parameters:
+ * waits:       set to the number of times a scanning thread waited for the apply threads
+ *
+ * Return value:
+ * number of entries applied
+ *
+ */
+    size_t  i;
+
+    for (i = 0; i < npending; i++)
+        apply_flush((unsigned int) i);
+    atomic_store(&apply_stop, 1);
+    for (i = 0; i < ninboxes; i++) {
+        pthread_mutex_lock(&inboxes[i].lock);
+        pthread_cond_signal(&inboxes[i].cond);
+        pthread_mutex_unlock(&inboxes[i].lock);
+    }
+    for (i = 0; i < ninboxes; i++) {
+        pthread_join(inboxes[i].thread, NULL);
+        pthread_mutex_destroy(&inboxes[i].lock);
+        pthread_cond_destroy(&inboxes[i].cond);
+    }
+    free(inboxes);
+    free(pending);
+    inboxes = NULL;
+    pending = NULL;
+    ninboxes = npending = 0;
+    *waits = atomic_load(&apply_waits);
+    return atomic_load(&apply_done);
+}
+
+#endif
@@ -0,0 +1,305 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * checkpoint file of the outstanding work of a scan
+ *
+ * A checkpoint is a ckpt_hdr_t followed by one record per pending queue element: a ckpt_rec_t,
+ * the directory path and, for a batch, the entries not processed yet in the packed batch
+ * format. A record with namelen 0 terminates the file, so a truncated checkpoint is detected.
+ * The file is written under a temporary name and renamed, so the previous checkpoint stays
+ * valid until the new one is complete. Like the journal it is written in host byte order.
+ */
+
+#include "chuid.h"
+
+extern fs_root_t        *begin_fs_list;
+
+#define CKPT_MAGIC      "CHUIDCKP"
+#define CKPT_VERSION    1
+
+typedef struct ckpt_hdr {
+    char                magic[8];
+    uint32_t            version;
+    uint32_t            nroots;
+    uint32_t            recsize;
+    uint32_t            reserved;
+} ckpt_hdr_t;
+
+typedef struct ckpt_rec {
+    int64_t             dirpos;
+    uint32_t            namelen;
+    uint32_t            batchlen;
+    uint32_t            batchcount;
+    int32_t             fs;
+} ckpt_rec_t;
+
+static FILE             *ckpt_fp = NULL;
+static char             *ckpt_tmp = NULL;
+static unsigned long    ckpt_count = 0;
+static short int        ckpt_failed = 0;
+
+static void
+        ckpt_error(const char *what, const char *path) {
+
+    print_errno_r(WARNING, errno, what, path);
+    ckpt_failed = 1;
+}
+
+int
+        ckpt_begin(const char *path, const unsigned long nroots) {
+
+/*
+ * Description:
+ * Starts writing a new checkpoint to <path>.tmp.
+ *
+ * Parameters:
+ * path:        name of the checkpoint file
+ * nroots:      number of roots in the directory file, checked on resume
+ *
+ * Return value:
+ * 0 on success, -1 if the file couldn't be created (a warning has been logged)
+ *
+ */
+    ckpt_hdr_t  hdr;
+    size_t      len = strlen(path) + 5;
+
+    if ((ckpt_tmp = (char *) malloc(sizeof (char) * len)) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for checkpoint file string\n");
+        exit(ENOMEM);
+    }
+    snprintf(ckpt_tmp, len, "%s.tmp", path);
+    ckpt_count = 0;
+    ckpt_failed = 0;
+    errno = 0;
+    if ((ckpt_fp = fopen(ckpt_tmp, "w")) == NULL) {
+        ckpt_error("couldn't create checkpoint", ckpt_tmp);
+        free(ckpt_tmp);
+        ckpt_tmp = NULL;
+        return -1;
+    }
+    memset(&hdr, 0, sizeof (ckpt_hdr_t));
+    memcpy(hdr.magic, CKPT_MAGIC, sizeof (hdr.magic));
+    hdr.version = CKPT_VERSION;
+    hdr.nroots = (uint32_t) nroots;
+    hdr.recsize = (uint32_t) sizeof (ckpt_rec_t);
+    errno = 0;
+    if (fwrite(&hdr, sizeof (ckpt_hdr_t), 1, ckpt_fp) != 1)
+        ckpt_error("couldn't write checkpoint", ckpt_tmp);
+    return 0;
+}
+
+void
+        ckpt_add(const queue_element_t *qe, const long dirpos) {
+
+/*
+ * Description:
+ * Adds a queue element to the checkpoint.
+ *
+ * Parameters:
+ * qe:          queue element
+ * dirpos:      position to continue at: the offset of the next entry for a batch, a telldir
+ *              value (or 0) for a directory
+ *
+ */
+    ckpt_rec_t  rec;
+    const char  *p, *start = NULL, *end = NULL;
+    size_t      plen = (qe->parent != NULL) ? strlen(qe->parent->name) : 0;
+
+    if (ckpt_fp == NULL || ckpt_failed)
+        return;
+    memset(&rec, 0, sizeof (ckpt_rec_t));
+/*
+ * an element queued in bounded mode holds its name only, the path of its parent is prepended
+ */
+    rec.namelen = (uint32_t) (strlen(qe->name) + ((qe->parent != NULL) ? plen + 1 : 0));
+    rec.fs = (qe->fs != NULL) ? (int32_t) qe->fs->index : -1;
+    if (qe->batch != NULL) {
+        start = qe->batch->buf + dirpos;
+        end = qe->batch->buf + qe->batch->len;
+        if (start >= end)
+            return;
+        for (p = start; p < end; p += strlen(p + 1) + 2)
+            rec.batchcount++;
+        rec.batchlen = (uint32_t) (end - start);
+    } else {
+        rec.dirpos = (int64_t) dirpos;
+    }
+    errno = 0;
+    if (fwrite(&rec, sizeof (ckpt_rec_t), 1, ckpt_fp) != 1 ||
+        (qe->parent != NULL && (fwrite(qe->parent->name, 1, plen, ckpt_fp) != plen || fputc('/', ckpt_fp) == EOF)) ||
+        fwrite(qe->name, 1, strlen(qe->name), ckpt_fp) != strlen(qe->name) ||
+        (rec.batchlen > 0 && fwrite(start, 1, rec.batchlen, ckpt_fp) != rec.batchlen)) {
+        ckpt_error("couldn't write checkpoint", ckpt_tmp);
+        return;
+    }
+    ckpt_count++;
+}
+
+void
+        ckpt_add_anchor(const queue_anchor_t *anchor) {
+
+/*
+ * Description:
+ * Adds all elements of a deq to the checkpoint.
+ *
+ */
+    const queue_element_t   *qe;
+    long                    i;
+
+    for (i = 0, qe = anchor->first; i < anchor->element_counter; i++, qe = qe->next)
+        ckpt_add(qe, qe->dirpos);
+}
+
+long
+        ckpt_commit(const char *path) {
+
+/*
+ * Description:
+ * Completes the checkpoint and replaces the previous one.
+ *
+ * Return value:
+ * number of queue elements in the checkpoint, -1 if it couldn't be written (a warning has
+ * been logged and the previous checkpoint is kept)
+ *
+ */
+    ckpt_rec_t  rec;
+    long        ret = (long) ckpt_count;
+
+    if (ckpt_fp == NULL)
+        return -1;
+    memset(&rec, 0, sizeof (ckpt_rec_t));
+    errno = 0;
+    if (!ckpt_failed && fwrite(&rec, sizeof (ckpt_rec_t), 1, ckpt_fp) != 1)
+        ckpt_error("couldn't write checkpoint", ckpt_tmp);
+    errno = 0;
+    if (!ckpt_failed && (fflush(ckpt_fp) != 0 || fsync(fileno(ckpt_fp)) != 0))
+        ckpt_error("couldn't write checkpoint", ckpt_tmp);
+    errno = 0;
+    if (fclose(ckpt_fp) != 0 && !ckpt_failed)
+        ckpt_error("couldn't close checkpoint", ckpt_tmp);
+    ckpt_fp = NULL;
+    errno = 0;
+    if (!ckpt_failed && rename(ckpt_tmp, path) != 0)
+        ckpt_error("couldn't rename checkpoint", ckpt_tmp);
+    if (ckpt_failed) {
+        unlink(ckpt_tmp);
+        ret = -1;
+    }
+    free(ckpt_tmp);
+    ckpt_tmp = NULL;
+    return ret;
+}
+
+long
+        ckpt_load(const char *path, const unsigned long nroots, const unsigned int cache, queue_anchor_t *anchor) {
+
+/*
+ * Description:
+ * Reads a checkpoint and puts its queue elements into anchor. Exits if the checkpoint can't
+ * be read or doesn't belong to the given directory file.
+ *
+ * Parameters:
+ * path:        name of the checkpoint file
+ * nroots:      number of roots in the directory file
+ * cache:       slab cache of the calling thread
+ * anchor:      deq the elements are put into
+ *
+ * Return value:
+ * number of queue elements read
+ *
+ */
+    FILE            *fp = NULL;
+    ckpt_hdr_t      hdr;
+    ckpt_rec_t      rec;
+    queue_element_t *qe = NULL;
+    fs_root_t       **roots = NULL, *fs = NULL;
+    char            *name = NULL;
+    size_t          namesize = 0;
+    long            count = 0;
+    unsigned long   i;
+    short int       excluded;
+
+    errno = 0;
+    if ((fp = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "ERROR: Couldn't open checkpoint <%s>: %s\n", path, strerror(errno));
+        exit(errno);
+    }
+    if (fread(&hdr, sizeof (ckpt_hdr_t), 1, fp) != 1 || memcmp(hdr.magic, CKPT_MAGIC, sizeof (hdr.magic)) != 0 ||
+        hdr.version != CKPT_VERSION || hdr.recsize != sizeof (ckpt_rec_t)) {
+        fprintf(stderr, "ERROR: <%s> is no chuid checkpoint of this version!\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (hdr.nroots != nroots) {
+        fprintf(stderr, "ERROR: Checkpoint <%s> was written for %u roots, the directory file has %lu!\n", path, hdr.nroots, nroots);
+        exit(EXIT_FAILURE);
+    }
+    if ((roots = (fs_root_t **) calloc(nroots + 1, sizeof (fs_root_t *))) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for checkpoint roots\n");
+        exit(ENOMEM);
+    }
+    for (i = 0, fs = begin_fs_list; fs != NULL && i < nroots; fs = fs->next, i++)
+        roots[i] = fs;
+    for (;;) {
+        if (fread(&rec, sizeof (ckpt_rec_t), 1, fp) != 1) {
+            fprintf(stderr, "ERROR: Checkpoint <%s> is truncated!\n", path);
+            exit(EXIT_FAILURE);
+        }
+        if (rec.namelen == 0)
+            break;
+        if (rec.namelen + 1 > namesize) {
+            namesize = rec.namelen + 1;
+            if ((name = (char *) realloc(name, namesize)) == NULL) {
+                fprintf(stderr, "ERROR: No memory available for checkpoint record\n");
+                exit(ENOMEM);
+            }
+        }
+        if (fread(name, 1, rec.namelen, fp) != rec.namelen) {
+            fprintf(stderr, "ERROR: Checkpoint <%s> is truncated!\n", path);
+            exit(EXIT_FAILURE);
+        }
+        name[rec.namelen] = '\0';
+        qe = (queue_element_t *) slab_alloc(cache, sizeof (queue_element_t));
+        qe->name = slab_strdup(cache, name);
+        qe->dirpos = (rec.batchlen > 0) ? 0 : (long) rec.dirpos;
+        qe->directsubdirs = 0;
+        qe->fs = (rec.fs >= 0 && (unsigned long) rec.fs < nroots) ? roots[rec.fs] : NULL;
+        qe->exnode = exclude_root(qe->name, &excluded);
+        qe->parent = NULL;
+        qe->refs = 1;
+        qe->batch = NULL;
+        qe->next = NULL;
+        if (rec.batchlen > 0) {
+            if ((qe->batch = (dir_batch_t *) malloc(sizeof (dir_batch_t))) == NULL ||
+                (qe->batch->buf = (char *) malloc(rec.batchlen)) == NULL) {
+                fprintf(stderr, "ERROR: No memory available for directory batch\n");
+                exit(ENOMEM);
+            }
+            if (fread(qe->batch->buf, 1, rec.batchlen, fp) != rec.batchlen) {
+                fprintf(stderr, "ERROR: Checkpoint <%s> is truncated!\n", path);
+                exit(EXIT_FAILURE);
+            }
+            qe->batch->count = (size_t) rec.batchcount;
+            qe->batch->len = rec.batchlen;
+            qe->batch->size = rec.batchlen;
+        }
+        deq_put(anchor, qe);
+        count++;
+    }
+    free(name);
+    free(roots);
+    fclose(fp);
+    return count;
+}
@@ -0,0 +1,546 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * chuid-bench: benchmark of the chuid scan engine on a synthetic tree (make bench)
+ *
+ * Generates a tree below <bench dir>/tree and runs chuid on it for every combination of
+ * mode (dry run, real), scheduler variant and thread count. The results are taken from the
+ * final metrics sample of each run (option -M).
+ *
+ * Tree: every directory down to the given depth has <fan-out> subdirectories. Subdirectory k
+ * of a directory holds files / (k + 1)^skew files, so with a skew > 0 the first subtrees are
+ * much larger than the others. The given ratio of the files are hardlinks to the previous file
+ * of their directory. Optionally a single huge directory is added below the root.
+ *
+ * Real runs change the owners, which needs root: the tree is owned by BENCH_UID and the
+ * mapping swaps BENCH_UID and BENCH_UID + 1, so each run changes every entry back again.
+ * Without root only dry runs are made.
+ */
+
+#include <sys/wait.h>
+#include "chuid.h"
+
+#define BENCH_UID 60001
+#define BENCH_MAX_THREADS 64
+#define BENCH_MAX_VARIANTS 32
+
+typedef struct bench_tree {
+    unsigned int        fanout;
+    unsigned int        depth;
+    unsigned int        files;
+    double              skew;
+    double              hardlinks;
+    unsigned long       huge;
+    unsigned long       nfiles;
+    unsigned long       nlinks;
+    unsigned long       ndirs;
+} bench_tree_t;
+
+typedef struct bench_result {
+    double              wall;
+    double              elapsed;
+    unsigned long       files;
+    unsigned long       dirs;
+    unsigned long       transfers;
+    unsigned long       hashhits;
+    unsigned long       busy_us;
+    int                 status;
+} bench_result_t;
+
+static char             *program = NULL;
+static short int        is_root = 0;
+static unsigned long    seed = 1;
+
+static void
+        usage(void) {
+
+    printf("Usage: %s [-h] [-k] [-g] [-c <chuid>] [-r <bench dir>] [-F <fan-out>] [-L <depth>] [-f <files per directory>] [-S <skew>] [-H <hardlink ratio>] [-X <huge directory entries>] [-t <thread counts>] [-V <variant>]... [-m dry|real|both]\n", program);
+    printf("\n\
+            -h                  this help\n\
+            -c <chuid>          chuid binary (default ./chuid)\n\
+            -r <bench dir>      directory for the tree and the run files (default /tmp/chuid-bench)\n\
+            -F <fan-out>        subdirectories per directory (default 4)\n\
+            -L <depth>          levels of subdirectories (default 4)\n\
+            -f <files>          files per directory (default 50)\n\
+            -S <skew>           subdirectory k holds files/(k+1)^skew files (default 0)\n\
+            -H <ratio>          ratio of files which are hardlinks (default 0)\n\
+            -X <entries>        add a single directory with <entries> files (default none)\n\
+            -t <thread counts>  comma separated list of thread counts (default 1,4,16)\n\
+            -V <variant>        chuid options of a scheduler variant, may be repeated (default: \"\", -o, -q, -W, -D)\n\
+            -m dry|real|both    dry runs, real runs (root only) or both (default both)\n\
+            -g                  generate the tree only\n\
+            -k                  keep the tree afterwards\n\n");
+}
+
+static unsigned long
+        bench_rand(void) {
+
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    return seed >> 33;
+}
+
+static char *
+        bench_path(const char *dir, const char *name) {
+
+    size_t  len = strlen(dir) + strlen(name) + 2;
+    char    *path;
+
+    if ((path = (char *) malloc(len)) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for path string\n");
+        exit(ENOMEM);
+    }
+    snprintf(path, len, "%s/%s", dir, name);
+    return path;
+}
+
+static void
+        bench_own(const char *path) {
+
+    errno = 0;
+    if (is_root && lchown(path, BENCH_UID, BENCH_UID) != 0) {
+        fprintf(stderr, "ERROR: Couldn't change owner of <%s>: %s\n", path, strerror(errno));
+        exit(errno);
+    }
+}
+
+static void
+        bench_files(bench_tree_t *t, const char *dir, const unsigned long n) {
+
+/*
+ * Description:
+ * Creates n files in dir, a part of them as hardlinks.
+ *
+ */
+    char            name[32], prev[32];
+    char            *path, *ppath;
+    unsigned long   i;
+    int             fd;
+
+    for (i = 0; i < n; i++) {
+        snprintf(name, sizeof (name), "f%lu", i);
+        path = bench_path(dir, name);
+        errno = 0;
+        if (i > 0 && t->hardlinks > 0. && (double) (bench_rand() % 10000) < t->hardlinks * 10000.) {
+            snprintf(prev, sizeof (prev), "f%lu", i - 1);
+            ppath = bench_path(dir, prev);
+            if (link(ppath, path) != 0) {
+                fprintf(stderr, "ERROR: Couldn't create link <%s>: %s\n", path, strerror(errno));
+                exit(errno);
+            }
+            free(ppath);
+            t->nlinks++;
+        } else {
+            if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+                fprintf(stderr, "ERROR: Couldn't create <%s>: %s\n", path, strerror(errno));
+                exit(errno);
+            }
+            close(fd);
+            bench_own(path);
+            t->nfiles++;
+        }
+        free(path);
+    }
+}
+
+static char *
+        bench_mkdir(bench_tree_t *t, const char *dir, const char *name) {
+
+    char    *path = bench_path(dir, name);
+
+    errno = 0;
+    if (mkdir(path, 0755) != 0) {
+        fprintf(stderr, "ERROR: Couldn't create directory <%s>: %s\n", path, strerror(errno));
+        exit(errno);
+    }
+    bench_own(path);
+    t->ndirs++;
+    return path;
+}
+
+static void
+        bench_subtree(bench_tree_t *t, const char *dir, const unsigned int level, const unsigned int k) {
+
+/*
+ * Description:
+ * Fills directory dir, subdirectory k of its parent at the given level, and creates its
+ * subtrees.
+ *
+ */
+    char            name[32], *path;
+    unsigned int    i;
+
+    bench_files(t, dir, (unsigned long) ceil((double) t->files / pow((double) k + 1., t->skew)));
+    if (level >= t->depth)
+        return;
+    for (i = 0; i < t->fanout; i++) {
+        snprintf(name, sizeof (name), "d%u", i);
+        path = bench_mkdir(t, dir, name);
+        bench_subtree(t, path, level + 1, i);
+        free(path);
+    }
+}
+
+static void
+        bench_generate(bench_tree_t *t, const char *root) {
+
+    char    *path;
+
+    path = bench_mkdir(t, root, "tree");
+    bench_subtree(t, path, 0, 0);
+    if (t->huge > 0) {
+        free(bench_mkdir(t, path, "huge"));
+        free(path);
+        path = bench_path(root, "tree/huge");
+        bench_files(t, path, t->huge);
+    }
+    free(path);
+}
+
+static int
+        bench_remove(const char *path) {
+
+/*
+ * Description:
+ * Removes a directory tree.
+ *
+ */
+    DIR             *dp;
+    struct dirent   *dirp;
+    struct stat     statbuf;
+    char            *child;
+
+    if (lstat(path, &statbuf) != 0)
+        return (errno == ENOENT) ? 0 : -1;
+    if (!S_ISDIR(statbuf.st_mode))
+        return unlink(path);
+    if ((dp = opendir(path)) == NULL)
+        return -1;
+    while ((dirp = readdir(dp)) != NULL) {
+        if (strcmp(dirp->d_name, ".") == 0 || strcmp(dirp->d_name, "..") == 0)
+            continue;
+        child = bench_path(path, dirp->d_name);
+        if (bench_remove(child) != 0)
+            fprintf(stderr, "WARNING: Couldn't remove <%s>: %s\n", child, strerror(errno));
+        free(child);
+    }
+    closedir(dp);
+    return rmdir(path);
+}
+
+static void
+        bench_write(const char *path, const char *text) {
+
+    FILE    *fp;
+
+    errno = 0;
+    if ((fp = fopen(path, "w")) == NULL || fputs(text, fp) == EOF || fclose(fp) != 0) {
+        fprintf(stderr, "ERROR: Couldn't write <%s>: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static unsigned long
+        bench_value(const char *line, const char *key) {
+
+/*
+ * Description:
+ * Returns the numeric value of key in a JSON metrics sample, 0 if it is missing.
+ *
+ */
+    char        pattern[64];
+    const char  *p;
+
+    snprintf(pattern, sizeof (pattern), "\"%s\":", key);
+    if ((p = strstr(line, pattern)) == NULL)
+        return 0;
+    return strtoul(p + strlen(pattern), NULL, 10);
+}
+
+static void
+        bench_metrics(const char *path, bench_result_t *r) {
+
+/*
+ * Description:
+ * Reads the last metrics sample of a run.
+ *
+ */
+    FILE        *fp;
+    char        *line = NULL, *last = NULL;
+    const char  *p;
+    size_t      size = 0;
+
+    if ((fp = fopen(path, "r")) == NULL)
+        return;
+    while (getline(&line, &size, fp) > 0) {
+        free(last);
+        if ((last = strdup(line)) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for metrics line\n");
+            exit(ENOMEM);
+        }
+    }
+    fclose(fp);
+    free(line);
+    if (last == NULL)
+        return;
+    r->files = bench_value(last, "files") + bench_value(last, "links") + bench_value(last, "others");
+    r->dirs = bench_value(last, "directories");
+    r->transfers = bench_value(last, "transfers");
+    r->hashhits = bench_value(last, "hardlink_hits");
+    r->busy_us = bench_value(last, "busy_us");
+    if ((p = strstr(last, "\"elapsed\":")) != NULL)
+        r->elapsed = strtod(p + 10, NULL);
+    free(last);
+}
+
+static void
+        bench_run(const char *chuid, const char *root, const short int real, const char *variant, const unsigned int threads, bench_result_t *r) {
+
+/*
+ * Description:
+ * Runs chuid once on the tree and collects its results.
+ *
+ */
+    char            *argv[64], *args, *tok, *save = NULL;
+    char            *dirs, *uids, *excl, *logdir, *metrics;
+    char            nthr[16];
+    struct timeval  t1, t2;
+    pid_t           pid;
+    int             argc = 0, fd;
+
+    dirs = bench_path(root, "dirs");
+    uids = bench_path(root, "uids");
+    excl = bench_path(root, "exclude");
+    logdir = bench_path(root, "log");
+    metrics = bench_path(root, "metrics.json");
+    unlink(metrics);
+    bench_remove(logdir);
+    mkdir(logdir, 0755);
+    snprintf(nthr, sizeof (nthr), "%u", threads);
+    if ((args = strdup(variant)) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for argument string\n");
+        exit(ENOMEM);
+    }
+    argv[argc++] = (char *) chuid;
+    argv[argc++] = "-N";
+    argv[argc++] = "-i";
+    argv[argc++] = uids;
+    argv[argc++] = "-d";
+    argv[argc++] = dirs;
+    argv[argc++] = "-e";
+    argv[argc++] = excl;
+    argv[argc++] = "-l";
+    argv[argc++] = logdir;
+    argv[argc++] = "-t";
+    argv[argc++] = nthr;
+    argv[argc++] = "-M";
+    argv[argc++] = metrics;
+    argv[argc++] = "--metrics-interval";
+    argv[argc++] = "86400";
+    if (!real)
+        argv[argc++] = "-n";
+    for (tok = strtok_r(args, " ", &save); tok != NULL && argc < 62; tok = strtok_r(NULL, " ", &save))
+        argv[argc++] = tok;
+    argv[argc] = NULL;
+
+    memset(r, 0, sizeof (bench_result_t));
+    gettimeofday(&t1, NULL);
+    errno = 0;
+    if ((pid = fork()) < 0) {
+        fprintf(stderr, "ERROR: Couldn't fork: %s\n", strerror(errno));
+        exit(errno);
+    }
+    if (pid == 0) {
+        if ((fd = open("/dev/null", O_WRONLY)) >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        execv(chuid, argv);
+        _exit(127);
+    }
+    waitpid(pid, &r->status, 0);
+    gettimeofday(&t2, NULL);
+    r->wall = (double) (t2.tv_sec - t1.tv_sec) + (double) (t2.tv_usec - t1.tv_usec) / 1000000.;
+    bench_metrics(metrics, r);
+    free(args);
+    free(dirs);
+    free(uids);
+    free(excl);
+    free(logdir);
+    free(metrics);
+}
+
+int
+        main(int argc, char *argv[]) {
+
+    bench_tree_t    tree = { 4, 4, 50, 0., 0., 0, 0, 0, 0 };
+    bench_result_t  r;
+    const char      *chuid = "./chuid", *root = "/tmp/chuid-bench", *mode = "both";
+    const char      *variants[BENCH_MAX_VARIANTS];
+    const char      *defaults[] = { "", "-o", "-q", "-W", "-D" };
+    unsigned int    threads[BENCH_MAX_THREADS];
+    char            *list, *tok, *save = NULL, *path, text[128];
+    char            abschuid[PATH_MAX];
+    int             c, nvariants = 0, nthreads = 0, v, t, real;
+    short int       keep = 0, generate_only = 0;
+    double          idle;
+
+    program = argv[0];
+    is_root = (geteuid() == 0);
+    while ((c = getopt(argc, argv, ":hkgc:r:F:L:f:S:H:X:t:V:m:")) != -1) {
+        switch (c) {
+            case 'h':
+                usage();
+                exit(EXIT_SUCCESS);
+            case 'k':
+                keep = 1;
+                break;
+            case 'g':
+                generate_only = 1;
+                keep = 1;
+                break;
+            case 'c':
+                chuid = optarg;
+                break;
+            case 'r':
+                root = optarg;
+                break;
+            case 'F':
+                tree.fanout = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'L':
+                tree.depth = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                tree.files = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'S':
+                tree.skew = strtod(optarg, NULL);
+                break;
+            case 'H':
+                tree.hardlinks = strtod(optarg, NULL);
+                break;
+            case 'X':
+                tree.huge = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                if ((list = strdup(optarg)) == NULL) {
+                    fprintf(stderr, "ERROR: No memory available for thread list\n");
+                    exit(ENOMEM);
+                }
+                for (tok = strtok_r(list, ",", &save); tok != NULL && nthreads < BENCH_MAX_THREADS; tok = strtok_r(NULL, ",", &save))
+                    if ((threads[nthreads] = (unsigned int) strtoul(tok, NULL, 10)) > 0)
+                        nthreads++;
+                free(list);
+                break;
+            case 'V':
+                if (nvariants < BENCH_MAX_VARIANTS)
+                    variants[nvariants++] = optarg;
+                break;
+            case 'm':
+                mode = optarg;
+                break;
+            case ':':
+                fprintf(stderr, "\nOption -%c requires an operand!\n\n", optopt);
+                usage();
+                exit(EXIT_FAILURE);
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (strcmp(mode, "dry") != 0 && strcmp(mode, "real") != 0 && strcmp(mode, "both") != 0) {
+        fprintf(stderr, "ERROR: Mode has to be dry, real or both!\n");
+        exit(EXIT_FAILURE);
+    }
+    if (tree.hardlinks < 0. || tree.hardlinks > 1. || tree.skew < 0.) {
+        fprintf(stderr, "ERROR: Hardlink ratio has to be in [0,1], skew >= 0!\n");
+        exit(EXIT_FAILURE);
+    }
+    if (nthreads == 0) {
+        threads[nthreads++] = 1;
+        threads[nthreads++] = 4;
+        threads[nthreads++] = 16;
+    }
+    if (nvariants == 0) {
+        for (v = 0; v < (int) (sizeof (defaults) / sizeof (defaults[0])); v++)
+            variants[nvariants++] = defaults[v];
+    }
+    if (realpath(chuid, abschuid) == NULL) {
+        fprintf(stderr, "ERROR: Couldn't find chuid <%s>: %s\n", chuid, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (!is_root && strcmp(mode, "dry") != 0) {
+        fprintf(stdout, "INFO: not running as root, real runs are skipped\n");
+        mode = "dry";
+    }
+
+    path = bench_path(root, "tree");
+    bench_remove(path);
+    free(path);
+    errno = 0;
+    if (mkdir(root, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "ERROR: Couldn't create <%s>: %s\n", root, strerror(errno));
+        exit(errno);
+    }
+    bench_generate(&tree, root);
+    fprintf(stdout, "tree: fan-out %u, depth %u, %u files per directory, skew %.2f, hardlink ratio %.2f, huge directory %lu\n",
+            tree.fanout, tree.depth, tree.files, tree.skew, tree.hardlinks, tree.huge);
+    fprintf(stdout, "      %lu directories, %lu files, %lu hardlinks\n\n", tree.ndirs, tree.nfiles, tree.nlinks);
+    if (generate_only)
+        exit(EXIT_SUCCESS);
+
+    path = bench_path(root, "dirs");
+    snprintf(text, sizeof (text), "%s/tree\n", root);
+    bench_write(path, text);
+    free(path);
+    path = bench_path(root, "exclude");
+    bench_write(path, "");
+    free(path);
+    path = bench_path(root, "uids");
+    snprintf(text, sizeof (text), "u:%u %u\nu:%u %u\n", BENCH_UID, BENCH_UID + 1, BENCH_UID + 1, BENCH_UID);
+    if (!is_root)
+        snprintf(text, sizeof (text), "u:%u %u\n", (unsigned int) geteuid(), (unsigned int) geteuid() + 1);
+    bench_write(path, text);
+    free(path);
+
+    fprintf(stdout, "mode variant         threads  time[s]    files/s     dirs/s  idle/thread[s]  transfers  hardlink hits\n");
+    for (real = 0; real <= 1; real++) {
+        if ((real && strcmp(mode, "dry") == 0) || (!real && strcmp(mode, "real") == 0))
+            continue;
+        for (v = 0; v < nvariants; v++) {
+            for (t = 0; t < nthreads; t++) {
+                bench_run(abschuid, root, (short int) real, variants[v], threads[t], &r);
+                if (!WIFEXITED(r.status) || WEXITSTATUS(r.status) != 0) {
+                    fprintf(stdout, "%-4s %-15s %7u  failed (status %d)\n", real ? "real" : "dry", (variants[v][0] != '\0') ? variants[v] : "default", threads[t], r.status);
+                    continue;
+                }
+                idle = r.elapsed - (double) r.busy_us / 1e6 / (double) threads[t];
+                fprintf(stdout, "%-4s %-15s %7u %8.2f %10.0f %10.0f %15.2f %10lu %14lu\n", real ? "real" : "dry",
+                        (variants[v][0] != '\0') ? variants[v] : "default", threads[t], r.wall,
+                        (r.wall > 0) ? (double) r.files / r.wall : 0., (r.wall > 0) ? (double) r.dirs / r.wall : 0.,
+                        (idle > 0.) ? idle : 0., r.transfers, r.hashhits);
+                fflush(stdout);
+            }
+        }
+    }
+    if (!keep) {
+        path = bench_path(root, "tree");
+        bench_remove(path);
+        free(path);
+    }
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,140 @@
+#!/bin/sh
+#
+# smoke test of chuid on a synthetic tree (make check)
+#
+# Builds a small tree with files, subdirectories, a hardlink, a symbolic link, a fifo and an
+# excluded directory, and checks the owners of all entries after
+# - a dry run and a report, which mustn't change anything,
+# - a real run with journal in several engine modes, against the owners expected from the
+#   mappings, and after a rollback of its journal against the original owners,
+# - a run with a mapping of gids only and the quota prescan, which mustn't skip the tree,
+# - a run interrupted after a checkpoint and resumed, and after a rollback of its journal.
+# Changing owners needs root, the test is skipped otherwise.
+#
+# CHUID: chuid binary to test, default ./chuid
+#
+
+CHUID=${CHUID:-./chuid}
+
+if [ "$(id -u)" != 0 ]; then
+    echo "chuid-check: changing owners needs root, skipped"
+    exit 77
+fi
+test -x "$CHUID" || { echo "chuid-check: no chuid binary <$CHUID>"; exit 99; }
+
+T=$(mktemp -d "${TMPDIR:-/tmp}/chuid-check.XXXXXX") || exit 99
+trap 'rm -rf "$T"' EXIT
+TREE=$T/tree
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+owners() {
+    find "$TREE" -printf '%p %y %U:%G\n' | sort
+}
+
+compare() {
+    # compare() <expected file> <step>
+    owners > "$T/actual"
+    cmp -s "$1" "$T/actual" || { diff "$1" "$T/actual" | head -20; fail "$2: unexpected owners"; }
+}
+
+run() {
+    # run() <step> <chuid arguments>
+    step=$1
+    shift
+    rm -rf "$T/log"
+    mkdir "$T/log"
+    "$CHUID" -i "${MAP:-$T/uids}" -d "$T/dirs" -e "$T/excl" -l "$T/log" -t 4 "$@" > "$T/out" 2>&1 || { cat "$T/out"; fail "$step: chuid failed"; }
+}
+
+rollback() {
+    # rollback() <step>
+    rm -rf "$T/rblog"
+    mkdir "$T/rblog"
+    "$CHUID" -l "$T/rblog" -t 4 -R "$T/log/chuid_journal" > "$T/out" 2>&1 || { cat "$T/out"; fail "$1: rollback failed"; }
+    compare "$T/baseline" "$1: rollback"
+}
+
+# the tree: 20 directories with 25 files and a subdirectory of 25 files each
+mkdir -p "$TREE/skip"
+i=1
+while [ $i -le 20 ]; do
+    mkdir -p "$TREE/d$i/sub"
+    j=1
+    while [ $j -le 25 ]; do
+        echo $j > "$TREE/d$i/f$j"
+        echo $j > "$TREE/d$i/sub/g$j"
+        j=$((j + 1))
+    done
+    i=$((i + 1))
+done
+ln "$TREE/d1/f1" "$TREE/d2/hardlink"
+ln -s ../d1/f1 "$TREE/d3/link"
+mkfifo "$TREE/d4/fifo"
+touch "$TREE/skip/s"
+chown -R 61000:61000 "$TREE"
+chown -h 61000:61000 "$TREE/d3/link"
+chown 61001:61001 "$TREE/d5/f1"
+
+echo "$TREE" > "$T/dirs"
+echo "skip" > "$T/excl"
+printf 'u:61000 62000\ng:61000 63000\nu:61001 62001\n' > "$T/uids"
+printf 'g:61000 63000\n' > "$T/gids"
+
+owners > "$T/baseline"
+# files, directories and links get the new owners, except for the root and the excluded directory
+expect() {
+    # expect() <1 if uids are mapped> <output file>
+    awk -v root="$TREE" -v uids="$1" '
+        $1 == root || index($1, root "/skip") == 1 || $2 !~ /^[fdl]$/ { print; next }
+        {
+            split($3, id, ":")
+            if (uids && id[1] == "61000") id[1] = "62000"; else if (uids && id[1] == "61001") id[1] = "62001"
+            if (id[2] == "61000") id[2] = "63000"
+            print $1 " " $2 " " id[1] ":" id[2]
+        }' "$T/baseline" > "$2"
+}
+expect 1 "$T/expected"
+expect 0 "$T/expected-gids"
+# the hardlink is changed, and recorded in the journal, once
+changes=$(($(diff "$T/baseline" "$T/expected" | grep -c '^>') - 1))
+
+run "dry run" -n
+compare "$T/baseline" "dry run"
+run "report" -a
+grep -q "owner pairs: 2" "$T/out" || { cat "$T/out"; fail "report: owner pairs missing"; }
+compare "$T/baseline" "report"
+
+for mode in "" "-f" "-c" "-W" "-B 16" "-w 2" "-D -H"; do
+    run "run $mode" -j $mode
+    compare "$T/expected" "run $mode"
+    n=$("$CHUID" -J "$T/log/chuid_journal" | wc -l)
+    [ "$n" -eq "$changes" ] || fail "run $mode: $n journal records, $changes changed entries"
+    rollback "run $mode"
+done
+
+# without quota information the prescan scans the tree, with it the tree holds mapped gids
+MAP=$T/gids run "prescan" -j -P
+compare "$T/expected-gids" "prescan"
+rollback "prescan"
+
+# a rate limited run is interrupted after its first checkpoint and resumed
+rm -rf "$T/log"
+mkdir "$T/log"
+"$CHUID" -i "$T/uids" -d "$T/dirs" -e "$T/excl" -l "$T/log" -t 2 -j -C 1 -L 1000 > "$T/out" 2>&1 &
+pid=$!
+sleep 2
+kill -INT $pid
+wait $pid
+test -f "$T/log/chuid_checkpoint" || { cat "$T/out"; fail "checkpoint: no checkpoint written"; }
+owners > "$T/actual"
+cmp -s "$T/expected" "$T/actual" && fail "checkpoint: run finished before the signal"
+"$CHUID" -i "$T/uids" -d "$T/dirs" -e "$T/excl" -l "$T/log" -t 4 -j -C 1 --resume > "$T/out" 2>&1 || { cat "$T/out"; fail "resume: chuid failed"; }
+compare "$T/expected" "resume"
+rollback "resume"
+
+echo "chuid-check: all checks passed"
+exit 0
@@ -69,15 +69,18 @@
  * -	Each node ist checked whether UID and/or GID must be changed. If there is a match
  * UID/GID will be changed according to provided list of 2-tuples. This is always a disjunct
  * process in two steps to keep the freedom of changing UID/GID independently of each other.
+ * By option -c (combined mode) an entry matching both lists is changed in one step instead.
  *
  * If the child is a regular file with nlink greater than 1, the thread synchronizes at a
  * global hash table to check whether the file has been seen before: If not, the file is
- * registered in the hash, the mutex is released.
+ * registered in the hash, the mutex is released. The hash is split into shards with a mutex
+ * each, so threads only wait for each other when they hit the same shard.
  *
  * If the child is a directory, it is pushed on the private stack of the thread for further
  * processing.
  *
  * Otherwise, only the Others-count field in the thread-specific structure is incremented.
+ * Where readdir reports the type of a child, such other children are counted without lstat.
  *
  * -	After each child determination, the thread checks whether there are too many threads
  * idle (no synchronization necessary):
@@ -128,6 +131,23 @@
  * stack. If the slow stack was empty, it takes an element from the fast stack; the
  * counter remains 0.
  *
+ * -	Further modes
+ * They are described where they are implemented:
+ * work stealing (-W): wsdeque.c, ws_handle_subtree
+ * batched directory reads (-B): read_tile_batched, process_batch
+ * asynchronous stat (-U): uring.c
+ * checkpoints (-C, --resume): checkpoint.c, ckpt_point, ckpt_take
+ * path lists (-p): feed_pathlist
+ * per-device queues (-D): devgroup.c, dev_handle_subtree
+ * automatic number of threads (-A): tune_threads
+ * bounded mode (-Q, --queue-memory, --spill): queue_bounded, spill.c
+ * incremental runs (-I): dirindex.c
+ * report mode (-a): report.c
+ * rate limit (-L, --latency-target): ratelimit.c
+ * pipelined mode (-w): apply.c
+ * statistics and metrics (-s, -M): stat_collect, metrics.c
+ * per-entry handlers of a configuration: ENTRY_HANDLERS, OWNER_HANDLER
+ *
  *
  * Hans Argenton & Fritz Kink, May 2022
  *
@@ -141,13 +161,30 @@
 #include "chuid.h"
 
 static pthread_mutex_t  thr_print = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t  thr_nlink = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t  thr_queue = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t  thr_handler = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t   queue_empty = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t  thr_ckpt = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   ckpt_release = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t   ckpt_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t   thr_park = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t  thr_tune = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   tune_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t  thr_metrics = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   metrics_wakeup = PTHREAD_COND_INITIALIZER;
 static pthread_t        *threads;
 #endif
 size_t                  numthr = 20;
+static size_t           autothreads = 0;
+static volatile size_t  active_threads = 20;
+static short int        tune_running = 0;
+static pthread_t        thr_tuner;
+static char             *metrics_target = NULL;
+static int              metrics_format = METRICS_JSON;
+static unsigned int     metrics_interval = METRICS_INTERVAL;
+static short int        metrics = 0;
+static short int        metrics_running = 0;
+static pthread_t        thr_metrics_writer;
 #ifdef __linux__
 static unsigned long    thr_stat;
 #elif __sun
@@ -163,14 +200,60 @@ FILE                    *fplog = NULL;
 short int               verbose = 0;
 static short int        stack = 1;
 static short int        dryrun = 0;
+static short int        report = 0;
+static char             *findex = NULL;
+static long             rate_ops = 0;
+static unsigned long    latency_target = 0;
 static short int        dual_queue = 1;
 static short int        stats = 0;
+static short int        fdrelative = 0;
+static size_t           applythreads = 0;
+static short int        worksteal = 0;
+static short int        combined = 0;
+static short int        resolve_names = 1;
+static short int        journaling = 0;
+static short int        resume = 0;
+static short int        prescan = 0;
+static FILE             *fpathlist = NULL;
+static short int        devqueues = 0;
+static short int        hungry = 0;
+static short int        bounded = 0;
+static long             queue_limit = LONG_MAX;
+static long             queue_memory = LONG_MAX;
+static short int        spilling = 0;
+static fs_root_t        **root_index = NULL;
+static dev_group_t      *groups = NULL;
+static long             ngroups = 0;
+static unsigned int     ckpt_interval = 0;
+static char             *fckpt = NULL;
+static unsigned long    nroots = 0;
+static ckpt_slot_t      *ckpt_slots = NULL;
+static volatile short int ckpt_pending = 0;
+static short int        ckpt_final = 0;
+static short int        ckpt_running = 0;
+static unsigned int     ckpt_parked = 0;
+static unsigned long    ckpt_gen = 0;
+static pthread_t        thr_ckpt_writer;
+static long             batchsize = 0;
+static unsigned int     uringdepth = 0;
+#ifdef HAVE_IO_URING
+static uring_t          *rings = NULL;
+#endif
+#ifdef HAVE_STDATOMIC_H
+static ws_deque_t       *wsq = NULL;
+static atomic_long      ws_pending;
+static atomic_int       ws_idle;
+static atomic_long      queued_nodes;
+static atomic_long      queued_bytes;
+#endif
 static struct statistic_counters  *stat_counters;
 static unsigned int     interval = 300;
 static size_t           busy_count = 0;
+static size_t           hungry_count = 0;
 static short int        notfinished = 1;
 static long             fast_nodes_befor_next_slow_node;
 static time_t           start_time;
+static struct timeval   start_tv;
 double                  busythreshold = 0.9;
 
 static queue_anchor_t   *fast_anchor = NULL;
@@ -192,8 +275,8 @@ char                    *exclude_list = NULL;
 static fs_root_t        *fs_list_ptr = NULL;
 fs_root_t               *begin_fs_list = NULL;
 fs_root_t                *begin_exclude_file = NULL;
-uidexchange_t		*begin_uidpair = NULL;
-gidexchange_t		*begin_gidpair = NULL;
+idmap_t                 uidmap;
+idmap_t                 gidmap;
 
 static void
         usage(void) {
@@ -203,18 +286,51 @@ static void
  * Prints short usage text.
  *
  */
-    printf("Usage: %s [-h] [-v] [-n] [-o] [-q] [-s <interval>] [-b <busy threshold>] [-t <nuber of threads>] -i <input file> -d <directory file> -e <exclude file> -l <logdir> \n", prog_name);
+    printf("Usage: %s [-h] [-v] [-n] [-a] [-o] [-q] [-f] [-c] [-N] [-j] [-C <interval>] [--resume] [-P] [-D] [-W] [-H] [-A <max threads>] [-M <metrics file>] [-I <index file>] [-L <ops per second>] [--latency-target <ms>] [-w <apply threads>] [-Q <max queued nodes>] [--queue-memory <MB>] [--spill] [-B <batch size>] [-U <queue depth>] [-s <interval>] [-b <busy threshold>] [-t <nuber of threads>] -i <input file> -d <directory file> -e <exclude file> -l <logdir> \n", prog_name);
+    printf("       %s [-v] [-n] [-a] [-q] [-f] [-c] [-N] [-j] [-B <batch size>] [-U <queue depth>] [-t <number of threads>] -i <input file> -p <path list> [-e <exclude file>] -l <logdir>\n", prog_name);
+    printf("       %s [-v] [-n] [-t <number of threads>] -l <logdir> --rollback <journal>\n", prog_name);
+    printf("       %s [-v] --dump-journal <journal>\n", prog_name);
     printf("Version: %s v%s %s, %s fkink Exp $\n", PACKAGE_NAME, VERSION, __DATE__, __TIME__);
     printf("Changes given uid to a new uid (optionally new gid, too) in a given directory.\n\
             \n\
             -i <input file>     input file containing old-uid new-uid respectively old-gid new-gid\n\
             -d <directory file> file containing root directories where changes should take place\n\
             -e <exclude file>   file containing directories/files to exclude from changes\n\
+            -p <path list>      check the entries listed in <path list> (one path per line, - for stdin) instead of traversing directories\n\
             -l <logdir>         logdir which will contain log output\n\
             -v                  verbose mode\n\
             -q                  queueing vs. stack version\n\
             -n                  dry run - shows files to be changed\n\
+            -a, --report        report mode: change nothing, count entries and bytes per old uid/gid and estimate the lchown calls and runtime of the real run\n\
             -o                  one queue version\n\
+            -f                  fd-relative traversal (fstatat/fchownat relative to the opened directory)\n\
+            -c                  combined mode: change uid and gid of an entry with one call if both match\n\
+            -N                  don't resolve uids/gids to names for log and dry run output\n\
+            -j                  record changes in the binary journal <logdir>/chuid_journal instead of the log file\n\
+            -J, --dump-journal <journal>\n\
+                                print the changes recorded in a journal and exit\n\
+            -R, --rollback <journal>\n\
+                                restore the old owners of all entries recorded in a journal\n\
+            -C <interval>       write a checkpoint of the outstanding work to <logdir>/chuid_checkpoint every <interval> seconds\n\
+            -r, --resume        continue an interrupted scan from <logdir>/chuid_checkpoint\n\
+            -P                  prescan: skip roots whose file systems hold no entry of an old uid/gid according to quota\n\
+            -D                  per-device queues: one queue per device of the roots, optional thread caps and NUMA nodes per device in the directory file\n\
+            -W                  work stealing scheduler instead of global fast/slow queues\n\
+            -H                  hand over work on demand: busy threads donate as many directories as threads wait for work, instead of using the busy threshold\n\
+            -M <metrics file>   write samples of the statistic counters to <metrics file> or to unix:<socket path>\n\
+            --metrics-format <json|prometheus>  format of the samples: JSON lines (default) or Prometheus text\n\
+            --metrics-interval <interval>  seconds between two samples (default 10)\n\
+            -I, --index <index file>  incremental run: don't check the entries of directories left clean by the previous run and unchanged since, record this run in <index file>\n\
+                                (a chgrp of an existing entry by its owner isn't noticed in such a directory)\n\
+            -L, --rate-limit <ops per second>  budget of stat and chown operations per second and file system, ops=<n> in the directory file sets it per device\n\
+            --latency-target <ms>  lower the operation rate of a file system while the mean lstat latency exceeds <ms> milliseconds (needs a budget)\n\
+            -w, --apply-threads <apply threads>  pipelined mode: the scanning threads queue the changes, <apply threads> further threads apply them\n\
+            -Q <max queued nodes>  bounded mode: beyond <max queued nodes> pending directories traverse depth-first and queue names without their path\n\
+            --queue-memory <MB> bounded mode with a limit on the memory of the pending directories\n\
+            --spill             in bounded mode write pending directories beyond the limit to a temporary file in <logdir>\n\
+            -A <max threads>    adapt the number of active threads during the scan (hill climbing on the scan rate) up to <max threads>, -t is the initial number\n\
+            -B <batch size>     read directories in one go and process their entries in batches of <batch size> entries\n\
+            -U <queue depth>    stat entries asynchronously through io_uring, <queue depth> requests per thread (implies -B)\n\
             -b <busy threshold> busy threshold for working threads out of allowed number of threads (default 0.9)\n\
             -t <# of threads>   number of threads (default 20)\n\
             -s <interval>       print continously statistics every <interval> seconds\n\
@@ -240,6 +356,10 @@ void
     char        timestr[SMAX];
     struct tm   *ltime;
     
+    if (log_active()) {
+        log_put(errorlevel[severity], emsg);
+        return;
+    }
     log_time = time(NULL);
     errno = 0;
     if ((ltime = localtime(&log_time)) == NULL) {
@@ -269,12 +389,13 @@ void
     }
 }
 
-static void
+void
         print_error_r(const int severity, const char *emsg) {
 
 /*
  * Description:
  * Writes an error message with a time stamp and severity to the log file in a thread safe way.
+ * During the scan phase the message goes to the calling thread's log buffer.
  *
  * Parameters:
  * emsg:    String which contains an error message
@@ -286,6 +407,10 @@ static void
     char        timestr[SMAX];
     char        *error_str = NULL;
     
+    if (log_active()) {
+        log_put(errorlevel[severity], emsg);
+        return;
+    }
     log_time = time(NULL);
     localtime_r(&log_time, &tim);
     strftime(timestr, (size_t) SMAX, "%a %b %d %H:%M:%S %Y ", &tim);
@@ -375,6 +500,8 @@ static void
     while(ptr != NULL) {
         ptr1 = ptr->next;
         free(ptr->dirpath);
+        free(ptr->device);
+        free(ptr->canonical);
         free(ptr);
         ptr = ptr1;
     }
@@ -401,6 +528,7 @@ static void
             ptr=ptr1;
         }
         begin_exclude_file = NULL;
+        exclude_free();
         if (verbose)
             fprintf(stdout, "INFO: Exclude file/directory list successfully deleted!!\n");
 }
@@ -587,888 +715,1807 @@ static char *
     return name;
 }
 
-static void 
-        process_tile(const unsigned int tid, queue_element_t *qe, char *pwdbuffer, char *grpbuffer) {
-    
+static char *
+        id_string(const unsigned int id) {
+
 /*
  * Description:
- * Receives from function handle_subtree a directory out of one of the global deqs and traverses
- * the subtree of this directory. In case of too many idle threads it hands over all but one of 
- * the roots of the subtrees still to be traversed to one of the global deqs.
+ * Returns an id formatted like the name of an id without passwd/group entry.
+ *
+ */
+    char    *name = NULL;
+
+    if ((name = (char *) malloc(sizeof(char) * 12)) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for ID name\n");
+        exit(ENOMEM);
+    }
+    snprintf(name, (size_t) 12, "%7u", id);
+    return name;
+}
+
+static void
+        idmap_names(idmap_t *map, const short int is_uid) {
+
+/*
+ * Description:
+ * Resolves old and new ids of all 2-tuples of a mapping table to user or group names once
+ * before the scan starts, so the scan itself never calls the name services. If name
+ * resolution is switched off the numeric ids are used as names.
  *
  * Parameters:
- * tid:         thread id
- * qe:          queue element representing subtree root
- * pwdbuffer:   buffer provided for the getpwuid_r function needed to be thread safe
- * grpbuffer:   buffer provided for the getgrgid_r function needed to be thread safe
+ * map:         uid or gid mapping table
+ * is_uid:      1 for the uid table, 0 for the gid table
  *
  */
-    fs_root_t        *efptr = NULL;
-    queue_anchor_t  *p_anchor = NULL;
-    queue_element_t *p_element = NULL, *w_element = NULL, *first_deq_element = NULL;
-    char            *pathofchild = NULL;	/* dirname */
-    char            *oname = NULL, *nname = NULL;
-#ifndef _WIN32
-    DIR             *dp = NULL;
-    struct dirent   *dirp = NULL;
-#endif
-    struct stat     t_statbuf, n_statbuf;
-    struct timeval  t1, t2;
-    double          scanrate, delta;
-    int             directories_scanned = 0;
-    int             include = 0, j = 0;
-    size_t          len;
-    long            deq_count = 0;
-    short int       backtodeq = 0, known_nlink_file = 0;
-    char            *msg = NULL;
-    char            *error_str = NULL;
-    short           too_many_idle_threads = 0;
-    uidexchange_t   *uptr = NULL;
-    gidexchange_t   *gptr = NULL;
-    
-    p_anchor = deq_init();
-    deq_push(p_anchor, qe);
-    gettimeofday(&t1, NULL);
-    while (p_anchor->element_counter > 0) {
-        too_many_idle_threads = 0;
-        backtodeq = 0;
-        if (dual_queue)
-            directories_scanned++;
-        w_element = deq_get(p_anchor);
-        errno = 0;
-        if ((dp = opendir(w_element->name)) != NULL) {
-            if (w_element->dirpos != 0) {
-                seekdir(dp, w_element->dirpos);
-            }
-            errno = 0;
-            for (dirp = readdir(dp); dirp != NULL && !too_many_idle_threads; dirp = readdir(dp)) {
+    struct stat     st;
+    char            *buffer = NULL;
+    size_t          i;
 
-                include = 1;
-                known_nlink_file = 0;
-                if ((strcmp(dirp->d_name, ".") != 0) && (strcmp(dirp->d_name, "..") != 0)) {/* ignore dot and dot-dot */
-
-                    efptr = begin_exclude_file;
-                    while (efptr != NULL) {
-                        if (strcmp(dirp->d_name, efptr->dirpath) != 0) {
-                            efptr = efptr->next;
-                        } else {
-                            include = 0;
-                            break;
-                        }
-                    }
-                    if (include) {
+    if (map->count == 0)
+        return;
+    if (resolve_names && (buffer = (char *) malloc(is_uid ? pwdlinelen : grplinelen)) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for %s buffer\n", is_uid ? "passwd" : "group");
+        exit(ENOMEM);
+    }
+    memset(&st, 0, sizeof(struct stat));
+    for (i = 0; i < map->count; i++) {
+        if (!resolve_names) {
+            map->entries[i].oldname = id_string(map->entries[i].oldid);
+            map->entries[i].newname = id_string(map->entries[i].newid);
+        } else if (is_uid) {
+            st.st_uid = (uid_t) map->entries[i].oldid;
+            map->entries[i].oldname = uidname(&st, buffer);
+            st.st_uid = (uid_t) map->entries[i].newid;
+            map->entries[i].newname = uidname(&st, buffer);
+        } else {
+            st.st_gid = (gid_t) map->entries[i].oldid;
+            map->entries[i].oldname = gidname(&st, buffer);
+            st.st_gid = (gid_t) map->entries[i].newid;
+            map->entries[i].newname = gidname(&st, buffer);
+        }
+    }
+    free(buffer);
+}
 
-                        len = strlen(w_element->name) + strlen(dirp->d_name) + 2;
-                        if ((pathofchild = (char *) malloc(sizeof (char) * len)) == NULL) {
-                            fprintf(stderr, "ERROR: No memory available for Name string\n");
-                            exit(ENOMEM);
-                        }
-                        snprintf(pathofchild, len, "%s/%s", w_element->name, dirp->d_name);
+void
+        print_errno_r(const int severity, const int errnum, const char *what, const char *path) {
 
-                        errno = 0;
-                        if (lstat(pathofchild, &t_statbuf) == 0) {
-                            if (S_ISREG(t_statbuf.st_mode)) {
-                                /* if we have an hardlink count bigger then 1 .... */
-                                if (t_statbuf.st_nlink > 1) {
-                                    pthread_mutex_lock(&thr_nlink);
-                                    /* hmins inserts the inode in the hash table and returns 1 if this file had already been visited and 0 if it is new */
-                                    known_nlink_file = h_mins(t_statbuf.st_ino, t_statbuf.st_dev);
-                                    pthread_mutex_unlock(&thr_nlink);
-                                }
-                                if (t_statbuf.st_nlink == 1 || !known_nlink_file) {
-                                    if (stats) {
-                                        stat_counters[tid].filecounter++;
-                                    }
-                                    if (dryrun) {
-					uptr = begin_uidpair;
-					while (uptr != NULL) {
-					    if (uptr->olduid == t_statbuf.st_uid) {
-						n_statbuf = t_statbuf;
-						n_statbuf.st_uid = uptr->newuid;
-						oname = uidname(&t_statbuf, pwdbuffer);
-						nname = uidname(&n_statbuf, pwdbuffer);
-						fprintf(stdout, "%s (FILE): %u (%s), uid will be changed to %u (%s)\n", pathofchild, uptr->olduid, oname, uptr->newuid, nname);	
-						free(oname);
-						free(nname);
-						break;
-					    }
-					    uptr = uptr->next;
-                                    	}
-					gptr = begin_gidpair;
-					while (gptr != NULL) {
-					    if (gptr->oldgid == t_statbuf.st_gid) {
-						n_statbuf = t_statbuf;
-						n_statbuf.st_gid = gptr->newgid;
-						oname = gidname(&t_statbuf, grpbuffer);
-						nname = gidname(&n_statbuf, grpbuffer);
-						fprintf(stdout, "%s (FILE): %u (%s), gid will be changed to %u (%s)\n", pathofchild, gptr->oldgid, oname, gptr->newgid, nname);	
-						free(oname);
-						free(nname);
-						break;
-					    }
-					    gptr = gptr->next;
-                                    	}
-                                    } else {
-					uptr = begin_uidpair;
-					while (uptr != NULL) {
-					    if (uptr->olduid == t_statbuf.st_uid) {
-                        			errno = 0;
-						if (chown(pathofchild, uptr->newuid, (gid_t)-1) == 0) {
-						    n_statbuf = t_statbuf;
-						    n_statbuf.st_uid = uptr->newuid;
-						    oname = uidname(&t_statbuf, pwdbuffer);
-						    nname = uidname(&n_statbuf, pwdbuffer);
-						    len = strlen(oname) + strlen(nname) + strlen(pathofchild)+ 64;
-						    if ((msg = (char *) malloc(sizeof (char) * len)) == NULL) {
-							fprintf(stderr, "ERROR: No memory available for message string\n");
-							exit(ENOMEM);
-						    }
-						    snprintf(msg, (size_t) len, "%s (FILE): %11u (%s), uid will be changed to %11u (%s)", pathofchild, uptr->olduid, oname, uptr->newuid, nname);
-						    print_error_r(INFO, msg);
-						    free(msg);
-						    free(oname);
-						    free(nname);
-						    break;
-						} else {
-#ifdef HAVE_STRERROR_R
-                            			    if ((error_str = (char *) malloc(sizeof (char) * (size_t) (ERR_BUF_LENGTH + 1))) == NULL) {
-                                			fprintf(stderr, "ERROR: No memory available for Error string!\n");
-                                			exit(ENOMEM);
-                            			    }
-                            			    if (strerror_r(errno, error_str, (size_t) ERR_BUF_LENGTH) == 0) {
-                                			if ((msg = (char *) malloc(sizeof (char) * (strlen(pathofchild) + strlen(error_str) + 20))) == NULL) {
-                                    			    fprintf(stderr, "ERROR: No memory available for message string\n");
-                                    			    exit(ENOMEM);
-                                			}
-                                			snprintf(msg, strlen(pathofchild) + strlen(error_str) + 20, "couldn't stat <%s>: %s", pathofchild, error_str);
-                                			print_error_r(WARNING, msg);
-                            			    } else {
-                                			if ((msg = (char *) malloc(sizeof (char) * (strlen(pathofchild) + 44))) == NULL) {
-                                    			    fprintf(stderr, "ERROR: No memory available for message string\n");
-                                    			    exit(ENOMEM);
-                                			}
-                                			snprintf(msg, strlen(pathofchild) + 44, "couldn't stat <%s>: couldn't get error string", pathofchild);
-                                			print_error_r(WARNING, msg);
-                            			    }
-                            			    free(error_str);
-#else
-                            			    if ((msg = (char *) malloc(sizeof (char) * (strlen(pathofchild) + strlen(strerror(errno)) + 20))) == NULL) {
-                                			fprintf(stderr, "ERROR: No memory available for message string\n");
-                                			exit(ENOMEM);
-                            			    }
-                            			    snprintf(msg, strlen(pathofchild) + strlen(strerror(errno)) + 20, "couldn't stat <%s>: %s", pathofchild, strerror(errno));
-                            			    print_error_r(WARNING, msg);
-#endif
-                            			    free(msg);
-						}
-					    }
-					    uptr = uptr->next;
-                                    	}
-					gptr = begin_gidpair;
-					while (gptr != NULL) {
-					    if (gptr->oldgid == t_statbuf.st_gid) {
-                        			errno = 0;
-						if (chown(pathofchild, (uid_t)-1, gptr->newgid) == 0) {
-						    n_statbuf = t_statbuf;
-						    n_statbuf.st_gid = gptr->newgid;
-						    oname = gidname(&t_statbuf, grpbuffer);
-						    nname = gidname(&n_statbuf, grpbuffer);
-						    len = strlen(oname) + strlen(nname) + strlen(pathofchild)+ 64;
-						    if ((msg = (char *) malloc(sizeof (char) * len)) == NULL) {
-							fprintf(stderr, "ERROR: No memory available for message string\n");
-							exit(ENOMEM);
-						    }
-						    snprintf(msg, (size_t) len, "%s (FILE): %11u (%s), gid will be changed to %11u (%s)", pathofchild, gptr->oldgid, oname, gptr->newgid, nname);
-						    print_error_r(INFO, msg);
-						    free(msg);
-						    free(oname);
-						    free(nname);
-						    break;
-						} else {
-#ifdef HAVE_STRERROR_R
-                            			    if ((error_str = (char *) malloc(sizeof (char) * (size_t) (ERR_BUF_LENGTH + 1))) == NULL) {
-                                			fprintf(stderr, "ERROR: No memory available for Error string!\n");
-                                			exit(ENOMEM);
-                            			    }
-                            			    if (strerror_r(errno, error_str, (size_t) ERR_BUF_LENGTH) == 0) {
-                                			if ((msg = (char *) malloc(sizeof (char) * (strlen(pathofchild) + strlen(error_str) + 20))) == NULL) {
-                                    			    fprintf(stderr, "ERROR: No memory available for message string\n");
-                                    			    exit(ENOMEM);
-                                			}
-                                			snprintf(msg, strlen(pathofchild) + strlen(error_str) + 20, "couldn't stat <%s>: %s", pathofchild, error_str);
-                                			print_error_r(WARNING, msg);
-                            			    } else {
-                                			if ((msg = (char *) malloc(sizeof (char) * (strlen(pathofchild) + 44))) == NULL) {
-                                    			    fprintf(stderr, "ERROR: No memory available for message string\n");
-                                    			    exit(ENOMEM);
-                                			}
-                                			snprintf(msg, strlen(pathofchild) + 44, "couldn't stat <%s>: couldn't get error string", pathofchild);
-                                			print_error_r(WARNING, msg);
-                            			    }
-                            			    free(error_str);
-#else
-                            			    if ((msg = (char *) malloc(sizeof (char) * (strlen(pathofchild) + strlen(strerror(errno)) + 20))) == NULL) {
-                                			fprintf(stderr, "ERROR: No memory available for message string\n");
-                                			exit(ENOMEM);
-                            			    }
-                            			    snprintf(msg, strlen(pathofchild) + strlen(strerror(errno)) + 20, "couldn't stat <%s>: %s", pathofchild, strerror(errno));
-                            			    print_error_r(WARNING, msg);
-#endif
-                            			    free(msg);
-						}
-					    }
-					    gptr = gptr->next;
-					}	
-				    }	
-                                }
-                                free(pathofchild);
-                                pathofchild = NULL;
-                            } else if (S_ISLNK(t_statbuf.st_mode)) {
-                                if (dryrun) {
-				    uptr = begin_uidpair;
-				    while (uptr != NULL) {
-					if (uptr->olduid == t_statbuf.st_uid) {
-					    n_statbuf = t_statbuf;
-					    n_statbuf.st_uid = uptr->newuid;
-					    oname = uidname(&t_statbuf, pwdbuffer);
-					    nname = uidname(&n_statbuf, pwdbuffer);
-					    fprintf(stdout, "%s (DIRECTORY): %u (%s), uid will be changed to %u (%s)\n", pathofchild, uptr->olduid, oname, uptr->newuid, nname);	
-					    free(oname);
-					    free(nname);
-					    break;
-					}
-					uptr = uptr->next;
-                                    }
-				    gptr = begin_gidpair;
-				    while (gptr != NULL) {
-					if (gptr->oldgid == t_statbuf.st_gid) {
-					    n_statbuf = t_statbuf;
-					    n_statbuf.st_gid = gptr->newgid;
-					    oname = gidname(&t_statbuf, grpbuffer);
-					    nname = gidname(&n_statbuf, grpbuffer);
-					    fprintf(stdout, "%s (DIRECTORY): %u (%s), gid will be changed to %u (%s)\n", pathofchild, gptr->oldgid, oname, gptr->newgid, nname);	
-					    free(oname);
-					    free(nname);
-					    break;
-					}
-					gptr = gptr->next;
-                                    }
-                                } else {
-				    uptr = begin_uidpair;
-				    while (uptr != NULL) {
-			 		if (uptr->olduid == t_statbuf.st_uid) {
-                	   		    errno = 0;
-					    if (lchown(pathofchild, uptr->newuid, (gid_t)-1) == 0) {
-						n_statbuf = t_statbuf;
-						n_statbuf.st_uid = uptr->newuid;
-						oname = uidname(&t_statbuf, pwdbuffer);
-						nname = uidname(&n_statbuf, pwdbuffer);
-						len = strlen(oname) + strlen(nname) + strlen(pathofchild)+ 69;
-						if ((msg = (char *) malloc(sizeof (char) * len)) == NULL) {
-						    fprintf(stderr, "ERROR: No memory available for message string\n");
-						    exit(ENOMEM);
-						}
-						snprintf(msg, (size_t) len, "%s (DIRECTORY): %11u (%s), uid will be changed to %11u (%s)", pathofchild, uptr->olduid, oname, uptr->newuid, nname);
-						print_error_r(INFO, msg);
-						free(msg);
-						free(oname);
-						free(nname);
-						break;
-					    } else {
-#ifdef HAVE_STRERROR_R
-                            			if ((error_str = (char *) malloc(sizeof (char) * (size_t) (ERR_BUF_LENGTH + 1))) == NULL) {
-                                		    fprintf(stderr, "ERROR: No memory available for Error string!\n");
-                                		    exit(ENOMEM);
-                            			}
-                            			if (strerror_r(errno, error_str, (size_t) ERR_BUF_LENGTH) == 0) {
-                                		    if ((msg = (char *) malloc(sizeof (char) * (strlen(pathofchild) + strlen(error_str) + 20))) == NULL) {
-                                    			fprintf(stderr, "ERROR: No memory available for message string\n");
-                                    			exit(ENOMEM);
-                                		    }
-                                		    snprintf(msg, strlen(pathofchild) + strlen(error_str) + 20, "couldn't stat <%s>: %s", pathofchild, error_str);
-                                		    print_error_r(WARNING, msg);
-                            			} else {
-                                		    if ((msg = (char *) malloc(sizeof (char) * (strlen(pathofchild) + 44))) == NULL) {
-                                    			fprintf(stderr, "ERROR: No memory available for message string\n");
-                                    			exit(ENOMEM);
-                                		    }
-                                		    snprintf(msg, strlen(pathofchild) + 44, "couldn't stat <%s>: couldn't get error string", pathofchild);
-                                		    print_error_r(WARNING, msg);
-                            			}
-                            			free(error_str);
-#else
-                            			if ((msg = (char *) malloc(sizeof (char) * (strlen(pathofchild) + strlen(strerror(errno)) + 20))) == NULL) {
-                                		    fprintf(stderr, "ERROR: No memory available for message string\n");
-                                		    exit(ENOMEM);
-                            			}
-                            			snprintf(msg, strlen(pathofchild) + strlen(strerror(errno)) + 20, "couldn't stat <%s>: %s", pathofchild, strerror(errno));
-                            			print_error_r(WARNING, msg);
-#endif
-                            			free(msg);
-					    }
-					}
-					uptr = uptr->next;
-                                    }
-				    gptr = begin_gidpair;
-				    while (gptr != NULL) {
-					if (gptr->oldgid == t_statbuf.st_gid) {
-                        		    errno = 0;
-					    if (lchown(pathofchild, (uid_t)-1, gptr->newgid) == 0) {
-						n_statbuf = t_statbuf;
-						n_statbuf.st_gid = gptr->newgid;
-						oname = gidname(&t_statbuf, grpbuffer);
-						nname = gidname(&n_statbuf, grpbuffer);
-						len = strlen(oname) + strlen(nname) + strlen(pathofchild)+ 69;
-						if ((msg = (char *) malloc(sizeof (char) * len)) == NULL) {
-						    fprintf(stderr, "ERROR: No memory available for message string\n");
-						    exit(ENOMEM);
-						}
-						snprintf(msg, (size_t) len, "%s (DIRECTORY): %11u (%s), gid will be changed to %11u (%s)", pathofchild, gptr->oldgid, oname, gptr->newgid, nname);
-						print_error_r(INFO, msg);
-						free(msg);
-						free(oname);
-						free(nname);
-						break;
-					    } else {
-#ifdef HAVE_STRERROR_R
-                            		        if ((error_str = (char *) malloc(sizeof (char) * (size_t) (ERR_BUF_LENGTH + 1))) == NULL) {
-                                		    fprintf(stderr, "ERROR: No memory available for Error string!\n");
-                                		    exit(ENOMEM);
-                            			}
-                            			if (strerror_r(errno, error_str, (size_t) ERR_BUF_LENGTH) == 0) {
-                                		    if ((msg = (char *) malloc(sizeof (char) * (strlen(pathofchild) + strlen(error_str) + 20))) == NULL) {
-                                    			fprintf(stderr, "ERROR: No memory available for message string\n");
-                                    			exit(ENOMEM);
-                                		    }
-                                		    snprintf(msg, strlen(pathofchild) + strlen(error_str) + 20, "couldn't stat <%s>: %s", pathofchild, error_str);
-                                		    print_error_r(WARNING, msg);
-                            			} else {
-                                		    if ((msg = (char *) malloc(sizeof (char) * (strlen(pathofchild) + 44))) == NULL) {
-                                    			fprintf(stderr, "ERROR: No memory available for message string\n");
-                                    		    exit(ENOMEM);
-                                		    }
-                                		    snprintf(msg, strlen(pathofchild) + 44, "couldn't stat <%s>: couldn't get error string", pathofchild);
-                                		    print_error_r(WARNING, msg);
-                            			}
-                            			free(error_str);
-#else
-                            			if ((msg = (char *) malloc(sizeof (char) * (strlen(pathofchild) + strlen(strerror(errno)) + 20))) == NULL) {
-                                		    fprintf(stderr, "ERROR: No memory available for message string\n");
-                                		    exit(ENOMEM);
-                            			}
-                            			snprintf(msg, strlen(pathofchild) + strlen(strerror(errno)) + 20, "couldn't stat <%s>: %s", pathofchild, strerror(errno));
-                            			print_error_r(WARNING, msg);
-#endif
-                            			free(msg);
-					    }
-					}
-					gptr = gptr->next;
-                                    }
-				}	
-                                if (stats)
-                                    stat_counters[tid].linkcounter++;
-                                free(pathofchild);
-                                pathofchild = NULL;
-                            } else if (S_ISDIR(t_statbuf.st_mode)) {
-                                if (dryrun) {
-				    uptr = begin_uidpair;
-				    while (uptr != NULL) {
-					if (uptr->olduid == t_statbuf.st_uid) {
-					    n_statbuf = t_statbuf;
-					    n_statbuf.st_uid = uptr->newuid;
-					    oname = uidname(&t_statbuf, pwdbuffer);
-					    nname = uidname(&n_statbuf, pwdbuffer);
-					    fprintf(stdout, "%s (DIRECTORY): %u (%s), uid will be changed to %u (%s)\n", pathofchild, uptr->olduid, oname, uptr->newuid, nname);	
-					    free(oname);
-					    free(nname);
-					    break;
-					}
-					uptr = uptr->next;
-                                    }
-				    gptr = begin_gidpair;
-				    while (gptr != NULL) {
-					if (gptr->oldgid == t_statbuf.st_gid) {
-					    n_statbuf = t_statbuf;
-					    n_statbuf.st_gid = gptr->newgid;
-					    oname = gidname(&t_statbuf, grpbuffer);
-					    nname = gidname(&n_statbuf, grpbuffer);
-					    fprintf(stdout, "%s (DIRECTORY): %u (%s), gid will be changed to %u (%s)\n", pathofchild, gptr->oldgid, oname, gptr->newgid, nname);	
-					    free(oname);
-					    free(nname);
-					    break;
-					}
-					gptr = gptr->next;
-                                    }
-                                } else {
-				    uptr = begin_uidpair;
-				    while (uptr != NULL) {
-			 		if (uptr->olduid == t_statbuf.st_uid) {
-                	   		    errno = 0;
-					    if (chown(pathofchild, uptr->newuid, (gid_t)-1) == 0) {
-						n_statbuf = t_statbuf;
-						n_statbuf.st_uid = uptr->newuid;
-						oname = uidname(&t_statbuf, pwdbuffer);
-						nname = uidname(&n_statbuf, pwdbuffer);
-						len = strlen(oname) + strlen(nname) + strlen(pathofchild)+ 69;
-						if ((msg = (char *) malloc(sizeof (char) * len)) == NULL) {
-						    fprintf(stderr, "ERROR: No memory available for message string\n");
-						    exit(ENOMEM);
-						}
-						snprintf(msg, (size_t) len, "%s (DIRECTORY): %11u (%s), uid will be changed to %11u (%s)", pathofchild, uptr->olduid, oname, uptr->newuid, nname);
-						print_error_r(INFO, msg);
-						free(msg);
-						free(oname);
-						free(nname);
-						break;
-					    } else {
-#ifdef HAVE_STRERROR_R
-                            			if ((error_str = (char *) malloc(sizeof (char) * (size_t) (ERR_BUF_LENGTH + 1))) == NULL) {
-                                		    fprintf(stderr, "ERROR: No memory available for Error string!\n");
-                                		    exit(ENOMEM);
-                            			}
-                            			if (strerror_r(errno, error_str, (size_t) ERR_BUF_LENGTH) == 0) {
-                                		    if ((msg = (char *) malloc(sizeof (char) * (strlen(pathofchild) + strlen(error_str) + 20))) == NULL) {
-                                    			fprintf(stderr, "ERROR: No memory available for message string\n");
-                                    			exit(ENOMEM);
-                                		    }
-                                		    snprintf(msg, strlen(pathofchild) + strlen(error_str) + 20, "couldn't stat <%s>: %s", pathofchild, error_str);
-                                		    print_error_r(WARNING, msg);
-                            			} else {
-                                		    if ((msg = (char *) malloc(sizeof (char) * (strlen(pathofchild) + 44))) == NULL) {
-                                    			fprintf(stderr, "ERROR: No memory available for message string\n");
-                                    			exit(ENOMEM);
-                                		    }
-                                		    snprintf(msg, strlen(pathofchild) + 44, "couldn't stat <%s>: couldn't get error string", pathofchild);
-                                		    print_error_r(WARNING, msg);
-                            			}
-                            			free(error_str);
-#else
-                            			if ((msg = (char *) malloc(sizeof (char) * (strlen(pathofchild) + strlen(strerror(errno)) + 20))) == NULL) {
-                                		    fprintf(stderr, "ERROR: No memory available for message string\n");
-                                		    exit(ENOMEM);
-                            			}
-                            			snprintf(msg, strlen(pathofchild) + strlen(strerror(errno)) + 20, "couldn't stat <%s>: %s", pathofchild, strerror(errno));
-                            			print_error_r(WARNING, msg);
-#endif
-                            			free(msg);
-						free(oname);
-						free(nname);
-					    }
-					}
-					uptr = uptr->next;
-                                    }
-				    gptr = begin_gidpair;
-				    while (gptr != NULL) {
-					if (gptr->oldgid == t_statbuf.st_gid) {
-                        		    errno = 0;
-					    if (chown(pathofchild, (uid_t)-1, gptr->newgid) == 0) {
-						n_statbuf = t_statbuf;
-						n_statbuf.st_gid = gptr->newgid;
-						oname = gidname(&t_statbuf, grpbuffer);
-						nname = gidname(&n_statbuf, grpbuffer);
-						len = strlen(oname) + strlen(nname) + strlen(pathofchild)+ 69;
-						if ((msg = (char *) malloc(sizeof (char) * len)) == NULL) {
-						    fprintf(stderr, "ERROR: No memory available for message string\n");
-						    exit(ENOMEM);
-						}
-						snprintf(msg, (size_t) len, "%s (DIRECTORY): %11u (%s), gid will be changed to %11u (%s)", pathofchild, gptr->oldgid, oname, gptr->newgid, nname);
-						print_error_r(INFO, msg);
-						free(msg);
-						free(oname);
-						free(nname);
-						break;
-					    } else {
+/*
+ * Description:
+ * Writes a message of the form "<what> <path>: <error string>" to the log file in a thread safe way.
+ *
+ * Parameters:
+ * severity:    INFO, WARNING or ERROR
+ * errnum:      error number the error string is derived from
+ * what:        description of the failed operation
+ * path:        path of the file the operation failed on
+ *
+ */
+    char        *msg = NULL;
+    size_t      len;
 #ifdef HAVE_STRERROR_R
-                            		        if ((error_str = (char *) malloc(sizeof (char) * (size_t) (ERR_BUF_LENGTH + 1))) == NULL) {
-                                		    fprintf(stderr, "ERROR: No memory available for Error string!\n");
-                                		    exit(ENOMEM);
-                            			}
-                            			if (strerror_r(errno, error_str, (size_t) ERR_BUF_LENGTH) == 0) {
-                                		    if ((msg = (char *) malloc(sizeof (char) * (strlen(pathofchild) + strlen(error_str) + 20))) == NULL) {
-                                    			fprintf(stderr, "ERROR: No memory available for message string\n");
-                                    			exit(ENOMEM);
-                                		    }
-                                		    snprintf(msg, strlen(pathofchild) + strlen(error_str) + 20, "couldn't stat <%s>: %s", pathofchild, error_str);
-                                		    print_error_r(WARNING, msg);
-                            			} else {
-                                		    if ((msg = (char *) malloc(sizeof (char) * (strlen(pathofchild) + 44))) == NULL) {
-                                    			fprintf(stderr, "ERROR: No memory available for message string\n");
-                                    		    exit(ENOMEM);
-                                		    }
-                                		    snprintf(msg, strlen(pathofchild) + 44, "couldn't stat <%s>: couldn't get error string", pathofchild);
-                                		    print_error_r(WARNING, msg);
-                            			}
-                            			free(error_str);
+    char        error_str[ERR_BUF_LENGTH + 1];
+
+    if (strerror_r(errnum, error_str, (size_t) ERR_BUF_LENGTH) != 0)
+        strncpy(error_str, "couldn't get error string", (size_t) ERR_BUF_LENGTH);
 #else
-                            			if ((msg = (char *) malloc(sizeof (char) * (strlen(pathofchild) + strlen(strerror(errno)) + 20))) == NULL) {
-                                		    fprintf(stderr, "ERROR: No memory available for message string\n");
-                                		    exit(ENOMEM);
-                            			}
-                            			snprintf(msg, strlen(pathofchild) + strlen(strerror(errno)) + 20, "couldn't stat <%s>: %s", pathofchild, strerror(errno));
-                            			print_error_r(WARNING, msg);
+    const char  *error_str = strerror(errnum);
 #endif
-                            			free(msg);
-					    }
-					}
-					gptr = gptr->next;
-                                    }
-				}	
-                                if (stats)
-                                    stat_counters[tid].dircounter++;
-                                w_element->directsubdirs++;
+    len = strlen(what) + strlen(path) + strlen(error_str) + 6;
+    if ((msg = (char *) malloc(sizeof (char) * len)) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for message string\n");
+        exit(ENOMEM);
+    }
+    snprintf(msg, len, "%s <%s>: %s", what, path, error_str);
+    print_error_r(severity, msg);
+    free(msg);
+}
+
+static char *
+        entry_path(tile_entry_t *te) {
+
 /*
- * this child is a directory which has to be investigated as well so we create a new deq element for it
+ * Description:
+ * Returns the full path of a directory entry. The path is assembled out of the path of the
+ * parent directory and the entry name only on demand and kept in a buffer reused for all
+ * entries of a tile.
+ *
+ * Parameters:
+ * te:          directory entry
+ *
  */
-                                if ((p_element = (queue_element_t *) malloc(sizeof (queue_element_t))) != NULL) {
-                                    p_element->dirpos = 0;
-                                    p_element->fs = w_element->fs;
-                                    p_element->directsubdirs = 0;
-                                    p_element->parent = w_element;
-                                    p_element->name = pathofchild;
-                                    pathofchild = NULL;
-                                    p_element->next = NULL;
+    size_t      len;
+
+    if (!te->pathvalid) {
+        len = strlen(te->dirname) + strlen(te->name) + 2;
+        if (len > te->pathlen) {
+            if ((te->path = (char *) realloc(te->path, sizeof (char) * len)) == NULL) {
+                fprintf(stderr, "ERROR: No memory available for Name string\n");
+                exit(ENOMEM);
+            }
+            te->pathlen = len;
+        }
+        snprintf(te->path, len, "%s/%s", te->dirname, te->name);
+        te->pathvalid = 1;
+    }
+    return te->path;
+}
+
+static short int
+        entry_needs_stat(const tile_entry_t *te) {
+
 /*
- * new element is put into the thread's private deq
+ * Description:
+ * Classifies a directory entry by the type readdir returned for it. Entries which are neither
+ * regular files, directories nor links are only counted, so they need no lstat. If the file
+ * system doesn't fill in the type (DT_UNKNOWN) the entry is always stat'ed.
+ *
  */
-                                    if (stack)
-                                        deq_push(p_anchor, p_element);
-                                    else
-                                        deq_put(p_anchor, p_element);
-                                } else {
-                                    fprintf(stderr, "Error allocating memory for new queue element!!\n");
-                                    exit(ENOMEM);
-                                } /* pathofchild needed for element name of directory child therefore no free */
-                            } else {
-                                if (stats)
-                                    stat_counters[tid].otherscounter++;
-                                free(pathofchild);
-                                pathofchild = NULL;
-                            }
-                        } else {
-#ifdef HAVE_STRERROR_R
-                            if ((error_str = (char *) malloc(sizeof (char) * (size_t) (ERR_BUF_LENGTH + 1))) == NULL) {
-                                fprintf(stderr, "ERROR: No memory available for Error string!\n");
-                                exit(ENOMEM);
-                            }
-                            if (strerror_r(errno, error_str, (size_t) ERR_BUF_LENGTH) == 0) {
-                                if ((msg = (char *) malloc(sizeof (char) * (strlen(pathofchild) + strlen(error_str) + 20))) == NULL) {
-                                    fprintf(stderr, "ERROR: No memory available for message string\n");
-                                    exit(ENOMEM);
-                                }
-                                snprintf(msg, strlen(pathofchild) + strlen(error_str) + 20, "couldn't stat <%s>: %s", pathofchild, error_str);
-                                print_error_r(WARNING, msg);
-                            } else {
-                                if ((msg = (char *) malloc(sizeof (char) * (strlen(pathofchild) + 44))) == NULL) {
-                                    fprintf(stderr, "ERROR: No memory available for message string\n");
-                                    exit(ENOMEM);
-                                }
-                                snprintf(msg, strlen(pathofchild) + 44, "couldn't stat <%s>: couldn't get error string", pathofchild);
-                                print_error_r(WARNING, msg);
-                            }
-                            free(error_str);
-#else
-                            if ((msg = (char *) malloc(sizeof (char) * (strlen(pathofchild) + strlen(strerror(errno)) + 20))) == NULL) {
-                                fprintf(stderr, "ERROR: No memory available for message string\n");
-                                exit(ENOMEM);
-                            }
-                            snprintf(msg, strlen(pathofchild) + strlen(strerror(errno)) + 20, "couldn't stat <%s>: %s", pathofchild, strerror(errno));
-                            print_error_r(WARNING, msg);
-#endif
-                            free(msg);
-                            free(pathofchild);
-                            pathofchild = NULL;
-                        }
+    switch (te->d_type) {
+        case DT_UNKNOWN:
+        case DT_REG:
+        case DT_DIR:
+        case DT_LNK:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static unsigned long
+        stat_latency(stat_counter_t *hist, stat_counter_t *sum, const struct timespec *t1) {
+
 /*
- * here we check for busy threads
+ * Description:
+ * Adds the time since t1 to a latency sum and histogram of the calling thread.
+ *
+ * Return value:
+ * time since t1 in nanoseconds
+ *
  */
-                        if ((double) busy_count / (double) numthr < busythreshold) {
+    struct timespec t2;
+    unsigned long   ns, us;
+    int             i = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    ns = (unsigned long) (t2.tv_sec - t1->tv_sec) * 1000000000UL + (unsigned long) t2.tv_nsec - (unsigned long) t1->tv_nsec;
+    for (us = ns / 1000; us > 0 && i < STAT_LAT_BUCKETS - 1; us >>= 1)
+        i++;
+    STAT_ADD(*sum, ns);
+    STAT_INC(hist[i]);
+    return ns;
+}
+
 /*
- * too few threads working so stop processeing of the current node's children.
+ * The per-entry code is written once as inline functions taking the run configuration as
+ * constant parameters and instantiated for every configuration (see ENTRY_HANDLERS and
+ * OWNER_HANDLER), so the compiler drops the branches a configuration doesn't need. The
+ * variants for a directory with and without a rate limit are selected once at startup, the
+ * one of a directory when it's taken up (tile_entry_t handler).
  */
-                            too_many_idle_threads = 1;
-                            w_element->dirpos = telldir(dp);
-                            errno = 0;
-                            if ((dirp = readdir(dp)) != NULL) {
-                                deq_put(p_anchor, w_element);
-                                backtodeq = 1;
-                            }
-                            if (errno != 0) {
-#ifdef HAVE_STRERROR_R
-                                if ((error_str = (char *) malloc(sizeof (char) * (size_t) (ERR_BUF_LENGTH + 1))) == NULL) {
-                                    fprintf(stderr, "ERROR: No memory available for Error string!\n");
-                                    exit(ENOMEM);
-                                }
-                                if (strerror_r(errno, error_str, (size_t) ERR_BUF_LENGTH) == 0) {
-                                    if ((msg = (char *) malloc(sizeof (char) * (strlen(w_element->name) + strlen(error_str) + 53))) == NULL) {
-                                        fprintf(stderr, "ERROR: No memory available for message string\n");
-                                        exit(ENOMEM);
-                                    }
-                                    snprintf(msg, strlen(w_element->name) + strlen(error_str) + 53, "readdir() at dirpos check failed for directory <%s>: %s", w_element->name, error_str);
-                                    print_error_r(WARNING, msg);
-                                } else {
-                                    if ((msg = (char *) malloc(sizeof (char) * (strlen(w_element->name) + 79))) == NULL) {
-                                        fprintf(stderr, "ERROR: No memory available for message string\n");
-                                        exit(ENOMEM);
-                                    }
-                                    snprintf(msg, strlen(w_element->name) + 79, "readdir() at dirpos check failed for directory <%s>: couldn't get error string", w_element->name);
-                                    print_error_r(WARNING, msg);
-                                }
-                                free(error_str);
+#ifdef __GNUC__
+#define ENTRY_INLINE static inline __attribute__((always_inline))
 #else
-                                if ((msg = (char *) malloc(sizeof (char) * (strlen(w_element->name) + strlen(strerror(errno)) + 53))) == NULL) {
-                                    fprintf(stderr, "ERROR: No memory available for message string\n");
-                                    exit(ENOMEM);
-                                }
-                                snprintf(msg, strlen(w_element->name) + strlen(strerror(errno)) + 53, "readdir() at dirpos check failed for directory <%s>: %s", w_element->name, strerror(errno));
-                                print_error_r(WARNING, msg);
+#define ENTRY_INLINE static inline
 #endif
-                                free(msg);
-                            }
-                        }
-                    } /* if included in investigation */
-                } /* exclude dot files */
-            } /* for (dirp = readdir(dp); dirp != NULL && !too_many_idle_threads;... */
 
-            if (errno != 0) {
-#ifdef HAVE_STRERROR_R
-                if ((error_str = (char *) malloc(sizeof (char) * (size_t) (ERR_BUF_LENGTH + 1))) == NULL) {
-                    fprintf(stderr, "ERROR: No memory available for Error string!\n");
-                    exit(ENOMEM);
-                }
-                if (strerror_r(errno, error_str, (size_t) ERR_BUF_LENGTH) == 0) {
-                    if ((msg = (char *) malloc(sizeof (char) * (strlen(w_element->name) + strlen(error_str) + 37))) == NULL) {
-                        fprintf(stderr, "ERROR: No memory available for message string\n");
-                        exit(ENOMEM);
-                    }
-                    snprintf(msg, strlen(w_element->name) + strlen(error_str) + 37, "readdir() failed for directory <%s>: %s", w_element->name, error_str);
-                    print_error_r(WARNING, msg);
-                } else {
-                    if ((msg = (char *) malloc(sizeof (char) * (strlen(w_element->name) + 62))) == NULL) {
-                        fprintf(stderr, "ERROR: No memory available for message string\n");
-                        exit(ENOMEM);
-                    }
-                    snprintf(msg, strlen(w_element->name) + 62, "readdir() failed for directory <%s>: couldn't get error string", w_element->name);
-                    print_error_r(WARNING, msg);
-                }
-                free(error_str);
-#else
-                if ((msg = (char *) malloc(sizeof (char) * (strlen(w_element->name) + strlen(strerror(errno)) + 37))) == NULL) {
-                    fprintf(stderr, "ERROR: No memory available for message string\n");
-                    exit(ENOMEM);
-                }
-                snprintf(msg, strlen(w_element->name) + strlen(strerror(errno)) + 37, "readdir() failed for directory <%s>: %s", w_element->name, strerror(errno));
-                print_error_r(WARNING, msg);
-#endif
-                free(msg);
-            }
+/*
+ * statistics of a configuration: none, counters only, counters and timed system calls
+ */
+#define STATS_NONE      0
+#define STATS_COUNT     1
+#define STATS_TIMED     2
+#define STATS_LEVELS    3
 
-            errno = 0;
-            if (closedir(dp) < 0) {
-#ifdef HAVE_STRERROR_R
-                if ((error_str = (char *) malloc(sizeof (char) * (size_t) (ERR_BUF_LENGTH + 1))) == NULL) {
-                    fprintf(stderr, "ERROR: No memory available for Error string!\n");
-                    exit(ENOMEM);
-                }
-                if (strerror_r(errno, error_str, (size_t) ERR_BUF_LENGTH) == 0) {
-                    if ((msg = (char *) malloc(sizeof (char) * (strlen(w_element->name) + strlen(error_str) + 28))) == NULL) {
-                        fprintf(stderr, "ERROR: No memory available for message string\n");
-                        exit(ENOMEM);
-                    }
-                    snprintf(msg, strlen(w_element->name) + strlen(error_str) + 28, "can't close directory <%s>: %s", w_element->name, error_str);
-                    print_error_r(WARNING, msg);
-                } else {
-                    if ((msg = (char *) malloc(sizeof (char) * (strlen(w_element->name) + 53))) == NULL) {
-                        fprintf(stderr, "ERROR: No memory available for message string\n");
-                        exit(ENOMEM);
-                    }
-                    snprintf(msg, strlen(w_element->name) + 53, "can't close directory <%s>: couldn't get error string", w_element->name);
-                    print_error_r(WARNING, msg);
-                }
-                free(error_str);
-#else
-                if ((msg = (char *) malloc(sizeof (char) * (strlen(w_element->name) + strlen(strerror(errno)) + 28))) == NULL) {
-                    fprintf(stderr, "ERROR: No memory available for message string\n");
-                    exit(ENOMEM);
-                }
-                snprintf(msg, strlen(w_element->name) + strlen(strerror(errno)) + 28, "can't close directory <%s>: %s", w_element->name, strerror(errno));
-                print_error_r(WARNING, msg);
-#endif
-                free(msg);
-            }
-            if (too_many_idle_threads && p_anchor->element_counter > 1) {
 /*
- * to make threads working again transfer the directories in the private deq to the global deq. Keep one for
- * continuing work in this thread.
+ * where a change is recorded: in the log file, in the journal (-j) or only on stdout (-n)
  */
-                gettimeofday(&t2, NULL);
-                if ((msg = (char *) malloc(sizeof (char) * 40)) == NULL) {
-                    fprintf(stderr, "ERROR: No memory available for message string\n");
-                    exit(ENOMEM);
-                }
-                snprintf(msg, (size_t) 40, "too many idle threads (%3ld) detected!", (long) (numthr - busy_count));
-                print_error_r(INFO, msg);
-                free(msg);
-                deq_count = p_anchor->element_counter;
-                if (dual_queue) {
-                    delta = (double) (t2.tv_sec - t1.tv_sec) + (double) (t2.tv_usec - t1.tv_usec) / 1000000.;
-                    scanrate = (delta > 0) ? directories_scanned / delta : directories_scanned;
-                    first_deq_element = deq_get(p_anchor);
-                    pthread_mutex_lock(&thr_queue);
-                    if (scanrate >= (double) (fast_anchor->speed + slow_anchor->speed) / 2.) {
-                        if (stack)
-                            deq_prepend(fast_anchor, p_anchor);
-                        else
-                            deq_append(fast_anchor, p_anchor);
-                        fast_anchor->speed = scanrate;
-                    } else {
-                        if (stack)
-                            deq_prepend(slow_anchor, p_anchor);
-                        else
-                            deq_append(slow_anchor, p_anchor);
-                        slow_anchor->speed = scanrate;
-                    }
-                    pthread_mutex_unlock(&thr_queue);
-                } else {
-                    pthread_mutex_lock(&thr_queue);
-                    if (stack)
-                        deq_prepend(fast_anchor, p_anchor);
-                    else
-                        deq_append(fast_anchor, p_anchor);
-                    pthread_mutex_unlock(&thr_queue);
-                }
-                for (j = 0; j < deq_count - 1; j++)
-                    pthread_cond_signal(&queue_empty);
-                deq_put(p_anchor, first_deq_element);
+#define OWNER_LOG       0
+#define OWNER_JOURNAL   1
+#define OWNER_DRYRUN    2
+#define OWNER_RECORDS   3
+
 /*
- * reset directories_scanned after transfer for next transfer scanrate calculation
+ * per-entry handlers of a configuration: lstat data known, entry only, and what is done with
+ * an entry to be changed (changed, counted for -a or handed to the apply threads of -w)
  */
-                directories_scanned = 0;
-            }
-        } else { /* could not open directory of node w */
-#ifdef HAVE_STRERROR_R
-            if ((error_str = (char *) malloc(sizeof (char) * (size_t) (ERR_BUF_LENGTH + 1))) == NULL) {
-                fprintf(stderr, "ERROR: No memory available for Error string!\n");
-                exit(ENOMEM);
-            }
-            if (strerror_r(errno, error_str, (size_t) ERR_BUF_LENGTH) == 0) {
-                if ((msg = (char *) malloc(sizeof (char) * (strlen(w_element->name) + strlen(error_str) + 20))) == NULL) {
-                    fprintf(stderr, "ERROR: No memory available for message string\n");
-                    exit(ENOMEM);
-                }
-                snprintf(msg, strlen(w_element->name) + strlen(error_str) + 20, "couldn't open <%s>: %s", w_element->name, error_str);
-                print_error_r(WARNING, msg);
-            } else {
-                if ((msg = (char *) malloc(sizeof (char) * (strlen(w_element->name) + 44))) == NULL) {
-                    fprintf(stderr, "ERROR: No memory available for message string\n");
-                    exit(ENOMEM);
-                }
-                snprintf(msg, strlen(w_element->name) + 44, "couldn't open <%s>: couldn't get error string", w_element->name);
-                print_error_r(WARNING, msg);
-            }
-            free(error_str);
-#else
-            if ((msg = (char *) malloc(sizeof (char) * (strlen(w_element->name) + strlen(strerror(errno)) + 20))) == NULL) {
-                fprintf(stderr, "ERROR: No memory available for message string\n");
-                exit(ENOMEM);
-            }
-            snprintf(msg, strlen(w_element->name) + strlen(strerror(errno)) + 20, "couldn't open <%s>: %s", w_element->name, strerror(errno));
-            print_error_r(WARNING, msg);
-#endif
-            free(msg);
-        }
+typedef struct entry_handler {
+    void        (*stat)(const unsigned int tid, tile_entry_t *te, const struct stat *t_statbuf, queue_element_t *w_element, queue_anchor_t *p_anchor);
+    void        (*entry)(const unsigned int tid, tile_entry_t *te, queue_element_t *w_element, queue_anchor_t *p_anchor);
+    apply_fn_t  owner;
+} entry_handler_t;
 
-        if (!backtodeq) {
-            free(w_element->name);
-            //free(w_element);
-        }
+ENTRY_INLINE int
+        entry_lstat(const unsigned int tid, tile_entry_t *te, struct stat *statbuf, const short int timed, const short int limited) {
+
+/*
+ * Description:
+ * lstat() for a directory entry, relative to its parent directory in fd-relative mode.
+ * If timed, timed for the metrics and the latency target of the rate limit; if limited, the
+ * tokens are taken from the bucket of the entry.
+ *
+ */
+    struct timespec t1;
+    unsigned long   ns;
+    int             rc, err;
+
+    if (limited)
+        rate_take(tid, te->bucket, 1);
+    if (!timed) {
+        if (te->dfd != AT_FDCWD)
+            return fstatat(te->dfd, te->name, statbuf, AT_SYMLINK_NOFOLLOW);
+        return lstat(entry_path(te), statbuf);
     }
-    free(p_anchor);
-    p_anchor = NULL;
-    free(w_element);
-    w_element = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (te->dfd != AT_FDCWD)
+        rc = fstatat(te->dfd, te->name, statbuf, AT_SYMLINK_NOFOLLOW);
+    else
+        rc = lstat(entry_path(te), statbuf);
+    err = errno;
+    STAT_INC(stat_counters[tid].lstatcounter);
+    ns = stat_latency(stat_counters[tid].lstat_hist, &stat_counters[tid].lstat_ns, &t1);
+    if (limited)
+        rate_latency(tid, te->bucket, ns);
+    errno = err;
+    return rc;
 }
 
-#ifndef _WIN32
-static void *
-        statistic(void *bla) {
-#else
-DWORD WINAPI
-	statistic(PVOID bla) {
-#endif
+ENTRY_INLINE int
+        entry_chown(const unsigned int tid, tile_entry_t *te, const uid_t uid, const gid_t gid, const short int timed, const short int limited) {
+
 /*
  * Description:
- * Gathers and prints out on demand some statistical data.
+ * lchown() for a directory entry, relative to its parent directory in fd-relative mode.
+ * Symbolic links are never followed, not even if a file or directory has been replaced by one
+ * since its lstat. If timed, timed for the metrics; if limited, rate limited.
  *
- * Parameters:
- * bla: dummy argument to make the compiler happy
  */
-    unsigned long       ofilecount=0, odircount=0, olinkcount=0, gfilecount=0, glinkcount=0, gdircount=0, glcount=0, gocount=0;
-    double              fscanrate = 0, dscanrate = 0, lscanrate = 0;
-    size_t              i = 0;
+    struct timespec t1;
+    int             rc, err;
 
-    if (dual_queue)
-        fprintf(stdout, "\nThreads busy      files   files/s directories/s links/s elements fast-q Speed slow-q Speed\n\n");
-    else
-        fprintf(stdout, "\nThreads busy      files   files/s directories/s links/s queue elements\n\n");
-    sleep(interval);
-    while (notfinished) {
-        for (i = 0; i < numthr; i++) {
-            gfilecount += stat_counters[i].filecounter;
-            gdircount += stat_counters[i].dircounter;
-            gocount += stat_counters[i].otherscounter;
-            glcount += stat_counters[i].linkcounter;
-        }
-        fscanrate = (gfilecount - ofilecount) / interval;
-        dscanrate = (gdircount - odircount) / interval;
-        lscanrate = (glinkcount - olinkcount) / interval;
-        ofilecount = gfilecount;
-        odircount = gdircount;
-        olinkcount = glinkcount;
-        if (dual_queue)
-            fprintf(stdout, "%7ld %4ld %10ld %7.0f %13.0f %7.0f %15ld %5.1f %6ld %5.1f\n", (long) numthr, (long) busy_count, gfilecount, fscanrate, dscanrate, lscanrate, fast_anchor->element_counter, fast_anchor->speed, slow_anchor->element_counter, slow_anchor->speed);
-        else
-            fprintf(stdout, "%7ld %4ld %10ld %7.0f %13.0f %7.0f %14ld\n", (long) numthr, (long) busy_count, gfilecount, fscanrate, dscanrate,  lscanrate, fast_anchor->element_counter);
-        gfilecount = 0;        
-        gdircount = 0;        
-        glcount = 0;        
-        gocount = 0;        
-        sleep(interval);
+    if (limited)
+        rate_take(tid, te->bucket, 1);
+    if (!timed) {
+        if (te->dfd != AT_FDCWD)
+            return fchownat(te->dfd, te->name, uid, gid, AT_SYMLINK_NOFOLLOW);
+        return lchown(entry_path(te), uid, gid);
     }
-    fprintf(stdout, "\n");
-    pthread_exit(EXIT_SUCCESS);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (te->dfd != AT_FDCWD)
+        rc = fchownat(te->dfd, te->name, uid, gid, AT_SYMLINK_NOFOLLOW);
+    else
+        rc = lchown(entry_path(te), uid, gid);
+    err = errno;
+    STAT_INC(stat_counters[tid].chowncounter);
+    stat_latency(stat_counters[tid].chown_hist, &stat_counters[tid].chown_ns, &t1);
+    errno = err;
+    return rc;
 }
 
-static void *
-        handle_subtree(void *id) {
+ENTRY_INLINE void
+        apply_owner_as(const unsigned int tid, tile_entry_t *te, const struct stat *statbuf, const char *type, const idmap_entry_t *uptr, const idmap_entry_t *gptr,
+                       const int record, const short int combine, const short int timed, const short int limited) {
 
 /*
  * Description:
- * Chooses one of the global deq's, takes a queue element out of it and calls process_tile for processing it.
- * After process_tile is finished chooses next available subtree root from global deq.
+ * Changes UID and GID of a directory entry (or just reports the change in dry run mode) in
+ * two disjunct steps. In combined mode an entry matching both lists is changed with one call
+ * and reported in one line. With a journal the changes are recorded there instead of the log
+ * file. Called by the scanning thread or, with -w, by an apply thread.
+ *
+ * Parameters:
+ * tid:         thread id
+ * te:          directory entry
+ * statbuf:     data returned by lstat for the entry
+ * type:        entry type used for reporting
+ * uptr, gptr:  mappings of the uid and gid of the entry, NULL if they aren't changed
+ * record:      one of the OWNER_ records
+ * combine:     combined mode (-c)
+ * timed:       lchown calls are timed for the metrics
+ * limited:     lchown calls take tokens from the bucket of the entry
  *
- * Parameter:
- * id: thread id
  */
-    queue_element_t *qe = NULL;
-    char            *pwdbuffer = NULL;
-    char            *grpbuffer = NULL;
-    unsigned int    tid = 0;
+    char            *msg = NULL;
+    size_t          len;
+    uid_t           newuid = statbuf->st_uid;
+    gid_t           newgid = statbuf->st_gid;
+    short int       changed = 0;
 
-    tid = *((unsigned int *) id);
-    
-    if ((pwdbuffer = (char *) malloc(pwdlinelen)) == NULL) {
-        fprintf(stderr, "ERROR: No memory available for passwd buffer\n");
-        exit(ENOMEM);
-    }
-    if ((grpbuffer = (char *) malloc(grplinelen)) == NULL) {
-        fprintf(stderr, "ERROR: No memory available for group buffer\n");
-        exit(ENOMEM);
+/*
+ * a directory with changes only shown can't be recorded as clean
+ */
+    if (record == OWNER_DRYRUN)
+        te->dirty = 1;
+    if (combine && uptr != NULL && gptr != NULL) {
+        errno = 0;
+        if (record == OWNER_DRYRUN || entry_chown(tid, te, (uid_t) uptr->newid, (gid_t) gptr->newid, timed, limited) == 0) {
+            if (record == OWNER_DRYRUN) {
+                fprintf(stdout, "%s (%s): %u (%s), uid will be changed to %u (%s), %u (%s), gid will be changed to %u (%s)\n", entry_path(te), type, uptr->oldid, uptr->oldname, uptr->newid, uptr->newname, gptr->oldid, gptr->oldname, gptr->newid, gptr->newname);
+            } else if (record == OWNER_JOURNAL) {
+                journal_change(tid, te->dirname, te->name, statbuf, (uid_t) uptr->newid, (gid_t) gptr->newid, type[0]);
+            } else {
+                len = strlen(uptr->oldname) + strlen(uptr->newname) + strlen(gptr->oldname) + strlen(gptr->newname) + strlen(entry_path(te)) + strlen(type) + 120;
+                msg = (char *) slab_alloc(tid, sizeof (char) * len);
+                snprintf(msg, len, "%s (%s): %11u (%s), uid will be changed to %11u (%s), %11u (%s), gid will be changed to %11u (%s)", entry_path(te), type, uptr->oldid, uptr->oldname, uptr->newid, uptr->newname, gptr->oldid, gptr->oldname, gptr->newid, gptr->newname);
+                print_error_r(INFO, msg);
+                slab_free(tid, msg);
+            }
+        } else {
+            print_errno_r(WARNING, errno, "couldn't change uid and gid of", entry_path(te));
+            te->dirty = 1;
+        }
+        return;
     }
-    
-    while (notfinished) {
-        pthread_mutex_lock(&thr_queue);
-        while ((fast_anchor->element_counter == 0) && (slow_anchor->element_counter == 0) && (notfinished))
-            pthread_cond_wait(&queue_empty, &thr_queue);
+    if (uptr != NULL) {
+        errno = 0;
+        if (record == OWNER_DRYRUN || entry_chown(tid, te, (uid_t) uptr->newid, (gid_t)-1, timed, limited) == 0) {
+            if (record == OWNER_DRYRUN) {
+                fprintf(stdout, "%s (%s): %u (%s), uid will be changed to %u (%s)\n", entry_path(te), type, uptr->oldid, uptr->oldname, uptr->newid, uptr->newname);
+            } else if (record == OWNER_JOURNAL) {
+                newuid = (uid_t) uptr->newid;
+                changed = 1;
+            } else {
+                len = strlen(uptr->oldname) + strlen(uptr->newname) + strlen(entry_path(te)) + strlen(type) + 60;
+                msg = (char *) slab_alloc(tid, sizeof (char) * len);
+                snprintf(msg, len, "%s (%s): %11u (%s), uid will be changed to %11u (%s)", entry_path(te), type, uptr->oldid, uptr->oldname, uptr->newid, uptr->newname);
+                print_error_r(INFO, msg);
+                slab_free(tid, msg);
+            }
+        } else {
+            print_errno_r(WARNING, errno, "couldn't change uid of", entry_path(te));
+            te->dirty = 1;
+        }
+    }
+    if (gptr != NULL) {
+        errno = 0;
+        if (record == OWNER_DRYRUN || entry_chown(tid, te, (uid_t)-1, (gid_t) gptr->newid, timed, limited) == 0) {
+            if (record == OWNER_DRYRUN) {
+                fprintf(stdout, "%s (%s): %u (%s), gid will be changed to %u (%s)\n", entry_path(te), type, gptr->oldid, gptr->oldname, gptr->newid, gptr->newname);
+            } else if (record == OWNER_JOURNAL) {
+                newgid = (gid_t) gptr->newid;
+                changed = 1;
+            } else {
+                len = strlen(gptr->oldname) + strlen(gptr->newname) + strlen(entry_path(te)) + strlen(type) + 60;
+                msg = (char *) slab_alloc(tid, sizeof (char) * len);
+                snprintf(msg, len, "%s (%s): %11u (%s), gid will be changed to %11u (%s)", entry_path(te), type, gptr->oldid, gptr->oldname, gptr->newid, gptr->newname);
+                print_error_r(INFO, msg);
+                slab_free(tid, msg);
+            }
+        } else {
+            print_errno_r(WARNING, errno, "couldn't change gid of", entry_path(te));
+            te->dirty = 1;
+        }
+    }
+    if (changed)
+        journal_change(tid, te->dirname, te->name, statbuf, newuid, newgid, type[0]);
+}
+
+/*
+ * one variant of apply_owner for every way of recording a change, with and without combined
+ * mode, timing and rate limit
+ */
+#define OWNER_HANDLER(suffix, record, combine, timed, limited) \
+static void \
+        apply_owner_##suffix(const unsigned int tid, tile_entry_t *te, const struct stat *statbuf, const char *type, const idmap_entry_t *uptr, const idmap_entry_t *gptr) { \
+    apply_owner_as(tid, te, statbuf, type, uptr, gptr, record, combine, timed, limited); \
+}
+#define OWNER_LIMITS(s, record, combine, timed) \
+    OWNER_HANDLER(s##_free, record, combine, timed, 0) OWNER_HANDLER(s##_limited, record, combine, timed, 1)
+#define OWNER_TIMES(s, record, combine) \
+    OWNER_LIMITS(s##_plain, record, combine, 0) OWNER_LIMITS(s##_timed, record, combine, 1)
+#define OWNER_COMBINES(s, record) \
+    OWNER_TIMES(s##_split, record, 0) OWNER_TIMES(s##_combined, record, 1)
+
+OWNER_COMBINES(log, OWNER_LOG)
+OWNER_COMBINES(journal, OWNER_JOURNAL)
+OWNER_COMBINES(dryrun, OWNER_DRYRUN)
+
+#define OWNER_ROW_L(s)  { apply_owner_##s##_free, apply_owner_##s##_limited }
+#define OWNER_ROW_T(s)  { OWNER_ROW_L(s##_plain), OWNER_ROW_L(s##_timed) }
+#define OWNER_ROW_C(s)  { OWNER_ROW_T(s##_split), OWNER_ROW_T(s##_combined) }
+
+/*
+ * indexed by record, combined mode, timing and rate limit
+ */
+static const apply_fn_t owner_handlers[OWNER_RECORDS][2][2][2] = {
+    OWNER_ROW_C(log), OWNER_ROW_C(journal), OWNER_ROW_C(dryrun)
+};
+
+ENTRY_INLINE void
+        report_owner_as(const unsigned int tid, tile_entry_t *te, const struct stat *statbuf, const char *type, const idmap_entry_t *uptr, const idmap_entry_t *gptr, const short int combine) {
+
+/*
+ * Description:
+ * Counts a directory entry and the lchown calls a real run would make for it in report mode.
+ *
+ */
+    if (uptr != NULL || gptr != NULL)
+        te->dirty = 1;
+    if (combine && uptr != NULL && gptr != NULL)
+        report_add(tid, statbuf, type[0], 1);
+    else
+        report_add(tid, statbuf, type[0], (unsigned long) (uptr != NULL) + (unsigned long) (gptr != NULL));
+}
+
+static void
+        report_owner_split(const unsigned int tid, tile_entry_t *te, const struct stat *statbuf, const char *type, const idmap_entry_t *uptr, const idmap_entry_t *gptr) {
+
+    report_owner_as(tid, te, statbuf, type, uptr, gptr, 0);
+}
+
+static void
+        report_owner_combined(const unsigned int tid, tile_entry_t *te, const struct stat *statbuf, const char *type, const idmap_entry_t *uptr, const idmap_entry_t *gptr) {
+
+    report_owner_as(tid, te, statbuf, type, uptr, gptr, 1);
+}
+
+static const apply_fn_t report_handlers[2] = { report_owner_split, report_owner_combined };
+
+#ifdef HAVE_STDATOMIC_H
+static void
+        queue_owner(const unsigned int tid, tile_entry_t *te, const struct stat *statbuf, const char *type, const idmap_entry_t *uptr, const idmap_entry_t *gptr) {
+
+/*
+ * Description:
+ * Hands a change to the apply threads in pipelined mode. The change is applied later, so the
+ * directory can't be recorded as clean.
+ *
+ */
+    apply_queue(tid, te, statbuf, type, uptr, gptr);
+    te->dirty = 1;
+}
+#endif
+
+ENTRY_INLINE void
+        change_owner(const unsigned int tid, tile_entry_t *te, const struct stat *statbuf, const char *type, const short int report) {
+
+/*
+ * Description:
+ * Checks UID and GID of a directory entry against the lists of 2-tuples and hands an entry to
+ * be changed to the owner handler of its directory, in report mode every entry.
+ *
+ * Parameters:
+ * tid:         thread id
+ * te:          directory entry
+ * statbuf:     data returned by lstat for the entry
+ * type:        entry type used for reporting
+ * report:      report mode (-a)
+ *
+ */
+    const idmap_entry_t *uptr = NULL;
+    const idmap_entry_t *gptr = NULL;
+
+    uptr = idmap_lookup(&uidmap, (unsigned int) statbuf->st_uid);
+    gptr = idmap_lookup(&gidmap, (unsigned int) statbuf->st_gid);
+    if (report || uptr != NULL || gptr != NULL)
+        te->handler->owner(tid, te, statbuf, type, uptr, gptr);
+}
+
+static long
+        element_bytes(const queue_element_t *element) {
+
+/*
+ * Description:
+ * Returns the memory held by a queue element, its name and its batch.
+ *
+ */
+    long    bytes = (long) (sizeof (queue_element_t) + strlen(element->name) + 1);
+
+    if (element->batch != NULL)
+        bytes += (long) (sizeof (dir_batch_t) + element->batch->size);
+    return bytes;
+}
+
+static void
+        queue_account(const long nodes, const long bytes) {
+
+/*
+ * Description:
+ * Adds to the number of queued nodes and their memory in bounded mode.
+ *
+ */
+#ifdef HAVE_STDATOMIC_H
+    if (bounded) {
+        atomic_fetch_add_explicit(&queued_nodes, nodes, memory_order_relaxed);
+        atomic_fetch_add_explicit(&queued_bytes, bytes, memory_order_relaxed);
+    }
+#endif
+}
+
+static short int
+        queue_bounded(void) {
+
+/*
+ * Description:
+ * Returns 1 in bounded mode if the queued nodes or their memory have reached the limit, 0
+ * otherwise. New subtree roots are pushed depth-first then and keep their name only, with a
+ * reference to the parent directory instead of the full path.
+ *
+ */
+#ifdef HAVE_STDATOMIC_H
+    if (bounded && (atomic_load_explicit(&queued_nodes, memory_order_relaxed) >= queue_limit ||
+                    atomic_load_explicit(&queued_bytes, memory_order_relaxed) >= queue_memory))
+        return 1;
+#endif
+    return 0;
+}
+
+static void
+        tile_push(const unsigned int tid, queue_anchor_t *p_anchor, queue_element_t *element) {
+
+/*
+ * Description:
+ * Puts a new subtree root into the thread's private deq, which is the thread's work stealing
+ * deque in work stealing mode. Beyond the limit of bounded mode the traversal is depth-first.
+ *
+ */
+#ifdef HAVE_STDATOMIC_H
+    if (worksteal) {
+        atomic_fetch_add_explicit(&ws_pending, 1, memory_order_relaxed);
+        ws_push(&wsq[tid], element);
+        if (atomic_load_explicit(&ws_idle, memory_order_relaxed) > 0)
+            pthread_cond_signal(&queue_empty);
+        return;
+    }
+#endif
+    if (stack || queue_bounded())
+        deq_push(p_anchor, element);
+    else
+        deq_put(p_anchor, element);
+}
+
+static short int
+        idmap_chained(const idmap_t *map) {
+
+/*
+ * Description:
+ * Returns 1 if a new id of the mapping table is an old id of the table, too. Entries changed
+ * to such an id would be changed again if they are visited a second time.
+ *
+ */
+    size_t  i;
+
+    for (i = 0; i < map->count; i++) {
+        if (map->entries[i].newid != map->entries[i].oldid && idmap_lookup(map, map->entries[i].newid) != NULL)
+            return 1;
+    }
+    return 0;
+}
+
+static short int
+        ckpt_point(const unsigned int tid, queue_anchor_t *p_anchor, queue_element_t *element, const long dirpos) {
+
+/*
+ * Description:
+ * Safe point for checkpoints, called by a worker between directory entries while a checkpoint
+ * is pending: the thread registers its private deq and the element it is working on and
+ * waits until the checkpoint has been written.
+ *
+ * Parameters:
+ * tid:         thread id
+ * p_anchor:    thread's private deq
+ * element:     element in progress, NULL if none
+ * dirpos:      position in element to continue at
+ *
+ * Return value:
+ * 1 if the scan is being stopped after a final checkpoint and the thread has to give up its
+ * work, 0 otherwise
+ *
+ */
+    unsigned long   gen;
+    short int       stop;
+
+    pthread_mutex_lock(&thr_ckpt);
+    if (ckpt_final || !ckpt_pending) {
+        stop = ckpt_final;
+        pthread_mutex_unlock(&thr_ckpt);
+        return stop;
+    }
+    ckpt_slots[tid].anchor = p_anchor;
+    ckpt_slots[tid].element = element;
+    ckpt_slots[tid].dirpos = dirpos;
+    ckpt_parked++;
+    gen = ckpt_gen;
+    while (gen == ckpt_gen)
+        pthread_cond_wait(&ckpt_release, &thr_ckpt);
+    ckpt_slots[tid].anchor = NULL;
+    ckpt_slots[tid].element = NULL;
+    stop = ckpt_final;
+    pthread_mutex_unlock(&thr_ckpt);
+    return stop;
+}
+
+static dev_group_t *
+        element_group(const queue_element_t *element) {
+
+/*
+ * Description:
+ * Returns the device group of a queue element (per-device queues only).
+ *
+ */
+    return &groups[(element->fs != NULL) ? element->fs->group : 0];
+}
+
+static short int
+        thread_parked(const unsigned int tid) {
+
+/*
+ * Description:
+ * Returns 1 if thread tid is beyond the number of active threads set by the thread count
+ * controller (-A), 0 otherwise.
+ *
+ */
+    return (autothreads > 0 && tid >= active_threads);
+}
+
+static long
+        hungry_demand(void) {
+
+/*
+ * Description:
+ * Returns the number of threads waiting for work which no queued element is left for (-H).
+ * Read without locking this is a hint only; under thr_queue it is exact.
+ *
+ */
+    long    demand = (long) hungry_count - fast_anchor->element_counter - slow_anchor->element_counter;
+    long    g;
+
+    for (g = 0; g < ngroups && demand > 0; g++)
+        demand -= groups[g].anchor->element_counter;
+    return demand;
+}
+
+static short int
+        idle_threads_waiting(const unsigned int tid, const queue_element_t *w_element, const queue_anchor_t *p_anchor) {
+
+/*
+ * Description:
+ * Returns 1 if so many threads are idle that a thread should hand over its work, 0 otherwise.
+ * With -H work is handed over if threads have asked for it and the private deq p_anchor holds
+ * work besides the current directory. With per-device queues work is only handed over if the
+ * thread cap of its device allows another thread to take it. A parked thread always hands over
+ * its work.
+ *
+ */
+    if (thread_parked(tid))
+        return 1;
+    if (worksteal)
+        return 0;
+    if (hungry) {
+        if (p_anchor->element_counter == 0 || hungry_demand() <= 0)
+            return 0;
+    } else if ((double) busy_count / (double) active_threads >= busythreshold)
+        return 0;
+    return (groups == NULL || element_group(w_element)->busy < element_group(w_element)->cap);
+}
+
+static short int
+        entry_excluded(const queue_element_t *w_element, const char *name) {
+
+/*
+ * Description:
+ * Returns 1 for dot, dot-dot and entries of directory w_element excluded by the exclude list,
+ * 0 otherwise.
+ *
+ */
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        return 1;
+    return (begin_exclude_file != NULL) ? exclude_entry(w_element->exnode, w_element->name, name) : 0;
+}
+
+static void
+        free_element(const unsigned int tid, queue_element_t *element) {
+
+/*
+ * Description:
+ * Releases a queue element together with its name and, for a batch, its entries. In bounded
+ * mode an element stays until the subtree roots queued with their name only no longer need
+ * its path; a released element drops its reference to the parent directory.
+ *
+ */
+    queue_element_t *parent;
+
+    while (element != NULL) {
+        if (bounded && !REF_DROP(element->refs))
+            return;
+        parent = element->parent;
+        queue_account(-1, -element_bytes(element));
+        if (element->batch != NULL) {
+            free(element->batch->buf);
+            free(element->batch);
+        }
+        slab_free(tid, element->name);
+        slab_free(tid, element);
+        element = parent;
+    }
+}
+
+static void
+        element_resolve(const unsigned int tid, queue_element_t *element) {
+
+/*
+ * Description:
+ * Replaces the name of a subtree root queued in bounded mode by its full path and drops the
+ * reference to the parent directory.
+ *
+ */
+    queue_element_t *parent = element->parent;
+    size_t          len;
+    char            *name;
+
+    if (parent == NULL)
+        return;
+    len = strlen(parent->name) + strlen(element->name) + 2;
+    if ((name = (char *) slab_alloc(tid, sizeof (char) * len)) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for Name string\n");
+        exit(ENOMEM);
+    }
+    snprintf(name, len, "%s/%s", parent->name, element->name);
+    queue_account(0, (long) strlen(parent->name) + 1);
+    slab_free(tid, element->name);
+    element->name = name;
+    element->parent = NULL;
+    free_element(tid, parent);
+}
+
+static void
+        spill_tile(const unsigned int tid, queue_anchor_t *p_anchor) {
+
+/*
+ * Description:
+ * Writes the oldest subtree roots of a private deq, those closest to the root, to the spill
+ * file until SPILL_KEEP are left. Batches and, after a write error, all other elements stay.
+ *
+ */
+    queue_anchor_t  spill;
+    queue_element_t *element;
+
+    memset(&spill, 0, sizeof (queue_anchor_t));
+    deq_take(p_anchor, &spill, p_anchor->element_counter - SPILL_KEEP, 1);
+    while ((element = deq_get(&spill)) != NULL) {
+        if (spill_put(element))
+            free_element(tid, element);
+        else
+            deq_put(p_anchor, element);
+    }
+}
+
+static void
+        queue_subdir(const unsigned int tid, tile_entry_t *te, queue_element_t *w_element, queue_anchor_t *p_anchor) {
+
+/*
+ * Description:
+ * Creates a new subtree root for a subdirectory and puts it into the thread's private deq.
+ *
+ */
+    queue_element_t *p_element = NULL;
+
+    if ((p_element = (queue_element_t *) slab_alloc(tid, sizeof (queue_element_t))) != NULL) {
+        p_element->dirpos = 0;
+        p_element->fs = w_element->fs;
+        p_element->exnode = exclude_child(w_element->exnode, te->name);
+        p_element->directsubdirs = 0;
+        p_element->refs = 1;
+        p_element->batch = NULL;
+        p_element->next = NULL;
+        if (queue_bounded()) {
+/*
+ * bounded mode: only the name is kept, the path is assembled when the directory is processed
+ */
+            p_element->parent = w_element;
+            REF_HOLD(w_element->refs);
+            p_element->name = slab_strdup(tid, te->name);
+        } else {
+            p_element->parent = NULL;
+            p_element->name = slab_strdup(tid, entry_path(te));
+        }
+        queue_account(1, element_bytes(p_element));
+/*
+ * new element is put into the thread's private deq
+ */
+        tile_push(tid, p_anchor, p_element);
+        if (spilling && p_anchor->element_counter > 2 * SPILL_KEEP && queue_bounded())
+            spill_tile(tid, p_anchor);
+    } else {
+        fprintf(stderr, "Error allocating memory for new queue element!!\n");
+        exit(ENOMEM);
+    }
+}
+
+ENTRY_INLINE void
+        process_stat_as(const unsigned int tid, tile_entry_t *te, const struct stat *t_statbuf, queue_element_t *w_element, queue_anchor_t *p_anchor,
+                        const short int level, const short int report, const short int paths) {
+
+/*
+ * Description:
+ * Checks and changes one directory entry whose lstat data are known. If the entry is a
+ * directory a new subtree root is created for it and put into the thread's private deq.
+ *
+ * Parameters:
+ * tid:         thread id
+ * te:          directory entry
+ * t_statbuf:   data returned by lstat (or statx) for the entry
+ * w_element:   queue element of the directory the entry belongs to
+ * p_anchor:    thread's private deq
+ * level:       one of the STATS_ levels
+ * report:      report mode (-a)
+ * paths:       path list mode (-p)
+ *
+ */
+    short int       known_nlink_file = 0;
+
+    if (S_ISREG(t_statbuf->st_mode)) {
+        /* if we have an hardlink count bigger then 1 .... */
+        if (t_statbuf->st_nlink > 1) {
+            /* hmins inserts the inode in the hash table and returns 1 if this file had already been visited and 0 if it is new */
+            known_nlink_file = h_mins(t_statbuf->st_ino, t_statbuf->st_dev);
+            if (known_nlink_file && level != STATS_NONE)
+                STAT_INC(stat_counters[tid].hashhits);
+        }
+        if (t_statbuf->st_nlink == 1 || !known_nlink_file) {
+            if (level != STATS_NONE) {
+                STAT_INC(stat_counters[tid].filecounter);
+            }
+            change_owner(tid, te, t_statbuf, "FILE", report);
+        }
+    } else if (S_ISLNK(t_statbuf->st_mode)) {
+        change_owner(tid, te, t_statbuf, "LINK", report);
+        if (level != STATS_NONE)
+            STAT_INC(stat_counters[tid].linkcounter);
+    } else if (S_ISDIR(t_statbuf->st_mode)) {
+        change_owner(tid, te, t_statbuf, "DIRECTORY", report);
+        if (level != STATS_NONE)
+            STAT_INC(stat_counters[tid].dircounter);
+        w_element->directsubdirs++;
+/*
+ * in path list mode only the listed entries are checked, directories aren't traversed
+ */
+        if (paths)
+            return;
+/*
+ * this child is a directory which has to be investigated as well so we create a new deq element for it
+ */
+        queue_subdir(tid, te, w_element, p_anchor);
+    } else {
+        if (level != STATS_NONE)
+            STAT_INC(stat_counters[tid].otherscounter);
+    }
+}
+
+ENTRY_INLINE void
+        process_entry_as(const unsigned int tid, tile_entry_t *te, queue_element_t *w_element, queue_anchor_t *p_anchor,
+                         const short int level, const short int report, const short int paths, const short int limited) {
+
+/*
+ * Description:
+ * Checks and changes one directory entry (see process_stat_as), calling lstat for it if needed.
+ *
+ */
+    struct stat     t_statbuf;
+
+    errno = 0;
+    if (!entry_needs_stat(te)) {
+        if (level != STATS_NONE)
+            STAT_INC(stat_counters[tid].otherscounter);
+    } else if (entry_lstat(tid, te, &t_statbuf, level == STATS_TIMED, limited) == 0) {
+        process_stat_as(tid, te, &t_statbuf, w_element, p_anchor, level, report, paths);
+    } else {
+        print_errno_r(WARNING, errno, "couldn't stat", entry_path(te));
+        te->dirty = 1;
+    }
+}
+
+/*
+ * one variant of the per-entry handlers for every configuration
+ */
+#define ENTRY_HANDLERS(suffix, level, report, paths, limited) \
+static void \
+        process_stat_##suffix(const unsigned int tid, tile_entry_t *te, const struct stat *t_statbuf, queue_element_t *w_element, queue_anchor_t *p_anchor) { \
+    process_stat_as(tid, te, t_statbuf, w_element, p_anchor, level, report, paths); \
+} \
+static void \
+        process_entry_##suffix(const unsigned int tid, tile_entry_t *te, queue_element_t *w_element, queue_anchor_t *p_anchor) { \
+    process_entry_as(tid, te, w_element, p_anchor, level, report, paths, limited); \
+}
+#define ENTRY_LIMITS(s, level, report, paths) \
+    ENTRY_HANDLERS(s##_free, level, report, paths, 0) ENTRY_HANDLERS(s##_limited, level, report, paths, 1)
+#define ENTRY_PATHS(s, level, report) \
+    ENTRY_LIMITS(s##_tree, level, report, 0) ENTRY_LIMITS(s##_list, level, report, 1)
+#define ENTRY_REPORTS(s, level) \
+    ENTRY_PATHS(s##_change, level, 0) ENTRY_PATHS(s##_report, level, 1)
+
+ENTRY_REPORTS(plain, STATS_NONE)
+ENTRY_REPORTS(count, STATS_COUNT)
+ENTRY_REPORTS(timed, STATS_TIMED)
+
+#define ENTRY_ROW_L(s)  { { process_stat_##s##_free, process_entry_##s##_free, NULL }, { process_stat_##s##_limited, process_entry_##s##_limited, NULL } }
+#define ENTRY_ROW_P(s)  { ENTRY_ROW_L(s##_tree), ENTRY_ROW_L(s##_list) }
+#define ENTRY_ROW_R(s)  { ENTRY_ROW_P(s##_change), ENTRY_ROW_P(s##_report) }
+
+/*
+ * indexed by statistics level, report mode, path list mode and rate limit; the owner handlers
+ * are added at startup
+ */
+static const entry_handler_t entry_handlers[STATS_LEVELS][2][2][2] = {
+    ENTRY_ROW_R(plain), ENTRY_ROW_R(count), ENTRY_ROW_R(timed)
+};
+
+/*
+ * the handlers of this run for directories without and with a rate limit
+ */
+static entry_handler_t  entry_variant[2];
+
+static void
+        process_unchanged(const unsigned int tid, tile_entry_t *te, queue_element_t *w_element, queue_anchor_t *p_anchor) {
+
+/*
+ * Description:
+ * Handles one entry of a directory left clean by the previous incremental run and unchanged
+ * since: only subdirectories are queued, nothing else is checked. lstat is only needed if
+ * readdir doesn't report the type of the entry.
+ *
+ */
+    struct stat     t_statbuf;
+
+    errno = 0;
+    if (te->d_type == DT_UNKNOWN) {
+        if (entry_lstat(tid, te, &t_statbuf, metrics, te->bucket != NULL) != 0) {
+            print_errno_r(WARNING, errno, "couldn't stat", entry_path(te));
+            te->dirty = 1;
+            return;
+        }
+        te->d_type = S_ISDIR(t_statbuf.st_mode) ? DT_DIR : DT_REG;
+    }
+    if (te->d_type == DT_DIR) {
+        w_element->directsubdirs++;
+        queue_subdir(tid, te, w_element, p_anchor);
+    } else if (stat_counters != NULL) {
+        STAT_INC(stat_counters[tid].skippedentries);
+    }
+}
+
+static void
+        batch_add(dir_batch_t **bp, const unsigned char d_type, const char *name) {
+
+/*
+ * Description:
+ * Appends a directory entry to a batch, creating the batch if *bp is NULL. Entries are packed
+ * into one buffer as the d_type byte followed by the null terminated name.
+ *
+ */
+    dir_batch_t *b = *bp;
+    size_t      len = strlen(name) + 2;
+
+    if (b == NULL) {
+        if ((b = (dir_batch_t *) calloc(1, sizeof (dir_batch_t))) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for directory batch\n");
+            exit(ENOMEM);
+        }
+        *bp = b;
+    }
+    if (b->len + len > b->size) {
+        b->size = (b->size == 0) ? (size_t) DIR_BATCH_INIT_SIZE : 2 * b->size;
+        while (b->len + len > b->size)
+            b->size *= 2;
+        if ((b->buf = (char *) realloc(b->buf, b->size)) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for directory batch\n");
+            exit(ENOMEM);
+        }
+    }
+    b->buf[b->len] = (char) d_type;
+    memcpy(b->buf + b->len + 1, name, len - 1);
+    b->len += len;
+    b->count++;
+}
+
+static queue_element_t *
+        batch_element(const unsigned int tid, const queue_element_t *w_element, dir_batch_t *b) {
+
+/*
+ * Description:
+ * Wraps a batch of entries of the directory w_element into a new queue element. dirpos of
+ * the element holds the offset of the next entry to be processed.
+ *
+ */
+    queue_element_t *element = NULL;
+
+    element = (queue_element_t *) slab_alloc(tid, sizeof (queue_element_t));
+    element->dirpos = 0;
+    element->fs = w_element->fs;
+    element->exnode = w_element->exnode;
+    element->directsubdirs = 0;
+    element->parent = NULL;
+    element->refs = 1;
+    element->name = slab_strdup(tid, w_element->name);
+    element->batch = b;
+    element->next = NULL;
+    queue_account(1, element_bytes(element));
+    return element;
+}
+
+static void
+        batch_publish(const unsigned int tid, queue_anchor_t *p_anchor, queue_element_t *element) {
+
+/*
+ * Description:
+ * Makes a full batch available to other threads while the reading thread continues with the
+ * directory. If there are idle threads (with -H: threads waiting for work) the batch goes to
+ * the global fast deq, otherwise it stays in the thread's private deq (and is handed over
+ * later like any other subtree root).
+ * In work stealing mode the batch is pushed to the thread's work stealing deque, with
+ * per-device queues it goes to the deq of its device.
+ *
+ */
+    if (!worksteal && (hungry ? hungry_demand() > 0 : busy_count < active_threads)) {
+        if (stat_counters != NULL)
+            STAT_INC(stat_counters[tid].transfers);
+        pthread_mutex_lock(&thr_queue);
+        if (groups != NULL && stack)
+            deq_push(element_group(element)->anchor, element);
+        else if (groups != NULL)
+            deq_put(element_group(element)->anchor, element);
+        else if (stack)
+            deq_push(fast_anchor, element);
+        else
+            deq_put(fast_anchor, element);
+        pthread_mutex_unlock(&thr_queue);
+        pthread_cond_signal(&queue_empty);
+    } else {
+        tile_push(tid, p_anchor, element);
+    }
+}
+
+static void
+        read_tile_batched(const unsigned int tid, queue_element_t *w_element, queue_anchor_t *p_anchor, char **dirbuf) {
+
+/*
+ * Description:
+ * Reads a directory in large chunks (getdents64 where available) without processing its
+ * entries. Every batchsize entries are published as a batch work item, the remaining entries
+ * are put as one more batch in front of the thread's private deq so the thread processes
+ * them next. A directory is therefore read by one thread only, but the entries of a large
+ * directory are checked and changed by many threads at once, and no directory position has
+ * to be kept across reopening the directory.
+ *
+ * Parameters:
+ * tid:         thread id
+ * w_element:   queue element of the directory
+ * p_anchor:    thread's private deq
+ * dirbuf:      buffer for getdents64, allocated on first use
+ *
+ */
+    dir_batch_t     *b = NULL;
+#if HAVE_DECL_SYS_GETDENTS64
+    struct dirent64_raw *d = NULL;
+    long            n, off;
+    int             fd;
+
+    errno = 0;
+    if ((fd = open(w_element->name, O_RDONLY | O_DIRECTORY)) < 0) {
+        print_errno_r(WARNING, errno, "couldn't open", w_element->name);
+        return;
+    }
+    if (*dirbuf == NULL && (*dirbuf = (char *) malloc(DIRENT_BUF_SIZE)) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for directory buffer\n");
+        exit(ENOMEM);
+    }
+    while ((n = syscall(SYS_getdents64, fd, *dirbuf, DIRENT_BUF_SIZE)) > 0) {
+        for (off = 0; off < n; off += d->d_reclen) {
+            d = (struct dirent64_raw *) (*dirbuf + off);
+            if (!entry_excluded(w_element, d->d_name)) {
+                batch_add(&b, d->d_type, d->d_name);
+                if (b->count >= batchsize) {
+                    batch_publish(tid, p_anchor, batch_element(tid, w_element, b));
+                    b = NULL;
+                }
+            }
+        }
+    }
+    if (n < 0)
+        print_errno_r(WARNING, errno, "getdents64() failed for directory", w_element->name);
+    errno = 0;
+    if (close(fd) < 0)
+        print_errno_r(WARNING, errno, "can't close directory", w_element->name);
+#else
+    DIR             *dp = NULL;
+    struct dirent   *dirp = NULL;
+
+    errno = 0;
+    if ((dp = opendir(w_element->name)) == NULL) {
+        print_errno_r(WARNING, errno, "couldn't open", w_element->name);
+        return;
+    }
+    for (dirp = readdir(dp); dirp != NULL; dirp = readdir(dp)) {
+        if (!entry_excluded(w_element, dirp->d_name)) {
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+            batch_add(&b, dirp->d_type, dirp->d_name);
+#else
+            batch_add(&b, DT_UNKNOWN, dirp->d_name);
+#endif
+            if (b->count >= batchsize) {
+                batch_publish(tid, p_anchor, batch_element(tid, w_element, b));
+                b = NULL;
+            }
+        }
+        errno = 0;
+    }
+    if (errno != 0)
+        print_errno_r(WARNING, errno, "readdir() failed for directory", w_element->name);
+    errno = 0;
+    if (closedir(dp) < 0)
+        print_errno_r(WARNING, errno, "can't close directory", w_element->name);
+#endif
+    if (b != NULL)
+        deq_push(p_anchor, batch_element(tid, w_element, b));
+}
+
+static short int
+        process_batch(const unsigned int tid, queue_element_t *w_element, tile_entry_t *te, queue_anchor_t *p_anchor, short int *backtodeq, short int *aborted) {
+
+/*
+ * Description:
+ * Checks and changes the entries of a batch, starting at the offset kept in dirpos. In case
+ * of too many idle threads processing stops and, if entries are left, the batch is put back
+ * into the thread's private deq. If the scan is stopped at a checkpoint, *aborted is set.
+ * With the io_uring engine the entries are stat'ed in chunks of up to the queue depth
+ * asynchronously before they are checked one by one; ownership changes remain synchronous.
+ *
+ * Return value:
+ * 1 if too many idle threads were detected, 0 otherwise
+ *
+ */
+    dir_batch_t *b = w_element->batch;
+    char        *p, *end, *chunk_end;
+    int         dfd = AT_FDCWD;
+    short int   too_many_idle_threads = 0;
+#ifdef HAVE_IO_URING
+    uring_t     *r = NULL;
+    struct stat t_statbuf;
+    char        *q;
+    int         sfd = -1;
+    unsigned int n = 0, k = 0;
+#endif
+
+    if (fdrelative) {
+        errno = 0;
+        if ((dfd = open(w_element->name, O_RDONLY | O_DIRECTORY)) < 0) {
+            print_errno_r(WARNING, errno, "couldn't open", w_element->name);
+            return 0;
+        }
+    }
+#ifdef HAVE_IO_URING
+    if (rings != NULL) {
+/*
+ * statx is always submitted relative to the directory, whether fd-relative mode is used or not
+ */
+        errno = 0;
+        if ((sfd = (dfd != AT_FDCWD) ? dfd : open(w_element->name, O_RDONLY | O_DIRECTORY)) >= 0)
+            r = &rings[tid];
+        else
+            print_errno_r(WARNING, errno, "couldn't open", w_element->name);
+    }
+#endif
+    te->dfd = dfd;
+    te->dirname = w_element->name;
+    p = b->buf + w_element->dirpos;
+    end = b->buf + b->len;
+    while (p < end && !too_many_idle_threads) {
+        chunk_end = end;
+#ifdef HAVE_IO_URING
+        if (r != NULL) {
+            for (n = 0, q = p; q < end && n < r->entries; q += strlen(q + 1) + 2) {
+                te->d_type = (unsigned char) *q;
+                if (entry_needs_stat(te))
+                    r->names[n++] = q + 1;
+            }
+            chunk_end = q;
+            if (n > 0 && te->bucket != NULL)
+                rate_take(tid, te->bucket, n);
+            errno = 0;
+            if (n > 0 && uring_statx(r, sfd, n) < 0)
+                print_errno_r(WARNING, errno, "io_uring_enter() failed for directory", w_element->name);
+            k = 0;
+        }
+#endif
+        while (p < chunk_end && !too_many_idle_threads) {
+            te->d_type = (unsigned char) *p;
+            te->name = p + 1;
+            te->pathvalid = 0;
+            p += strlen(p + 1) + 2;
+#ifdef HAVE_IO_URING
+            if (r != NULL && entry_needs_stat(te)) {
+/*
+ * entries the kernel didn't complete are stat'ed synchronously
+ */
+                if (r->res[k] == 0) {
+                    statx_to_stat(&r->stx[k], &t_statbuf);
+                    te->handler->stat(tid, te, &t_statbuf, w_element, p_anchor);
+                } else if (r->res[k] < 0) {
+                    print_errno_r(WARNING, -r->res[k], "couldn't stat", entry_path(te));
+                } else {
+                    te->handler->entry(tid, te, w_element, p_anchor);
+                }
+                k++;
+            } else
+#endif
+            te->handler->entry(tid, te, w_element, p_anchor);
+            if (ckpt_pending && ckpt_point(tid, p_anchor, w_element, (long int) (p - b->buf))) {
+                *aborted = 1;
+                too_many_idle_threads = 1;
+                break;
+            }
+/*
+ * here we check for busy threads
+ */
+            if (idle_threads_waiting(tid, w_element, p_anchor)) {
+                too_many_idle_threads = 1;
+                if (p < end) {
+                    w_element->dirpos = (long int) (p - b->buf);
+                    deq_put(p_anchor, w_element);
+                    *backtodeq = 1;
+                }
+            }
+        }
+    }
+#ifdef HAVE_IO_URING
+    if (sfd >= 0 && sfd != dfd)
+        close(sfd);
+#endif
+    if (dfd != AT_FDCWD)
+        close(dfd);
+    return too_many_idle_threads;
+}
+
+#ifndef _WIN32
+static void
+        list_lock(sigset_t *oldsigs) {
+
+/*
+ * Description:
+ * Locks the global deqs from the feeding main thread. The signal handler runs in the main
+ * thread and waits for the worker threads, so signals are blocked while the lock is held.
+ *
+ */
+    sigset_t    sigs;
+
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGQUIT);
+    pthread_sigmask(SIG_BLOCK, &sigs, oldsigs);
+    pthread_mutex_lock(&thr_queue);
+}
+
+static void
+        list_unlock(sigset_t *oldsigs) {
+
+    pthread_mutex_unlock(&thr_queue);
+    pthread_sigmask(SIG_SETMASK, oldsigs, NULL);
+}
+
+static void
+        list_publish(queue_element_t *w_element, dir_batch_t *b) {
+
+/*
+ * Description:
+ * Puts a batch of listed entries of directory w_element into the global fast deq. Waits while
+ * the threads lag behind by more than LIST_QUEUE_FACTOR batches per thread.
+ *
+ */
+    sigset_t    oldsigs;
+
+    list_lock(&oldsigs);
+    while (notfinished && fast_anchor->element_counter + slow_anchor->element_counter >= (long) (LIST_QUEUE_FACTOR * numthr)) {
+        list_unlock(&oldsigs);
+        usleep(1000);
+        list_lock(&oldsigs);
+    }
+    if (stack)
+        deq_push(fast_anchor, batch_element((unsigned int) numthr, w_element, b));
+    else
+        deq_put(fast_anchor, batch_element((unsigned int) numthr, w_element, b));
+    list_unlock(&oldsigs);
+    pthread_cond_signal(&queue_empty);
+}
+
+static unsigned long
+        feed_pathlist(FILE *fp) {
+
+/*
+ * Description:
+ * Path list mode: reads the paths to be checked, one per line, and hands them to the worker
+ * threads as batches. Consecutive paths of the same directory go into one batch, so a list
+ * sorted by directory is processed with few directory opens. The calling thread counts as a
+ * busy thread until the end of the list, so the scan phase doesn't end before.
+ *
+ * Return value:
+ * number of entries handed to the threads
+ *
+ */
+    queue_element_t w_element;
+    dir_batch_t     *b = NULL;
+    char            *line = NULL, *name, *slash, *dir = NULL;
+    const char      *dirpart;
+    size_t          size = 0, len;
+    long            limit = (batchsize > 0) ? batchsize : LIST_BATCH_SIZE;
+    unsigned long   count = 0;
+    short int       excluded = 0;
+    sigset_t        oldsigs;
+
+    memset(&w_element, 0, sizeof (queue_element_t));
+    while (getline(&line, &size, fp) != -1) {
+        len = strcspn(line, "\n");
+        while (len > 1 && line[len - 1] == '/')
+            len--;
+        line[len] = '\0';
+        if (len == 0)
+            continue;
+        if ((slash = strrchr(line, '/')) == NULL) {
+            dirpart = ".";
+            name = line;
+        } else {
+            *slash = '\0';
+            dirpart = (slash == line) ? "/" : line;
+            name = slash + 1;
+        }
+        if (*name == '\0')
+            continue;
+        if (dir == NULL || strcmp(dir, dirpart) != 0 || (b != NULL && b->count >= (size_t) limit)) {
+            if (b != NULL)
+                list_publish(&w_element, b);
+            b = NULL;
+            if (dir == NULL || strcmp(dir, dirpart) != 0) {
+                free(dir);
+                if ((dir = strdup(dirpart)) == NULL) {
+                    fprintf(stderr, "ERROR: No memory available for Name string\n");
+                    exit(ENOMEM);
+                }
+                w_element.name = dir;
+                w_element.exnode = exclude_dir(dir, &excluded);
+            }
+        }
+        if (excluded || entry_excluded(&w_element, name))
+            continue;
+        batch_add(&b, DT_UNKNOWN, name);
+        count++;
+    }
+    if (b != NULL)
+        list_publish(&w_element, b);
+    free(dir);
+    free(line);
+    list_lock(&oldsigs);
+    busy_count--;
+    if ((busy_count == 0) && (fast_anchor->element_counter == 0) && (slow_anchor->element_counter == 0)) {
+        notfinished = 0;
+        pthread_cond_broadcast(&queue_empty);
+        pthread_cond_broadcast(&thr_park);
+    }
+    list_unlock(&oldsigs);
+    return count;
+}
+#endif
+
+static void
+        release_tile(const unsigned int tid, queue_anchor_t *p_anchor) {
+
+/*
+ * Description:
+ * Moves all elements of the private deq of a parked thread to the global deq (the deq of their
+ * device with per-device queues) and wakes up active threads to take them.
+ *
+ */
+    queue_element_t *element;
+    long            j, count = p_anchor->element_counter;
+
+    if (stat_counters != NULL)
+        STAT_ADD(stat_counters[tid].transfers, (unsigned long) count);
+    pthread_mutex_lock(&thr_queue);
+    while ((element = deq_get(p_anchor)) != NULL)
+        deq_put((groups != NULL) ? element_group(element)->anchor : fast_anchor, element);
+    pthread_mutex_unlock(&thr_queue);
+    for (j = 0; j < count; j++)
+        pthread_cond_signal(&queue_empty);
+}
+
+static void 
+        process_tile(const unsigned int tid, queue_element_t *qe) {
+    
+/*
+ * Description:
+ * Receives from function handle_subtree a directory out of one of the global deqs and traverses
+ * the subtree of this directory. In case of too many idle threads it hands over all but one of 
+ * the roots of the subtrees still to be traversed to one of the global deqs.
+ * In fd-relative mode the entries of a directory are handled relative to the descriptor of the
+ * opened directory, so the path of an entry is only assembled if it has to be reported or queued.
+ * In work stealing mode only the directory qe itself is processed; its subdirectories go to the
+ * thread's work stealing deque, where idle threads can steal them.
+ * In batch mode (batchsize > 0) directories are read first and their entries are processed as
+ * batches, which can be taken over by other threads.
+ *
+ * Parameters:
+ * tid:         thread id
+ * qe:          queue element representing subtree root or a batch of directory entries
+ *
+ */
+    queue_anchor_t  *p_anchor = NULL;
+    queue_anchor_t  handover, *target = NULL;
+    queue_element_t *w_element = NULL;
+#ifndef _WIN32
+    DIR             *dp = NULL;
+    struct dirent   *dirp = NULL;
+#endif
+    struct timeval  t1, t2;
+    struct timespec tb1, tb2;
+    double          scanrate = 0., delta;
+    int             directories_scanned = 0;
+    int             j = 0;
+    long            deq_count = 0;
+    short int       backtodeq = 0;
+    short int       aborted = 0;
+    char            *msg = NULL;
+    char            *dirbuf = NULL;
+    short           too_many_idle_threads = 0;
+    short int       indexed = 0, unchanged = 0, whole = 0;
+    struct stat     dirstat;
+    struct timespec seen;
+    tile_entry_t    te;
+    
+    memset(&te, 0, sizeof (tile_entry_t));
+    p_anchor = deq_init();
+    deq_push(p_anchor, qe);
+    gettimeofday(&t1, NULL);
+    if (stat_counters != NULL)
+        clock_gettime(CLOCK_MONOTONIC, &tb1);
+    while (p_anchor->element_counter > 0) {
+        too_many_idle_threads = 0;
+        backtodeq = 0;
+        if (ckpt_pending && ckpt_point(tid, p_anchor, NULL, 0)) {
+            aborted = 1;
+            break;
+        }
+        if (thread_parked(tid)) {
+            release_tile(tid, p_anchor);
+            break;
+        }
+        directories_scanned++;
+        w_element = deq_get(p_anchor);
+        element_resolve(tid, w_element);
+        te.bucket = rate_of(w_element->fs);
+        te.handler = &entry_variant[te.bucket != NULL];
+        errno = 0;
+        if (w_element->batch != NULL) {
+            too_many_idle_threads = process_batch(tid, w_element, &te, p_anchor, &backtodeq, &aborted);
+        } else if (batchsize > 0) {
+            read_tile_batched(tid, w_element, p_anchor, &dirbuf);
+        } else if ((dp = opendir(w_element->name)) != NULL) {
+/*
+ * incremental run: the directory is looked up in the index of the previous run before it is read
+ */
+            whole = (w_element->dirpos == 0);
+            indexed = (findex != NULL && fstat(dirfd(dp), &dirstat) == 0);
+            if (indexed) {
+                clock_gettime(CLOCK_REALTIME, &seen);
+                unchanged = dirindex_unchanged(&dirstat);
+                if (unchanged && stat_counters != NULL && whole)
+                    STAT_INC(stat_counters[tid].unchangeddirs);
+            }
+            if (w_element->dirpos != 0) {
+                seekdir(dp, w_element->dirpos);
+            }
+            te.dfd = fdrelative ? dirfd(dp) : AT_FDCWD;
+            te.dirname = w_element->name;
+            te.dirty = 0;
+            errno = 0;
+            for (dirp = readdir(dp); dirp != NULL && !too_many_idle_threads; dirp = readdir(dp)) {
+
+                if (!entry_excluded(w_element, dirp->d_name)) {/* ignore dot, dot-dot and excluded names */
+
+                    te.name = dirp->d_name;
+                    te.pathvalid = 0;
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+                    te.d_type = dirp->d_type;
+#else
+                    te.d_type = DT_UNKNOWN;
+#endif
+                    if (indexed && unchanged)
+                        process_unchanged(tid, &te, w_element, p_anchor);
+                    else
+                        te.handler->entry(tid, &te, w_element, p_anchor);
+                    if (ckpt_pending && ckpt_point(tid, p_anchor, w_element, telldir(dp))) {
+                        aborted = 1;
+                        errno = 0;
+                        break;
+                    }
+/*
+ * here we check for busy threads
+ */
+                    if (idle_threads_waiting(tid, w_element, p_anchor)) {
+/*
+ * too few threads working so stop processeing of the current node's children.
+ */
+                        too_many_idle_threads = 1;
+                        w_element->dirpos = telldir(dp);
+                        errno = 0;
+                        if ((dirp = readdir(dp)) != NULL) {
+                            deq_put(p_anchor, w_element);
+                            backtodeq = 1;
+                        }
+                        if (errno != 0)
+                            print_errno_r(WARNING, errno, "readdir() at dirpos check failed for directory", w_element->name);
+                    }
+                } /* if included in investigation */
+                errno = 0;
+            } /* for (dirp = readdir(dp); dirp != NULL && !too_many_idle_threads;... */
+
+            if (errno != 0)
+                print_errno_r(WARNING, errno, "readdir() failed for directory", w_element->name);
+/*
+ * a directory is recorded for the next incremental run once it has been read to its end:
+ * if it has been read in one piece or if it's still unchanged, its entries having been
+ * clean at the previous run then
+ */
+            else if (indexed && (whole || unchanged) && !aborted && !backtodeq)
+                dirindex_add(tid, &dirstat, &seen, unchanged || !te.dirty);
+
+            errno = 0;
+            if (closedir(dp) < 0)
+                print_errno_r(WARNING, errno, "can't close directory", w_element->name);
+        } else { /* could not open directory of node w */
+            print_errno_r(WARNING, errno, "couldn't open", w_element->name);
+        }
+
+        if (aborted) {
+            free_element(tid, w_element);
+            break;
+        }
+        if (too_many_idle_threads && p_anchor->element_counter > 1) {
+/*
+ * to make threads working again transfer the directories in the private deq to the global deq. Keep one for
+ * continuing work in this thread. With -H only as many directories are transferred as threads wait for work,
+ * those closest to the root of the subtree: the oldest ones, at the back of a stack or the front of a queue.
+ */
+            gettimeofday(&t2, NULL);
+            msg = (char *) slab_alloc(tid, sizeof (char) * 40);
+            snprintf(msg, (size_t) 40, "too many idle threads (%3ld) detected!", (long) (active_threads - busy_count));
+            print_error_r(INFO, msg);
+            slab_free(tid, msg);
+            if (dual_queue) {
+                delta = (double) (t2.tv_sec - t1.tv_sec) + (double) (t2.tv_usec - t1.tv_usec) / 1000000.;
+                scanrate = (delta > 0) ? directories_scanned / delta : directories_scanned;
+            }
+            pthread_mutex_lock(&thr_queue);
+            deq_count = p_anchor->element_counter - 1;
+            if (hungry && hungry_demand() < deq_count)
+                deq_count = (hungry_demand() > 0) ? hungry_demand() : 0;
+/*
+ * beyond the limit of bounded mode the idle threads get one directory each, the rest stays for spilling
+ */
+            if (queue_bounded() && (long) (active_threads - busy_count) < deq_count)
+                deq_count = (busy_count < active_threads) ? (long) (active_threads - busy_count) : 1;
+            memset(&handover, 0, sizeof (queue_anchor_t));
+            deq_take(p_anchor, &handover, deq_count, stack || !hungry);
+            if (deq_count == 0) {
+                target = NULL;
+            } else if (groups != NULL) {
+/*
+ * all elements of the private deq belong to the device of the subtree root
+ */
+                target = element_group(handover.first)->anchor;
+            } else if (dual_queue) {
+                target = (scanrate >= (double) (fast_anchor->speed + slow_anchor->speed) / 2.) ? fast_anchor : slow_anchor;
+                target->speed = scanrate;
+            } else {
+                target = fast_anchor;
+            }
+            if (target != NULL && stack)
+                deq_prepend(target, &handover);
+            else if (target != NULL)
+                deq_append(target, &handover);
+            pthread_mutex_unlock(&thr_queue);
+            if (stat_counters != NULL)
+                STAT_ADD(stat_counters[tid].transfers, (unsigned long) deq_count);
+            for (j = 0; j < deq_count; j++)
+                pthread_cond_signal(&queue_empty);
+/*
+ * reset directories_scanned after transfer for next transfer scanrate calculation
+ */
+            directories_scanned = 0;
+        }
+
+        if (!backtodeq)
+            free_element(tid, w_element);
+    }
+/*
+ * stopped at a final checkpoint: the work left is recorded there
+ */
+    while (aborted && p_anchor->element_counter > 0)
+        free_element(tid, deq_get(p_anchor));
+#ifdef HAVE_STDATOMIC_H
+    if (applythreads > 0)
+        apply_flush(tid);
+#endif
+    free(dirbuf);
+    free(te.path);
+    free(p_anchor);
+    p_anchor = NULL;
+    if (stat_counters != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &tb2);
+        STAT_ADD(stat_counters[tid].busy_ns, (unsigned long) (tb2.tv_sec - tb1.tv_sec) * 1000000000UL + (unsigned long) tb2.tv_nsec - (unsigned long) tb1.tv_nsec);
+    }
+}
+
+static void
+        stat_collect(metrics_sample_t *m) {
+
+/*
+ * Description:
+ * Takes a sample of the statistic counters of all threads and of the queue state. The
+ * counters are read without locking, the queue state under the queue mutex.
+ *
+ */
+    struct timeval  now;
+    size_t          i;
+    long            g;
+    int             b;
+
+    memset(m, 0, sizeof (metrics_sample_t));
+    for (i = 0; i < numthr + 1 + applythreads; i++) {
+        m->files += STAT_GET(stat_counters[i].filecounter);
+        m->dirs += STAT_GET(stat_counters[i].dircounter);
+        m->links += STAT_GET(stat_counters[i].linkcounter);
+        m->others += STAT_GET(stat_counters[i].otherscounter);
+        m->lstats += STAT_GET(stat_counters[i].lstatcounter);
+        m->lstat_ns += STAT_GET(stat_counters[i].lstat_ns);
+        m->chowns += STAT_GET(stat_counters[i].chowncounter);
+        m->chown_ns += STAT_GET(stat_counters[i].chown_ns);
+        for (b = 0; b < STAT_LAT_BUCKETS; b++) {
+            m->lstat_hist[b] += STAT_GET(stat_counters[i].lstat_hist[b]);
+            m->chown_hist[b] += STAT_GET(stat_counters[i].chown_hist[b]);
+        }
+        m->hashhits += STAT_GET(stat_counters[i].hashhits);
+        m->unchangeddirs += STAT_GET(stat_counters[i].unchangeddirs);
+        m->skippedentries += STAT_GET(stat_counters[i].skippedentries);
+        m->transfers += STAT_GET(stat_counters[i].transfers);
+        m->busy_ns += STAT_GET(stat_counters[i].busy_ns);
+    }
+    m->threads = numthr;
+    m->active = active_threads;
+#ifdef HAVE_STDATOMIC_H
+    if (worksteal) {
+        m->busy = numthr - (unsigned long) atomic_load(&ws_idle);
+        m->queued_fast = (unsigned long) atomic_load(&ws_pending);
+    } else
+#endif
+    {
+        pthread_mutex_lock(&thr_queue);
+        m->busy = busy_count;
+        m->queued_fast = (unsigned long) fast_anchor->element_counter;
+        m->queued_slow = (unsigned long) slow_anchor->element_counter;
+        m->speed_fast = fast_anchor->speed;
+        m->speed_slow = slow_anchor->speed;
+        for (g = 0; g < ngroups; g++)
+            m->queued_fast += (unsigned long) groups[g].anchor->element_counter;
+        pthread_mutex_unlock(&thr_queue);
+    }
+    gettimeofday(&now, NULL);
+    m->elapsed = (double) (now.tv_sec - start_tv.tv_sec) + (double) (now.tv_usec - start_tv.tv_usec) / 1000000.;
+}
+
+#ifndef _WIN32
+static void *
+        statistic(void *bla) {
+#else
+DWORD WINAPI
+	statistic(PVOID bla) {
+#endif
+/*
+ * Description:
+ * Gathers and prints out on demand some statistical data.
+ *
+ * Parameters:
+ * bla: dummy argument to make the compiler happy
+ */
+    metrics_sample_t    m;
+    unsigned long       ofilecount = 0, odircount = 0, olinkcount = 0;
+    double              fscanrate = 0, dscanrate = 0, lscanrate = 0;
+
+    if (dual_queue && !worksteal)
+        fprintf(stdout, "\nThreads busy      files   files/s directories/s links/s elements fast-q Speed slow-q Speed\n\n");
+    else
+        fprintf(stdout, "\nThreads busy      files   files/s directories/s links/s queue elements\n\n");
+    sleep(interval);
+    while (notfinished) {
+        stat_collect(&m);
+        fscanrate = (double) (m.files - ofilecount) / interval;
+        dscanrate = (double) (m.dirs - odircount) / interval;
+        lscanrate = (double) (m.links - olinkcount) / interval;
+        ofilecount = m.files;
+        odircount = m.dirs;
+        olinkcount = m.links;
+        if (dual_queue && !worksteal)
+            fprintf(stdout, "%7ld %4ld %10ld %7.0f %13.0f %7.0f %15ld %5.1f %6ld %5.1f\n", (long) m.active, (long) m.busy, (long) m.files, fscanrate, dscanrate, lscanrate, (long) m.queued_fast, m.speed_fast, (long) m.queued_slow, m.speed_slow);
+        else
+            fprintf(stdout, "%7ld %4ld %10ld %7.0f %13.0f %7.0f %14ld\n", (long) m.active, (long) m.busy, (long) m.files, fscanrate, dscanrate,  lscanrate, (long) m.queued_fast);
+        sleep(interval);
+    }
+    fprintf(stdout, "\n");
+    pthread_exit(EXIT_SUCCESS);
+}
+
+static long
+        spill_reload(const unsigned int tid) {
+
+/*
+ * Description:
+ * Moves up to SPILL_CHUNK directories from the spill file back into the global deq (the deq of
+ * their device with per-device queues) and wakes up threads to take them. To be called with
+ * thr_queue locked.
+ *
+ * Return value:
+ * number of directories moved
+ *
+ */
+    queue_element_t *element;
+    char            *name;
+    long            fs, dirpos, n, j;
+    short int       excluded;
+
+    for (n = 0; n < SPILL_CHUNK && (name = spill_get(&fs, &dirpos)) != NULL; n++) {
+        if ((element = (queue_element_t *) slab_alloc(tid, sizeof (queue_element_t))) == NULL) {
+            fprintf(stderr, "Error allocating memory for new queue element!!\n");
+            exit(ENOMEM);
+        }
+        element->name = slab_strdup(tid, name);
+        free(name);
+        element->dirpos = dirpos;
+        element->fs = (fs >= 0 && (unsigned long) fs < nroots) ? root_index[fs] : NULL;
+        element->exnode = exclude_root(element->name, &excluded);
+        element->directsubdirs = 0;
+        element->parent = NULL;
+        element->refs = 1;
+        element->batch = NULL;
+        element->next = NULL;
+        queue_account(1, element_bytes(element));
+        deq_put((groups != NULL) ? element_group(element)->anchor : fast_anchor, element);
+    }
+    for (j = 1; j < n; j++)
+        pthread_cond_signal(&queue_empty);
+    return n;
+}
+
+static void *
+        handle_subtree(void *id) {
+
+/*
+ * Description:
+ * Chooses one of the global deq's, takes a queue element out of it and calls process_tile for processing it.
+ * After process_tile is finished chooses next available subtree root from global deq.
+ *
+ * Parameter:
+ * id: thread id
+ */
+    queue_element_t *qe = NULL;
+    unsigned int    tid = 0;
+
+    tid = *((unsigned int *) id);
+    log_register(tid);
+    
+    
+    while (notfinished) {
+        pthread_mutex_lock(&thr_queue);
+        while (thread_parked(tid) && notfinished)
+            pthread_cond_wait(&thr_park, &thr_queue);
+        hungry_count++;
+        while ((fast_anchor->element_counter == 0) && (slow_anchor->element_counter == 0) && (notfinished)) {
+            if (spill_count() > 0 && spill_reload(tid) > 0)
+                break;
+            pthread_cond_wait(&queue_empty, &thr_queue);
+        }
+        hungry_count--;
+        if (thread_parked(tid)) {
+            pthread_mutex_unlock(&thr_queue);
+            continue;
+        }
         if (notfinished) {
             if (dual_queue) {
                 if (fast_nodes_befor_next_slow_node > 0) {
@@ -1500,16 +2547,17 @@ static void *
             if (qe != NULL) {
                 busy_count++;
                 pthread_mutex_unlock(&thr_queue);
-                process_tile(tid, qe, pwdbuffer, grpbuffer);                
+                process_tile(tid, qe);                
                 pthread_mutex_lock(&thr_queue);
                 busy_count--;
-               if ((busy_count == 0) && (fast_anchor->element_counter == 0) && (slow_anchor->element_counter == 0)) {
+               if ((busy_count == 0) && (fast_anchor->element_counter == 0) && (slow_anchor->element_counter == 0) && (spill_count() == 0)) {
 /*
 * since no more global deq's elements and we are the only busy thread: the scan phase is finished.
 * wakeup all threads and tell them to exit.
 */
                     notfinished = 0;
                     pthread_cond_broadcast(&queue_empty);
+                    pthread_cond_broadcast(&thr_park);
                 }
                 pthread_mutex_unlock(&thr_queue);
             } else {
@@ -1519,11 +2567,485 @@ static void *
             pthread_mutex_unlock(&thr_queue);
         }
     }
-    free(pwdbuffer);
-    free(grpbuffer);
     pthread_exit(EXIT_SUCCESS);
 }
 
+static dev_group_t *
+        dev_pick(const long home) {
+
+/*
+ * Description:
+ * Chooses the device group a thread takes its next subtree root from: its home group if that
+ * one has work and is below its thread cap, otherwise the next group which has. To be called
+ * with thr_queue locked.
+ *
+ * Return value:
+ * device group or NULL if no work can be taken
+ *
+ */
+    dev_group_t *g;
+    long        i;
+
+    for (i = 0; i < ngroups; i++) {
+        g = &groups[(home + i) % ngroups];
+        if (g->anchor->element_counter > 0 && g->busy < g->cap)
+            return g;
+    }
+    return NULL;
+}
+
+static short int
+        dev_work_left(void) {
+
+/*
+ * Description:
+ * Returns 1 if one of the device deqs holds work, 0 otherwise. To be called with thr_queue
+ * locked.
+ *
+ */
+    long    i;
+
+    for (i = 0; i < ngroups; i++) {
+        if (groups[i].anchor->element_counter > 0)
+            return 1;
+    }
+    return 0;
+}
+
+static void *
+        dev_handle_subtree(void *id) {
+
+/*
+ * Description:
+ * Per-device queue version of handle_subtree: takes a subtree root from the deq of the thread's
+ * home device or, if there is no work it may take, from the deq of another device, and calls
+ * process_tile for it. A thread waits if all devices with work are at their thread cap.
+ *
+ * Parameter:
+ * id: thread id
+ */
+    queue_element_t *qe = NULL;
+    dev_group_t     *g = NULL;
+    unsigned int    tid = 0;
+    long            home;
+
+    tid = *((unsigned int *) id);
+    log_register(tid);
+    home = dev_home(tid);
+    if (groups[home].numa >= 0)
+        dev_pin(groups[home].numa);
+
+    pthread_mutex_lock(&thr_queue);
+    while (notfinished) {
+        if (thread_parked(tid)) {
+            pthread_cond_wait(&thr_park, &thr_queue);
+            continue;
+        }
+        if ((g = dev_pick(home)) == NULL) {
+            if (!dev_work_left() && spill_count() > 0 && spill_reload(tid) > 0)
+                continue;
+            hungry_count++;
+            pthread_cond_wait(&queue_empty, &thr_queue);
+            hungry_count--;
+            continue;
+        }
+        qe = deq_get(g->anchor);
+        g->busy++;
+        busy_count++;
+        pthread_mutex_unlock(&thr_queue);
+        process_tile(tid, qe);
+        pthread_mutex_lock(&thr_queue);
+        g->busy--;
+        busy_count--;
+        if ((busy_count == 0) && !dev_work_left() && (spill_count() == 0)) {
+/*
+* no work left and no busy thread: the scan phase is finished
+*/
+            notfinished = 0;
+            pthread_cond_broadcast(&queue_empty);
+            pthread_cond_broadcast(&thr_park);
+        } else if (g->anchor->element_counter > 0) {
+/*
+* a thread waiting for the cap of this device may continue
+*/
+            pthread_cond_signal(&queue_empty);
+        }
+    }
+    pthread_mutex_unlock(&thr_queue);
+    pthread_exit(EXIT_SUCCESS);
+}
+
+#ifdef HAVE_STDATOMIC_H
+static queue_element_t *
+        ws_find_work(const unsigned int tid, unsigned int *seed) {
+
+/*
+ * Description:
+ * Tries to steal the oldest subtree root from the work stealing deques of the other threads,
+ * starting with a random victim.
+ *
+ */
+    queue_element_t *qe = NULL;
+    size_t          i, victim;
+
+    if (numthr < 2)
+        return NULL;
+    victim = (size_t) rand_r(seed) % numthr;
+    for (i = 0; i < numthr; i++, victim = (victim + 1) % numthr) {
+        if (victim != tid && (qe = ws_steal(&wsq[victim])) != NULL)
+            return qe;
+    }
+    return NULL;
+}
+
+static void *
+        ws_handle_subtree(void *id) {
+
+/*
+ * Description:
+ * Work stealing version of handle_subtree: takes the newest subtree root from the thread's own
+ * deque or, if that is empty, steals one from another thread and calls process_tile for it.
+ * The scan phase is finished when no subtree root is pending anymore.
+ *
+ * Parameter:
+ * id: thread id
+ */
+    queue_element_t *qe = NULL;
+    unsigned int    tid = 0, seed;
+    struct timespec ts;
+
+    tid = *((unsigned int *) id);
+    seed = tid + 1;
+    log_register(tid);
+
+
+    while (notfinished) {
+        if ((qe = ws_take(&wsq[tid])) == NULL)
+            qe = ws_find_work(tid, &seed);
+        if (qe != NULL) {
+            process_tile(tid, qe);
+            if (atomic_fetch_sub_explicit(&ws_pending, 1, memory_order_acq_rel) == 1) {
+/*
+* this was the last pending subtree root: the scan phase is finished.
+*/
+                pthread_mutex_lock(&thr_queue);
+                notfinished = 0;
+                pthread_cond_broadcast(&queue_empty);
+                pthread_mutex_unlock(&thr_queue);
+            }
+        } else {
+/*
+* nothing to steal: wait until a thread pushes new work. Wakeups are not synchronized with
+* the pushes, so waits are bounded.
+*/
+            pthread_mutex_lock(&thr_queue);
+            atomic_fetch_add_explicit(&ws_idle, 1, memory_order_relaxed);
+            if (notfinished) {
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_nsec += WS_IDLE_WAIT_NS;
+                if (ts.tv_nsec >= 1000000000L) {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&queue_empty, &thr_queue, &ts);
+            }
+            atomic_fetch_sub_explicit(&ws_idle, 1, memory_order_relaxed);
+            pthread_mutex_unlock(&thr_queue);
+        }
+    }
+    pthread_exit(EXIT_SUCCESS);
+}
+#endif
+
+static void
+        ckpt_add_spilled(const long fs, const long dirpos, const char *name) {
+
+/*
+ * Description:
+ * Adds a directory of the spill file to the checkpoint.
+ *
+ */
+    queue_element_t element;
+
+    memset(&element, 0, sizeof (queue_element_t));
+    element.name = (char *) name;
+    element.fs = (fs >= 0 && (unsigned long) fs < nroots) ? root_index[fs] : NULL;
+    ckpt_add(&element, dirpos);
+}
+
+static void
+        ckpt_take(const short int final) {
+
+/*
+ * Description:
+ * Writes a checkpoint of all outstanding work: waits until every busy thread has stopped at
+ * a safe point, then records the global deqs and the private deq and current element of
+ * every thread. Threads waiting for work can't take any while the queue mutex is held.
+ *
+ * Parameters:
+ * final:       the scan is being stopped; threads give up their work after the checkpoint
+ *
+ */
+    struct timespec ts = { 0, 1000000L };
+    char            msg[80];
+    size_t          i;
+    long            n = -1;
+
+    pthread_mutex_lock(&thr_ckpt);
+    ckpt_pending = 1;
+    pthread_mutex_unlock(&thr_ckpt);
+    for (;;) {
+        pthread_mutex_lock(&thr_queue);
+        pthread_mutex_lock(&thr_ckpt);
+        if (ckpt_parked >= busy_count)
+            break;
+        pthread_mutex_unlock(&thr_ckpt);
+        pthread_mutex_unlock(&thr_queue);
+        nanosleep(&ts, NULL);
+    }
+    if (ckpt_begin(fckpt, nroots) == 0) {
+        ckpt_add_anchor(fast_anchor);
+        ckpt_add_anchor(slow_anchor);
+        for (i = 0; i < (size_t) ngroups; i++)
+            ckpt_add_anchor(groups[i].anchor);
+        if (spilling)
+            spill_scan(ckpt_add_spilled);
+        for (i = 0; i < numthr; i++) {
+            if (ckpt_slots[i].anchor == NULL)
+                continue;
+            if (ckpt_slots[i].element != NULL)
+                ckpt_add(ckpt_slots[i].element, ckpt_slots[i].dirpos);
+            ckpt_add_anchor(ckpt_slots[i].anchor);
+        }
+        n = ckpt_commit(fckpt);
+    }
+    if (final)
+        ckpt_final = 1;
+    else
+        ckpt_pending = 0;
+    ckpt_parked = 0;
+    ckpt_gen++;
+    pthread_cond_broadcast(&ckpt_release);
+    pthread_mutex_unlock(&thr_ckpt);
+    pthread_mutex_unlock(&thr_queue);
+    if (n >= 0) {
+        snprintf(msg, sizeof (msg), "checkpoint written: %ld directories outstanding", n);
+        print_error_r(INFO, msg);
+    }
+}
+
+static void
+        tune_set(const size_t n, const double rate) {
+
+/*
+ * Description:
+ * Sets the number of active threads. Threads beyond it hand over their work and park, parked
+ * threads below it return to work.
+ *
+ * Parameters:
+ * n:           new number of active threads
+ * rate:        scan rate (entries/s) measured with the old number, for the log
+ *
+ */
+    char    msg[128];
+
+    snprintf(msg, sizeof (msg), "auto threads: %ld -> %ld active (%.0f entries/s, %.0f per thread)", (long) active_threads, (long) n, rate, rate / (double) active_threads);
+    pthread_mutex_lock(&thr_queue);
+    active_threads = n;
+    pthread_cond_broadcast(&queue_empty);
+    pthread_cond_broadcast(&thr_park);
+    pthread_mutex_unlock(&thr_queue);
+    print_error_r(INFO, msg);
+    if (verbose)
+        fprintf(stdout, "INFO: %s\n", msg);
+}
+
+static void *
+        tune_threads(void *arg) {
+
+/*
+ * Description:
+ * Thread count controller (-A): every TUNE_INTERVAL seconds measures the scan rate of all
+ * threads and moves the number of active threads by hill climbing between 1 and the maximum.
+ * As long as a move raises the rate the controller keeps its direction; if the rate falls (by
+ * more than TUNE_TOLERANCE) the direction is reversed, the step halved and, after moving back,
+ * the number is held for TUNE_HOLD intervals. If additional threads didn't pay off the
+ * controller turns back, too, so it settles at the smallest number of threads reaching the best
+ * rate. While threads are idle for lack of work the number isn't raised but lowered.
+ * The threads are created once, up to the maximum; a thread beyond the active ones hands over
+ * its private deq at its next entry, like at the busy threshold, and parks (thread_parked).
+ *
+ */
+    struct timespec ts;
+    unsigned long   total, last_total = 0;
+    double          rate, last_rate = 0.;
+    long            step, dir = 1, n, hold = 0;
+    short int       moved = 0, reversed = 0;
+    size_t          i;
+
+    step = (long) (autothreads / 8);
+    if (step < 1)
+        step = 1;
+    pthread_mutex_lock(&thr_tune);
+    while (tune_running) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += TUNE_INTERVAL;
+        if (pthread_cond_timedwait(&tune_wakeup, &thr_tune, &ts) != ETIMEDOUT || !tune_running)
+            continue;
+        for (i = 0, total = 0; i < numthr; i++)
+            total += STAT_GET(stat_counters[i].filecounter) + STAT_GET(stat_counters[i].dircounter) + STAT_GET(stat_counters[i].linkcounter) + STAT_GET(stat_counters[i].otherscounter);
+        rate = (double) (total - last_total) / (double) TUNE_INTERVAL;
+        last_total = total;
+        reversed = 0;
+        if (moved && (rate < last_rate * (1. - TUNE_TOLERANCE) || (dir > 0 && rate <= last_rate * (1. + TUNE_TOLERANCE)))) {
+            dir = -dir;
+            if (step > 1)
+                step /= 2;
+            reversed = 1;
+        }
+        last_rate = rate;
+        moved = 0;
+        if (hold > 0) {
+            hold--;
+            continue;
+        }
+        if (dir > 0 && (double) busy_count < (double) active_threads * busythreshold)
+/*
+* threads are idle for lack of work: more of them won't help
+*/
+            dir = -1;
+        n = (long) active_threads + dir * step;
+        if (n < 1 || n > (long) autothreads) {
+/*
+* at a bound: turn around
+*/
+            dir = -dir;
+            n = (long) active_threads + dir * step;
+        }
+        if (n < 1 || n > (long) autothreads)
+            continue;
+        tune_set((size_t) n, rate);
+        moved = 1;
+        if (reversed)
+            hold = TUNE_HOLD;
+    }
+    pthread_mutex_unlock(&thr_tune);
+    return arg;
+}
+
+static void
+        tune_shutdown(void) {
+
+/*
+ * Description:
+ * Stops the thread count controller.
+ *
+ */
+    pthread_mutex_lock(&thr_tune);
+    if (!tune_running) {
+        pthread_mutex_unlock(&thr_tune);
+        return;
+    }
+    tune_running = 0;
+    pthread_cond_signal(&tune_wakeup);
+    pthread_mutex_unlock(&thr_tune);
+    pthread_join(thr_tuner, NULL);
+}
+
+static void *
+        metrics_writer(void *arg) {
+
+/*
+ * Description:
+ * Metrics thread: writes a sample of the counters every metrics_interval seconds until
+ * metrics_shutdown.
+ *
+ */
+    struct timespec     ts;
+    metrics_sample_t    m;
+
+    pthread_mutex_lock(&thr_metrics);
+    while (metrics_running) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += metrics_interval;
+        if (pthread_cond_timedwait(&metrics_wakeup, &thr_metrics, &ts) == ETIMEDOUT && metrics_running) {
+            pthread_mutex_unlock(&thr_metrics);
+            stat_collect(&m);
+            metrics_write(&m);
+            pthread_mutex_lock(&thr_metrics);
+        }
+    }
+    pthread_mutex_unlock(&thr_metrics);
+    return arg;
+}
+
+static void
+        metrics_shutdown(void) {
+
+/*
+ * Description:
+ * Stops the metrics thread and writes a last sample.
+ *
+ */
+    metrics_sample_t    m;
+
+    pthread_mutex_lock(&thr_metrics);
+    if (!metrics_running) {
+        pthread_mutex_unlock(&thr_metrics);
+        return;
+    }
+    metrics_running = 0;
+    pthread_cond_signal(&metrics_wakeup);
+    pthread_mutex_unlock(&thr_metrics);
+    pthread_join(thr_metrics_writer, NULL);
+    stat_collect(&m);
+    metrics_write(&m);
+    metrics_close();
+}
+
+static void *
+        ckpt_writer(void *arg) {
+
+/*
+ * Description:
+ * Checkpoint thread: writes a checkpoint every ckpt_interval seconds until ckpt_shutdown.
+ *
+ */
+    struct timespec ts;
+
+    pthread_mutex_lock(&thr_ckpt);
+    while (ckpt_running) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += ckpt_interval;
+        if (pthread_cond_timedwait(&ckpt_wakeup, &thr_ckpt, &ts) == ETIMEDOUT && ckpt_running) {
+            pthread_mutex_unlock(&thr_ckpt);
+            ckpt_take(0);
+            pthread_mutex_lock(&thr_ckpt);
+        }
+    }
+    pthread_mutex_unlock(&thr_ckpt);
+    return arg;
+}
+
+static void
+        ckpt_shutdown(void) {
+
+/*
+ * Description:
+ * Stops the checkpoint thread.
+ *
+ */
+    pthread_mutex_lock(&thr_ckpt);
+    if (!ckpt_running) {
+        pthread_mutex_unlock(&thr_ckpt);
+        return;
+    }
+    ckpt_running = 0;
+    pthread_cond_signal(&ckpt_wakeup);
+    pthread_mutex_unlock(&thr_ckpt);
+    pthread_join(thr_ckpt_writer, NULL);
+}
+
 static void
 	handler(const int signum) {
 /*
@@ -1531,8 +3053,9 @@ static void
  * Signal handler.
  *
  */
-    char    *msg = NULL;
-    size_t  i;
+    char            *msg = NULL;
+    size_t          i;
+    unsigned long   waits = 0;
 
 /*
  *   if threads are already started allow all threads a clean shutdown
@@ -1541,12 +3064,33 @@ static void
     if (notfinished) {
         notfinished = 0;
         pthread_cond_broadcast(&queue_empty);
+        pthread_cond_broadcast(&thr_park);
     }
     pthread_mutex_unlock(&thr_handler);
+    rollback_stop();
+/*
+ * with checkpoints the threads stop at the next entry, after a final checkpoint of their work
+ */
+    tune_shutdown();
+    if (ckpt_interval > 0 && ckpt_slots != NULL) {
+        ckpt_shutdown();
+        ckpt_take(1);
+    }
     for (i = 0; i < numthr; i++)
         pthread_join(threads[i], NULL);
+#ifdef HAVE_STDATOMIC_H
+/*
+ * the apply threads finish the changes already queued, which still go to the log and journal
+ */
+    if (applythreads > 0)
+        apply_close(&waits);
+#endif
     if (stats)
         pthread_join(thr_stat, NULL);
+    metrics_shutdown();
+    log_shutdown();
+    journal_close();
+    spill_close();
     if ((msg = (char *) malloc(sizeof(char) * (22+strlen(strsignal(signum))))) == NULL) {
         fprintf(stderr, "ERROR: No memory available for message string\n");
         exit(ENOMEM);
@@ -1557,17 +3101,29 @@ static void
 
     fprintf(stderr, "\n%s\n", msg);
     free(msg);
-    free(htab->het_tab);
-    free(htab);
+/*
+* elements left after a final checkpoint
+*/
+    while (fast_anchor != NULL && fast_anchor->element_counter > 0)
+        free_element((unsigned int) numthr, deq_get(fast_anchor));
+    while (slow_anchor != NULL && slow_anchor->element_counter > 0)
+        free_element((unsigned int) numthr, deq_get(slow_anchor));
+    for (i = 0; i < (size_t) ngroups; i++) {
+        while (groups[i].anchor->element_counter > 0)
+            free_element((unsigned int) numthr, deq_get(groups[i].anchor));
+    }
+    h_free();
+    slab_destroy();
     free(threads);
-    if (stats)
-        free(stat_counters);
+    free(stat_counters);
     free(fast_anchor);
     fast_anchor = NULL;
     free(slow_anchor);
     slow_anchor = NULL;
     delete_fs_list();
     delete_ex_list();
+    idmap_free(&uidmap);
+    idmap_free(&gidmap);
     fclose(fplog);
     exit(EXIT_FAILURE);
 }
@@ -1583,14 +3139,48 @@ int
     size_t          i = 0, buflen = 0;
     char            *msg = NULL;
     char            *flog = NULL;
+    char            *fjournal = NULL;
+    unsigned long   hl_entries = 0, hl_slots = 0, hl_bytes = 0;
+    unsigned long   nscan = 0;
+    metrics_sample_t sample;
    
     /* OPTIONS and USAGE */
     int             c, u = 0;	/* index -- getopt_long */
     extern char     *optarg;
     extern int      optopt;
+    char            *dumpjournal = NULL;
+    char            *rbjournal = NULL;
+    char            *pathlist = NULL;
+    int             rc;
+    long            n = 0;
+    short int       excluded = 0;
+    double          latency_ms = 0.0;
+    long            nbuckets = 0;
+    unsigned long   applied = 0, applywaits = 0;
+    int             record = OWNER_LOG;
+#ifndef _WIN32
+    sigset_t        sigs, oldsigs;
+#endif
+#ifdef HAVE_GETOPT_LONG
+    static struct option longopts[] = {
+        { "dump-journal", required_argument, NULL, 'J' },
+        { "rollback", required_argument, NULL, 'R' },
+        { "resume", no_argument, NULL, 'r' },
+        { "metrics", required_argument, NULL, 'M' },
+        { "metrics-format", required_argument, NULL, OPT_METRICS_FORMAT },
+        { "metrics-interval", required_argument, NULL, OPT_METRICS_INTERVAL },
+        { "queue-memory", required_argument, NULL, OPT_QUEUE_MEMORY },
+        { "spill", no_argument, NULL, OPT_SPILL },
+        { "report", no_argument, NULL, 'a' },
+        { "index", required_argument, NULL, 'I' },
+        { "rate-limit", required_argument, NULL, 'L' },
+        { "latency-target", required_argument, NULL, OPT_LATENCY_TARGET },
+        { "apply-threads", required_argument, NULL, 'w' },
+        { NULL, 0, NULL, 0 }
+    };
+#endif
 #ifndef _WIN32
     size_t          *taskids = NULL;
-    struct stat     statbuf;
 #else
     HANDLE          taskids;
     DWORD           dwLevel = 10;
@@ -1633,7 +3223,11 @@ int
     limits.rlim_max = RLIM_INFINITY;
     setrlimit(RLIMIT_NOFILE, &limits);
         
-    while ((c = getopt(argc, argv, ":hi:d:e:qvnob:s:t:l:")) != -1) {
+#ifdef HAVE_GETOPT_LONG
+    while ((c = getopt_long(argc, argv, ":hi:d:e:p:qvnaofcNjJ:R:rC:PDWHA:M:Q:B:U:I:L:w:b:s:t:l:", longopts, NULL)) != -1) {
+#else
+    while ((c = getopt(argc, argv, ":hi:d:e:p:qvnaofcNjJ:R:rC:PDWHA:M:Q:B:U:I:L:w:b:s:t:l:")) != -1) {
+#endif
         switch (c) {
             case 'h':
                 usage();
@@ -1644,6 +3238,9 @@ int
            case 'd':
                 dirlist = strdup(optarg);
                 break;
+            case 'p':
+                pathlist = optarg;
+                break;
            case 'e':
                 exclude_list = strdup(optarg);
                 break;
@@ -1656,9 +3253,143 @@ int
             case 'n':
                 dryrun = 1;
                 break;
+            case 'a':
+                report = 1;
+                break;
             case 'o':
                 dual_queue = 0;
                 break;
+            case 'f':
+                fdrelative = 1;
+                break;
+            case 'B':
+                if (sscanf(optarg, "%ld", &batchsize) != 1 || batchsize < 1) {
+                    fprintf(stderr, "ERROR: Batch size has to be a positive number!\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'N':
+                resolve_names = 0;
+                break;
+            case 'c':
+                combined = 1;
+                break;
+            case 'j':
+                journaling = 1;
+                break;
+            case 'P':
+                prescan = 1;
+                break;
+            case 'D':
+                devqueues = 1;
+                break;
+            case 'A':
+                if (sscanf(optarg, "%lu", &autothreads) != 1 || autothreads < 1 || autothreads > PTHREAD_THREADS_MAX) {
+                    fprintf(stderr, "ERROR: Maximum number of threads: allowed Number range: 1 >= # <= %d\n", PTHREAD_THREADS_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'Q':
+            case OPT_QUEUE_MEMORY:
+#ifdef HAVE_STDATOMIC_H
+                if (sscanf(optarg, "%ld", (c == 'Q') ? &queue_limit : &queue_memory) != 1 || ((c == 'Q') ? queue_limit : queue_memory) < 1) {
+                    fprintf(stderr, "ERROR: Queue limit has to be a positive number!\n");
+                    exit(EXIT_FAILURE);
+                }
+                if (c == OPT_QUEUE_MEMORY)
+                    queue_memory = (queue_memory > LONG_MAX / (1024 * 1024)) ? LONG_MAX : queue_memory * 1024 * 1024;
+                bounded = 1;
+#else
+                fprintf(stderr, "ERROR: Bounded mode not supported by this build!\n");
+                exit(EXIT_FAILURE);
+#endif
+                break;
+            case OPT_SPILL:
+                spilling = 1;
+                break;
+            case 'J':
+                dumpjournal = optarg;
+                break;
+            case 'R':
+                rbjournal = optarg;
+                break;
+            case 'r':
+                resume = 1;
+                break;
+            case 'C':
+                if (sscanf(optarg, "%u", &ckpt_interval) != 1 || ckpt_interval < 1) {
+                    fprintf(stderr, "ERROR: Checkpoint interval has to be a positive number of seconds!\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'U':
+#ifdef HAVE_IO_URING
+                if (sscanf(optarg, "%u", &uringdepth) != 1 || uringdepth < 1 || uringdepth > URING_MAX_DEPTH) {
+                    fprintf(stderr, "ERROR: Queue depth has to be between 1 and %d!\n", URING_MAX_DEPTH);
+                    exit(EXIT_FAILURE);
+                }
+#else
+                fprintf(stderr, "ERROR: io_uring not supported by this build!\n");
+                exit(EXIT_FAILURE);
+#endif
+                break;
+            case 'M':
+                metrics_target = optarg;
+                break;
+            case 'I':
+                findex = optarg;
+                break;
+            case 'w':
+#ifdef HAVE_STDATOMIC_H
+                if (sscanf(optarg, "%lu", (unsigned long *) &applythreads) != 1 || applythreads < 1) {
+                    fprintf(stderr, "ERROR: Number of apply threads has to be a positive number!\n");
+                    exit(EXIT_FAILURE);
+                }
+#else
+                fprintf(stderr, "ERROR: Apply threads not supported by this build!\n");
+                exit(EXIT_FAILURE);
+#endif
+                break;
+            case 'L':
+                if (sscanf(optarg, "%ld", &rate_ops) != 1 || rate_ops < 1) {
+                    fprintf(stderr, "ERROR: Operation budget has to be a positive number of operations per second!\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_LATENCY_TARGET:
+                if (sscanf(optarg, "%lf", &latency_ms) != 1 || latency_ms <= 0.0) {
+                    fprintf(stderr, "ERROR: Latency target has to be a positive number of milliseconds!\n");
+                    exit(EXIT_FAILURE);
+                }
+                latency_target = (unsigned long) (latency_ms * 1e6);
+                break;
+            case OPT_METRICS_FORMAT:
+                if (strcmp(optarg, "json") == 0) {
+                    metrics_format = METRICS_JSON;
+                } else if (strcmp(optarg, "prometheus") == 0 || strcmp(optarg, "prom") == 0) {
+                    metrics_format = METRICS_PROMETHEUS;
+                } else {
+                    fprintf(stderr, "ERROR: Metrics format has to be json or prometheus!\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_METRICS_INTERVAL:
+                if (sscanf(optarg, "%u", &metrics_interval) != 1 || metrics_interval < 1) {
+                    fprintf(stderr, "ERROR: Metrics interval has to be a positive number of seconds!\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'W':
+#ifdef HAVE_STDATOMIC_H
+                worksteal = 1;
+#else
+                fprintf(stderr, "ERROR: Work stealing mode not supported by this build!\n");
+                exit(EXIT_FAILURE);
+#endif
+                break;
+            case 'H':
+                hungry = 1;
+                break;
             case 'b':
                 sscanf(optarg, "%lf", &busythreshold);
                 stats = 1;
@@ -1694,12 +3425,80 @@ int
         }
     }
     
-    if (uidlist == NULL) {
+    if (dumpjournal != NULL)
+        exit(journal_dump(dumpjournal));
+
+    if (ckpt_interval > 0 && worksteal) {
+        fprintf(stderr, "ERROR: Checkpoints are not supported in work stealing mode!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pathlist != NULL && (dirlist != NULL || worksteal || ckpt_interval > 0 || resume || prescan || devqueues)) {
+        fprintf(stderr, "ERROR: A path list can't be combined with -d, -W, -C, --resume, -P or -D!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (report && (dryrun || ckpt_interval > 0 || resume || rbjournal != NULL)) {
+        fprintf(stderr, "ERROR: Report mode can't be combined with -n, -C, --resume or --rollback!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (applythreads > 0 && (dryrun || report || ckpt_interval > 0 || resume)) {
+        fprintf(stderr, "ERROR: Apply threads can't be combined with -n, -a, -C or --resume!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (findex != NULL && (batchsize > 0 || uringdepth > 0 || pathlist != NULL)) {
+        fprintf(stderr, "ERROR: An incremental run can't be combined with -B, -U or -p!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (devqueues && worksteal) {
+        fprintf(stderr, "ERROR: Per-device queues are not supported in work stealing mode!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (bounded && worksteal) {
+        fprintf(stderr, "ERROR: Bounded mode is not supported in work stealing mode!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (spilling && !bounded) {
+        fprintf(stderr, "ERROR: Spilling needs a limit of bounded mode (-Q or --queue-memory)!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (hungry && worksteal) {
+        fprintf(stderr, "ERROR: Work handover on demand is not supported in work stealing mode!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (autothreads > 0 && worksteal) {
+        fprintf(stderr, "ERROR: An automatic number of threads is not supported in work stealing mode!\n");
+        exit(EXIT_FAILURE);
+    }
+/*
+* with -A all threads up to the maximum are started, -t gives the number of initially active ones
+*/
+    if (autothreads > 0) {
+        if (max_openfiles - autothreads < OPENFILES_OFFSET) {
+            autothreads = max_openfiles - OPENFILES_OFFSET;
+            if (verbose)
+                fprintf(stdout, "INFO: Due to file descriptor limit maximum # of threads decreased to %ld!\n", (long) autothreads);
+        }
+        active_threads = (numthr < autothreads) ? numthr : autothreads;
+        numthr = autothreads;
+    } else {
+        active_threads = numthr;
+    }
+
+    if (uidlist == NULL && rbjournal == NULL) {
         fprintf(stderr, "\nNo uid list file given!\n\n");
         usage();
     }
     
     start_time = time(NULL);
+    gettimeofday(&start_tv, NULL);
     
     if (logdir == NULL) {
         fprintf(stderr, "ERROR: No LogDir specified\n");
@@ -1713,16 +3512,54 @@ int
     }
     snprintf(flog, buflen, "%s/chuid_log", logdir);
     errno = 0;
-    if ((fplog = fopen(flog, "w")) == NULL) {
+    if ((fplog = fopen(flog, resume ? "a" : "w")) == NULL) {
         fprintf (stderr, "ERROR: Couldn't open log file <%s>: %s\n", flog, strerror(errno));
         exit(errno);
     }
 
     print_error(INFO, "chuid started");
+
+    if (pathlist != NULL) {
+        errno = 0;
+        if ((fpathlist = (strcmp(pathlist, "-") == 0) ? stdin : fopen(pathlist, "r")) == NULL) {
+            fprintf(stderr, "ERROR: Can't open path list file %s: %s\n", pathlist, strerror(errno));
+            exit(errno);
+        }
+    }
+
+#ifndef _WIN32
+    if (rbjournal != NULL) {
+/*
+* rollback mode: only the entries recorded in the journal are visited
+*/
+        if ((taskids = calloc(numthr, sizeof(size_t))) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for THREADS ID array\n");
+            exit(ENOMEM);
+        }
+        if ((threads = calloc(numthr, sizeof(pthread_t))) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for THREADS array\n");
+            exit(ENOMEM);
+        }
+        rc = rollback(rbjournal, threads, taskids, numthr, dryrun);
+        free(taskids);
+        free(threads);
+        print_error(INFO, (rc == EXIT_SUCCESS) ? "Rollback successfully completed" : "Rollback completed with errors");
+        errno = 0;
+        if (fclose(fplog) < 0) {
+            fprintf (stderr, "ERROR: Couldn't close <%s>: %s\n", flog, strerror(errno));
+            exit(errno);
+        }
+        free(flog);
+        free(logdir);
+        exit(rc);
+    }
+#endif
             
     parseuidlist(uidlist);
-    parsefilelist(dirlist);
-    parseexfilelist(exclude_list);
+    if (fpathlist == NULL)
+        parsefilelist(dirlist);
+    if (fpathlist == NULL || exclude_list != NULL)
+        parseexfilelist(exclude_list);
    
     free(uidlist);
     uidlist = NULL;
@@ -1733,8 +3570,17 @@ int
    
     pwdlinelen = get_pwd_buffer_size();
     grplinelen = get_grp_buffer_size();
+    idmap_names(&uidmap, 1);
+    idmap_names(&gidmap, 0);
+/*
+* a resumed scan visits again the entries processed after the last checkpoint
+*/
+    if (resume && (idmap_chained(&uidmap) || idmap_chained(&gidmap))) {
+        fprintf(stderr, "ERROR: Can't resume: a new id of the input file is an old id, too, entries would be changed twice!\n");
+        exit(EXIT_FAILURE);
+    }
 
-    h_init(INIT_MODULE, INIT_TAB_SIZE);
+    h_init((unsigned int) numthr * HASH_SHARDS_PER_THREAD, INIT_HASH_SLOTS);
     
 #ifndef _WIN32
     if ((taskids = calloc(numthr, sizeof(size_t))) == NULL) {
@@ -1757,40 +3603,146 @@ int
     
     fast_anchor = deq_init();
     slow_anchor = deq_init();
+/*
+* one slab cache per worker thread plus one for the main thread and one per apply thread
+*/
+    slab_init(numthr + 1 + applythreads);
+#ifdef HAVE_IO_URING
+    if (uringdepth > 0) {
+/*
+* the io_uring engine works on batches of directory entries
+*/
+        if (batchsize == 0)
+            batchsize = (long) uringdepth;
+        if ((rings = (uring_t *) calloc(numthr, sizeof(uring_t))) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for io_uring rings\n");
+            exit(ENOMEM);
+        }
+        for (i = 0; i < numthr; i++) {
+            if (uring_init(&rings[i], uringdepth) < 0) {
+                fprintf(stderr, "WARNING: io_uring not available (%s), using synchronous lstat!\n", strerror(errno));
+                while (i-- > 0)
+                    uring_free(&rings[i]);
+                free(rings);
+                rings = NULL;
+                break;
+            }
+        }
+    }
+#endif
 
-    if (begin_fs_list == NULL) {
+    if (begin_fs_list == NULL && fpathlist == NULL) {
         fprintf(stderr, "ERROR: No files systems to work on!\n");
         exit(EXIT_FAILURE);
     }
-    fs_list_ptr = begin_fs_list;
+    for (fs_list_ptr = begin_fs_list; fs_list_ptr != NULL; fs_list_ptr = fs_list_ptr->next)
+        nroots++;
+/*
+* the roots are stat'ed in parallel; duplicates and roots within other roots are skipped
+*/
+    if (!resume)
+        check_roots(begin_fs_list, nroots, numthr);
+    for (fs_list_ptr = begin_fs_list; fs_list_ptr != NULL; fs_list_ptr = fs_list_ptr->next)
+        nscan += !fs_list_ptr->skip;
+/*
+* roots whose file systems hold no entry of a mapped owner according to quota are skipped
+*/
+    if (prescan && !resume && prescan_roots(begin_fs_list, &uidmap, &gidmap) == nscan) {
+        print_error(INFO, "prescan: no root holds entries of mapped owners, nothing to do");
+        if (verbose)
+            fprintf(stdout, "INFO: prescan: no root holds entries of mapped owners, nothing to do\n");
+        errno = 0;
+        if (fclose(fplog) < 0) {
+            fprintf (stderr, "ERROR: Couldn't close <%s>: %s\n", flog, strerror(errno));
+            exit(errno);
+        }
+        exit(EXIT_SUCCESS);
+    }
+    if (ckpt_interval > 0 || resume) {
+        buflen = strlen(logdir) + 18;
+        if ((fckpt = (char *) malloc(sizeof(char) * buflen)) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for checkpoint file string\n");
+            exit(ENOMEM);
+        }
+        snprintf(fckpt, buflen, "%s/chuid_checkpoint", logdir);
+    }
+    if (resume) {
+/*
+* continue with the work outstanding at the last checkpoint instead of the roots
+*/
+        n = ckpt_load(fckpt, nroots, (unsigned int) numthr, fast_anchor);
+        buflen = strlen(fckpt) + 64;
+        if ((msg = (char *) malloc(sizeof(char) * buflen)) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for message string\n");
+            exit(ENOMEM);
+        }
+        snprintf(msg, buflen, "resuming from checkpoint <%s>: %ld directories", fckpt, n);
+        print_error(INFO, msg);
+        if (verbose)
+            fprintf(stdout, "INFO: %s\n", msg);
+        free(msg);
+        if (n == 0) {
+            fprintf(stderr, "ERROR: Nothing left to do in checkpoint <%s>!\n", fckpt);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (devqueues)
+        groups = dev_groups(begin_fs_list, numthr, &ngroups);
+/*
+* stat and chown operations are limited per file system by -L or ops= in the directory file
+*/
+    for (fs_list_ptr = begin_fs_list; fs_list_ptr != NULL && fs_list_ptr->maxops == 0; fs_list_ptr = fs_list_ptr->next)
+        ;
+    if (rate_ops > 0 || fs_list_ptr != NULL)
+        nbuckets = rate_init(begin_fs_list, numthr + 1 + applythreads, rate_ops, latency_target);
+    if (latency_target > 0 && nbuckets == 0) {
+        fprintf(stderr, "ERROR: A latency target needs an operation budget (-L or ops= in the directory file)!\n");
+        exit(EXIT_FAILURE);
+    }
+    fs_list_ptr = resume ? NULL : begin_fs_list;
     while (fs_list_ptr != NULL) {
-        if ((element = (queue_element_t *) malloc(sizeof(queue_element_t))) != NULL) {
+        if (fs_list_ptr->skip) {
+            fs_list_ptr = fs_list_ptr->next;
+            continue;
+        }
+        if ((element = (queue_element_t *) slab_alloc((unsigned int) numthr, sizeof(queue_element_t))) != NULL) {
 /*
 * in case there is no file system specific parameter, use the default
 */
-            if ((element->name = strdup(fs_list_ptr->dirpath)) == NULL) {
-                fprintf(stderr, "ERROR: No memory available for Name string\n");
-                exit(ENOMEM);
-            }
+            element->name = slab_strdup((unsigned int) numthr, fs_list_ptr->dirpath);
+            element->exnode = exclude_root(element->name, &excluded);
             errno = 0;
-            if (lstat(element->name, &statbuf) == 0) {
+            if (excluded) {
+                buflen = sizeof(char) * (strlen(element->name) + 32);
+                if ((msg = (char *) malloc(buflen)) == NULL) {
+                    fprintf(stderr, "ERROR: No memory available for message string\n");
+                    exit(ENOMEM);
+                }
+                snprintf(msg, buflen, "<%s> is excluded, skipped", element->name);
+                print_error(WARNING, msg);
+                free(msg);
+                slab_free((unsigned int) numthr, element->name);
+                slab_free((unsigned int) numthr, element);
+            } else if (fs_list_ptr->stat_errno == 0) {
                 element->directsubdirs = 0;
                 element->parent = NULL;
+                element->refs = 1;
+                element->batch = NULL;
                 element->dirpos = 0;
                 element->fs = fs_list_ptr;
                 element->next = NULL;
                 deq_put(fast_anchor, element);
             } else {
-                buflen = sizeof(char) * (strlen(element->name) + strlen(strerror(errno)) + 19);
+                buflen = sizeof(char) * (strlen(element->name) + strlen(strerror(fs_list_ptr->stat_errno)) + 19);
                 if ((msg = (char *) malloc(buflen)) == NULL) {
                     fprintf(stderr, "ERROR: No memory available for message string\n");
                     exit(ENOMEM);
                 }
-                snprintf(msg, buflen, "couldn't stat <%s>: %s", element->name, strerror(errno));
+                snprintf(msg, buflen, "couldn't stat <%s>: %s", element->name, strerror(fs_list_ptr->stat_errno));
                 print_error(WARNING, msg);
                 free(msg);
-                free(element->name);
-                free(element);
+                slab_free((unsigned int) numthr, element->name);
+                slab_free((unsigned int) numthr, element);
             }
         } else {
             fprintf(stderr, "Error allocating memory for new queue element!!\n");
@@ -1798,21 +3750,70 @@ int
         }
         fs_list_ptr = fs_list_ptr->next;
     }
-    if (fast_anchor->first == NULL) {
+    if (fast_anchor->first == NULL && fpathlist == NULL) {
         fprintf(stderr, "ERROR: No valid files systems to work on!\n");
         exit(EXIT_FAILURE);
     }
+/*
+* bounded mode: count the roots (or the directories of the checkpoint) and create the spill file
+*/
+    for (element = fast_anchor->first; bounded && element != NULL; element = element->next)
+        queue_account(1, element_bytes(element));
+    if (spilling) {
+        if ((root_index = (fs_root_t **) calloc(nroots + 1, sizeof (fs_root_t *))) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for root index\n");
+            exit(ENOMEM);
+        }
+        for (i = 0, fs_list_ptr = begin_fs_list; fs_list_ptr != NULL && i < nroots; fs_list_ptr = fs_list_ptr->next, i++)
+            root_index[i] = fs_list_ptr;
+        spill_open(logdir);
+    }
+/*
+* with per-device queues the roots go to the deqs of their devices
+*/
+    while (groups != NULL && (element = deq_get(fast_anchor)) != NULL)
+        deq_put(element_group(element)->anchor, element);
+#ifdef HAVE_STDATOMIC_H
+    if (worksteal) {
+/*
+* hand out the file system roots round robin to the threads' work stealing deques
+*/
+        if ((wsq = (ws_deque_t *) calloc(numthr, sizeof(ws_deque_t))) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for work stealing deques\n");
+            exit(ENOMEM);
+        }
+        for (i = 0; i < numthr; i++)
+            ws_init(&wsq[i], WS_INIT_SIZE);
+        atomic_init(&ws_pending, 0);
+        atomic_init(&ws_idle, 0);
+        for (i = 0; (element = deq_get(fast_anchor)) != NULL; i++) {
+            atomic_fetch_add(&ws_pending, 1);
+            ws_push(&wsq[i % numthr], element);
+        }
+    }
+#endif
    
-    if (stats) {
+    if (stats || autothreads > 0 || metrics_target != NULL || report || findex != NULL || latency_target > 0) {
 /*
 * initialize thread specific statistic counters
 */
-        if ((stat_counters = calloc(numthr, sizeof(struct statistic_counters))) == NULL) {
+        if ((stat_counters = calloc(numthr + 1 + applythreads, sizeof(struct statistic_counters))) == NULL) {
             fprintf(stderr, "ERROR: No memory available for STATISTICS array\n");
             exit(ENOMEM);
         }
-        memset(stat_counters, 0, numthr*sizeof(struct statistic_counters));
-
+    }
+    if (metrics_target != NULL)
+        metrics_open(metrics_target, metrics_format);
+/*
+* the lstat latency of a report is the base of its runtime estimate
+*/
+    if (metrics_target != NULL || report || latency_target > 0)
+        metrics = 1;
+    if (report)
+        report_init(numthr);
+    if (findex != NULL)
+        dirindex_open(findex, numthr, &uidmap, &gidmap, begin_exclude_file);
+    if (stats) {
         errno = 0;
 #ifdef _WIN32
 		thr_stat = CreateThread(NULL, 0, statistic, NULL, 0, &thr_statID);
@@ -1825,11 +3826,74 @@ int
             exit(errno);
         }
     }
+/*
+* journal of all changes, written through one buffer per worker thread (nothing changes in a dry run or report)
+*/
+    if (journaling && !dryrun && !report) {
+        buflen = strlen(logdir) + 15;
+        if ((fjournal = (char *) malloc(sizeof(char) * buflen)) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for journal file string\n");
+            exit(ENOMEM);
+        }
+        snprintf(fjournal, buflen, "%s/chuid_journal", logdir);
+        journal_open(fjournal, numthr + 1 + applythreads, resume);
+        free(fjournal);
+    } else {
+        journaling = 0;
+    }
+    if (ckpt_interval > 0 && (ckpt_slots = (ckpt_slot_t *) calloc(numthr, sizeof(ckpt_slot_t))) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for checkpoint slots\n");
+        exit(ENOMEM);
+    }
+#ifndef _WIN32
+/*
+* signals are handled by the main thread only: the handler relies on the other threads
+* reaching a safe point or finishing their work
+*/
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGQUIT);
+    pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+#endif
+/*
+* in path list mode the main thread feeds the threads and counts as busy until the list is read
+*/
+    if (fpathlist != NULL)
+        busy_count = 1;
+/*
+* buffered logging during the scan phase: one buffer per worker thread plus one for all others;
+* apply threads have theirs after the slot of the main thread, in front of the shared one
+*/
+    log_init((applythreads > 0) ? numthr + 2 + applythreads : numthr + 1);
+/*
+* the per-entry handlers of this configuration, for directories without and with a rate limit
+*/
+    record = dryrun ? OWNER_DRYRUN : journaling ? OWNER_JOURNAL : OWNER_LOG;
+    for (i = 0; i < 2; i++) {
+        entry_variant[i] = entry_handlers[metrics ? STATS_TIMED : (stat_counters != NULL) ? STATS_COUNT : STATS_NONE][report][fpathlist != NULL][i];
+        if (report)
+            entry_variant[i].owner = report_handlers[combined];
+#ifdef HAVE_STDATOMIC_H
+        else if (applythreads > 0)
+            entry_variant[i].owner = queue_owner;
+#endif
+        else
+            entry_variant[i].owner = owner_handlers[record][combined][metrics][i];
+    }
+#ifdef HAVE_STDATOMIC_H
+    if (applythreads > 0)
+        apply_init(applythreads, numthr, (unsigned int) (numthr + 1), fdrelative, owner_handlers[record][combined][metrics]);
+#endif
     for (i = 0; i < numthr; i++) {
 #ifndef _WIN32
         taskids[i] = i;
         errno = 0;
-        if (pthread_create(&threads[i], NULL, handle_subtree, (void *) &(taskids[i])) != 0 ) {
+#ifdef HAVE_STDATOMIC_H
+        if (pthread_create(&threads[i], NULL, worksteal ? ws_handle_subtree : (groups != NULL ? dev_handle_subtree : handle_subtree), (void *) &(taskids[i])) != 0 ) {
+#else
+        if (pthread_create(&threads[i], NULL, (groups != NULL) ? dev_handle_subtree : handle_subtree, (void *) &(taskids[i])) != 0 ) {
+#endif
             fprintf(stderr, "Worker thread %ld did not start!\n", (unsigned long) i);
             exit(errno);
 #else
@@ -1840,6 +3904,47 @@ int
 #endif
         }
     }
+    if (ckpt_interval > 0) {
+        ckpt_running = 1;
+        if (pthread_create(&thr_ckpt_writer, NULL, ckpt_writer, NULL) != 0) {
+            fprintf(stderr, "Checkpoint thread did not start!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (metrics_target != NULL) {
+        metrics_running = 1;
+        if (pthread_create(&thr_metrics_writer, NULL, metrics_writer, NULL) != 0) {
+            fprintf(stderr, "Metrics thread did not start!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (autothreads > 0) {
+        tune_running = 1;
+        if (pthread_create(&thr_tuner, NULL, tune_threads, NULL) != 0) {
+            fprintf(stderr, "Thread count controller did not start!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+#ifndef _WIN32
+    pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+#endif
+#ifndef _WIN32
+    if (fpathlist != NULL) {
+        n = (long) feed_pathlist(fpathlist);
+        if (fpathlist != stdin)
+            fclose(fpathlist);
+        buflen = 64;
+        if ((msg = (char *) malloc(sizeof(char) * buflen)) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for message string\n");
+            exit(ENOMEM);
+        }
+        snprintf(msg, buflen, "path list: %ld entries read", n);
+        print_error(INFO, msg);
+        if (verbose)
+            fprintf(stdout, "INFO: %s\n", msg);
+        free(msg);
+    }
+#endif
 
     for (i = 0; i < numthr; i++) {
 #ifndef _WIN32
@@ -1851,6 +3956,13 @@ int
         }
 #endif
     }
+#ifdef HAVE_STDATOMIC_H
+/*
+* the apply threads finish the changes the scan has left them before anything is accounted
+*/
+    if (applythreads > 0)
+        applied = apply_close(&applywaits);
+#endif
     if (stats) {
 #ifndef _WIN32
         pthread_join(thr_stat, NULL);
@@ -1861,13 +3973,94 @@ int
         }
 #endif
     }
+    tune_shutdown();
+    metrics_shutdown();
+    ckpt_shutdown();
+    log_shutdown();
+    journal_close();
+    if (report || findex != NULL)
+        stat_collect(&sample);
+    if (report) {
+        report_write(stdout, &uidmap, &gidmap, sample.elapsed, sample.lstats, sample.lstat_ns, numthr);
+    }
+/*
+* the scan is complete: a checkpoint would only describe work done already
+*/
+    if (fckpt != NULL) {
+        unlink(fckpt);
+        free(fckpt);
+        fckpt = NULL;
+    }
+    free(ckpt_slots);
+
+    h_usage(&hl_entries, &hl_slots, &hl_bytes);
+    buflen = 256;
+    if ((msg = (char *) malloc(sizeof(char) * buflen)) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for message string\n");
+        exit(ENOMEM);
+    }
+    snprintf(msg, buflen, "hardlink table: %lu inodes in %lu slots, %lu KB", hl_entries, hl_slots, hl_bytes / 1024);
+    print_error(INFO, msg);
+    if (verbose)
+        fprintf(stdout, "INFO: %s\n", msg);
+    if (spilling) {
+        snprintf(msg, buflen, "bounded mode: %lu directories spilled", spill_close());
+        print_error(INFO, msg);
+        if (verbose)
+            fprintf(stdout, "INFO: %s\n", msg);
+        free(root_index);
+    }
+    if (findex != NULL) {
+        snprintf(msg, buflen, "incremental: %lu directories unchanged, %lu entries not checked", sample.unchangeddirs, sample.skippedentries);
+        print_error(INFO, msg);
+        if (verbose)
+            fprintf(stdout, "INFO: %s\n", msg);
+        snprintf(msg, buflen, "incremental: %lu clean directories recorded in the index", dirindex_close(1));
+        print_error(INFO, msg);
+        if (verbose)
+            fprintf(stdout, "INFO: %s\n", msg);
+    }
+    if (report) {
+        snprintf(msg, buflen, "report: %lu files, %lu directories, %lu links in %.1f s", sample.files, sample.dirs, sample.links, sample.elapsed);
+        print_error(INFO, msg);
+    }
+    if (applythreads > 0) {
+        snprintf(msg, buflen, "pipelined: %lu entries changed by %lu apply threads, scanning threads waited %lu times for them", applied, (unsigned long) applythreads, applywaits);
+        print_error(INFO, msg);
+        if (verbose)
+            fprintf(stdout, "INFO: %s\n", msg);
+    }
+    for (n = 0; rate_summary(n, msg, buflen); n++) {
+        print_error(INFO, msg);
+        if (verbose)
+            fprintf(stdout, "INFO: %s\n", msg);
+    }
+    free(msg);
 
+    rate_free(begin_fs_list);
     delete_fs_list();
     delete_ex_list();
-    if (stats) 
-        free(stat_counters);
-    free(htab->het_tab);
-    free(htab);
+    idmap_free(&uidmap);
+    idmap_free(&gidmap);
+    free(stat_counters);
+#ifdef HAVE_STDATOMIC_H
+    if (worksteal) {
+        for (i = 0; i < numthr; i++)
+            ws_destroy(&wsq[i]);
+        free(wsq);
+    }
+#endif
+#ifdef HAVE_IO_URING
+    if (rings != NULL) {
+        for (i = 0; i < numthr; i++)
+            uring_free(&rings[i]);
+        free(rings);
+    }
+#endif
+    if (groups != NULL)
+        dev_free(groups, ngroups);
+    h_free();
+    slab_destroy();
     free(fast_anchor);
     free(slow_anchor);
     free(taskids);
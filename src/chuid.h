@@ -50,6 +50,36 @@
 #include <stddef.h>
 #include <locale.h>
 #include <ctype.h>
+#include <stdint.h>
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+#ifdef HAVE_FNMATCH_H
+#include <fnmatch.h>
+#endif
+#ifdef HAVE_SYS_QUOTA_H
+#include <sys/quota.h>
+#endif
+#ifdef HAVE_MNTENT_H
+#include <mntent.h>
+#endif
+#if defined(HAVE_SYS_SOCKET_H) && defined(HAVE_SYS_UN_H)
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#ifdef HAVE_STDATOMIC_H
+#include <stdatomic.h>
+#endif
+#if HAVE_DECL_SYS_GETDENTS64 || HAVE_DECL_SYS_IO_URING_SETUP
+#include <sys/syscall.h>
+#endif
+#if defined(HAVE_LINUX_IO_URING_H) && HAVE_DECL_SYS_IO_URING_SETUP && defined(HAVE_STDATOMIC_H)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#endif
 #ifdef __SunOS_5_10
 #include <umem.h>
 #endif
@@ -65,9 +95,28 @@
 #ifndef SMAX
 #define	SMAX 50
 #endif
-#define INIT_MODULE 100
-#define INIT_TAB_SIZE 70
+#define INIT_HASH_SLOTS 128
+#define HASH_SHARDS_PER_THREAD 4
+#define CACHE_LINE 64
+#define WS_INIT_SIZE 256
+#define WS_IDLE_WAIT_NS 2000000L
 #define ERR_BUF_LENGTH 1024
+#define DIRENT_BUF_SIZE (64 * 1024)
+#define DIR_BATCH_INIT_SIZE 4096
+#define URING_MAX_DEPTH 4096
+#define LOG_BUF_SIZE (64 * 1024)
+#define LOG_QUEUE_MAX 64
+#define JOURNAL_BUF_SIZE (64 * 1024)
+#define ROLLBACK_CHUNK 1024
+#define LIST_BATCH_SIZE 256
+#define LIST_QUEUE_FACTOR 4
+#define TUNE_INTERVAL 2
+#define TUNE_TOLERANCE 0.05
+#define TUNE_HOLD 4
+#define STAT_LAT_BUCKETS 20
+#define METRICS_INTERVAL 10
+#define SPILL_KEEP 256
+#define SPILL_CHUNK 64
 
 #define ERROR 2
 #define WARNING 1
@@ -86,42 +135,198 @@
 #define _PATH_DEVNULL "/dev/null"
 #endif
 
+#ifndef DT_UNKNOWN
+#define DT_UNKNOWN 0
+#define DT_REG 8
+#define DT_DIR 4
+#define DT_LNK 10
+#endif
+
 #define	NEWP(type, num)		(type *) malloc((num) * sizeof(type))
 #define	RENEWP(old, type, num)	(type *) realloc((old), (num) * sizeof(type))
 
+/*
+ * statistic counters are written by their thread only and read by the statistic, controller
+ * and metrics threads; with C11 atomics as relaxed loads and stores, which are plain moves
+ */
+#ifdef HAVE_STDATOMIC_H
+typedef atomic_ulong stat_counter_t;
+#define STAT_ADD(c, n) atomic_store_explicit(&(c), atomic_load_explicit(&(c), memory_order_relaxed) + (n), memory_order_relaxed)
+#define STAT_GET(c) atomic_load_explicit(&(c), memory_order_relaxed)
+#else
+typedef unsigned long stat_counter_t;
+#define STAT_ADD(c, n) ((c) += (n))
+#define STAT_GET(c) (c)
+#endif
+#define STAT_INC(c) STAT_ADD(c, 1)
+
+/*
+ * reference count of a queue element whose name other elements continue (bounded mode)
+ */
+#ifdef HAVE_STDATOMIC_H
+typedef atomic_long ref_counter_t;
+#define REF_HOLD(c) atomic_fetch_add_explicit(&(c), 1, memory_order_relaxed)
+#define REF_DROP(c) (atomic_fetch_sub_explicit(&(c), 1, memory_order_acq_rel) == 1)
+#else
+typedef long ref_counter_t;
+#define REF_HOLD(c) ((c)++)
+#define REF_DROP(c) (--(c) == 0)
+#endif
+
+/*
+ * one block per thread, padded so that two threads never write to the same cache line;
+ * latency histograms count calls taking less than 2^i microseconds in bucket i, the last
+ * bucket counts the longer ones
+ */
 struct statistic_counters {
-        unsigned long        filecounter;
-        unsigned long        dircounter;
-        unsigned long        otherscounter;
-        unsigned long        linkcounter;
+        stat_counter_t      filecounter;
+        stat_counter_t      dircounter;
+        stat_counter_t      otherscounter;
+        stat_counter_t      linkcounter;
+        stat_counter_t      lstatcounter;
+        stat_counter_t      lstat_ns;
+        stat_counter_t      lstat_hist[STAT_LAT_BUCKETS];
+        stat_counter_t      chowncounter;
+        stat_counter_t      chown_ns;
+        stat_counter_t      chown_hist[STAT_LAT_BUCKETS];
+        stat_counter_t      hashhits;
+        stat_counter_t      unchangeddirs;
+        stat_counter_t      skippedentries;
+        stat_counter_t      transfers;
+        stat_counter_t      busy_ns;
+        char                pad[CACHE_LINE];
 };
 
+/*
+ * a sample of all counters for the metrics file (option -M), summed over the threads
+ */
+typedef struct metrics_sample {
+    double              elapsed;
+    unsigned long       threads;
+    unsigned long       active;
+    unsigned long       busy;
+    unsigned long       queued_fast;
+    unsigned long       queued_slow;
+    double              speed_fast;
+    double              speed_slow;
+    unsigned long       files;
+    unsigned long       dirs;
+    unsigned long       links;
+    unsigned long       others;
+    unsigned long       lstats;
+    unsigned long       lstat_ns;
+    unsigned long       lstat_hist[STAT_LAT_BUCKETS];
+    unsigned long       chowns;
+    unsigned long       chown_ns;
+    unsigned long       chown_hist[STAT_LAT_BUCKETS];
+    unsigned long       hashhits;
+    unsigned long       unchangeddirs;
+    unsigned long       skippedentries;
+    unsigned long       transfers;
+    unsigned long       busy_ns;
+} metrics_sample_t;
+
+#define METRICS_JSON 0
+#define METRICS_PROMETHEUS 1
+#define OPT_METRICS_FORMAT 256
+#define OPT_METRICS_INTERVAL 257
+#define OPT_QUEUE_MEMORY 258
+#define OPT_SPILL 259
+#define OPT_LATENCY_TARGET 260
+
 typedef struct fs_root {
     char                *dirpath;
+    long                index;
+    short int           skip;
+    char                *device;
+    long                maxthreads;
+    int                 numa;
+    long                group;
+    short int           checked;
+    int                 stat_errno;
+    dev_t               dev;
+    ino_t               ino;
+    char                *canonical;
+    long                maxops;
+    struct rate_bucket  *bucket;
     struct fs_root      *next;
 } fs_root_t;
 
-typedef struct uidexchange {
-    uid_t		  olduid;
-    uid_t		  newuid;
-    struct uidexchange    *next;
-} uidexchange_t;
+typedef struct rate_bucket rate_bucket_t;
 
-typedef struct gidexchange {
-    gid_t		  oldgid;
-    gid_t		  newgid;
-    struct gidexchange    *next;
-} gidexchange_t;
+#define IDMAP_EMPTY  0
+#define IDMAP_DENSE  1
+#define IDMAP_SORTED 2
+#define IDMAP_HASH   3
+
+typedef struct idmap_entry {
+    unsigned int        oldid;
+    unsigned int        newid;
+    unsigned int        seq;
+    char                *oldname;
+    char                *newname;
+} idmap_entry_t;
+
+typedef struct idmap {
+    int                 layout;
+    size_t              count;
+    unsigned int        minid;
+    unsigned int        maxid;
+    size_t              size;
+    unsigned int        shift;
+    unsigned int        *index;
+    idmap_entry_t       *entries;
+} idmap_t;
+
+typedef struct ex_node {
+    const struct ex_node *parent;
+    char                *name;
+    short int           excluded;
+    size_t              children;
+} ex_node_t;
+
+typedef struct dir_batch {
+    size_t              count;
+    size_t              len;
+    size_t              size;
+    char                *buf;
+} dir_batch_t;
 
 typedef struct queue_element {
 	char			*name;
 	long int		dirpos;
         long                    directsubdirs;
 	fs_root_t		*fs;
+	const ex_node_t		*exnode;
+	dir_batch_t		*batch;
 	struct queue_element    *parent;
+	ref_counter_t		refs;
 	struct queue_element    *next;
 } queue_element_t;
 
+#if HAVE_DECL_SYS_GETDENTS64
+struct dirent64_raw {
+    uint64_t            d_ino;
+    int64_t             d_off;
+    unsigned short      d_reclen;
+    unsigned char       d_type;
+    char                d_name[];
+};
+#endif
+
+typedef struct tile_entry {
+    int                 dfd;
+    const char          *dirname;
+    const char          *name;
+    char                *path;
+    size_t              pathlen;
+    short int           pathvalid;
+    unsigned char       d_type;
+    short int           dirty;
+    struct rate_bucket  *bucket;
+    const struct entry_handler *handler;
+} tile_entry_t;
+
 typedef struct queue_anchor {
     long            element_counter;
     double          speed;
@@ -129,24 +334,198 @@ typedef struct queue_anchor {
     queue_element_t *first;
 } queue_anchor_t;
 
+typedef struct dev_group {
+    queue_anchor_t      *anchor;
+    char                *name;
+    long                roots;
+    long                cap;
+    long                busy;
+    int                 numa;
+    char                pad[CACHE_LINE];
+} dev_group_t;
+
+#ifdef HAVE_STDATOMIC_H
+typedef struct ws_array {
+    long                        size;
+    _Atomic(queue_element_t *)  *buf;
+    struct ws_array             *prev;
+} ws_array_t;
+
+typedef struct ws_deque {
+    atomic_long                 top;
+    char                        pad[CACHE_LINE];
+    atomic_long                 bottom;
+    _Atomic(ws_array_t *)       array;
+    char                        pad2[CACHE_LINE];
+} ws_deque_t;
+#endif
+
+#ifdef HAVE_IO_URING
+typedef struct uring {
+    int                 fd;
+    unsigned int        entries;
+    unsigned int        *sq_tail;
+    unsigned int        sq_mask;
+    unsigned int        *sq_array;
+    unsigned int        *cq_head;
+    unsigned int        *cq_tail;
+    unsigned int        cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void                *sq_ring;
+    void                *cq_ring;
+    size_t              sq_ring_size;
+    size_t              cq_ring_size;
+    size_t              sqes_size;
+    const char          **names;
+    unsigned char       *types;
+    struct statx        *stx;
+    int                 *res;
+} uring_t;
+#endif
+
+#define JR_DIR       1
+#define JR_CHANGE    2
+
+typedef struct journal_hdr {
+    char                magic[8];
+    uint32_t            version;
+    uint32_t            bom;
+    uint32_t            recsize;
+    uint32_t            reserved;
+} journal_hdr_t;
+
+typedef struct journal_rec {
+    uint64_t            dirid;
+    uint64_t            dev;
+    uint64_t            ino;
+    uint32_t            olduid;
+    uint32_t            oldgid;
+    uint32_t            newuid;
+    uint32_t            newgid;
+    uint32_t            namelen;
+    uint8_t             type;
+    uint8_t             kind;
+    uint8_t             reserved[2];
+} journal_rec_t;
+
+typedef struct ckpt_slot {
+    queue_anchor_t      *anchor;
+    queue_element_t     *element;
+    long                dirpos;
+} ckpt_slot_t;
+
+typedef int (*journal_cb_t)(const journal_rec_t *rec, const char *dirname, const char *name, void *arg);
+
 struct h_ent {
    ino_t        ino;
    dev_t        dev;
-   struct h_ent *c_link;
 };
 
-struct htab {
-   unsigned int mod;
+struct h_shard {
+   pthread_mutex_t lock;
    unsigned int het_tab_size;
-   unsigned int first_free;
+   unsigned int used;
+   short int    has_zero;
    struct h_ent *het_tab;
-   struct h_ent *hash[1];
+   char         pad[CACHE_LINE];
+};
+
+struct htab {
+   unsigned int   nshards;
+   unsigned int   shift;
+   struct h_shard *shard;
 };
 
 void parsefilelist(const char *file_list_file_name);
 void parseexfilelist(const char *exfile_list_file_name);
+void check_roots(fs_root_t *list, const unsigned long n, const size_t threads);
 void parseuidlist(const char *uid_list_file_name);
-void h_init(const unsigned int mod, const unsigned int het_tab_size);
+void exclude_build(const fs_root_t *list);
+const ex_node_t *exclude_root(const char *path, short int *excluded);
+const ex_node_t *exclude_dir(const char *path, short int *excluded);
+const ex_node_t *exclude_below(const char *path, const size_t from, short int *excluded);
+const ex_node_t *exclude_child(const ex_node_t *dir, const char *name);
+short int exclude_entry(const ex_node_t *dir, const char *dirname, const char *name);
+void exclude_free(void);
+const char *dev_key(const fs_root_t *ptr, char *key, const size_t size);
+dev_group_t *dev_groups(fs_root_t *list, const size_t numthr, long *ngroups);
+long dev_home(const unsigned int tid);
+void dev_pin(const int node);
+void dev_free(dev_group_t *groups, const long n);
+typedef void (*apply_fn_t)(const unsigned int tid, tile_entry_t *te, const struct stat *statbuf, const char *type, const idmap_entry_t *uptr, const idmap_entry_t *gptr);
+#ifdef HAVE_STDATOMIC_H
+void apply_init(const size_t nthreads, const size_t producers, const unsigned int base, const short int fdrelative, const apply_fn_t *fn);
+void apply_queue(const unsigned int tid, const tile_entry_t *te, const struct stat *statbuf, const char *type, const idmap_entry_t *uptr, const idmap_entry_t *gptr);
+void apply_flush(const unsigned int tid);
+unsigned long apply_close(unsigned long *waits);
+#endif
+long rate_init(fs_root_t *list, const size_t numthr, const long ops, const unsigned long target_ns);
+rate_bucket_t *rate_of(const fs_root_t *fs);
+void rate_take(const unsigned int tid, rate_bucket_t *b, const unsigned long n);
+void rate_latency(const unsigned int tid, rate_bucket_t *b, const unsigned long ns);
+short int rate_summary(const long i, char *msg, const size_t len);
+void rate_free(fs_root_t *list);
+unsigned long prescan_roots(fs_root_t *list, const idmap_t *umap, const idmap_t *gmap);
+void idmap_build(idmap_t *map, idmap_entry_t *entries, size_t count, const char *kind);
+const idmap_entry_t *idmap_lookup(const idmap_t *map, const unsigned int oldid);
+const char *idmap_layout_name(const idmap_t *map);
+void idmap_free(idmap_t *map);
+void slab_init(const size_t n);
+void slab_destroy(void);
+void *slab_alloc(const unsigned int cache, const size_t size);
+void slab_free(const unsigned int cache, void *ptr);
+char *slab_strdup(const unsigned int cache, const char *s);
+#ifdef HAVE_STDATOMIC_H
+void ws_init(ws_deque_t *dq, const long size);
+void ws_destroy(ws_deque_t *dq);
+void ws_push(ws_deque_t *dq, queue_element_t *qe);
+queue_element_t *ws_take(ws_deque_t *dq);
+queue_element_t *ws_steal(ws_deque_t *dq);
+long ws_size(ws_deque_t *dq);
+#endif
+#ifdef HAVE_IO_URING
+int uring_init(uring_t *r, const unsigned int entries);
+void uring_free(uring_t *r);
+int uring_statx(uring_t *r, const int dfd, const unsigned int n);
+void statx_to_stat(const struct statx *stx, struct stat *statbuf);
+#endif
+void log_init(const size_t n);
+void log_register(const unsigned int slot);
+short int log_active(void);
+void log_put(const char *level, const char *emsg);
+void log_shutdown(void);
+void journal_open(const char *path, const size_t n, const short int append);
+void journal_change(const unsigned int tid, const char *dirname, const char *name, const struct stat *statbuf, const uid_t newuid, const gid_t newgid, const char kind);
+void journal_close(void);
+int journal_read(const char *path, journal_cb_t cb, void *arg);
+int journal_dump(const char *path);
+int rollback(const char *path, pthread_t *threads, size_t *taskids, const size_t n, const short int dryrun);
+void rollback_stop(void);
+int ckpt_begin(const char *path, const unsigned long nroots);
+void ckpt_add(const queue_element_t *qe, const long dirpos);
+void ckpt_add_anchor(const queue_anchor_t *anchor);
+long ckpt_commit(const char *path);
+long ckpt_load(const char *path, const unsigned long nroots, const unsigned int cache, queue_anchor_t *anchor);
+void spill_open(const char *dir);
+short int spill_put(const queue_element_t *qe);
+char *spill_get(long *fs, long *dirpos);
+long spill_count(void);
+void spill_scan(void (*fn)(const long fs, const long dirpos, const char *name));
+unsigned long spill_close(void);
+void dirindex_open(const char *path, const size_t numthr, const idmap_t *umap, const idmap_t *gmap, const fs_root_t *exlist);
+short int dirindex_unchanged(const struct stat *st);
+void dirindex_add(const unsigned int tid, const struct stat *st, const struct timespec *seen, const short int clean);
+unsigned long dirindex_close(const short int complete);
+void report_init(const size_t numthr);
+void report_add(const unsigned int tid, const struct stat *statbuf, const char type, const unsigned long chowns);
+void report_write(FILE *fp, const idmap_t *umap, const idmap_t *gmap, const double elapsed, const unsigned long lstats, const unsigned long lstat_ns, const size_t threads);
+void metrics_open(const char *target, const int format);
+void metrics_write(const metrics_sample_t *m);
+void metrics_close(void);
+void h_init(const unsigned int nshards, const unsigned int slots);
+void h_free(void);
+void h_usage(unsigned long *entries, unsigned long *slots, unsigned long *bytes);
 short int h_mins(const ino_t , const dev_t);
 queue_anchor_t *deq_init(void);
 queue_element_t *deq_get(queue_anchor_t *anchor);
@@ -154,9 +533,12 @@ void deq_put(queue_anchor_t *anchor, queue_element_t *new);
 void deq_push(queue_anchor_t *anchor, queue_element_t *new);
 void deq_append(queue_anchor_t *global, queue_anchor_t *local);
 void deq_prepend(queue_anchor_t *global, queue_anchor_t *local);
+void deq_take(queue_anchor_t *local, queue_anchor_t *taken, long count, const short int from_last);
 long get_max_openfiles(void);
 size_t get_pwd_buffer_size(void);
 size_t get_grp_buffer_size(void);
 void safe_descriptor(void);
 unsigned char *mk_esc_seq(char *string, unsigned char escchar, unsigned char *ret_string);
 void print_error(const int severity, const char *emsg);
+void print_error_r(const int severity, const char *emsg);
+void print_errno_r(const int severity, const int errnum, const char *what, const char *path);
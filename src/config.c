@@ -24,103 +24,259 @@ extern char                 *logdir;
 extern fs_root_t            *begin_fs_list;
 extern double               busythreshold;
 extern fs_root_t             *begin_exclude_file;
-extern uidexchange_t        *begin_uidpair;
-extern gidexchange_t        *begin_gidpair;
+extern idmap_t              uidmap;
+extern idmap_t              gidmap;
 
-static void 
-        append (const char *dirpath) {
+static void
+        root_options(char *line, char **device, long *maxthreads, int *numa, long *maxops) {
 
 /*
  * Description:
- * Appends a file system to the file system list.
+ * Strips the per-root options dev=<name>, threads=<n>, numa=<node> and ops=<n> from the end of
+ * a line of the directory file.
  *
  * Parameters:
- * dirpath:      path of file system root which has to be scanned
+ * line:         line of the directory file, the path is left in it
+ * device:       set to the device name (strdup'ed) or NULL
+ * maxthreads:   set to the maximal number of threads for the device or 0
+ * numa:         set to the NUMA node for the threads of the device or -1
+ * maxops:       set to the budget of stat and chown operations per second for the device or 0
  *
  */
-    fs_root_t	*ptr, *ptrtmp;
-    
-    if (begin_fs_list == NULL) {
-        if((begin_fs_list = (fs_root_t *) malloc(sizeof(fs_root_t))) == NULL) {
-                fprintf(stderr, "ERROR: No memory available for begin\n");
+    char    *token;
+    size_t  len;
+
+    *device = NULL;
+    *maxthreads = 0;
+    *numa = -1;
+    *maxops = 0;
+    for (;;) {
+        for (len = strlen(line); len > 0 && isspace((unsigned char) line[len - 1]); len--)
+            ;
+        line[len] = '\0';
+        for (token = line + len; token > line && !isspace((unsigned char) token[-1]); token--)
+            ;
+        if (token == line)
+            break;
+        if (strncmp(token, "dev=", 4) == 0 && token[4] != '\0') {
+            free(*device);
+            if ((*device = strdup(token + 4)) == NULL) {
+                fprintf(stderr, "ERROR: No memory available for device name\n");
                 exit(ENOMEM);
-        }
-        if ((begin_fs_list->dirpath = strdup(dirpath)) == NULL) {
-            fprintf(stderr, "ERROR: No memory available for dirpath entry\n");
-            exit(ENOMEM);
-        }
-        begin_fs_list->next = NULL;
-    } else {
-        ptr = begin_fs_list;
-        while (ptr != NULL) {
-            if (strcmp(ptr->dirpath, dirpath) != 0) {
-                ptrtmp = ptr;
-                ptr = ptr->next;
-            } else {
-                fprintf(stderr, "WARNING: Duplicate directory/file name: %s!\n", dirpath);
-                return;
             }
+        } else if (strncmp(token, "threads=", 8) == 0) {
+            if (sscanf(token + 8, "%ld", maxthreads) != 1 || *maxthreads < 1) {
+                fprintf(stderr, "ERROR: Invalid thread count <%s> in directory file!\n", token);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(token, "numa=", 5) == 0) {
+            if (sscanf(token + 5, "%d", numa) != 1 || *numa < 0) {
+                fprintf(stderr, "ERROR: Invalid NUMA node <%s> in directory file!\n", token);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(token, "ops=", 4) == 0) {
+            if (sscanf(token + 4, "%ld", maxops) != 1 || *maxops < 1) {
+                fprintf(stderr, "ERROR: Invalid operation budget <%s> in directory file!\n", token);
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            break;
         }
+        *token = '\0';
+    }
+}
 
-        if ((ptrtmp->next = (fs_root_t *) malloc(sizeof(fs_root_t))) == NULL) {
-                fprintf(stderr, "ERROR: No memory available for new list element\n");
-                exit(ENOMEM);
-        }
-        ptr = ptrtmp->next;
-        if ((ptr->dirpath = strdup(dirpath)) == NULL) {
-            fprintf(stderr, "ERROR: No memory available for dirpath entry\n");
+typedef struct path_set {
+    fs_root_t           **slots;
+    size_t              size;
+    size_t              count;
+} path_set_t;
+
+static path_set_t           fs_set = { NULL, 0, 0 };
+static path_set_t           ex_set = { NULL, 0, 0 };
+static fs_root_t            *fs_tail = NULL;
+static fs_root_t            *ex_tail = NULL;
+
+static size_t
+        path_hash(const char *path) {
+
+/*
+ * Description:
+ * FNV-1a hash of a path.
+ *
+ */
+    unsigned long long  h = 0xCBF29CE484222325ULL;
+
+    for (; *path != '\0'; path++) {
+        h ^= (unsigned char) *path;
+        h *= 0x100000001B3ULL;
+    }
+    return (size_t) (h ^ (h >> 32));
+}
+
+static fs_root_t **
+        path_slot(path_set_t *set, const char *path) {
+
+/*
+ * Description:
+ * Returns the slot of a path in a set of list elements: the slot holding the element with
+ * this path or the free slot it belongs to.
+ *
+ */
+    size_t  i = path_hash(path) & (set->size - 1);
+
+    while (set->slots[i] != NULL && strcmp(set->slots[i]->dirpath, path) != 0)
+        i = (i + 1) & (set->size - 1);
+    return &set->slots[i];
+}
+
+static short int
+        path_seen(path_set_t *set, const char *path) {
+
+/*
+ * Description:
+ * Returns 1 if a list element with this path is in the set already, 0 otherwise.
+ *
+ */
+    return (set->size > 0 && *path_slot(set, path) != NULL);
+}
+
+static void
+        path_insert(path_set_t *set, fs_root_t *ptr) {
+
+/*
+ * Description:
+ * Adds a list element to the set of its list, doubling the set at a load of 1/2.
+ *
+ */
+    fs_root_t   **old = set->slots;
+    size_t      oldsize = set->size, i;
+
+    if (2 * (set->count + 1) > set->size) {
+        set->size = (oldsize == 0) ? 256 : 2 * oldsize;
+        if ((set->slots = (fs_root_t **) calloc(set->size, sizeof (fs_root_t *))) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for path set\n");
             exit(ENOMEM);
         }
-        ptr->next = NULL;
+        for (i = 0; i < oldsize; i++) {
+            if (old[i] != NULL)
+                *path_slot(set, old[i]->dirpath) = old[i];
+        }
+        free(old);
+    }
+    *path_slot(set, ptr->dirpath) = ptr;
+    set->count++;
+}
+
+static void
+        path_set_free(path_set_t *set) {
+
+    free(set->slots);
+    set->slots = NULL;
+    set->size = set->count = 0;
+}
+
+static void
+        normalize_path(char *path) {
+
+/*
+ * Description:
+ * Removes repeated and trailing slashes from a path, so that the same directory is written
+ * the same way for the duplicate and nesting checks.
+ *
+ */
+    char    *src, *dst;
+
+    for (src = dst = path; *src != '\0'; src++) {
+        if (*src == '/' && dst > path && dst[-1] == '/')
+            continue;
+        *dst++ = *src;
+    }
+    if (dst > path + 1 && dst[-1] == '/')
+        dst--;
+    *dst = '\0';
+}
+
+static fs_root_t *
+        list_add(fs_root_t **begin, fs_root_t **tail, path_set_t *set, const char *dirpath) {
+
+/*
+ * Description:
+ * Appends a new element to the end of the root or the exclude list. Duplicates are found
+ * through the hash set of the list.
+ *
+ * Return value:
+ * new list element, NULL if the list holds dirpath already
+ *
+ */
+    fs_root_t	*ptr;
+
+    if (path_seen(set, dirpath)) {
+        fprintf(stderr, "WARNING: Duplicate directory/file name: %s!\n", dirpath);
+        return NULL;
     }
+    if ((ptr = (fs_root_t *) calloc(1, sizeof(fs_root_t))) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for new list element\n");
+        exit(ENOMEM);
+    }
+    if ((ptr->dirpath = strdup(dirpath)) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for dirpath entry\n");
+        exit(ENOMEM);
+    }
+    ptr->index = (*tail != NULL) ? (*tail)->index + 1 : 0;
+    ptr->skip = 0;
+    ptr->device = NULL;
+    ptr->numa = -1;
+    ptr->next = NULL;
+    if (*tail != NULL)
+        (*tail)->next = ptr;
+    else
+        *begin = ptr;
+    *tail = ptr;
+    path_insert(set, ptr);
+    return ptr;
 }
 
 static void 
-        appendex (const char *filename) {
+        append (const char *dirpath, char *device, const long maxthreads, const int numa, const long maxops) {
 
 /*
  * Description:
  * Appends a file system to the file system list.
  *
  * Parameters:
- * filename:     path of file system root which has to be exluded
+ * dirpath:      path of file system root which has to be scanned
+ * device:       device name for per-device queues (taken over) or NULL
+ * maxthreads:   maximal number of threads for the device or 0
+ * numa:         NUMA node for the threads of the device or -1
+ * maxops:       budget of stat and chown operations per second for the device or 0
  *
  */
-    fs_root_t	*ptr, *ptrtmp;
-    
-    if (begin_exclude_file == NULL) {
-        if((begin_exclude_file = (fs_root_t *) malloc(sizeof(fs_root_t))) == NULL) {
-                fprintf(stderr, "ERROR: No memory available for begin\n");
-                exit(ENOMEM);
-        }
-        if ((begin_exclude_file->dirpath = strdup(filename)) == NULL) {
-            fprintf(stderr, "ERROR: No memory available for dirpath entry\n");
-            exit(ENOMEM);
-        }
-        begin_exclude_file->next = NULL;
-    } else {
-        ptr = begin_exclude_file;
-        while (ptr != NULL) {
-            if (strcmp(ptr->dirpath, filename) != 0) {
-                ptrtmp = ptr;
-                ptr = ptr->next;
-            } else {
-                fprintf(stderr, "WARNING: Duplicate directory/file name: %s!\n", filename);
-                return;
-            }
-        }
+    fs_root_t	*ptr;
 
-        if ((ptrtmp->next = (fs_root_t *) malloc(sizeof(fs_root_t))) == NULL) {
-                fprintf(stderr, "ERROR: No memory available for new list element\n");
-                exit(ENOMEM);
-        }
-        ptr = ptrtmp->next;
-        if ((ptr->dirpath = strdup(filename)) == NULL) {
-            fprintf(stderr, "ERROR: No memory available for dirpath entry\n");
-            exit(ENOMEM);
-        }
-        ptr->next = NULL;
+    if ((ptr = list_add(&begin_fs_list, &fs_tail, &fs_set, dirpath)) == NULL) {
+        free(device);
+        return;
     }
+    ptr->device = device;
+    ptr->maxthreads = maxthreads;
+    ptr->numa = numa;
+    ptr->maxops = maxops;
+    ptr->group = 0;
+}
+
+static void 
+        appendex (const char *filename) {
+
+/*
+ * Description:
+ * Appends a file system to the file system list.
+ *
+ * Parameters:
+ * filename:     path of file system root which has to be exluded
+ *
+ */
+    list_add(&begin_exclude_file, &ex_tail, &ex_set, filename);
 }
 
 void
@@ -137,6 +293,10 @@ void
     char            *lbuf = NULL; /* line buffer */
     FILE            *fp;
     size_t          max_line;
+    char            *device = NULL;
+    long            maxthreads = 0;
+    int             numa = -1;
+    long            maxops = 0;
 
 #ifdef _WIN32    
     max_line = (size_t) 1000;
@@ -164,7 +324,9 @@ void
            
         if (strlen(lbuf) < NAME_MAX) {
 	    lbuf[strcspn(lbuf, "\n")] = '\0';
-            append(lbuf);
+            root_options(lbuf, &device, &maxthreads, &numa, &maxops);
+            normalize_path(lbuf);
+            append(lbuf, device, maxthreads, numa, maxops);
         } else {
 	    fprintf(stderr, "ERROR: Directory path <%s> longer than allowed by system!\n", lbuf);
             exit(E2BIG);
@@ -172,6 +334,7 @@ void
     }
     free(lbuf);
     lbuf = NULL;
+    path_set_free(&fs_set);
     
     fclose(fp);
     
@@ -235,6 +398,7 @@ void
     }
     free(lbuf);
     lbuf = NULL;
+    path_set_free(&ex_set);
     
     fclose(fp);
     
@@ -247,94 +411,37 @@ void
 	    ptr = ptr->next;
 	}
     }
+    exclude_build(begin_exclude_file);
 }
 
-void
-	uid_list (uid_t olduid, uid_t newuid) {
-/*
- * Description:
- * Creates a mapping list of old uid's and their corresponding new uid
- *
- * Parameters:
- * olduid: old uid
- * newuid: new uid
- *
- */
-    uidexchange_t    *ptr, *ptrtmp;
-
-
-    if (begin_uidpair == NULL ) {
-	if ((begin_uidpair = (uidexchange_t *) malloc(sizeof(uidexchange_t))) == NULL) {
-	    fprintf(stderr, "ERROR: No memory available for begin of mapping list\n");
-	    exit(ENOMEM);
-	}
-	begin_uidpair->olduid = olduid;
-	begin_uidpair->newuid = newuid;
-	begin_uidpair->next = NULL;
-    } else {
-	ptr = begin_uidpair;
-	while (ptr != NULL) {
-            if (ptr->olduid != olduid) {
-                ptrtmp = ptr;
-                ptr = ptr->next;
-            } else {
-                fprintf(stderr, "WARNING: Duplicate old uid: %d!\n", olduid);
-                return;
-            }
-        }
-	if ((ptrtmp->next = (uidexchange_t *) malloc(sizeof(uidexchange_t))) == NULL) {
-	    fprintf(stderr, "ERROR: No memory available for begin of mapping list\n");
-	    exit(ENOMEM);
-	}
-	ptr = ptrtmp->next;
-	ptr->olduid = olduid;
-	ptr->newuid = newuid;
-	ptr->next = NULL;
-    }
-}
-	
-void
-	gid_list (gid_t oldgid, gid_t newgid) {
+static void
+	id_list (idmap_entry_t **list, size_t *count, size_t *size, unsigned int oldid, unsigned int newid) {
 /*
  * Description:
- * Creates a mapping list of old uid's and their corresponding new uid and gid (optional)
+ * Appends a 2-tuple of old id and corresponding new id to a mapping list. Duplicates are
+ * detected when the list is compiled into its lookup table.
  *
  * Parameters:
- * oldgid: old gid
- * newgid: new gid
+ * list:   mapping list
+ * count:  number of 2-tuples in list
+ * size:   allocated number of 2-tuples
+ * oldid:  old uid/gid
+ * newid:  new uid/gid
  *
  */
-    gidexchange_t    *ptr, *ptrtmp;
-
-
-    if (begin_gidpair == NULL ) {
-	if ((begin_gidpair = (gidexchange_t *) malloc(sizeof(gidexchange_t))) == NULL) {
-	    fprintf(stderr, "ERROR: No memory available for begin of mapping list\n");
-	    exit(ENOMEM);
-	}
-	begin_gidpair->oldgid = oldgid;
-	begin_gidpair->newgid = newgid;
-	begin_gidpair->next = NULL;
-    } else {
-	ptr = begin_gidpair;
-	while (ptr != NULL) {
-            if (ptr->oldgid != oldgid) {
-                ptrtmp = ptr;
-                ptr = ptr->next;
-            } else {
-                fprintf(stderr, "WARNING: Duplicate old gid: %d!\n", oldgid);
-                return;
-            }
-        }
-	if ((ptrtmp->next = (gidexchange_t *) malloc(sizeof(gidexchange_t))) == NULL) {
-	    fprintf(stderr, "ERROR: No memory available for begin of mapping list\n");
+    if (*count >= *size) {
+	*size = (*size > 0) ? 2 * *size : 64;
+	if ((*list = (idmap_entry_t *) realloc(*list, sizeof(idmap_entry_t) * *size)) == NULL) {
+	    fprintf(stderr, "ERROR: No memory available for mapping list\n");
 	    exit(ENOMEM);
 	}
-	ptr = ptrtmp->next;
-	ptr->oldgid = oldgid;
-	ptr->newgid = newgid;
-	ptr->next = NULL;
     }
+    (*list)[*count].oldid = oldid;
+    (*list)[*count].newid = newid;
+    (*list)[*count].seq = (unsigned int) *count;
+    (*list)[*count].oldname = NULL;
+    (*list)[*count].newname = NULL;
+    (*count)++;
 }
 	
 int
@@ -380,6 +487,9 @@ void
     int		    items_read = 0;
     int		    linenumber = 0;
     const int	    tag_length = 2;
+    idmap_entry_t   *ulist = NULL, *glist = NULL;
+    size_t	    ucount = 0, usize = 0, gcount = 0, gsize = 0;
+    size_t	    i;
 
 #ifdef _WIN32
     max_line = (size_t) 1000;
@@ -412,9 +522,9 @@ void
 	items_read = sscanf(lbuf, "%2[ug:]%u%*[, \t]%u", tag, &oldid, &newid);
 	tag[strcspn(tag, ":")] = '\0';
 	if (strcmpi(tag, "u") == 0 && items_read == 3) {
-	    uid_list(oldid, newid);
+	    id_list(&ulist, &ucount, &usize, oldid, newid);
 	} else if (strcmpi(tag, "g") == 0 && items_read == 3) {
-	    gid_list(oldid, newid);
+	    id_list(&glist, &gcount, &gsize, oldid, newid);
 	} else {
 	    fprintf(stderr, "ERROR:  Mangled input line\n");
 	    fprintf(stderr, "<%s>\t LINE: %d\n", lbuf, linenumber);
@@ -433,20 +543,227 @@ void
     free(tag);
     tag = NULL;
 
+    idmap_build(&uidmap, ulist, ucount, "uid");
+    idmap_build(&gidmap, glist, gcount, "gid");
+
     if (verbose) {
-        
-        uidexchange_t	*uptr = begin_uidpair;
-	fprintf(stdout, "INFO: Old uid, new uid\n");
-	while (uptr != NULL) {
-	    fprintf(stdout, "%u, %u\n", uptr->olduid, uptr->newuid);
-	    uptr = uptr->next;
-	}
+	fprintf(stdout, "INFO: Old uid, new uid (%s)\n", idmap_layout_name(&uidmap));
+	for (i = 0; i < uidmap.count; i++)
+	    fprintf(stdout, "%u, %u\n", uidmap.entries[i].oldid, uidmap.entries[i].newid);
 
-        gidexchange_t	*gptr = begin_gidpair;
-	fprintf(stdout, "INFO: Old gid, new gid\n");
-	while (gptr != NULL) {
-	    fprintf(stdout, "%u, %u\n", gptr->oldgid, gptr->newgid);
-	    gptr = gptr->next;
-	}
+	fprintf(stdout, "INFO: Old gid, new gid (%s)\n", idmap_layout_name(&gidmap));
+	for (i = 0; i < gidmap.count; i++)
+	    fprintf(stdout, "%u, %u\n", gidmap.entries[i].oldid, gidmap.entries[i].newid);
+    }
+}
+
+static pthread_mutex_t      thr_check = PTHREAD_MUTEX_INITIALIZER;
+static fs_root_t            **check_list = NULL;
+static unsigned long        check_count = 0;
+static unsigned long        check_next = 0;
+
+static void *
+        check_worker(void *arg) {
+
+/*
+ * Description:
+ * Calls lstat and realpath for the roots in check_list until all of them are done. On
+ * network file systems every lstat of a root is a round trip, so the roots are checked by
+ * several of these threads at the same time.
+ *
+ */
+    struct stat     statbuf;
+    fs_root_t       *ptr;
+    unsigned long   i;
+
+    for (;;) {
+        pthread_mutex_lock(&thr_check);
+        i = check_next++;
+        pthread_mutex_unlock(&thr_check);
+        if (i >= check_count)
+            break;
+        ptr = check_list[i];
+        errno = 0;
+        if (lstat(ptr->dirpath, &statbuf) == 0) {
+            ptr->stat_errno = 0;
+            ptr->dev = statbuf.st_dev;
+            ptr->ino = statbuf.st_ino;
+            ptr->canonical = realpath(ptr->dirpath, NULL);
+        } else {
+            ptr->stat_errno = (errno != 0) ? errno : ENOENT;
+        }
+        ptr->checked = 1;
+    }
+    return arg;
+}
+
+static int
+        check_cmp_inode(const void *a, const void *b) {
+
+    const fs_root_t *x = *(const fs_root_t * const *) a;
+    const fs_root_t *y = *(const fs_root_t * const *) b;
+
+    if (x->dev != y->dev)
+        return (x->dev < y->dev) ? -1 : 1;
+    if (x->ino != y->ino)
+        return (x->ino < y->ino) ? -1 : 1;
+    return (x->index < y->index) ? -1 : (x->index > y->index);
+}
+
+static int
+        check_cmp_path(const void *a, const void *b) {
+
+/*
+ * Description:
+ * Orders paths with '/' before every other character, so that the subdirectories of a path
+ * directly follow it: "/a", "/a/b", "/a-b" instead of "/a", "/a-b", "/a/b".
+ *
+ */
+    const unsigned char *x = (const unsigned char *) (*(const fs_root_t * const *) a)->canonical;
+    const unsigned char *y = (const unsigned char *) (*(const fs_root_t * const *) b)->canonical;
+
+    for (; *x != '\0' && *x == *y; x++, y++)
+        ;
+    if (*x == *y)
+        return 0;
+    if (*x == '/' || *y == '/')
+        return (*x == '/') ? ((*y == '\0') ? 1 : -1) : ((*x == '\0') ? -1 : 1);
+    return (*x < *y) ? -1 : 1;
+}
+
+static short int
+        check_nested(const char *outer, const char *inner) {
+
+/*
+ * Description:
+ * Returns 1 if the path inner lies within the path outer, 0 otherwise. Both are normalized.
+ *
+ */
+    size_t  len = strlen(outer);
+
+    return (strncmp(outer, inner, len) == 0 && inner[len] != '\0' && (inner[len] == '/' || (len > 0 && outer[len - 1] == '/')));
+}
+
+static void
+        check_skip(fs_root_t *ptr, const char *why, const fs_root_t *other) {
+
+    size_t  len = strlen(ptr->dirpath) + strlen(other->dirpath) + strlen(why) + 24;
+    char    *msg;
+
+    if ((msg = (char *) malloc(sizeof(char) * len)) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for message string\n");
+        exit(ENOMEM);
+    }
+    snprintf(msg, len, "<%s> %s <%s>, skipped", ptr->dirpath, why, other->dirpath);
+    print_error(WARNING, msg);
+    if (verbose)
+        fprintf(stdout, "WARNING: %s\n", msg);
+    free(msg);
+    ptr->skip = 1;
+}
+
+void
+        check_roots(fs_root_t *list, const unsigned long n, const size_t threads) {
+
+/*
+ * Description:
+ * Checks the roots before the scan: lstat is called for all of them by up to threads threads
+ * in parallel, the results are kept in the roots for queueing them and for the device groups.
+ * Of several roots which are the same directory (same device and inode, e.g. through a
+ * symbolic link) and of roots lying within another root only the first, respectively the
+ * outer one is kept, the others are marked to be skipped; otherwise their subtrees would be
+ * scanned twice. Roots which can't be stat'ed or are excluded don't hide other roots, and
+ * neither does a root whose traversal wouldn't reach the other one because of an exclusion.
+ *
+ * Parameters:
+ * list:        list of roots
+ * n:           number of roots in list
+ * threads:     maximal number of threads for the lstat calls
+ *
+ */
+    pthread_t       *tids = NULL;
+    fs_root_t       **valid, **encl, *ptr, *outer;
+    unsigned long   i, j, nthr, nvalid = 0, n_canon, depth, started;
+    short int       excluded;
+
+    if (n == 0)
+        return;
+    if ((check_list = (fs_root_t **) malloc(n * sizeof(fs_root_t *))) == NULL ||
+        (valid = (fs_root_t **) malloc(n * sizeof(fs_root_t *))) == NULL ||
+        (encl = (fs_root_t **) malloc(n * sizeof(fs_root_t *))) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for root check\n");
+        exit(ENOMEM);
+    }
+    for (i = 0, ptr = list; ptr != NULL && i < n; ptr = ptr->next) {
+        if (!ptr->skip)
+            check_list[i++] = ptr;
+    }
+    check_count = i;
+    check_next = 0;
+    nthr = (threads < check_count) ? threads : check_count;
+    if (nthr > 1 && (tids = (pthread_t *) malloc(nthr * sizeof(pthread_t))) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for root check\n");
+        exit(ENOMEM);
+    }
+    for (started = 0; nthr > 1 && started < nthr; started++) {
+        if (pthread_create(&tids[started], NULL, check_worker, NULL) != 0)
+            break;
+    }
+/*
+ * the main thread checks roots as well, so the check is complete even if no thread started
+ */
+    check_worker(NULL);
+    for (i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+    if (verbose)
+        fprintf(stdout, "INFO: %lu roots checked by %lu threads\n", check_count, (started > 0) ? started : 1);
+
+    for (i = 0; i < check_count; i++) {
+        ptr = check_list[i];
+        excluded = 0;
+        exclude_root(ptr->dirpath, &excluded);
+        if (ptr->stat_errno == 0 && !excluded)
+            valid[nvalid++] = ptr;
+    }
+    qsort(valid, nvalid, sizeof(fs_root_t *), check_cmp_inode);
+    for (i = 1, outer = (nvalid > 0) ? valid[0] : NULL; i < nvalid; i++) {
+        if (valid[i]->dev == outer->dev && valid[i]->ino == outer->ino)
+            check_skip(valid[i], "is the same directory as", outer);
+        else
+            outer = valid[i];
+    }
+/*
+ * nesting is decided on the canonical paths, which contain no symbolic links a traversal
+ * wouldn't follow; in this order the roots within a root directly follow it
+ */
+    for (i = 0, n_canon = 0; i < nvalid; i++) {
+        if (!valid[i]->skip && valid[i]->canonical != NULL)
+            valid[n_canon++] = valid[i];
+    }
+    qsort(valid, n_canon, sizeof(fs_root_t *), check_cmp_path);
+/*
+ * encl holds the kept roots enclosing the current one, innermost last; a root within one of
+ * them is skipped unless it lies below an excluded directory of each, seen from that root
+ */
+    for (i = 0, depth = 0; i < n_canon; i++) {
+        while (depth > 0 && strcmp(encl[depth - 1]->canonical, valid[i]->canonical) != 0 &&
+               !check_nested(encl[depth - 1]->canonical, valid[i]->canonical))
+            depth--;
+        if (depth > 0 && strcmp(encl[depth - 1]->canonical, valid[i]->canonical) == 0) {
+            check_skip(valid[i], "is the same directory as", encl[depth - 1]);
+            continue;
+        }
+        for (j = depth, excluded = 1; j > 0 && excluded; j--)
+            exclude_below(valid[i]->canonical, strlen(encl[j - 1]->canonical), &excluded);
+        if (!excluded) {
+            check_skip(valid[i], "lies within root", encl[j]);
+            continue;
+        }
+        encl[depth++] = valid[i];
     }
+    free(encl);
+    free(valid);
+    free(check_list);
+    check_list = NULL;
 }
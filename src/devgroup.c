@@ -0,0 +1,238 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * device groups for per-device work queues (option -D)
+ *
+ * The roots are grouped by device: by the dev= key given for them in the directory file, or
+ * else by the device number of the root. Every group has a deq of its own and a cap on the
+ * number of threads working on it at the same time (threads= in the directory file, default
+ * all threads). Each thread gets a home group: the threads are dealt out round robin to the
+ * groups which haven't reached their cap yet. A group may name a NUMA node (numa=); the threads
+ * of such a group are bound to the CPUs of that node.
+ */
+
+#define _GNU_SOURCE
+#include "chuid.h"
+
+extern short int        verbose;
+
+static long             *homes = NULL;
+
+static long
+        dev_find(dev_group_t *groups, const long n, const char *name) {
+
+    long    i;
+
+    for (i = 0; i < n; i++) {
+        if (strcmp(groups[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+const char *
+        dev_key(const fs_root_t *ptr, char *key, const size_t size) {
+
+/*
+ * Description:
+ * Returns the device name of a root: its dev= key, else its device number formatted into key.
+ *
+ */
+    struct stat statbuf;
+
+    if (ptr->device != NULL)
+        return ptr->device;
+    if (ptr->checked && ptr->stat_errno == 0) {
+        snprintf(key, size, "dev %llu", (unsigned long long) ptr->dev);
+        return key;
+    }
+    if (!ptr->checked && lstat(ptr->dirpath, &statbuf) == 0) {
+        snprintf(key, size, "dev %llu", (unsigned long long) statbuf.st_dev);
+        return key;
+    }
+    return "unknown";
+}
+
+dev_group_t *
+        dev_groups(fs_root_t *list, const size_t numthr, long *ngroups) {
+
+/*
+ * Description:
+ * Builds the device groups of the roots and assigns the home groups of the threads.
+ *
+ * Parameters:
+ * list:        list of roots; the group of each root is stored in its group field
+ * numthr:      number of worker threads
+ * ngroups:     set to the number of groups
+ *
+ * Return value:
+ * array of ngroups device groups
+ *
+ */
+    dev_group_t *groups = NULL, *g;
+    fs_root_t   *ptr;
+    char        key[64];
+    const char  *name;
+    long        n = 0, size = 0, g_idx, tries, *count = NULL;
+    size_t      i;
+
+    for (ptr = list; ptr != NULL; ptr = ptr->next) {
+        name = dev_key(ptr, key, sizeof (key));
+        if ((g_idx = dev_find(groups, n, name)) < 0) {
+            if (n >= size) {
+                size = (size == 0) ? 8 : 2 * size;
+                if ((groups = (dev_group_t *) realloc(groups, size * sizeof (dev_group_t))) == NULL) {
+                    fprintf(stderr, "ERROR: No memory available for device groups\n");
+                    exit(ENOMEM);
+                }
+            }
+            g = &groups[n];
+            memset(g, 0, sizeof (dev_group_t));
+            if ((g->name = strdup(name)) == NULL) {
+                fprintf(stderr, "ERROR: No memory available for device groups\n");
+                exit(ENOMEM);
+            }
+            g->anchor = deq_init();
+            g->numa = -1;
+            g_idx = n++;
+        }
+        g = &groups[g_idx];
+        if (ptr->maxthreads > g->cap)
+            g->cap = ptr->maxthreads;
+        if (ptr->numa >= 0 && g->numa < 0)
+            g->numa = ptr->numa;
+        g->roots++;
+        ptr->group = g_idx;
+    }
+    if (n == 0) {
+/*
+ * no roots (path list or resumed scan without roots): one group for everything
+ */
+        if ((groups = (dev_group_t *) calloc(1, sizeof (dev_group_t))) == NULL ||
+            (groups[0].name = strdup("default")) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for device groups\n");
+            exit(ENOMEM);
+        }
+        groups[0].anchor = deq_init();
+        groups[0].numa = -1;
+        n = 1;
+    }
+    for (g_idx = 0; g_idx < n; g_idx++) {
+        if (groups[g_idx].cap <= 0 || groups[g_idx].cap > (long) numthr)
+            groups[g_idx].cap = (long) numthr;
+    }
+    if ((homes = (long *) calloc(numthr, sizeof (long))) == NULL ||
+        (count = (long *) calloc(n, sizeof (long))) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for device groups\n");
+        exit(ENOMEM);
+    }
+    for (i = 0, g_idx = 0; i < numthr; i++) {
+        for (tries = 0; tries < n && count[g_idx] >= groups[g_idx].cap; tries++)
+            g_idx = (g_idx + 1) % n;
+        homes[i] = g_idx;
+        count[g_idx]++;
+        g_idx = (g_idx + 1) % n;
+    }
+    free(count);
+    if (verbose) {
+        for (g_idx = 0; g_idx < n; g_idx++) {
+            g = &groups[g_idx];
+            fprintf(stdout, "INFO: device <%s>: %ld roots, at most %ld threads", g->name, g->roots, g->cap);
+            if (g->numa >= 0)
+                fprintf(stdout, ", NUMA node %d", g->numa);
+            fprintf(stdout, "\n");
+        }
+    }
+    *ngroups = n;
+    return groups;
+}
+
+long
+        dev_home(const unsigned int tid) {
+
+/*
+ * Description:
+ * Returns the home group of thread tid.
+ *
+ */
+    return homes[tid];
+}
+
+void
+        dev_pin(const int node) {
+
+/*
+ * Description:
+ * Binds the calling thread to the CPUs of a NUMA node. A failure is logged, the thread then
+ * runs unbound.
+ *
+ */
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    cpu_set_t   set;
+    FILE        *fp;
+    char        path[64];
+    long        lo, hi, cpu;
+    int         c;
+
+    snprintf(path, sizeof (path), "/sys/devices/system/node/node%d/cpulist", node);
+    errno = 0;
+    if ((fp = fopen(path, "r")) == NULL) {
+        print_errno_r(WARNING, errno, "couldn't read CPUs of NUMA node", path);
+        return;
+    }
+    CPU_ZERO(&set);
+    while (fscanf(fp, "%ld", &lo) == 1) {
+        hi = lo;
+        if ((c = fgetc(fp)) == '-') {
+            if (fscanf(fp, "%ld", &hi) != 1)
+                break;
+            c = fgetc(fp);
+        }
+        for (cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET((int) cpu, &set);
+        if (c != ',')
+            break;
+    }
+    fclose(fp);
+    if (CPU_COUNT(&set) == 0)
+        errno = ENOENT;
+    else
+        errno = pthread_setaffinity_np(pthread_self(), sizeof (cpu_set_t), &set);
+    if (errno != 0)
+        print_errno_r(WARNING, errno, "couldn't bind thread to the CPUs of NUMA node", path);
+#else
+    print_error_r(WARNING, "binding threads to NUMA nodes isn't supported on this system");
+#endif
+}
+
+void
+        dev_free(dev_group_t *groups, const long n) {
+
+/*
+ * Description:
+ * Releases the device groups. Their deqs have to be empty.
+ *
+ */
+    long    i;
+
+    for (i = 0; i < n; i++) {
+        free(groups[i].name);
+        free(groups[i].anchor);
+    }
+    free(groups);
+    free(homes);
+    homes = NULL;
+}
@@ -0,0 +1,360 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * directory index of an incremental run (option -I)
+ *
+ * For every directory read completely in one piece a record with device, inode, mtime and
+ * ctime is kept, flagged clean if no entry of the directory was left with a mapped owner.
+ * Creating, removing or renaming an entry advances mtime and ctime of its directory, so the
+ * entries of a directory whose times haven't changed since a clean record are taken to still
+ * carry no mapped owner; a later run doesn't lstat them, it only descends into the
+ * subdirectories. Changing the owner of an existing entry leaves the times of its directory
+ * alone: only root can change the uid, but the owner of an entry can change its gid to any of
+ * their groups, even to a mapped old gid, which the next incremental run doesn't notice in a
+ * skipped directory. Subtrees can't be skipped as a
+ * whole: a change deep down leaves the times of the directories above it alone.
+ * The records are collected per thread and written sorted by device and inode, so the index
+ * of the previous run is looked up by binary search without locking. The index is only valid
+ * for the same input and exclude files, whose fingerprint is kept in the header.
+ */
+
+#include "chuid.h"
+
+#define DIRINDEX_MAGIC "CHUIDIX1"
+
+/*
+ * a directory whose mtime is this close to the time it was stat'ed may get another entry
+ * within the same timestamp tick without its mtime advancing, so it isn't recorded as clean;
+ * an mtime in whole seconds is taken for a file system with a granularity of one second
+ */
+#define DIRINDEX_RACY_NS 20000000LL
+#define DIRINDEX_RACY_COARSE_NS 2000000000LL
+
+typedef struct dirindex_header {
+    char                magic[8];
+    uint64_t            fingerprint;
+    uint64_t            count;
+} dirindex_header_t;
+
+typedef struct dirindex_rec {
+    uint64_t            dev;
+    uint64_t            ino;
+    int64_t             mtime_ns;
+    int64_t             ctime_ns;
+    uint32_t            flags;
+    uint32_t            pad;
+} dirindex_rec_t;
+
+#define DIRINDEX_CLEAN  1
+
+/*
+ * one buffer per thread, padded so that two threads never write to the same cache line
+ */
+typedef struct dirindex_buf {
+    dirindex_rec_t      *recs;
+    size_t              count;
+    size_t              size;
+    char                pad[CACHE_LINE];
+} dirindex_buf_t;
+
+static char             *index_path = NULL;
+static uint64_t         index_fp = 0;
+static dirindex_rec_t   *prev = NULL;
+static size_t           nprev = 0;
+static dirindex_buf_t   *bufs = NULL;
+static size_t           nbufs = 0;
+
+static uint64_t
+        fp_add(uint64_t h, const void *data, const size_t len) {
+
+/*
+ * Description:
+ * Continues the FNV-1a hash h over len bytes of data.
+ *
+ */
+    const unsigned char *p = (const unsigned char *) data;
+    size_t              i;
+
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
+static int64_t
+        ts_ns(const struct stat *st, const short int ctime_too) {
+
+/*
+ * Description:
+ * Returns the mtime (ctime_too = 0) or ctime of st in nanoseconds.
+ *
+ */
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+    if (ctime_too)
+        return (int64_t) st->st_ctim.tv_sec * 1000000000LL + (int64_t) st->st_ctim.tv_nsec;
+    return (int64_t) st->st_mtim.tv_sec * 1000000000LL + (int64_t) st->st_mtim.tv_nsec;
+#else
+    return (int64_t) (ctime_too ? st->st_ctime : st->st_mtime) * 1000000000LL;
+#endif
+}
+
+static int
+        rec_cmp(const void *a, const void *b) {
+
+    const dirindex_rec_t *x = (const dirindex_rec_t *) a;
+    const dirindex_rec_t *y = (const dirindex_rec_t *) b;
+
+    if (x->dev != y->dev)
+        return (x->dev < y->dev) ? -1 : 1;
+    return (x->ino < y->ino) ? -1 : (x->ino > y->ino);
+}
+
+static void
+        dirindex_load(void) {
+
+/*
+ * Description:
+ * Reads the index of the previous run. A missing index means a first run; an index that
+ * can't be read or was written for other input or exclude files is ignored with a warning.
+ *
+ */
+    dirindex_header_t   h;
+    FILE                *fp;
+    size_t              i;
+
+    errno = 0;
+    if ((fp = fopen(index_path, "r")) == NULL) {
+        if (errno != ENOENT)
+            print_errno_r(WARNING, errno, "couldn't open directory index, full scan for", index_path);
+        return;
+    }
+    if (fread(&h, sizeof (dirindex_header_t), 1, fp) != 1 || memcmp(h.magic, DIRINDEX_MAGIC, 8) != 0) {
+        print_error_r(WARNING, "directory index unreadable or of another format, full scan");
+        fclose(fp);
+        return;
+    }
+    if (h.fingerprint != index_fp) {
+        print_error_r(WARNING, "directory index belongs to other input or exclude files, full scan");
+        fclose(fp);
+        return;
+    }
+    if (h.count > 0 && (prev = (dirindex_rec_t *) malloc(h.count * sizeof (dirindex_rec_t))) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for directory index\n");
+        exit(ENOMEM);
+    }
+    if (h.count > 0 && fread(prev, sizeof (dirindex_rec_t), h.count, fp) != h.count) {
+        print_error_r(WARNING, "directory index truncated, full scan");
+        free(prev);
+        prev = NULL;
+        fclose(fp);
+        return;
+    }
+    fclose(fp);
+    nprev = (size_t) h.count;
+    for (i = 1; i < nprev; i++) {
+        if (rec_cmp(&prev[i - 1], &prev[i]) >= 0) {
+            print_error_r(WARNING, "directory index not sorted, full scan");
+            free(prev);
+            prev = NULL;
+            nprev = 0;
+            return;
+        }
+    }
+}
+
+void
+        dirindex_open(const char *path, const size_t numthr, const idmap_t *umap, const idmap_t *gmap, const fs_root_t *exlist) {
+
+/*
+ * Description:
+ * Loads the index of the previous run from path and prepares the buffers of numthr threads
+ * for the new one.
+ *
+ * Parameters:
+ * path:        index file
+ * numthr:      number of worker threads
+ * umap, gmap:  uid and gid maps of the input file
+ * exlist:      exclude list
+ *
+ */
+    uint64_t    h = 0;
+    size_t      i;
+
+    if ((index_path = strdup(path)) == NULL ||
+        (bufs = (dirindex_buf_t *) calloc(numthr, sizeof (dirindex_buf_t))) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for directory index\n");
+        exit(ENOMEM);
+    }
+    nbufs = numthr;
+/*
+ * the fingerprint covers the mappings and the exclude list, not the order of their lines:
+ * it is the xor of the hashes of the single lines, each of them starting with its kind
+ */
+    for (i = 0; i < umap->count; i++)
+        h ^= fp_add(fp_add(fp_add(0xCBF29CE484222325ULL, "u", 1), &umap->entries[i].oldid, sizeof (unsigned int)), &umap->entries[i].newid, sizeof (unsigned int));
+    for (i = 0; i < gmap->count; i++)
+        h ^= fp_add(fp_add(fp_add(0xCBF29CE484222325ULL, "g", 1), &gmap->entries[i].oldid, sizeof (unsigned int)), &gmap->entries[i].newid, sizeof (unsigned int));
+    for (; exlist != NULL; exlist = exlist->next)
+        h ^= fp_add(fp_add(0xCBF29CE484222325ULL, "e", 1), exlist->dirpath, strlen(exlist->dirpath));
+    index_fp = h;
+    dirindex_load();
+}
+
+short int
+        dirindex_unchanged(const struct stat *st) {
+
+/*
+ * Description:
+ * Returns 1 if the previous run left directory st clean and it hasn't changed since, 0
+ * otherwise.
+ *
+ */
+    dirindex_rec_t  key;
+    const dirindex_rec_t *r;
+
+    if (nprev == 0)
+        return 0;
+    key.dev = (uint64_t) st->st_dev;
+    key.ino = (uint64_t) st->st_ino;
+    if ((r = (const dirindex_rec_t *) bsearch(&key, prev, nprev, sizeof (dirindex_rec_t), rec_cmp)) == NULL)
+        return 0;
+    return ((r->flags & DIRINDEX_CLEAN) && r->mtime_ns == ts_ns(st, 0) && r->ctime_ns == ts_ns(st, 1));
+}
+
+void
+        dirindex_add(const unsigned int tid, const struct stat *st, const struct timespec *seen, const short int clean) {
+
+/*
+ * Description:
+ * Records a directory read completely in one piece.
+ *
+ * Parameters:
+ * tid:         thread id
+ * st:          data of the directory, taken before it was read
+ * seen:        time st was taken
+ * clean:       1 if no entry of the directory was left with a mapped owner
+ *
+ */
+    dirindex_buf_t  *b = &bufs[tid];
+    dirindex_rec_t  *r;
+    int64_t         now = (int64_t) seen->tv_sec * 1000000000LL + (int64_t) seen->tv_nsec;
+    int64_t         racy;
+
+    if (b->count >= b->size) {
+        b->size = (b->size == 0) ? 1024 : 2 * b->size;
+        if ((b->recs = (dirindex_rec_t *) realloc(b->recs, b->size * sizeof (dirindex_rec_t))) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for directory index\n");
+            exit(ENOMEM);
+        }
+    }
+    r = &b->recs[b->count++];
+    memset(r, 0, sizeof (dirindex_rec_t));
+    r->dev = (uint64_t) st->st_dev;
+    r->ino = (uint64_t) st->st_ino;
+    r->mtime_ns = ts_ns(st, 0);
+    r->ctime_ns = ts_ns(st, 1);
+/*
+ * entries are only added, removed or renamed with mtime advancing; ctime also changes with the
+ * owner of the directory itself, which this run may just have changed
+ */
+    racy = (r->mtime_ns % 1000000000LL == 0) ? DIRINDEX_RACY_COARSE_NS : DIRINDEX_RACY_NS;
+    if (clean && now - r->mtime_ns > racy)
+        r->flags = DIRINDEX_CLEAN;
+}
+
+unsigned long
+        dirindex_close(const short int complete) {
+
+/*
+ * Description:
+ * Writes the new index if the scan is complete and releases all buffers. The index is
+ * written under a temporary name and renamed, so the old one stays until the new one is
+ * complete.
+ *
+ * Return value:
+ * number of directories recorded as clean
+ *
+ */
+    dirindex_header_t   h;
+    dirindex_rec_t      *all = NULL;
+    size_t              i, n = 0, k = 0, len;
+    unsigned long       clean = 0;
+    char                *tmp = NULL;
+    FILE                *fp;
+    short int           ok;
+
+    for (i = 0; i < nbufs; i++)
+        n += bufs[i].count;
+    if (complete && n > 0 && (all = (dirindex_rec_t *) malloc(n * sizeof (dirindex_rec_t))) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for directory index\n");
+        exit(ENOMEM);
+    }
+    for (i = 0; i < nbufs; i++) {
+        if (all != NULL)
+            memcpy(all + k, bufs[i].recs, bufs[i].count * sizeof (dirindex_rec_t));
+        k += bufs[i].count;
+        free(bufs[i].recs);
+    }
+    free(bufs);
+    bufs = NULL;
+    nbufs = 0;
+    free(prev);
+    prev = NULL;
+    nprev = 0;
+    if (complete) {
+        if (n > 1)
+            qsort(all, n, sizeof (dirindex_rec_t), rec_cmp);
+/*
+ * a directory read twice (reached through two roots) is only clean if both reads were
+ */
+        for (i = 0, k = 0; i < n; i++) {
+            if (k > 0 && rec_cmp(&all[k - 1], &all[i]) == 0)
+                all[k - 1].flags &= all[i].flags;
+            else
+                all[k++] = all[i];
+        }
+        for (i = 0; i < k; i++)
+            clean += (all[i].flags & DIRINDEX_CLEAN) ? 1 : 0;
+        memset(&h, 0, sizeof (dirindex_header_t));
+        memcpy(h.magic, DIRINDEX_MAGIC, 8);
+        h.fingerprint = index_fp;
+        h.count = (uint64_t) k;
+        len = strlen(index_path) + 5;
+        if ((tmp = (char *) malloc(sizeof (char) * len)) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for directory index\n");
+            exit(ENOMEM);
+        }
+        snprintf(tmp, len, "%s.tmp", index_path);
+        errno = 0;
+        if ((fp = fopen(tmp, "w")) == NULL) {
+            print_errno_r(WARNING, errno, "couldn't create directory index", tmp);
+        } else {
+            ok = (fwrite(&h, sizeof (dirindex_header_t), 1, fp) == 1 && (k == 0 || fwrite(all, sizeof (dirindex_rec_t), k, fp) == k));
+            if (fclose(fp) != 0)
+                ok = 0;
+            if (!ok || rename(tmp, index_path) != 0) {
+                print_errno_r(WARNING, errno, "couldn't write directory index", tmp);
+                unlink(tmp);
+            }
+        }
+        free(tmp);
+    }
+    free(all);
+    free(index_path);
+    index_path = NULL;
+    return clean;
+}
@@ -0,0 +1,454 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * compiled exclude list
+ *
+ * The exclude list is compiled once into a read-only structure, so the threads test entries
+ * against it without any locking:
+ * - bare names are kept in a hash set and cost one lookup per entry regardless of the length
+ *   of the exclude list,
+ * - absolute paths are split into their components and stored as a trie. Every queue element
+ *   carries the trie node of its directory path (NULL once the path left the trie), so testing
+ *   an entry is a single lookup of its name among the children of that node,
+ * - lines starting with "glob:" are fnmatch(3) patterns; a pattern without a slash is matched
+ *   against the entry name, a pattern with a slash against the full path of the entry.
+ * Trie nodes and names share one open addressing table keyed by (parent node, name); names
+ * are children of the sentinel node ex_names, the trie starts at the sentinel node ex_top.
+ */
+
+#include "chuid.h"
+
+extern short int        verbose;
+
+#define EX_GLOB_PREFIX  "glob:"
+
+static ex_node_t        ex_top = { NULL, NULL, 0, 0 };
+static ex_node_t        ex_names = { NULL, NULL, 0, 0 };
+static ex_node_t        **ex_table = NULL;
+static size_t           ex_mask = 0;
+static size_t           ex_count = 0;
+static char             **ex_name_globs = NULL;
+static size_t           ex_nname_globs = 0;
+static char             **ex_path_globs = NULL;
+static size_t           ex_npath_globs = 0;
+
+static size_t
+        ex_hash(const ex_node_t *parent, const char *name, const size_t len) {
+
+/*
+ * Description:
+ * FNV-1a hash of name, mixed with the address of its parent node.
+ *
+ */
+    unsigned long long  h = 0xCBF29CE484222325ULL ^ (unsigned long long) (uintptr_t) parent;
+    size_t              i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char) name[i];
+        h *= 0x100000001B3ULL;
+    }
+    h ^= h >> 29;
+    return (size_t) h;
+}
+
+static ex_node_t *
+        ex_find(const ex_node_t *parent, const char *name, const size_t len) {
+
+/*
+ * Description:
+ * Looks up the child name (of length len, not necessarily terminated) of parent.
+ *
+ */
+    ex_node_t   *n;
+    size_t      i;
+
+    if (ex_table == NULL || parent->children == 0)
+        return NULL;
+    for (i = ex_hash(parent, name, len) & ex_mask; (n = ex_table[i]) != NULL; i = (i + 1) & ex_mask) {
+        if (n->parent == parent && strncmp(n->name, name, len) == 0 && n->name[len] == '\0')
+            return n;
+    }
+    return NULL;
+}
+
+static void
+        ex_grow(void) {
+
+/*
+ * Description:
+ * Doubles the table and rehashes all nodes.
+ *
+ */
+    ex_node_t   **old = ex_table, *n;
+    size_t      oldsize = (ex_table == NULL) ? 0 : ex_mask + 1, size, i, j;
+
+    size = (oldsize == 0) ? 64 : 2 * oldsize;
+    if ((ex_table = (ex_node_t **) calloc(size, sizeof (ex_node_t *))) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for exclude table\n");
+        exit(ENOMEM);
+    }
+    ex_mask = size - 1;
+    for (i = 0; i < oldsize; i++) {
+        if ((n = old[i]) == NULL)
+            continue;
+        for (j = ex_hash(n->parent, n->name, strlen(n->name)) & ex_mask; ex_table[j] != NULL; j = (j + 1) & ex_mask)
+            ;
+        ex_table[j] = n;
+    }
+    free(old);
+}
+
+static ex_node_t *
+        ex_insert(ex_node_t *parent, const char *name, const size_t len) {
+
+/*
+ * Description:
+ * Returns the child name of parent, creating it if it doesn't exist yet.
+ *
+ */
+    ex_node_t   *n;
+    size_t      i;
+
+    if ((n = ex_find(parent, name, len)) != NULL)
+        return n;
+    if (ex_table == NULL || 2 * (ex_count + 1) > ex_mask + 1)
+        ex_grow();
+    if ((n = (ex_node_t *) malloc(sizeof (ex_node_t))) == NULL ||
+        (n->name = (char *) malloc(len + 1)) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for exclude entry\n");
+        exit(ENOMEM);
+    }
+    memcpy(n->name, name, len);
+    n->name[len] = '\0';
+    n->parent = parent;
+    n->excluded = 0;
+    n->children = 0;
+    for (i = ex_hash(parent, name, len) & ex_mask; ex_table[i] != NULL; i = (i + 1) & ex_mask)
+        ;
+    ex_table[i] = n;
+    ex_count++;
+    parent->children++;
+    return n;
+}
+
+static void
+        ex_add_glob(char ***list, size_t *count, const char *pattern) {
+
+    if ((*list = (char **) realloc(*list, (*count + 1) * sizeof (char *))) == NULL ||
+        ((*list)[*count] = strdup(pattern)) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for exclude pattern\n");
+        exit(ENOMEM);
+    }
+    (*count)++;
+}
+
+static const ex_node_t *
+        ex_walk(const char *path, short int *excluded) {
+
+/*
+ * Description:
+ * Follows the components of an absolute path down the trie.
+ *
+ * Parameters:
+ * path:        path, relative paths are never part of the trie
+ * excluded:    set to 1 if path or one of its parent directories is excluded
+ *
+ * Return value:
+ * trie node of path, NULL if path isn't part of the trie
+ *
+ */
+    const ex_node_t *node = &ex_top;
+    const char      *p = path, *end;
+
+    *excluded = 0;
+    if (path[0] != '/')
+        return NULL;
+    while (node != NULL && *p != '\0') {
+        for (; *p == '/'; p++)
+            ;
+        if (*p == '\0')
+            break;
+        end = p + strcspn(p, "/");
+        if ((node = ex_find(node, p, (size_t) (end - p))) != NULL && node->excluded) {
+            *excluded = 1;
+            return NULL;
+        }
+        p = end;
+    }
+    return node;
+}
+
+#ifdef HAVE_FNMATCH_H
+static short int
+        ex_glob_match(const char *dirname, const char *name, const size_t nlen) {
+
+/*
+ * Description:
+ * Matches an entry against the name patterns and, with its full path, the path patterns.
+ *
+ */
+    char        buf[PATH_MAX], *path = buf;
+    size_t      i, dlen;
+    short int   ret = 0;
+
+    for (i = 0; i < ex_nname_globs; i++) {
+        if (fnmatch(ex_name_globs[i], name, 0) == 0)
+            return 1;
+    }
+    if (ex_npath_globs == 0)
+        return 0;
+    dlen = strlen(dirname);
+    if (dlen + nlen + 2 > sizeof (buf) && (path = (char *) malloc(dlen + nlen + 2)) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for Name string\n");
+        exit(ENOMEM);
+    }
+    memcpy(path, dirname, dlen);
+    path[dlen] = '/';
+    memcpy(path + dlen + 1, name, nlen + 1);
+    for (i = 0; !ret && i < ex_npath_globs; i++) {
+        if (fnmatch(ex_path_globs[i], path, FNM_PATHNAME) == 0)
+            ret = 1;
+    }
+    if (path != buf)
+        free(path);
+    return ret;
+}
+#endif
+
+void
+        exclude_build(const fs_root_t *list) {
+
+/*
+ * Description:
+ * Compiles the exclude list into the name set, the path trie and the pattern lists.
+ *
+ * Parameters:
+ * list:        exclude list as read by parseexfilelist
+ *
+ */
+    const fs_root_t *ptr;
+    const char      *p, *end, *entry;
+    ex_node_t       *node;
+    size_t          plen = strlen(EX_GLOB_PREFIX);
+
+    for (ptr = list; ptr != NULL; ptr = ptr->next) {
+        entry = ptr->dirpath;
+        if (strncmp(entry, EX_GLOB_PREFIX, plen) == 0) {
+            if (entry[plen] == '\0')
+                continue;
+#ifndef HAVE_FNMATCH_H
+            fprintf(stderr, "WARNING: Exclude pattern <%s> ignored, no pattern matching on this system!\n", entry + plen);
+            continue;
+#endif
+            if (strchr(entry + plen, '/') != NULL)
+                ex_add_glob(&ex_path_globs, &ex_npath_globs, entry + plen);
+            else
+                ex_add_glob(&ex_name_globs, &ex_nname_globs, entry + plen);
+        } else if (entry[0] == '/') {
+            node = &ex_top;
+            for (p = entry; *p != '\0'; p = end) {
+                for (; *p == '/'; p++)
+                    ;
+                if (*p == '\0')
+                    break;
+                end = p + strcspn(p, "/");
+                node = ex_insert(node, p, (size_t) (end - p));
+            }
+            if (node != &ex_top)
+                node->excluded = 1;
+            else
+                fprintf(stderr, "WARNING: Exclude entry </> ignored!\n");
+        } else if (strchr(entry, '/') != NULL) {
+            fprintf(stderr, "WARNING: Exclude entry <%s> is neither an absolute path nor a name, ignored!\n", entry);
+        } else if (entry[0] != '\0') {
+            ex_insert(&ex_names, entry, strlen(entry))->excluded = 1;
+        }
+    }
+    if (verbose)
+        fprintf(stdout, "INFO: %lu excluded names, %lu path components, %lu patterns\n", (unsigned long) ex_names.children,
+                (unsigned long) (ex_count - ex_names.children), (unsigned long) (ex_nname_globs + ex_npath_globs));
+}
+
+const ex_node_t *
+        exclude_root(const char *path, short int *excluded) {
+
+/*
+ * Description:
+ * Returns the trie node of a root directory.
+ *
+ * Parameters:
+ * path:        path of the root directory
+ * excluded:    set to 1 if the root itself is excluded by a path or a path pattern
+ *
+ */
+    const ex_node_t *node = ex_walk(path, excluded);
+#ifdef HAVE_FNMATCH_H
+    size_t          i;
+
+    for (i = 0; !*excluded && i < ex_npath_globs; i++) {
+        if (fnmatch(ex_path_globs[i], path, FNM_PATHNAME) == 0)
+            *excluded = 1;
+    }
+#endif
+    return node;
+}
+
+const ex_node_t *
+        exclude_dir(const char *path, short int *excluded) {
+
+/*
+ * Description:
+ * Returns the trie node of a directory whose entries are checked without a traversal (path
+ * list mode). Like in a traversal the directory counts as excluded if one of its components is
+ * excluded by a name, a path or a pattern.
+ *
+ * Parameters:
+ * path:        path of the directory
+ * excluded:    set to 1 if the directory or one of its parents is excluded
+ *
+ */
+    return exclude_below(path, 0, excluded);
+}
+
+const ex_node_t *
+        exclude_below(const char *path, const size_t from, short int *excluded) {
+
+/*
+ * Description:
+ * Like exclude_dir, but only the components of path after its first from characters are
+ * tested, the ones a traversal starting at that prefix checks.
+ *
+ * Parameters:
+ * path:        path of the directory
+ * from:        length of the prefix of path the traversal starts at
+ * excluded:    set to 1 if one of the components after the prefix is excluded
+ *
+ */
+    const ex_node_t *node = (path[0] == '/') ? &ex_top : NULL, *n;
+    const char      *p, *end;
+#ifdef HAVE_FNMATCH_H
+    char            *buf = NULL;
+    size_t          i;
+#endif
+
+    *excluded = 0;
+    for (p = path; !*excluded && *p != '\0'; p = end) {
+        for (; *p == '/'; p++)
+            ;
+        if (*p == '\0')
+            break;
+        end = p + strcspn(p, "/");
+        if (node != NULL && (node = ex_find(node, p, (size_t) (end - p))) != NULL && node->excluded && (size_t) (p - path) >= from)
+            *excluded = 1;
+        if ((size_t) (p - path) < from)
+            continue;
+        if ((n = ex_find(&ex_names, p, (size_t) (end - p))) != NULL && n->excluded)
+            *excluded = 1;
+#ifdef HAVE_FNMATCH_H
+        if (ex_nname_globs == 0 && ex_npath_globs == 0)
+            continue;
+        if (buf == NULL && (buf = strdup(path)) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for Name string\n");
+            exit(ENOMEM);
+        }
+        buf[end - path] = '\0';
+        for (i = 0; !*excluded && i < ex_nname_globs; i++) {
+            if (fnmatch(ex_name_globs[i], buf + (p - path), 0) == 0)
+                *excluded = 1;
+        }
+        for (i = 0; !*excluded && i < ex_npath_globs; i++) {
+            if (fnmatch(ex_path_globs[i], buf, FNM_PATHNAME) == 0)
+                *excluded = 1;
+        }
+        buf[end - path] = path[end - path];
+#endif
+    }
+#ifdef HAVE_FNMATCH_H
+    free(buf);
+#endif
+    return *excluded ? NULL : node;
+}
+
+const ex_node_t *
+        exclude_child(const ex_node_t *dir, const char *name) {
+
+/*
+ * Description:
+ * Returns the trie node of the subdirectory name of a directory with trie node dir.
+ *
+ */
+    return (dir == NULL) ? NULL : ex_find(dir, name, strlen(name));
+}
+
+short int
+        exclude_entry(const ex_node_t *dir, const char *dirname, const char *name) {
+
+/*
+ * Description:
+ * Checks an entry against the exclude list.
+ *
+ * Parameters:
+ * dir:         trie node of the entry's directory (may be NULL)
+ * dirname:     path of the entry's directory
+ * name:        name of the entry
+ *
+ * Return value:
+ * 1 if the entry is excluded, 0 otherwise
+ *
+ */
+    const ex_node_t *n;
+    size_t          nlen = strlen(name);
+
+    if ((n = ex_find(&ex_names, name, nlen)) != NULL && n->excluded)
+        return 1;
+    if (dir != NULL && (n = ex_find(dir, name, nlen)) != NULL && n->excluded)
+        return 1;
+#ifdef HAVE_FNMATCH_H
+    if (ex_nname_globs > 0 || ex_npath_globs > 0)
+        return ex_glob_match(dirname, name, nlen);
+#endif
+    return 0;
+}
+
+void
+        exclude_free(void) {
+
+/*
+ * Description:
+ * Releases the compiled exclude list.
+ *
+ */
+    size_t  i;
+
+    for (i = 0; ex_table != NULL && i <= ex_mask; i++) {
+        if (ex_table[i] != NULL) {
+            free(ex_table[i]->name);
+            free(ex_table[i]);
+        }
+    }
+    free(ex_table);
+    ex_table = NULL;
+    ex_mask = ex_count = 0;
+    ex_top.children = ex_names.children = 0;
+    for (i = 0; i < ex_nname_globs; i++)
+        free(ex_name_globs[i]);
+    for (i = 0; i < ex_npath_globs; i++)
+        free(ex_path_globs[i]);
+    free(ex_name_globs);
+    free(ex_path_globs);
+    ex_name_globs = ex_path_globs = NULL;
+    ex_nname_globs = ex_npath_globs = 0;
+}
@@ -4,104 +4,208 @@
 
 extern struct htab *htab;
 
-static void
-        h_reset(void) {
-    
-    unsigned int  i;
-    struct h_ent  **p;
-    
-    htab->first_free= 0;
-    
-    p = htab->hash;
-    for (i = htab->mod; i > 0; i--)
-        *p++ = NULL;
+/*
+ * The table of visited hardlinked inodes is split into shards, each protected by a mutex of
+ * its own and grown independently of the others. Threads therefore only serialize if they
+ * insert into the same shard at the same time, and growing a shard stalls just the threads
+ * hitting that shard.
+ *
+ * Each shard is a flat open addressing table with linear probing: the (ino, dev) entries are
+ * stored in one array without any links, so a lookup usually touches a single cache line.
+ * A slot with ino and dev both 0 is empty; the (improbable) key (0, 0) is kept in a flag.
+ */
+
+#define H_MAX_LOAD_NUM  7
+#define H_MAX_LOAD_DEN  10
+
+static unsigned long long
+        h_mix(const ino_t ino, const dev_t dev) {
+
+/*
+ * Description:
+ * Mixes device and inode number into a 64 bit hash: the upper bits select the shard, the
+ * lower bits the slot within the shard.
+ *
+ */
+    unsigned long long  h;
+
+    h = (unsigned long long) ino ^ ((unsigned long long) dev * 0x9E3779B97F4A7C15ULL);
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
 }
 
 void
-        h_init(const unsigned int mod, const unsigned int het_tab_size) {
-    
-    struct htab    *htab_r;
-    
-    if ((htab_r = (struct htab *) malloc(sizeof(struct htab) + sizeof(struct h_ent *) * mod)) == NULL) {
+        h_init(const unsigned int nshards, const unsigned int slots) {
+
+/*
+ * Description:
+ * Creates the hardlink table with at least nshards shards (rounded up to a power of 2).
+ *
+ * Parameters:
+ * nshards:         minimal number of shards
+ * slots:           initial number of slots per shard (rounded up to a power of 2)
+ *
+ */
+    struct htab     *htab_r;
+    struct h_shard  *sh;
+    unsigned int    i, n, m;
+
+    for (n = 1; n < nshards; n <<= 1)
+        ;
+    for (m = 8; m < slots; m <<= 1)
+        ;
+
+    if ((htab_r = (struct htab *) malloc(sizeof(struct htab))) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for hash initialization\n");
+            exit(ENOMEM);
+        }
+    if ((htab_r->shard = (struct h_shard *) calloc(n, sizeof(struct h_shard))) == NULL) {
             fprintf(stderr, "ERROR: No memory available for hash initialization\n");
             exit(ENOMEM);
         }
-    
-    if ((htab_r->het_tab = (struct h_ent *) malloc(sizeof(struct h_ent) * het_tab_size)) == NULL) {
+    htab_r->nshards = n;
+    for (htab_r->shift = 64; n > 1; n >>= 1)
+        htab_r->shift--;
+
+    for (i = 0; i < htab_r->nshards; i++) {
+        sh = &htab_r->shard[i];
+        pthread_mutex_init(&sh->lock, NULL);
+        if ((sh->het_tab = (struct h_ent *) calloc(m, sizeof(struct h_ent))) == NULL) {
             fprintf(stderr, "ERROR: No memory available for hash initialization\n");
             exit(ENOMEM);
         }
-    
-    htab_r->mod = mod;
-    htab_r->het_tab_size = het_tab_size;
+        sh->het_tab_size = m;
+        sh->used = 0;
+        sh->has_zero = 0;
+    }
     htab = htab_r;
-    
-    h_reset();
+}
+
+void
+        h_free(void) {
+
+/*
+ * Description:
+ * Releases the hardlink table.
+ *
+ */
+    unsigned int    i;
+
+    if (htab == NULL)
+        return;
+    for (i = 0; i < htab->nshards; i++) {
+        pthread_mutex_destroy(&htab->shard[i].lock);
+        free(htab->shard[i].het_tab);
+    }
+    free(htab->shard);
+    free(htab);
+    htab = NULL;
 }
 
 static short int
-        h_ins(struct htab *ht, const ino_t ino, const dev_t dev) {
-    
-    struct h_ent  **hp, *ep2, *ep;
-
-    hp = &ht->hash[ino % ht->mod];
-    ep2 = *hp;
-    
-    if (ep2 != NULL) {
-        ep = ep2;
-        do {
-            if (ep->ino == ino && ep->dev == dev)
-                return 1;
-            ep = ep->c_link;
-        } while (ep != NULL);
+        h_ins(struct h_ent *tab, const unsigned int size, unsigned long long h, const ino_t ino, const dev_t dev) {
+
+/*
+ * Description:
+ * Looks up an entry and inserts it if it is not there yet.
+ *
+ * Return value:
+ * 1 if the entry was found, 0 if it was inserted
+ *
+ */
+    struct h_ent    *ep;
+    unsigned int    mask = size - 1;
+    unsigned int    i;
+
+    for (i = (unsigned int) h & mask; ; i = (i + 1) & mask) {
+        ep = &tab[i];
+        if (ep->ino == ino && ep->dev == dev)
+            return 1;
+        if (ep->ino == 0 && ep->dev == 0) {
+            ep->ino = ino;
+            ep->dev = dev;
+            return 0;
+        }
     }
-    ep = *hp = &ht->het_tab[ht->first_free++];
-    ep->ino = ino;
-    ep->dev = dev;
-    ep->c_link = ep2;
-    
-    return 0;
+}
+
+static void
+        h_grow(struct h_shard *sh) {
+
+/*
+ * Description:
+ * Doubles the slots of a shard and re-inserts its entries. Called with the shard locked.
+ *
+ */
+    struct h_ent    *old, *ep;
+    unsigned int    i, oldsize;
+
+    old = sh->het_tab;
+    oldsize = sh->het_tab_size;
+    sh->het_tab_size = 2 * oldsize;
+    if ((sh->het_tab = (struct h_ent *) calloc(sh->het_tab_size, sizeof(struct h_ent))) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for hash calculation\n");
+        exit(ENOMEM);
+    }
+    for (i = 0, ep = old; i < oldsize; i++, ep++) {
+        if (ep->ino != 0 || ep->dev != 0)
+            h_ins(sh->het_tab, sh->het_tab_size, h_mix(ep->ino, ep->dev), ep->ino, ep->dev);
+    }
+    free(old);
 }
 
 short int
         h_mins(const ino_t ino, const dev_t dev) {
-    
-    struct htab    *htab_r = htab;
-    struct h_ent   *ep;
-    unsigned int    mod, i, het_tab_size;
-    
-    if (htab_r->first_free>= htab_r->het_tab_size) {
-        
-        if ((htab_r = (struct htab *) realloc((char *) htab_r, sizeof(struct htab))) == NULL) {
-            fprintf(stderr, "ERROR: No memory available for hash calculation\n");
-            exit(ENOMEM);
-        }
-        
-        mod = 2 * htab_r->mod;
-        het_tab_size = 2 * htab_r->het_tab_size;
-        
-        if ((htab_r->het_tab = (struct h_ent *) realloc((char *) htab_r->het_tab, sizeof(struct h_ent) * het_tab_size)) == NULL) {
-            fprintf(stderr, "ERROR: No memory available for hash calculation\n");
-            exit(ENOMEM);
-        }
-       
-        if ((htab_r = (struct htab *) realloc((char *) htab_r, sizeof(struct htab) + sizeof(struct h_ent *) * mod)) == NULL) {
-            fprintf(stderr, "ERROR: No memory available for hash calculation\n");
-            exit(ENOMEM);
-        }
-        
-        htab_r->mod = mod;
-        htab_r->het_tab_size = het_tab_size;
-        htab = htab_r;
-        
-        i = htab_r->first_free;
-        
-        h_reset();
-        
-        for (ep = htab_r->het_tab; i > 0; i--) {
-            h_ins(htab_r, ep->ino, ep->dev);
-            ep++;
-        }
+
+/*
+ * Description:
+ * Registers a hardlinked inode. Thread safe.
+ *
+ * Return value:
+ * 1 if the inode had already been visited, 0 if it is new
+ *
+ */
+    struct h_shard      *sh;
+    unsigned long long  h;
+    short int           known;
+
+    h = h_mix(ino, dev);
+    sh = &htab->shard[(htab->nshards > 1) ? (unsigned int) (h >> htab->shift) : 0];
+    pthread_mutex_lock(&sh->lock);
+    if (ino == 0 && dev == 0) {
+        known = sh->has_zero;
+        sh->has_zero = 1;
+    } else {
+        if ((sh->used + 1) * H_MAX_LOAD_DEN > sh->het_tab_size * H_MAX_LOAD_NUM)
+            h_grow(sh);
+        if ((known = h_ins(sh->het_tab, sh->het_tab_size, h, ino, dev)) == 0)
+            sh->used++;
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return known;
+}
+
+void
+        h_usage(unsigned long *entries, unsigned long *slots, unsigned long *bytes) {
+
+/*
+ * Description:
+ * Reports number of registered inodes, number of slots and memory used by the hardlink table.
+ * To be called after the scan phase.
+ *
+ */
+    unsigned int    i;
+
+    *entries = 0;
+    *slots = 0;
+    *bytes = sizeof(struct htab) + htab->nshards * sizeof(struct h_shard);
+    for (i = 0; i < htab->nshards; i++) {
+        *entries += htab->shard[i].used + htab->shard[i].has_zero;
+        *slots += htab->shard[i].het_tab_size;
+        *bytes += htab->shard[i].het_tab_size * sizeof(struct h_ent);
     }
-    return h_ins(htab_r, ino, dev);
 }
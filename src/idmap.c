@@ -0,0 +1,196 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* read-only lookup tables for the uid/gid mappings */
+
+#include "chuid.h"
+
+/*
+ * ranges up to IDMAP_DENSE_FACTOR times the number of tuples (plus some slack for small lists)
+ * are stored as a direct index, lists up to IDMAP_SORTED_MAX tuples are searched binary,
+ * everything else goes into an open addressing hash
+ */
+#define IDMAP_DENSE_FACTOR  4
+#define IDMAP_DENSE_SLACK   1024
+#define IDMAP_SORTED_MAX    16
+
+static int
+        idmap_cmp(const void *a, const void *b) {
+
+/*
+ * Description:
+ * Orders mapping entries by old id and, for equal old ids, by their position in the input file.
+ *
+ */
+    const idmap_entry_t *ea = (const idmap_entry_t *) a;
+    const idmap_entry_t *eb = (const idmap_entry_t *) b;
+
+    if (ea->oldid != eb->oldid)
+        return (ea->oldid < eb->oldid) ? -1 : 1;
+    if (ea->seq != eb->seq)
+        return (ea->seq < eb->seq) ? -1 : 1;
+    return 0;
+}
+
+static unsigned int
+        idmap_hash(const unsigned int id, const unsigned int shift) {
+
+    return (unsigned int) ((id * 2654435761U) >> shift);
+}
+
+void
+        idmap_build(idmap_t *map, idmap_entry_t *entries, size_t count, const char *kind) {
+
+/*
+ * Description:
+ * Compiles the parsed list of 2-tuples into a read-only lookup table. Duplicate old ids are
+ * reported and only their first occurrence is kept. The layout is chosen from the shape of
+ * the input: a direct index for compact id ranges, a sorted array for short lists and an
+ * open addressing hash otherwise.
+ *
+ * Parameters:
+ * map:         lookup table to be initialized
+ * entries:     array of 2-tuples, ownership is passed to the lookup table
+ * count:       number of 2-tuples in entries
+ * kind:        "uid" or "gid", used for messages
+ *
+ */
+    size_t          i, n = 0, range;
+    unsigned int    bits, slot;
+
+    memset(map, 0, sizeof(idmap_t));
+    map->layout = IDMAP_EMPTY;
+    if (count == 0) {
+        free(entries);
+        return;
+    }
+
+    qsort(entries, count, sizeof(idmap_entry_t), idmap_cmp);
+    for (i = 0; i < count; i++) {
+        if (n > 0 && entries[n-1].oldid == entries[i].oldid) {
+            fprintf(stderr, "WARNING: Duplicate old %s: %u!\n", kind, entries[i].oldid);
+            continue;
+        }
+        entries[n++] = entries[i];
+    }
+    map->entries = entries;
+    map->count = n;
+    map->minid = entries[0].oldid;
+    map->maxid = entries[n-1].oldid;
+
+    range = (size_t) (map->maxid - map->minid) + 1;
+    if (range <= IDMAP_DENSE_FACTOR * n + IDMAP_DENSE_SLACK) {
+        map->layout = IDMAP_DENSE;
+        map->size = range;
+        if ((map->index = (unsigned int *) calloc(range, sizeof(unsigned int))) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for %s mapping table\n", kind);
+            exit(ENOMEM);
+        }
+        for (i = 0; i < n; i++)
+            map->index[entries[i].oldid - map->minid] = (unsigned int) i + 1;
+    } else if (n <= IDMAP_SORTED_MAX) {
+        map->layout = IDMAP_SORTED;
+    } else {
+        map->layout = IDMAP_HASH;
+        for (bits = 1; ((size_t) 1 << bits) < 2 * n; bits++)
+            ;
+        map->size = (size_t) 1 << bits;
+        map->shift = 32 - bits;
+        if ((map->index = (unsigned int *) calloc(map->size, sizeof(unsigned int))) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for %s mapping table\n", kind);
+            exit(ENOMEM);
+        }
+        for (i = 0; i < n; i++) {
+            slot = idmap_hash(entries[i].oldid, map->shift);
+            while (map->index[slot] != 0)
+                slot = (slot + 1) & (unsigned int) (map->size - 1);
+            map->index[slot] = (unsigned int) i + 1;
+        }
+    }
+}
+
+const idmap_entry_t *
+        idmap_lookup(const idmap_t *map, const unsigned int oldid) {
+
+/*
+ * Description:
+ * Returns the mapping entry for an old id or NULL if the id is not to be changed.
+ *
+ * Parameters:
+ * map:         lookup table
+ * oldid:       uid or gid found on the file
+ *
+ */
+    size_t          lo, hi, mid;
+    unsigned int    slot, pos;
+
+    switch (map->layout) {
+        case IDMAP_DENSE:
+            if (oldid < map->minid || oldid > map->maxid)
+                return NULL;
+            pos = map->index[oldid - map->minid];
+            return (pos != 0) ? &map->entries[pos-1] : NULL;
+        case IDMAP_SORTED:
+            lo = 0;
+            hi = map->count;
+            while (lo < hi) {
+                mid = (lo + hi) / 2;
+                if (map->entries[mid].oldid < oldid)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            return (lo < map->count && map->entries[lo].oldid == oldid) ? &map->entries[lo] : NULL;
+        case IDMAP_HASH:
+            if (oldid < map->minid || oldid > map->maxid)
+                return NULL;
+            for (slot = idmap_hash(oldid, map->shift); (pos = map->index[slot]) != 0; slot = (slot + 1) & (unsigned int) (map->size - 1)) {
+                if (map->entries[pos-1].oldid == oldid)
+                    return &map->entries[pos-1];
+            }
+            return NULL;
+        default:
+            return NULL;
+    }
+}
+
+const char *
+        idmap_layout_name(const idmap_t *map) {
+
+    switch (map->layout) {
+        case IDMAP_DENSE:
+            return "direct index";
+        case IDMAP_SORTED:
+            return "sorted array";
+        case IDMAP_HASH:
+            return "open addressing hash";
+        default:
+            return "empty";
+    }
+}
+
+void
+        idmap_free(idmap_t *map) {
+
+    size_t  i;
+
+    for (i = 0; i < map->count; i++) {
+        free(map->entries[i].oldname);
+        free(map->entries[i].newname);
+    }
+    free(map->entries);
+    free(map->index);
+    memset(map, 0, sizeof(idmap_t));
+}
@@ -0,0 +1,364 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * binary change journal
+ *
+ * The journal starts with a journal_hdr_t followed by records, each a journal_rec_t and
+ * namelen bytes of name (not null terminated). A JR_DIR record assigns an id to the path of a
+ * directory; the JR_CHANGE records following it carry device, inode, old and new ids of an
+ * entry of that directory and the entry's name only. Directory ids contain the number of the
+ * thread which wrote them in their upper 16 bits: every thread writes its records into a
+ * buffer of its own, and a buffer is appended to the journal as a whole, so a change record
+ * always refers to the last directory record written by the same thread.
+ * The journal is written in host byte order; the header allows a reader to detect a journal
+ * written on a machine with a different byte order or record layout.
+ */
+
+#include "chuid.h"
+
+extern short int        verbose;
+
+#define JOURNAL_MAGIC   "CHUIDJNL"
+#define JOURNAL_VERSION 1
+#define JOURNAL_BOM     0x01020304U
+#define JOURNAL_DIR_SHIFT 48
+
+typedef struct journal_buf {
+    char                *buf;
+    size_t              len;
+    char                *lastdir;
+    uint64_t            dirid;
+    uint64_t            dirseq;
+    char                pad[CACHE_LINE];
+} journal_buf_t;
+
+static journal_buf_t    *jbufs = NULL;
+static size_t           njbufs = 0;
+static int              journal_fd = -1;
+static char             *journal_name = NULL;
+static pthread_mutex_t  thr_journal = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+        journal_write(const char *buf, const size_t len) {
+
+/*
+ * Description:
+ * Appends len bytes to the journal. Serialized, as buffers of all threads go to one file.
+ *
+ */
+    size_t      done = 0;
+    ssize_t     n;
+
+    pthread_mutex_lock(&thr_journal);
+    while (done < len) {
+        errno = 0;
+        if ((n = write(journal_fd, buf + done, len - done)) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "ERROR: Problems writing journal <%s>: %s\n", journal_name, strerror(errno));
+            exit(ENOSPC);
+        }
+        done += (size_t) n;
+    }
+    pthread_mutex_unlock(&thr_journal);
+}
+
+void
+        journal_open(const char *path, const size_t n, const short int append) {
+
+/*
+ * Description:
+ * Creates the journal file and one record buffer per thread.
+ *
+ * Parameters:
+ * path:        name of the journal file
+ * n:           number of threads writing to the journal
+ * append:      continue an existing journal (resumed scan) instead of creating a new one
+ *
+ */
+    journal_hdr_t   hdr;
+    struct stat     statbuf;
+    size_t          i;
+
+    errno = 0;
+    if ((journal_fd = open(path, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0600)) < 0) {
+        fprintf(stderr, "ERROR: Couldn't open journal <%s>: %s\n", path, strerror(errno));
+        exit(errno);
+    }
+    if ((journal_name = strdup(path)) == NULL ||
+        (jbufs = (journal_buf_t *) calloc(n, sizeof (journal_buf_t))) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for journal buffers\n");
+        exit(ENOMEM);
+    }
+    for (i = 0; i < n; i++) {
+        if ((jbufs[i].buf = (char *) malloc(JOURNAL_BUF_SIZE)) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for journal buffers\n");
+            exit(ENOMEM);
+        }
+    }
+    njbufs = n;
+    if (append && fstat(journal_fd, &statbuf) == 0 && statbuf.st_size > 0)
+        return;
+    memset(&hdr, 0, sizeof (journal_hdr_t));
+    memcpy(hdr.magic, JOURNAL_MAGIC, sizeof (hdr.magic));
+    hdr.version = JOURNAL_VERSION;
+    hdr.bom = JOURNAL_BOM;
+    hdr.recsize = (uint32_t) sizeof (journal_rec_t);
+    journal_write((const char *) &hdr, sizeof (journal_hdr_t));
+}
+
+static void
+        journal_record(journal_buf_t *jb, const journal_rec_t *rec, const char *name, const size_t namelen) {
+
+/*
+ * Description:
+ * Adds a record to a thread buffer, writing the buffer to the journal first if it is full.
+ *
+ */
+    size_t  need = sizeof (journal_rec_t) + namelen;
+
+    if (jb->len + need > JOURNAL_BUF_SIZE) {
+        journal_write(jb->buf, jb->len);
+        jb->len = 0;
+    }
+    if (need > JOURNAL_BUF_SIZE) {
+        journal_write((const char *) rec, sizeof (journal_rec_t));
+        journal_write(name, namelen);
+        return;
+    }
+    memcpy(jb->buf + jb->len, rec, sizeof (journal_rec_t));
+    memcpy(jb->buf + jb->len + sizeof (journal_rec_t), name, namelen);
+    jb->len += need;
+}
+
+void
+        journal_change(const unsigned int tid, const char *dirname, const char *name, const struct stat *statbuf, const uid_t newuid, const gid_t newgid, const char kind) {
+
+/*
+ * Description:
+ * Records the change of owner of a directory entry. A directory record is written before the
+ * first change in a directory.
+ *
+ * Parameters:
+ * tid:         thread id
+ * dirname:     path of the directory containing the entry
+ * name:        name of the entry
+ * statbuf:     data returned by lstat before the change
+ * newuid:      uid after the change (the old uid if it wasn't changed)
+ * newgid:      gid after the change (the old gid if it wasn't changed)
+ * kind:        'F' (file), 'D' (directory) or 'L' (link)
+ *
+ */
+    journal_buf_t   *jb = &jbufs[tid];
+    journal_rec_t   rec;
+    size_t          len;
+
+    if (jb->lastdir == NULL || strcmp(jb->lastdir, dirname) != 0) {
+        free(jb->lastdir);
+        if ((jb->lastdir = strdup(dirname)) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for journal directory\n");
+            exit(ENOMEM);
+        }
+        jb->dirid = ((uint64_t) tid << JOURNAL_DIR_SHIFT) | ++jb->dirseq;
+        len = strlen(dirname);
+        memset(&rec, 0, sizeof (journal_rec_t));
+        rec.type = JR_DIR;
+        rec.dirid = jb->dirid;
+        rec.namelen = (uint32_t) len;
+        journal_record(jb, &rec, dirname, len);
+    }
+    len = strlen(name);
+    memset(&rec, 0, sizeof (journal_rec_t));
+    rec.type = JR_CHANGE;
+    rec.kind = (uint8_t) kind;
+    rec.dirid = jb->dirid;
+    rec.dev = (uint64_t) statbuf->st_dev;
+    rec.ino = (uint64_t) statbuf->st_ino;
+    rec.olduid = (uint32_t) statbuf->st_uid;
+    rec.oldgid = (uint32_t) statbuf->st_gid;
+    rec.newuid = (uint32_t) newuid;
+    rec.newgid = (uint32_t) newgid;
+    rec.namelen = (uint32_t) len;
+    journal_record(jb, &rec, name, len);
+}
+
+void
+        journal_close(void) {
+
+/*
+ * Description:
+ * Writes all thread buffers and closes the journal. To be called when no thread records
+ * changes anymore.
+ *
+ */
+    size_t  i;
+
+    if (journal_fd < 0)
+        return;
+    for (i = 0; i < njbufs; i++) {
+        if (jbufs[i].len > 0)
+            journal_write(jbufs[i].buf, jbufs[i].len);
+        free(jbufs[i].buf);
+        free(jbufs[i].lastdir);
+    }
+    free(jbufs);
+    jbufs = NULL;
+    njbufs = 0;
+    errno = 0;
+    if (close(journal_fd) < 0)
+        fprintf(stderr, "ERROR: Problems closing journal <%s>: %s\n", journal_name, strerror(errno));
+    journal_fd = -1;
+    free(journal_name);
+    journal_name = NULL;
+}
+
+int
+        journal_read(const char *path, journal_cb_t cb, void *arg) {
+
+/*
+ * Description:
+ * Reads a journal and calls cb for every change record with the path of its directory.
+ *
+ * Parameters:
+ * path:        name of the journal file
+ * cb:          function called for every change record
+ * arg:         passed to cb
+ *
+ * Return value:
+ * 0 on success, -1 if the journal couldn't be read or is corrupt (a message has been printed)
+ *
+ */
+    FILE            *fp = NULL;
+    journal_hdr_t   hdr;
+    journal_rec_t   rec;
+    char            **dirs = NULL;
+    uint64_t        *dirids = NULL;
+    char            *name = NULL;
+    size_t          namesize = 0, slot;
+    size_t          nslots = (size_t) 1 << 16;
+    int             ret = 0;
+
+    errno = 0;
+    if ((fp = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "ERROR: Couldn't open journal <%s>: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fread(&hdr, sizeof (journal_hdr_t), 1, fp) != 1 || memcmp(hdr.magic, JOURNAL_MAGIC, sizeof (hdr.magic)) != 0) {
+        fprintf(stderr, "ERROR: <%s> is no chuid journal!\n", path);
+        fclose(fp);
+        return -1;
+    }
+    if (hdr.version != JOURNAL_VERSION || hdr.bom != JOURNAL_BOM || hdr.recsize != sizeof (journal_rec_t)) {
+        fprintf(stderr, "ERROR: Journal <%s> was written with an incompatible version or on a different architecture!\n", path);
+        fclose(fp);
+        return -1;
+    }
+/*
+ * the last directory of every thread, indexed by the thread number kept in the directory id
+ */
+    if ((dirs = (char **) calloc(nslots, sizeof (char *))) == NULL ||
+        (dirids = (uint64_t *) calloc(nslots, sizeof (uint64_t))) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for journal directories\n");
+        exit(ENOMEM);
+    }
+    while (fread(&rec, sizeof (journal_rec_t), 1, fp) == 1) {
+        if (rec.namelen + 1 > namesize) {
+            namesize = rec.namelen + 1;
+            if ((name = (char *) realloc(name, namesize)) == NULL) {
+                fprintf(stderr, "ERROR: No memory available for journal record\n");
+                exit(ENOMEM);
+            }
+        }
+        if (fread(name, 1, rec.namelen, fp) != rec.namelen) {
+            fprintf(stderr, "ERROR: Journal <%s> is truncated!\n", path);
+            ret = -1;
+            break;
+        }
+        name[rec.namelen] = '\0';
+        slot = (size_t) (rec.dirid >> JOURNAL_DIR_SHIFT) & (nslots - 1);
+        if (rec.type == JR_DIR) {
+            free(dirs[slot]);
+            if ((dirs[slot] = strdup(name)) == NULL) {
+                fprintf(stderr, "ERROR: No memory available for journal directories\n");
+                exit(ENOMEM);
+            }
+            dirids[slot] = rec.dirid;
+        } else if (rec.type == JR_CHANGE && dirs[slot] != NULL && dirids[slot] == rec.dirid) {
+            if ((ret = cb(&rec, dirs[slot], name, arg)) != 0)
+                break;
+        } else {
+            fprintf(stderr, "ERROR: Journal <%s> is corrupt!\n", path);
+            ret = -1;
+            break;
+        }
+    }
+    if (ret == 0 && ferror(fp)) {
+        fprintf(stderr, "ERROR: Problems reading journal <%s>: %s\n", path, strerror(errno));
+        ret = -1;
+    }
+    for (slot = 0; slot < nslots; slot++)
+        free(dirs[slot]);
+    free(dirs);
+    free(dirids);
+    free(name);
+    fclose(fp);
+    return ret;
+}
+
+static int
+        journal_print(const journal_rec_t *rec, const char *dirname, const char *name, void *arg) {
+
+    const char  *kind;
+
+    switch (rec->kind) {
+        case 'F':
+            kind = "FILE";
+            break;
+        case 'D':
+            kind = "DIRECTORY";
+            break;
+        case 'L':
+            kind = "LINK";
+            break;
+        default:
+            kind = "OTHER";
+    }
+    (*(unsigned long *) arg)++;
+    if (fprintf(stdout, "%s/%s (%s): dev %llu ino %llu, uid %u -> %u, gid %u -> %u\n", dirname, name, kind,
+                (unsigned long long) rec->dev, (unsigned long long) rec->ino, rec->olduid, rec->newuid, rec->oldgid, rec->newgid) < 0)
+        return -1;
+    return 0;
+}
+
+int
+        journal_dump(const char *path) {
+
+/*
+ * Description:
+ * Prints all change records of a journal as text, one line per changed entry.
+ *
+ * Return value:
+ * exit status for the program
+ *
+ */
+    unsigned long   count = 0;
+
+    if (journal_read(path, journal_print, &count) != 0)
+        return EXIT_FAILURE;
+    if (verbose)
+        fprintf(stdout, "INFO: %lu changes in journal <%s>\n", count, path);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,318 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * buffered logging for the scan phase
+ *
+ * Every thread formats its log lines into a buffer of its own, using a time stamp string it
+ * only renews when the second changes. Full buffers are queued to a writer thread, which
+ * writes each of them with a single write() call; once per second it also collects the
+ * partially filled buffers, so no line stays unwritten for much longer than a second. The
+ * per-buffer mutex is only contended by the writer's collection, so threads logging many
+ * changes no longer serialize on one lock or wait for the log file.
+ * Lines of one thread are written in the order they were logged. Lines of different threads
+ * are written in blocks and may therefore be out of chronological order.
+ */
+
+#include "chuid.h"
+
+extern FILE             *fplog;
+extern char             *logdir;
+
+typedef struct log_chunk {
+    struct log_chunk    *next;
+    size_t              len;
+    size_t              size;
+    char                data[];
+} log_chunk_t;
+
+typedef struct log_buf {
+    pthread_mutex_t     lock;
+    log_chunk_t         *cur;
+    time_t              stamp;
+    char                timestr[SMAX];
+    char                pad[CACHE_LINE];
+} log_buf_t;
+
+static log_buf_t        *bufs = NULL;
+static size_t           nbufs = 0;
+static pthread_key_t    log_key;
+static pthread_t        log_thread;
+static pthread_mutex_t  log_qlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   log_qcond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t   log_space = PTHREAD_COND_INITIALIZER;
+static log_chunk_t      *log_head = NULL;
+static log_chunk_t      *log_tail = NULL;
+static unsigned int     log_queued = 0;
+static short int        log_running = 0;
+static int              log_fd = -1;
+
+static log_chunk_t *
+        log_chunk_new(const size_t size) {
+
+    log_chunk_t *c;
+
+    if ((c = (log_chunk_t *) malloc(sizeof (log_chunk_t) + size)) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for log buffer\n");
+        exit(ENOMEM);
+    }
+    c->next = NULL;
+    c->len = 0;
+    c->size = size;
+    return c;
+}
+
+static void
+        log_enqueue(log_chunk_t *c, const short int wait) {
+
+/*
+ * Description:
+ * Hands a buffer over to the writer thread. If wait is set and the writer lags behind by more
+ * than LOG_QUEUE_MAX buffers, the caller waits, which bounds the memory used for logging.
+ *
+ */
+    pthread_mutex_lock(&log_qlock);
+    while (wait && log_running && log_queued >= LOG_QUEUE_MAX)
+        pthread_cond_wait(&log_space, &log_qlock);
+    if (log_tail != NULL)
+        log_tail->next = c;
+    else
+        log_head = c;
+    log_tail = c;
+    log_queued++;
+    pthread_cond_signal(&log_qcond);
+    pthread_mutex_unlock(&log_qlock);
+}
+
+static void
+        log_collect(void) {
+
+/*
+ * Description:
+ * Moves all partially filled thread buffers to the writer queue.
+ *
+ */
+    log_chunk_t *c;
+    size_t      i;
+
+    for (i = 0; i < nbufs; i++) {
+        pthread_mutex_lock(&bufs[i].lock);
+        c = bufs[i].cur;
+        if (c != NULL && c->len > 0)
+            bufs[i].cur = NULL;
+        else
+            c = NULL;
+        pthread_mutex_unlock(&bufs[i].lock);
+        if (c != NULL)
+            log_enqueue(c, 0);
+    }
+}
+
+static void
+        log_write_chunk(log_chunk_t *c) {
+
+/*
+ * Description:
+ * Writes a buffer to the log file, normally with one write() call.
+ *
+ */
+    size_t      done = 0;
+    ssize_t     n;
+
+    while (done < c->len) {
+        errno = 0;
+        if ((n = write(log_fd, c->data + done, c->len - done)) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "ERROR: Problems writing logfile <%s>: %s\n", logdir, strerror(errno));
+            exit(ENOSPC);
+        }
+        done += (size_t) n;
+    }
+}
+
+static void *
+        log_writer(void *arg) {
+
+/*
+ * Description:
+ * Writer thread: writes queued buffers in the order they were queued and collects partially
+ * filled buffers once per second. Terminates after log_shutdown when everything is written.
+ *
+ */
+    log_chunk_t     *list, *next;
+    struct timespec ts;
+    short int       stop;
+
+    pthread_mutex_lock(&log_qlock);
+    for (;;) {
+        if (log_head == NULL && log_running) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec++;
+            pthread_cond_timedwait(&log_qcond, &log_qlock, &ts);
+        }
+        if (log_head == NULL) {
+            stop = !log_running;
+            pthread_mutex_unlock(&log_qlock);
+            log_collect();
+            pthread_mutex_lock(&log_qlock);
+            if (log_head == NULL && stop)
+                break;
+            continue;
+        }
+        list = log_head;
+        log_head = log_tail = NULL;
+        log_queued = 0;
+        pthread_cond_broadcast(&log_space);
+        pthread_mutex_unlock(&log_qlock);
+        for (; list != NULL; list = next) {
+            next = list->next;
+            log_write_chunk(list);
+            free(list);
+        }
+        pthread_mutex_lock(&log_qlock);
+    }
+    pthread_mutex_unlock(&log_qlock);
+    return arg;
+}
+
+void
+        log_init(const size_t n) {
+
+/*
+ * Description:
+ * Switches the log file to buffered logging and starts the writer thread.
+ *
+ * Parameters:
+ * n:           number of thread buffers; threads not registered with log_register share the
+ *              last one
+ *
+ */
+    size_t  i;
+
+    if ((bufs = (log_buf_t *) calloc(n, sizeof (log_buf_t))) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for log buffers\n");
+        exit(ENOMEM);
+    }
+    for (i = 0; i < n; i++) {
+        pthread_mutex_init(&bufs[i].lock, NULL);
+        bufs[i].stamp = (time_t) -1;
+    }
+    nbufs = n;
+    pthread_key_create(&log_key, NULL);
+/*
+ * everything written with stdio so far has to precede the buffered lines
+ */
+    fflush(fplog);
+    log_fd = fileno(fplog);
+    log_running = 1;
+    if (pthread_create(&log_thread, NULL, log_writer, NULL) != 0) {
+        fprintf(stderr, "ERROR: Couldn't create log writer thread\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void
+        log_register(const unsigned int slot) {
+
+/*
+ * Description:
+ * Assigns thread buffer slot to the calling thread.
+ *
+ */
+    pthread_setspecific(log_key, &bufs[slot]);
+}
+
+short int
+        log_active(void) {
+
+    return log_running;
+}
+
+void
+        log_put(const char *level, const char *emsg) {
+
+/*
+ * Description:
+ * Adds a log line with time stamp and severity to the calling thread's buffer.
+ *
+ * Parameters:
+ * level:       severity string, e.g. "INFO: "
+ * emsg:        message
+ *
+ */
+    log_buf_t   *lb;
+    log_chunk_t *full = NULL;
+    struct tm   tim;
+    time_t      now;
+    size_t      tlen, llen, mlen, need;
+
+    if ((lb = (log_buf_t *) pthread_getspecific(log_key)) == NULL)
+        lb = &bufs[nbufs - 1];
+    llen = strlen(level);
+    mlen = strlen(emsg);
+    pthread_mutex_lock(&lb->lock);
+    now = time(NULL);
+    if (now != lb->stamp) {
+        localtime_r(&now, &tim);
+        strftime(lb->timestr, (size_t) SMAX, "%a %b %d %H:%M:%S %Y ", &tim);
+        lb->stamp = now;
+    }
+    tlen = strlen(lb->timestr);
+    need = tlen + llen + mlen + 1;
+    if (lb->cur != NULL && lb->cur->len + need > lb->cur->size) {
+        full = lb->cur;
+        lb->cur = NULL;
+    }
+    if (lb->cur == NULL)
+        lb->cur = log_chunk_new((need > LOG_BUF_SIZE) ? need : (size_t) LOG_BUF_SIZE);
+    memcpy(lb->cur->data + lb->cur->len, lb->timestr, tlen);
+    memcpy(lb->cur->data + lb->cur->len + tlen, level, llen);
+    memcpy(lb->cur->data + lb->cur->len + tlen + llen, emsg, mlen);
+    lb->cur->data[lb->cur->len + need - 1] = '\n';
+    lb->cur->len += need;
+    pthread_mutex_unlock(&lb->lock);
+    if (full != NULL)
+        log_enqueue(full, 1);
+}
+
+void
+        log_shutdown(void) {
+
+/*
+ * Description:
+ * Writes all buffered lines, stops the writer thread and switches back to unbuffered logging.
+ * To be called when no other thread logs anymore.
+ *
+ */
+    size_t  i;
+
+    if (!log_running)
+        return;
+    pthread_mutex_lock(&log_qlock);
+    log_running = 0;
+    pthread_cond_broadcast(&log_qcond);
+    pthread_cond_broadcast(&log_space);
+    pthread_mutex_unlock(&log_qlock);
+    pthread_join(log_thread, NULL);
+    for (i = 0; i < nbufs; i++) {
+        free(bufs[i].cur);
+        pthread_mutex_destroy(&bufs[i].lock);
+    }
+    free(bufs);
+    bufs = NULL;
+    nbufs = 0;
+    pthread_key_delete(log_key);
+}
@@ -0,0 +1,296 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * machine readable metrics (option -M)
+ *
+ * A sample of the statistic counters is written every metrics interval and once at the end of
+ * the scan, either as one JSON object per line or in the Prometheus text format. JSON lines
+ * are appended to the metrics file, so a long run can be graphed afterwards. A Prometheus file
+ * holds the latest sample only; it is written under a temporary name and renamed, as the
+ * textfile collector of the node exporter expects. A target unix:<path> sends the samples to
+ * a Unix domain stream socket instead.
+ */
+
+#include <stdarg.h>
+#include "chuid.h"
+
+typedef struct metrics_buf {
+    char                *buf;
+    size_t              len;
+    size_t              size;
+} metrics_buf_t;
+
+static char             *metrics_target = NULL;
+static char             *metrics_tmp = NULL;
+static int              metrics_format = METRICS_JSON;
+static int              metrics_fd = -1;
+static short int        metrics_failed = 0;
+static metrics_buf_t    mb = { NULL, 0, 0 };
+
+static void
+        mb_printf(const char *fmt, ...) {
+
+/*
+ * Description:
+ * Appends formatted text to the sample buffer.
+ *
+ */
+    va_list ap;
+    int     n;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(mb.buf + mb.len, mb.size - mb.len, fmt, ap);
+        va_end(ap);
+        if (n >= 0 && (size_t) n < mb.size - mb.len) {
+            mb.len += (size_t) n;
+            return;
+        }
+        mb.size = (mb.size == 0) ? 4096 : 2 * mb.size;
+        if ((mb.buf = (char *) realloc(mb.buf, mb.size)) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for metrics buffer\n");
+            exit(ENOMEM);
+        }
+    }
+}
+
+static void
+        mb_hist_json(const char *name, const unsigned long count, const unsigned long ns, const unsigned long *hist) {
+
+    int     i;
+
+    mb_printf(",\"%s\":{\"count\":%lu,\"sum_us\":%lu,\"hist_us\":[", name, count, ns / 1000);
+    for (i = 0; i < STAT_LAT_BUCKETS; i++)
+        mb_printf("%s%lu", (i > 0) ? "," : "", hist[i]);
+    mb_printf("]}");
+}
+
+static void
+        mb_hist_prom(const char *name, const char *help, const unsigned long count, const unsigned long ns, const unsigned long *hist) {
+
+/*
+ * Description:
+ * Appends a latency histogram in the Prometheus format, which has cumulative buckets.
+ *
+ */
+    unsigned long   sum = 0;
+    int             i;
+
+    mb_printf("# HELP chuid_%s_seconds %s\n# TYPE chuid_%s_seconds histogram\n", name, help, name);
+    for (i = 0; i < STAT_LAT_BUCKETS - 1; i++) {
+        sum += hist[i];
+        mb_printf("chuid_%s_seconds_bucket{le=\"%g\"} %lu\n", name, (double) (1UL << i) / 1e6, sum);
+    }
+    mb_printf("chuid_%s_seconds_bucket{le=\"+Inf\"} %lu\n", name, count);
+    mb_printf("chuid_%s_seconds_sum %.9f\nchuid_%s_seconds_count %lu\n", name, (double) ns / 1e9, name, count);
+}
+
+static void
+        mb_prom(const char *name, const char *type, const char *help, const unsigned long value) {
+
+    mb_printf("# HELP chuid_%s %s\n# TYPE chuid_%s %s\nchuid_%s %lu\n", name, help, name, type, name, value);
+}
+
+static void
+        metrics_format_sample(const metrics_sample_t *m) {
+
+/*
+ * Description:
+ * Formats a sample into the sample buffer.
+ *
+ */
+    mb.len = 0;
+    if (metrics_format == METRICS_JSON) {
+        mb_printf("{\"time\":%ld,\"elapsed\":%.3f,\"threads\":%lu,\"active\":%lu,\"busy\":%lu,\"queue_fast\":%lu,\"queue_slow\":%lu",
+                  (long) time(NULL), m->elapsed, m->threads, m->active, m->busy, m->queued_fast, m->queued_slow);
+        mb_printf(",\"files\":%lu,\"directories\":%lu,\"links\":%lu,\"others\":%lu,\"hardlink_hits\":%lu,\"transfers\":%lu,\"busy_us\":%lu",
+                  m->files, m->dirs, m->links, m->others, m->hashhits, m->transfers, m->busy_ns / 1000);
+        mb_hist_json("lstat", m->lstats, m->lstat_ns, m->lstat_hist);
+        mb_hist_json("chown", m->chowns, m->chown_ns, m->chown_hist);
+        mb_printf("}\n");
+        return;
+    }
+    mb_printf("# HELP chuid_elapsed_seconds Time since the start of the scan.\n# TYPE chuid_elapsed_seconds gauge\nchuid_elapsed_seconds %.3f\n", m->elapsed);
+    mb_prom("threads", "gauge", "Number of worker threads.", m->threads);
+    mb_prom("threads_active", "gauge", "Number of active worker threads.", m->active);
+    mb_prom("threads_busy", "gauge", "Number of worker threads processing a subtree.", m->busy);
+    mb_printf("# HELP chuid_queue_elements Queue elements in the global queues.\n# TYPE chuid_queue_elements gauge\n");
+    mb_printf("chuid_queue_elements{queue=\"fast\"} %lu\nchuid_queue_elements{queue=\"slow\"} %lu\n", m->queued_fast, m->queued_slow);
+    mb_printf("# HELP chuid_entries_total Directory entries checked.\n# TYPE chuid_entries_total counter\n");
+    mb_printf("chuid_entries_total{type=\"file\"} %lu\nchuid_entries_total{type=\"directory\"} %lu\n", m->files, m->dirs);
+    mb_printf("chuid_entries_total{type=\"link\"} %lu\nchuid_entries_total{type=\"other\"} %lu\n", m->links, m->others);
+    mb_prom("hardlink_hits_total", "counter", "Files with several links found in the hardlink table.", m->hashhits);
+    mb_prom("queue_transfers_total", "counter", "Queue elements handed over to the global queues.", m->transfers);
+    mb_printf("# HELP chuid_thread_busy_seconds_total Time the worker threads spent processing subtrees.\n# TYPE chuid_thread_busy_seconds_total counter\nchuid_thread_busy_seconds_total %.6f\n", (double) m->busy_ns / 1e9);
+    mb_hist_prom("lstat", "Latency of lstat calls.", m->lstats, m->lstat_ns, m->lstat_hist);
+    mb_hist_prom("chown", "Latency of lchown calls.", m->chowns, m->chown_ns, m->chown_hist);
+}
+
+static int
+        metrics_connect(const char *path) {
+
+/*
+ * Description:
+ * Connects to a Unix domain stream socket.
+ *
+ * Return value:
+ * socket descriptor, -1 with errno set on failure
+ *
+ */
+#if defined(HAVE_SYS_SOCKET_H) && defined(HAVE_SYS_UN_H)
+    struct sockaddr_un  addr;
+    int                 fd, err;
+
+    if (strlen(path) >= sizeof (addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof (struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *) &addr, sizeof (struct sockaddr_un)) != 0) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+static int
+        metrics_put(const int fd) {
+
+/*
+ * Description:
+ * Writes the sample buffer to fd.
+ *
+ * Return value:
+ * 0 on success, -1 with errno set on failure
+ *
+ */
+    size_t  off = 0;
+    ssize_t n;
+
+    while (off < mb.len) {
+        if ((n = write(fd, mb.buf + off, mb.len - off)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        off += (size_t) n;
+    }
+    return 0;
+}
+
+void
+        metrics_open(const char *target, const int format) {
+
+/*
+ * Description:
+ * Opens the metrics target. Exits if it can't be opened.
+ *
+ * Parameters:
+ * target:      metrics file or unix:<socket path>
+ * format:      METRICS_JSON or METRICS_PROMETHEUS
+ *
+ */
+    size_t  len = strlen(target) + 5;
+
+    metrics_format = format;
+    if ((metrics_target = strdup(target)) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for metrics target string\n");
+        exit(ENOMEM);
+    }
+    errno = 0;
+    if (strncmp(target, "unix:", 5) == 0) {
+        if ((metrics_fd = metrics_connect(target + 5)) < 0) {
+            fprintf(stderr, "ERROR: Couldn't connect to metrics socket <%s>: %s\n", target + 5, strerror(errno));
+            exit(errno);
+        }
+#ifdef SIGPIPE
+        signal(SIGPIPE, SIG_IGN);
+#endif
+    } else if (format == METRICS_PROMETHEUS) {
+        if ((metrics_tmp = (char *) malloc(sizeof (char) * len)) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for metrics target string\n");
+            exit(ENOMEM);
+        }
+        snprintf(metrics_tmp, len, "%s.tmp", target);
+    } else if ((metrics_fd = open(target, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+        fprintf(stderr, "ERROR: Couldn't open metrics file <%s>: %s\n", target, strerror(errno));
+        exit(errno);
+    }
+}
+
+void
+        metrics_write(const metrics_sample_t *m) {
+
+/*
+ * Description:
+ * Writes a sample to the metrics target. After a failure a warning is logged and no further
+ * samples are written.
+ *
+ */
+    int     fd, rc;
+
+    if (metrics_target == NULL || metrics_failed)
+        return;
+    metrics_format_sample(m);
+    errno = 0;
+    if (metrics_tmp != NULL) {
+        if ((fd = open(metrics_tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+            rc = -1;
+        } else {
+            rc = metrics_put(fd);
+            if (close(fd) != 0)
+                rc = -1;
+            if (rc == 0)
+                rc = rename(metrics_tmp, metrics_target);
+        }
+    } else {
+        rc = metrics_put(metrics_fd);
+    }
+    if (rc != 0) {
+        print_errno_r(WARNING, errno, "couldn't write metrics, no further samples written to", metrics_target);
+        metrics_failed = 1;
+    }
+}
+
+void
+        metrics_close(void) {
+
+/*
+ * Description:
+ * Closes the metrics target.
+ *
+ */
+    if (metrics_fd >= 0)
+        close(metrics_fd);
+    metrics_fd = -1;
+    free(metrics_target);
+    free(metrics_tmp);
+    free(mb.buf);
+    metrics_target = NULL;
+    metrics_tmp = NULL;
+    mb.buf = NULL;
+    mb.len = mb.size = 0;
+}
@@ -0,0 +1,259 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * quota based prescan of the roots
+ *
+ * Quota accounting knows the number of inodes every uid and gid owns on a file system. Before
+ * the scan, the usage of all old ids of the input file is queried on the file system holding a
+ * root and on every file system mounted below it (the traversal crosses mount points). If all
+ * of these report quota information and none of the old ids owns an inode, nothing below the
+ * root can be changed and the root is skipped. Without quota information (quotas not enabled,
+ * no permission, file system without quota support) the root is scanned as usual.
+ * Quota usage is kept per file system, not per directory, so a root is only skipped if the
+ * complete file systems involved hold no entry of a mapped owner.
+ */
+
+#include "chuid.h"
+
+extern short int        verbose;
+
+#if defined(HAVE_SYS_QUOTA_H) && defined(HAVE_MNTENT_H)
+
+typedef struct pre_mount {
+    char                *dir;
+    char                *fsname;
+} pre_mount_t;
+
+/*
+ * QCMD of <sys/quota.h> shifts Q_GETQUOTA out of the range of int
+ */
+#define PRE_QCMD(cmd, type) ((int) (((unsigned int) (cmd) << SUBCMDSHIFT) | ((unsigned int) (type) & SUBCMDMASK)))
+
+static pre_mount_t      *mounts = NULL;
+static size_t           nmounts = 0;
+
+static void
+        pre_load_mounts(void) {
+
+/*
+ * Description:
+ * Reads the mount table.
+ *
+ */
+    FILE            *fp;
+    struct mntent   *m;
+    size_t          size = 0;
+
+    errno = 0;
+    if ((fp = setmntent("/proc/self/mounts", "r")) == NULL && (fp = setmntent(MOUNTED, "r")) == NULL) {
+        print_errno_r(WARNING, errno, "prescan: couldn't read mount table", MOUNTED);
+        return;
+    }
+    while ((m = getmntent(fp)) != NULL) {
+        if (nmounts >= size) {
+            size = (size == 0) ? 64 : 2 * size;
+            if ((mounts = (pre_mount_t *) realloc(mounts, size * sizeof (pre_mount_t))) == NULL) {
+                fprintf(stderr, "ERROR: No memory available for mount table\n");
+                exit(ENOMEM);
+            }
+        }
+        if ((mounts[nmounts].dir = strdup(m->mnt_dir)) == NULL ||
+            (mounts[nmounts].fsname = strdup(m->mnt_fsname)) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for mount table\n");
+            exit(ENOMEM);
+        }
+        nmounts++;
+    }
+    endmntent(fp);
+}
+
+static short int
+        pre_below(const char *path, const char *dir) {
+
+/*
+ * Description:
+ * Returns 1 if path is dir or lies below dir, 0 otherwise.
+ *
+ */
+    size_t  len = strlen(dir);
+
+    if (strcmp(dir, "/") == 0)
+        return 1;
+    return strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+static int
+        pre_query(const pre_mount_t *mnt, const int type, const unsigned int id, struct dqblk *dq) {
+
+/*
+ * Description:
+ * Gets the quota usage of id on a mounted file system, through the mount point if the kernel
+ * supports quotactl_fd, otherwise through the device.
+ *
+ * Return value:
+ * 0 on success, -1 with errno set otherwise
+ *
+ */
+#if HAVE_DECL_SYS_QUOTACTL_FD
+    int     fd, rc, err;
+
+    if ((fd = open(mnt->dir, O_RDONLY | O_DIRECTORY)) >= 0) {
+        rc = (int) syscall(SYS_quotactl_fd, fd, PRE_QCMD(Q_GETQUOTA, type), id, dq);
+        err = errno;
+        close(fd);
+        errno = err;
+        if (rc == 0 || errno != ENOSYS)
+            return rc;
+    }
+#endif
+    return quotactl(PRE_QCMD(Q_GETQUOTA, type), mnt->fsname, (int) id, (caddr_t) dq);
+}
+
+static int
+        pre_usage(const pre_mount_t *mnt, const int type, const idmap_t *map, unsigned long long *inodes) {
+
+/*
+ * Description:
+ * Adds the number of inodes owned by the old ids of map on a file system to inodes.
+ *
+ * Return value:
+ * 0 on success, the error number if quota information is missing
+ *
+ */
+    struct dqblk    dq;
+    size_t          i;
+
+    for (i = 0; i < map->count; i++) {
+        memset(&dq, 0, sizeof (struct dqblk));
+        errno = 0;
+        if (pre_query(mnt, type, map->entries[i].oldid, &dq) != 0)
+            return (errno != 0) ? errno : EINVAL;
+        if (!(dq.dqb_valid & QIF_INODES))
+            return ENODATA;
+        *inodes += (unsigned long long) dq.dqb_curinodes;
+    }
+    return 0;
+}
+
+static void
+        pre_report(const char *root, const char *what, const char *detail) {
+
+    char    *msg = NULL;
+    size_t  len = strlen(root) + strlen(what) + strlen(detail) + 16;
+
+    if ((msg = (char *) malloc(sizeof (char) * len)) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for message string\n");
+        exit(ENOMEM);
+    }
+    snprintf(msg, len, "prescan <%s>: %s%s", root, what, detail);
+    print_error(INFO, msg);
+    if (verbose)
+        fprintf(stdout, "INFO: %s\n", msg);
+    free(msg);
+}
+
+static void
+        pre_root(fs_root_t *root, const idmap_t *umap, const idmap_t *gmap) {
+
+/*
+ * Description:
+ * Checks the file systems of one root and marks the root to be skipped if none of them holds
+ * an entry of a mapped owner.
+ *
+ */
+    char                path[PATH_MAX], detail[PATH_MAX + 64];
+    const pre_mount_t   *top = NULL;
+    unsigned long long  inodes = 0;
+    size_t              i;
+    int                 err = 0;
+
+    errno = 0;
+    if (realpath(root->dirpath, path) == NULL) {
+        pre_report(root->dirpath, "couldn't resolve path, scanned: ", strerror(errno));
+        return;
+    }
+    for (i = 0; i < nmounts; i++) {
+        if (pre_below(path, mounts[i].dir) && (top == NULL || strlen(mounts[i].dir) >= strlen(top->dir)))
+            top = &mounts[i];
+    }
+    if (top == NULL) {
+        pre_report(root->dirpath, "file system not found in mount table, scanned", "");
+        return;
+    }
+    for (i = 0; i < nmounts && err == 0; i++) {
+        if (&mounts[i] != top && (strcmp(mounts[i].dir, top->dir) == 0 || !pre_below(mounts[i].dir, path)))
+            continue;
+        if (umap->count > 0)
+            err = pre_usage(&mounts[i], USRQUOTA, umap, &inodes);
+        if (err == 0 && gmap->count > 0)
+            err = pre_usage(&mounts[i], GRPQUOTA, gmap, &inodes);
+        if (err != 0)
+            snprintf(detail, sizeof (detail), "%s: %s", mounts[i].dir, strerror(err));
+    }
+    if (err != 0) {
+        pre_report(root->dirpath, "no quota information, scanned: ", detail);
+    } else if (inodes == 0) {
+        root->skip = 1;
+        pre_report(root->dirpath, "no entries of mapped owners, skipped", "");
+    } else {
+        snprintf(detail, sizeof (detail), "%llu", inodes);
+        pre_report(root->dirpath, "entries of mapped owners on its file systems: ", detail);
+    }
+}
+
+#endif /* HAVE_SYS_QUOTA_H && HAVE_MNTENT_H */
+
+unsigned long
+        prescan_roots(fs_root_t *list, const idmap_t *umap, const idmap_t *gmap) {
+
+/*
+ * Description:
+ * Prescans all roots not yet skipped and marks those which can't contain entries of mapped
+ * owners.
+ *
+ * Parameters:
+ * list:        list of roots
+ * umap:        uid mapping table
+ * gmap:        gid mapping table
+ *
+ * Return value:
+ * number of roots newly marked to be skipped
+ *
+ */
+    unsigned long   skipped = 0;
+#if defined(HAVE_SYS_QUOTA_H) && defined(HAVE_MNTENT_H)
+    fs_root_t       *ptr;
+    size_t          i;
+
+    pre_load_mounts();
+    for (ptr = list; ptr != NULL; ptr = ptr->next) {
+        if (ptr->skip)
+            continue;
+        pre_root(ptr, umap, gmap);
+        skipped += ptr->skip;
+    }
+    for (i = 0; i < nmounts; i++) {
+        free(mounts[i].dir);
+        free(mounts[i].fsname);
+    }
+    free(mounts);
+    mounts = NULL;
+    nmounts = 0;
+#else
+    print_error(WARNING, "prescan: no quota support on this system, all roots are scanned");
+#endif
+    return skipped;
+}
@@ -173,3 +173,47 @@ queue_element_t *
         exit(EXIT_FAILURE);
     }
 }
+
+void
+        deq_take(queue_anchor_t *local, queue_anchor_t *taken, long count, const short int from_last) {
+
+/*
+ * Description:
+ * This function moves count elements from the front or the back of a double ended queue into
+ * an empty double ended queue, keeping their order.
+ *
+ * Parameter:
+ * local:     double ended queue the elements are taken from
+ * taken:     empty double ended queue receiving the elements
+ * count:     number of elements, at most the number of elements in local
+ * from_last: take the elements from the back of local instead of the front
+ */
+    queue_element_t *ptr;
+    long            i;
+
+    if (count > local->element_counter)
+        count = local->element_counter;
+    if (count <= 0)
+        return;
+    if (count == local->element_counter) {
+        deq_append(taken, local);
+        return;
+    }
+    if (from_last) {
+        for (ptr = local->first, i = 1; i < local->element_counter - count; i++)
+            ptr = ptr->next;
+        taken->first = ptr->next;
+        taken->last = local->last;
+        ptr->next = NULL;
+        local->last = ptr;
+    } else {
+        for (ptr = local->first, i = 1; i < count; i++)
+            ptr = ptr->next;
+        taken->first = local->first;
+        taken->last = ptr;
+        local->first = ptr->next;
+        ptr->next = NULL;
+    }
+    taken->element_counter = count;
+    local->element_counter -= count;
+}
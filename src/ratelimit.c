@@ -0,0 +1,353 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * rate limit of stat and chown operations (options -L and --latency-target)
+ *
+ * Every file system of the roots gets a token bucket filled at its budget of operations per
+ * second: the smallest ops= of its roots in the directory file, else the budget of -L. File
+ * systems are told apart like the device groups of -D. A thread takes the tokens of about
+ * 10 ms of its share of the budget at once and spends them without locking. If the bucket is
+ * empty the thread takes the tokens anyway and sleeps until they are due, so a thread never
+ * waits for the lock of a bucket any longer than it takes to do the bookkeeping.
+ *
+ * With a latency target the rate of every bucket is adapted by additive increase and
+ * multiplicative decrease (AIMD): once a second the mean latency of the lstat calls on the file
+ * system is compared with the target. Above it the rate is cut by 30 %, else it grows by 5 % of
+ * the budget, which it never exceeds.
+ */
+
+#include "chuid.h"
+
+extern short int        verbose;
+
+#define RATE_INTERVAL_NS    1000000000ULL
+#define RATE_CHUNK_NS       10000000ULL
+#define RATE_BURST_NS       50000000ULL
+#define RATE_MAX_CHUNK      64
+#define RATE_MIN_SAMPLES    16
+#define RATE_DECREASE       0.7
+#define RATE_INCREASE       0.05
+
+/*
+ * tokens and lstat latencies of one thread, padded so that two threads never write to the same
+ * cache line
+ */
+typedef struct rate_slot {
+    unsigned long       credit;
+    stat_counter_t      lat_ns;
+    stat_counter_t      lat_n;
+    char                pad[CACHE_LINE];
+} rate_slot_t;
+
+struct rate_bucket {
+    pthread_mutex_t     lock;
+    char                *name;
+    double              budget;
+    double              rate;
+    double              lowest;
+    double              tokens;
+    unsigned long long  last;
+    unsigned long long  adjusted;
+    unsigned long       seen_ns;
+    unsigned long       seen_n;
+    unsigned long       decreases;
+    unsigned long long  waited_ns;
+    rate_slot_t         *slots;
+};
+
+static rate_bucket_t    **buckets = NULL;
+static long             nbuckets = 0;
+static rate_bucket_t    *fallback = NULL;
+static size_t           rate_threads = 1;
+static unsigned long long rate_target = 0;
+
+static unsigned long long
+        rate_now(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + (unsigned long long) ts.tv_nsec;
+}
+
+static rate_bucket_t *
+        rate_new(const char *name, const double budget) {
+
+/*
+ * Description:
+ * Creates a bucket with a budget of operations per second (0 for one still unknown) and adds it
+ * to the buckets.
+ *
+ */
+    rate_bucket_t   *b;
+
+    if ((b = (rate_bucket_t *) calloc(1, sizeof (rate_bucket_t))) == NULL ||
+        (b->name = strdup(name)) == NULL ||
+        (buckets = (rate_bucket_t **) realloc(buckets, (nbuckets + 1) * sizeof (rate_bucket_t *))) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for rate limit\n");
+        exit(ENOMEM);
+    }
+    b->budget = budget;
+    buckets[nbuckets++] = b;
+    return b;
+}
+
+static void
+        rate_start(rate_bucket_t *b) {
+
+/*
+ * Description:
+ * Sets up a bucket whose budget is known.
+ *
+ */
+    if ((b->slots = (rate_slot_t *) calloc(rate_threads, sizeof (rate_slot_t))) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for rate limit\n");
+        exit(ENOMEM);
+    }
+    pthread_mutex_init(&b->lock, NULL);
+    b->rate = b->lowest = b->budget;
+    b->last = b->adjusted = rate_now();
+    if (verbose)
+        fprintf(stdout, "INFO: rate limit <%s>: %.0f operations/s\n", b->name, b->budget);
+}
+
+long
+        rate_init(fs_root_t *list, const size_t numthr, const long ops, const unsigned long target_ns) {
+
+/*
+ * Description:
+ * Creates the buckets of the file systems of the roots and stores the bucket of each root in
+ * its bucket field. Roots without a budget get no bucket.
+ *
+ * Parameters:
+ * list:        list of roots
+ * numthr:      number of worker threads
+ * ops:         budget of -L in operations per second or 0
+ * target_ns:   lstat latency target in nanoseconds or 0
+ *
+ * Return value:
+ * number of buckets
+ *
+ */
+    fs_root_t       *ptr;
+    rate_bucket_t   *b;
+    char            key[64];
+    const char      *name;
+    long            i, n;
+
+    rate_threads = (numthr > 0) ? numthr : 1;
+    rate_target = target_ns;
+    for (ptr = list; ptr != NULL; ptr = ptr->next) {
+        name = dev_key(ptr, key, sizeof (key));
+        for (i = 0; i < nbuckets && strcmp(buckets[i]->name, name) != 0; i++)
+            ;
+        b = (i < nbuckets) ? buckets[i] : rate_new(name, 0.0);
+        if (ptr->maxops > 0 && (b->budget == 0.0 || (double) ptr->maxops < b->budget))
+            b->budget = (double) ptr->maxops;
+        ptr->bucket = b;
+    }
+/*
+ * file systems without ops= get the budget of -L, without that they aren't limited
+ */
+    for (i = 0; i < nbuckets; i++) {
+        if (buckets[i]->budget == 0.0)
+            buckets[i]->budget = (double) ops;
+    }
+    for (ptr = list; ptr != NULL; ptr = ptr->next) {
+        if (ptr->bucket->budget == 0.0)
+            ptr->bucket = NULL;
+    }
+    for (i = 0, n = 0; i < nbuckets; i++) {
+        b = buckets[i];
+        if (b->budget > 0.0) {
+            rate_start(b);
+            buckets[n++] = b;
+        } else {
+            free(b->name);
+            free(b);
+        }
+    }
+    nbuckets = n;
+/*
+ * without roots (path list) all entries share a bucket with the budget of -L
+ */
+    if (ops > 0 && list == NULL) {
+        fallback = rate_new("default", (double) ops);
+        rate_start(fallback);
+    }
+    return nbuckets;
+}
+
+rate_bucket_t *
+        rate_of(const fs_root_t *fs) {
+
+/*
+ * Description:
+ * Returns the bucket the operations below root fs take their tokens from, NULL if they aren't
+ * limited.
+ *
+ */
+    return (fs != NULL) ? fs->bucket : fallback;
+}
+
+static void
+        rate_adjust(rate_bucket_t *b, const unsigned long long now) {
+
+/*
+ * Description:
+ * Adapts the rate of a bucket to the mean lstat latency since the last adjustment. Called with
+ * the bucket locked.
+ *
+ */
+    unsigned long   ns = 0, n = 0;
+    double          mean;
+    size_t          i;
+
+    for (i = 0; i < rate_threads; i++) {
+        ns += STAT_GET(b->slots[i].lat_ns);
+        n += STAT_GET(b->slots[i].lat_n);
+    }
+    b->adjusted = now;
+    if (n - b->seen_n < RATE_MIN_SAMPLES)
+        return;
+    mean = (double) (ns - b->seen_ns) / (double) (n - b->seen_n);
+    b->seen_ns = ns;
+    b->seen_n = n;
+    if (mean > (double) rate_target) {
+        b->rate *= RATE_DECREASE;
+        if (b->rate < b->budget / 100.0)
+            b->rate = b->budget / 100.0;
+        if (b->rate < 1.0)
+            b->rate = 1.0;
+        b->decreases++;
+    } else {
+        b->rate += b->budget * RATE_INCREASE;
+        if (b->rate > b->budget)
+            b->rate = b->budget;
+    }
+    if (b->rate < b->lowest)
+        b->lowest = b->rate;
+}
+
+void
+        rate_take(const unsigned int tid, rate_bucket_t *b, const unsigned long n) {
+
+/*
+ * Description:
+ * Takes n tokens for thread tid from its credit, refilled from the bucket. Sleeps until the
+ * tokens are due if the bucket is empty.
+ *
+ */
+    rate_slot_t         *slot = &b->slots[tid];
+    unsigned long long  now, wait = 0;
+    unsigned long       chunk;
+    double              burst, c;
+    struct timespec     ts;
+
+    if (slot->credit >= n) {
+        slot->credit -= n;
+        return;
+    }
+    pthread_mutex_lock(&b->lock);
+    now = rate_now();
+    b->tokens += (double) (now - b->last) * b->rate / 1e9;
+    b->last = now;
+    if (rate_target > 0 && now - b->adjusted >= RATE_INTERVAL_NS)
+        rate_adjust(b, now);
+    burst = b->rate * (double) RATE_BURST_NS / 1e9;
+    if (b->tokens > burst)
+        b->tokens = burst;
+    c = b->rate * (double) RATE_CHUNK_NS / 1e9 / (double) rate_threads;
+    chunk = (c < 1.0) ? 1 : (c > RATE_MAX_CHUNK) ? RATE_MAX_CHUNK : (unsigned long) c;
+    if (chunk < n - slot->credit)
+        chunk = n - slot->credit;
+    b->tokens -= (double) chunk;
+    if (b->tokens < 0.0) {
+        wait = (unsigned long long) (-b->tokens / b->rate * 1e9);
+        b->waited_ns += wait;
+    }
+    pthread_mutex_unlock(&b->lock);
+    slot->credit += chunk - n;
+    if (wait > 0) {
+        ts.tv_sec = (time_t) (wait / 1000000000ULL);
+        ts.tv_nsec = (long) (wait % 1000000000ULL);
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+            ;
+    }
+}
+
+void
+        rate_latency(const unsigned int tid, rate_bucket_t *b, const unsigned long ns) {
+
+/*
+ * Description:
+ * Records the latency of an lstat call of thread tid for the rate adaption of a bucket.
+ *
+ */
+    if (rate_target == 0)
+        return;
+    STAT_ADD(b->slots[tid].lat_ns, ns);
+    STAT_INC(b->slots[tid].lat_n);
+}
+
+short int
+        rate_summary(const long i, char *msg, const size_t len) {
+
+/*
+ * Description:
+ * Describes bucket i for the log.
+ *
+ * Return value:
+ * 1 if msg has been filled, 0 if there's no bucket i
+ *
+ */
+    rate_bucket_t   *b;
+
+    if (i < 0 || i >= nbuckets)
+        return 0;
+    b = buckets[i];
+    if (rate_target > 0)
+        snprintf(msg, len, "rate limit <%s>: budget %.0f operations/s, lowest rate %.0f, final rate %.0f, %lu decreases, threads waited %.1f s",
+                 b->name, b->budget, b->lowest, b->rate, b->decreases, (double) b->waited_ns / 1e9);
+    else
+        snprintf(msg, len, "rate limit <%s>: budget %.0f operations/s, threads waited %.1f s", b->name, b->budget, (double) b->waited_ns / 1e9);
+    return 1;
+}
+
+void
+        rate_free(fs_root_t *list) {
+
+/*
+ * Description:
+ * Releases the buckets and clears the bucket fields of the roots.
+ *
+ */
+    fs_root_t   *ptr;
+    long        i;
+
+    for (ptr = list; ptr != NULL; ptr = ptr->next)
+        ptr->bucket = NULL;
+    for (i = 0; i < nbuckets; i++) {
+        pthread_mutex_destroy(&buckets[i]->lock);
+        free(buckets[i]->name);
+        free(buckets[i]->slots);
+        free(buckets[i]);
+    }
+    free(buckets);
+    buckets = NULL;
+    nbuckets = 0;
+    fallback = NULL;
+}
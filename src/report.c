@@ -0,0 +1,253 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * ownership report (option -a)
+ *
+ * Instead of changing anything the threads count the entries and bytes of every (uid, gid)
+ * pair they come across, together with the lchown calls a real run would make for them. Each
+ * thread counts into a hash table of its own, so the traversal runs without any locking; the
+ * tables are merged when the scan is complete. The report lists the pairs by the number of
+ * entries and estimates the runtime of the real run from the duration of the traversal and the
+ * mean latency of lstat, which takes a metadata round trip just like lchown.
+ */
+
+#include "chuid.h"
+
+typedef struct report_entry {
+    unsigned int        uid;
+    unsigned int        gid;
+    unsigned long       files;
+    unsigned long       dirs;
+    unsigned long       links;
+    unsigned long       bytes;
+    unsigned long       chowns;
+    short int           used;
+} report_entry_t;
+
+/*
+ * one table per thread, padded so that two threads never write to the same cache line
+ */
+typedef struct report_table {
+    report_entry_t      *entries;
+    size_t              size;
+    size_t              count;
+    char                pad[CACHE_LINE];
+} report_table_t;
+
+static report_table_t   *tables = NULL;
+static size_t           ntables = 0;
+
+static size_t
+        report_slot(const report_entry_t *entries, const size_t size, const unsigned int uid, const unsigned int gid) {
+
+/*
+ * Description:
+ * Returns the slot of a (uid, gid) pair in a table of size slots (a power of 2): the slot
+ * holding the pair or the free slot it belongs to.
+ *
+ */
+    size_t  i = ((size_t) uid * 2654435761U ^ (size_t) gid * 40503U) & (size - 1);
+
+    while (entries[i].used && (entries[i].uid != uid || entries[i].gid != gid))
+        i = (i + 1) & (size - 1);
+    return i;
+}
+
+static void
+        report_grow(report_table_t *t) {
+
+/*
+ * Description:
+ * Doubles the size of a table.
+ *
+ */
+    report_entry_t  *old = t->entries;
+    size_t          oldsize = t->size, i;
+
+    t->size = (oldsize == 0) ? 64 : 2 * oldsize;
+    if ((t->entries = (report_entry_t *) calloc(t->size, sizeof (report_entry_t))) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for report table\n");
+        exit(ENOMEM);
+    }
+    for (i = 0; i < oldsize; i++) {
+        if (old[i].used)
+            t->entries[report_slot(t->entries, t->size, old[i].uid, old[i].gid)] = old[i];
+    }
+    free(old);
+}
+
+static report_entry_t *
+        report_get(report_table_t *t, const unsigned int uid, const unsigned int gid) {
+
+/*
+ * Description:
+ * Returns the entry of a (uid, gid) pair, adding it to the table if it's new.
+ *
+ */
+    report_entry_t  *e;
+
+    if (2 * (t->count + 1) > t->size)
+        report_grow(t);
+    e = &t->entries[report_slot(t->entries, t->size, uid, gid)];
+    if (!e->used) {
+        e->uid = uid;
+        e->gid = gid;
+        e->used = 1;
+        t->count++;
+    }
+    return e;
+}
+
+void
+        report_init(const size_t numthr) {
+
+/*
+ * Description:
+ * Creates the tables of numthr threads.
+ *
+ */
+    if ((tables = (report_table_t *) calloc(numthr, sizeof (report_table_t))) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for report tables\n");
+        exit(ENOMEM);
+    }
+    ntables = numthr;
+}
+
+void
+        report_add(const unsigned int tid, const struct stat *statbuf, const char type, const unsigned long chowns) {
+
+/*
+ * Description:
+ * Counts a directory entry in the table of thread tid.
+ *
+ * Parameters:
+ * tid:         thread id
+ * statbuf:     data returned by lstat for the entry
+ * type:        first letter of the entry type (F, D or L)
+ * chowns:      lchown calls a real run would make for the entry
+ *
+ */
+    report_entry_t  *e = report_get(&tables[tid], (unsigned int) statbuf->st_uid, (unsigned int) statbuf->st_gid);
+
+    if (type == 'F')
+        e->files++;
+    else if (type == 'D')
+        e->dirs++;
+    else
+        e->links++;
+    e->bytes += (unsigned long) statbuf->st_size;
+    e->chowns += chowns;
+}
+
+static int
+        report_cmp(const void *a, const void *b) {
+
+    const report_entry_t *x = (const report_entry_t *) a;
+    const report_entry_t *y = (const report_entry_t *) b;
+    unsigned long   nx = x->files + x->dirs + x->links;
+    unsigned long   ny = y->files + y->dirs + y->links;
+
+    if (nx != ny)
+        return (nx < ny) ? 1 : -1;
+    if (x->uid != y->uid)
+        return (x->uid < y->uid) ? -1 : 1;
+    return (x->gid < y->gid) ? -1 : (x->gid > y->gid);
+}
+
+static const char *
+        report_name(const idmap_t *map, const unsigned int id) {
+
+    const idmap_entry_t *e = idmap_lookup(map, id);
+
+    return (e != NULL) ? e->oldname : "-";
+}
+
+void
+        report_write(FILE *fp, const idmap_t *umap, const idmap_t *gmap, const double elapsed, const unsigned long lstats, const unsigned long lstat_ns, const size_t threads) {
+
+/*
+ * Description:
+ * Merges the tables of all threads, writes the report to fp and releases the tables.
+ *
+ * Parameters:
+ * fp:          stream the report is written to
+ * umap, gmap:  maps of the input file, for the names of the old ids
+ * elapsed:     duration of the traversal in seconds
+ * lstats:      number of timed lstat calls, 0 if they weren't timed
+ * lstat_ns:    time spent in the timed lstat calls
+ * threads:     number of worker threads
+ *
+ */
+    report_table_t  all;
+    report_entry_t  *e, *list = NULL, sum;
+    size_t          i, j, n = 0, changing = 0;
+    double          latency = 0.0, estimate;
+
+    memset(&all, 0, sizeof (report_table_t));
+    memset(&sum, 0, sizeof (report_entry_t));
+    for (i = 0; i < ntables; i++) {
+        for (j = 0; j < tables[i].size; j++) {
+            if (!tables[i].entries[j].used)
+                continue;
+            e = report_get(&all, tables[i].entries[j].uid, tables[i].entries[j].gid);
+            e->files += tables[i].entries[j].files;
+            e->dirs += tables[i].entries[j].dirs;
+            e->links += tables[i].entries[j].links;
+            e->bytes += tables[i].entries[j].bytes;
+            e->chowns += tables[i].entries[j].chowns;
+        }
+        free(tables[i].entries);
+    }
+    free(tables);
+    tables = NULL;
+    ntables = 0;
+    if (all.count > 0 && (list = (report_entry_t *) malloc(all.count * sizeof (report_entry_t))) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for report\n");
+        exit(ENOMEM);
+    }
+    for (j = 0; j < all.size; j++) {
+        if (all.entries[j].used)
+            list[n++] = all.entries[j];
+    }
+    free(all.entries);
+    if (n > 1)
+        qsort(list, n, sizeof (report_entry_t), report_cmp);
+
+    fprintf(fp, "%11s %-16s %11s %-16s %12s %12s %12s %16s %12s\n", "UID", "NAME", "GID", "NAME", "FILES", "DIRECTORIES", "LINKS", "BYTES", "LCHOWN");
+    for (i = 0; i < n; i++) {
+        e = &list[i];
+        fprintf(fp, "%11u %-16s %11u %-16s %12lu %12lu %12lu %16lu %12lu\n", e->uid, report_name(umap, e->uid), e->gid, report_name(gmap, e->gid), e->files, e->dirs, e->links, e->bytes, e->chowns);
+        sum.files += e->files;
+        sum.dirs += e->dirs;
+        sum.links += e->links;
+        sum.bytes += e->bytes;
+        sum.chowns += e->chowns;
+        if (e->chowns > 0)
+            changing++;
+    }
+    free(list);
+    fprintf(fp, "%-57s %12lu %12lu %12lu %16lu %12lu\n", "TOTAL", sum.files, sum.dirs, sum.links, sum.bytes, sum.chowns);
+    fprintf(fp, "owner pairs: %lu, %lu of them to be changed\n", (unsigned long) n, (unsigned long) changing);
+    fprintf(fp, "traversal: %.1f s with %lu threads\n", elapsed, (unsigned long) threads);
+    if (lstats > 0) {
+        latency = (double) lstat_ns / (double) lstats / 1e9;
+        estimate = elapsed + (double) sum.chowns * latency / (double) ((threads > 0) ? threads : 1);
+        fprintf(fp, "mean lstat latency: %.1f us\n", latency * 1e6);
+        fprintf(fp, "estimated runtime: %.1f s (traversal plus %lu lchown calls at the lstat latency)\n", estimate, sum.chowns);
+    } else {
+        fprintf(fp, "estimated runtime: lstat calls weren't timed, no estimate\n");
+    }
+}
@@ -0,0 +1,340 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * rollback of the changes recorded in a journal
+ *
+ * The journal is loaded into memory as a list of work units, each holding up to
+ * ROLLBACK_CHUNK consecutive change records of one directory. The worker threads take units
+ * one after the other; a thread opens the directory of its unit once and restores the entries
+ * relative to it with fstatat/fchownat, so the cost depends on the number of changed entries
+ * only, no tree is traversed. An entry is only restored if it is still the recorded inode
+ * (same device and inode number) and still owned by the new UID/GID; UID and GID are checked
+ * and restored independently.
+ */
+
+#include "chuid.h"
+
+extern short int        verbose;
+
+typedef struct rb_entry {
+    journal_rec_t       rec;
+    size_t              name;
+} rb_entry_t;
+
+typedef struct rb_unit {
+    size_t              path;
+    size_t              first;
+    size_t              count;
+} rb_unit_t;
+
+typedef struct rb_counters {
+    unsigned long       restored;
+    unsigned long       skipped;
+    unsigned long       failed;
+} rb_counters_t;
+
+static rb_entry_t       *entries = NULL;
+static size_t           nentries = 0, entries_size = 0;
+static rb_unit_t        *units = NULL;
+static size_t           nunits = 0, units_size = 0;
+static char             *names = NULL;
+static size_t           names_len = 0, names_size = 0;
+static size_t           next_unit = 0;
+static short int        rb_stop = 0;
+static short int        rb_dryrun = 0;
+static rb_counters_t    rb_total;
+static pthread_mutex_t  thr_rollback = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t
+        rb_string(const char *s) {
+
+/*
+ * Description:
+ * Copies a string into the name pool and returns its offset.
+ *
+ */
+    size_t  len = strlen(s) + 1, off = names_len;
+
+    if (names_len + len > names_size) {
+        names_size = (names_size == 0) ? 64 * 1024 : 2 * names_size;
+        if (names_size < names_len + len)
+            names_size = names_len + len;
+        if ((names = (char *) realloc(names, names_size)) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for rollback names\n");
+            exit(ENOMEM);
+        }
+    }
+    memcpy(names + names_len, s, len);
+    names_len += len;
+    return off;
+}
+
+static int
+        rb_add(const journal_rec_t *rec, const char *dirname, const char *name, void *arg) {
+
+/*
+ * Description:
+ * journal_read callback: appends a change record, starting a new work unit if the directory
+ * differs from the one of the last unit or that unit is full.
+ *
+ */
+    rb_unit_t   *u = (nunits > 0) ? &units[nunits - 1] : NULL;
+
+    if (u == NULL || u->count >= ROLLBACK_CHUNK || strcmp(names + u->path, dirname) != 0) {
+        if (nunits >= units_size) {
+            units_size = (units_size == 0) ? 1024 : 2 * units_size;
+            if ((units = (rb_unit_t *) realloc(units, units_size * sizeof (rb_unit_t))) == NULL) {
+                fprintf(stderr, "ERROR: No memory available for rollback units\n");
+                exit(ENOMEM);
+            }
+        }
+        u = &units[nunits++];
+        u->path = (u > units && strcmp(names + u[-1].path, dirname) == 0) ? u[-1].path : rb_string(dirname);
+        u->first = nentries;
+        u->count = 0;
+    }
+    if (nentries >= entries_size) {
+        entries_size = (entries_size == 0) ? 4096 : 2 * entries_size;
+        if ((entries = (rb_entry_t *) realloc(entries, entries_size * sizeof (rb_entry_t))) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for rollback entries\n");
+            exit(ENOMEM);
+        }
+    }
+    entries[nentries].rec = *rec;
+    entries[nentries].name = rb_string(name);
+    nentries++;
+    u->count++;
+    return 0;
+}
+
+static const char *
+        rb_kind(const uint8_t kind) {
+
+    switch (kind) {
+        case 'F':
+            return "FILE";
+        case 'D':
+            return "DIRECTORY";
+        case 'L':
+            return "LINK";
+    }
+    return "OTHER";
+}
+
+static void
+        rb_skip(const char *path, const char *reason) {
+
+    char    *msg = NULL;
+    size_t  len = strlen(path) + strlen(reason) + 20;
+
+    if ((msg = (char *) malloc(sizeof (char) * len)) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for message string\n");
+        exit(ENOMEM);
+    }
+    snprintf(msg, len, "%s not restored: %s", path, reason);
+    print_error_r(WARNING, msg);
+    free(msg);
+}
+
+static void
+        rb_entry(const int dfd, const char *dirname, const rb_entry_t *e, rb_counters_t *cnt) {
+
+/*
+ * Description:
+ * Restores the old owner of one entry if it still is the recorded inode and still carries
+ * the new UID and/or GID.
+ *
+ * Parameters:
+ * dfd:         descriptor of the entry's directory
+ * dirname:     path of the entry's directory, for messages
+ * e:           change record
+ * cnt:         counters of the calling thread
+ *
+ */
+    const journal_rec_t *r = &e->rec;
+    const char  *name = names + e->name;
+    struct stat statbuf;
+    uid_t       uid = (uid_t) -1;
+    gid_t       gid = (gid_t) -1;
+    char        *path = NULL, *msg = NULL;
+    size_t      len, dlen = strlen(dirname), nlen = strlen(name);
+
+    len = dlen + nlen + 2;
+    if ((path = (char *) malloc(sizeof (char) * len)) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for Name string\n");
+        exit(ENOMEM);
+    }
+    memcpy(path, dirname, dlen);
+    path[dlen] = '/';
+    memcpy(path + dlen + 1, name, nlen + 1);
+    errno = 0;
+    if (fstatat(dfd, name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0) {
+        print_errno_r(WARNING, errno, "couldn't stat", path);
+        cnt->failed++;
+        free(path);
+        return;
+    }
+    if ((uint64_t) statbuf.st_dev != r->dev || (uint64_t) statbuf.st_ino != r->ino) {
+        rb_skip(path, "not the inode recorded in the journal");
+        cnt->skipped++;
+        free(path);
+        return;
+    }
+    if (r->newuid != r->olduid && (uint32_t) statbuf.st_uid == r->newuid)
+        uid = (uid_t) r->olduid;
+    if (r->newgid != r->oldgid && (uint32_t) statbuf.st_gid == r->newgid)
+        gid = (gid_t) r->oldgid;
+    if (uid == (uid_t) -1 && gid == (gid_t) -1) {
+        rb_skip(path, "owner changed since the journal was written");
+        cnt->skipped++;
+        free(path);
+        return;
+    }
+    len = strlen(path) + 120;
+    if ((msg = (char *) malloc(sizeof (char) * len)) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for message string\n");
+        exit(ENOMEM);
+    }
+    if (uid != (uid_t) -1 && gid != (gid_t) -1)
+        snprintf(msg, len, "%s (%s): %11u, uid restored to %11u, %11u, gid restored to %11u", path, rb_kind(r->kind), r->newuid, r->olduid, r->newgid, r->oldgid);
+    else if (uid != (uid_t) -1)
+        snprintf(msg, len, "%s (%s): %11u, uid restored to %11u", path, rb_kind(r->kind), r->newuid, r->olduid);
+    else
+        snprintf(msg, len, "%s (%s): %11u, gid restored to %11u", path, rb_kind(r->kind), r->newgid, r->oldgid);
+    errno = 0;
+    if (rb_dryrun) {
+        fprintf(stdout, "%s\n", msg);
+        cnt->restored++;
+    } else if (fchownat(dfd, name, uid, gid, AT_SYMLINK_NOFOLLOW) == 0) {
+        print_error_r(INFO, msg);
+        cnt->restored++;
+    } else {
+        print_errno_r(WARNING, errno, "couldn't restore owner of", path);
+        cnt->failed++;
+    }
+    free(msg);
+    free(path);
+}
+
+static void *
+        rb_worker(void *arg) {
+
+/*
+ * Description:
+ * Worker thread: restores the entries of one work unit after the other.
+ *
+ */
+    const unsigned int  tid = (unsigned int) *(size_t *) arg;
+    rb_counters_t       cnt = { 0, 0, 0 };
+    rb_unit_t           *u;
+    const char          *dirname;
+    size_t              i;
+    int                 dfd;
+
+    log_register(tid);
+    for (;;) {
+        pthread_mutex_lock(&thr_rollback);
+        if (rb_stop || next_unit >= nunits) {
+            pthread_mutex_unlock(&thr_rollback);
+            break;
+        }
+        u = &units[next_unit++];
+        pthread_mutex_unlock(&thr_rollback);
+        dirname = names + u->path;
+        errno = 0;
+        if ((dfd = open(dirname, O_RDONLY | O_DIRECTORY)) < 0) {
+            print_errno_r(WARNING, errno, "couldn't open", dirname);
+            cnt.failed += u->count;
+            continue;
+        }
+        for (i = u->first; i < u->first + u->count; i++)
+            rb_entry(dfd, dirname, &entries[i], &cnt);
+        errno = 0;
+        if (close(dfd) < 0)
+            print_errno_r(WARNING, errno, "can't close directory", dirname);
+    }
+    pthread_mutex_lock(&thr_rollback);
+    rb_total.restored += cnt.restored;
+    rb_total.skipped += cnt.skipped;
+    rb_total.failed += cnt.failed;
+    pthread_mutex_unlock(&thr_rollback);
+    return arg;
+}
+
+void
+        rollback_stop(void) {
+
+/*
+ * Description:
+ * Lets the rollback threads terminate after their current work unit.
+ *
+ */
+    pthread_mutex_lock(&thr_rollback);
+    rb_stop = 1;
+    pthread_mutex_unlock(&thr_rollback);
+}
+
+int
+        rollback(const char *path, pthread_t *threads, size_t *taskids, const size_t n, const short int dryrun) {
+
+/*
+ * Description:
+ * Restores the old owners of all entries recorded in a journal using n threads.
+ *
+ * Parameters:
+ * path:        name of the journal file
+ * threads:     array for n thread handles
+ * taskids:     array for n thread ids
+ * n:           number of threads
+ * dryrun:      only show the entries which would be restored
+ *
+ * Return value:
+ * exit status for the program
+ *
+ */
+    char    msg[256];
+    size_t  i;
+
+    if (journal_read(path, rb_add, NULL) != 0)
+        return EXIT_FAILURE;
+    if (verbose)
+        fprintf(stdout, "INFO: %lu changes in %lu work units to roll back\n", (unsigned long) nentries, (unsigned long) nunits);
+    rb_dryrun = dryrun;
+    log_init(n + 1);
+    for (i = 0; i < n; i++) {
+        taskids[i] = i;
+        errno = 0;
+        if (pthread_create(&threads[i], NULL, rb_worker, (void *) &taskids[i]) != 0) {
+            fprintf(stderr, "Worker thread %ld did not start!\n", (unsigned long) i);
+            exit(errno);
+        }
+    }
+    for (i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+    log_shutdown();
+    snprintf(msg, sizeof (msg), "rollback of <%.128s>: %lu restored, %lu skipped, %lu failed", path, rb_total.restored, rb_total.skipped, rb_total.failed);
+    print_error(INFO, msg);
+    if (verbose)
+        fprintf(stdout, "INFO: %s\n", msg);
+    free(entries);
+    free(units);
+    free(names);
+    entries = NULL;
+    units = NULL;
+    names = NULL;
+    nentries = nunits = names_len = 0;
+    return (rb_total.failed > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,245 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * per-thread slab allocator for queue elements, path names and message strings
+ *
+ * Every thread owns a cache with one free list per size class and a chunk it carves new
+ * objects from, so allocating and freeing doesn't take any lock. Objects may be freed by
+ * another thread than the one which allocated them (queue elements travel through the global
+ * deqs): they simply go to the free list of the freeing thread. If a free list grows beyond
+ * SLAB_CACHE_MAX objects, half of it is moved to a global depot, where caches running empty
+ * refill from before they carve new objects. Chunks are only released by slab_destroy.
+ */
+
+#include "chuid.h"
+
+#define SLAB_CLASSES    8
+#define SLAB_MIN_SHIFT  5       /* smallest class holds 32 bytes */
+#define SLAB_CHUNK_SIZE (256 * 1024)
+#define SLAB_CACHE_MAX  512
+#define SLAB_LARGE      0xff
+
+typedef union slab_hdr {
+    unsigned char       sclass;
+    union slab_hdr      *next;
+    long double         align;
+} slab_hdr_t;
+
+typedef struct slab_cache {
+    slab_hdr_t          *free_list[SLAB_CLASSES];
+    unsigned int        free_count[SLAB_CLASSES];
+    char                *chunk;
+    size_t              chunk_left;
+    char                pad[CACHE_LINE];
+} slab_cache_t;
+
+typedef struct slab_chunk {
+    struct slab_chunk   *next;
+} slab_chunk_t;
+
+static slab_cache_t     *caches = NULL;
+static size_t           ncaches = 0;
+static slab_chunk_t     *chunks = NULL;
+static slab_hdr_t       *depot[SLAB_CLASSES];
+static unsigned int     depot_count[SLAB_CLASSES];
+static pthread_mutex_t  thr_slab = PTHREAD_MUTEX_INITIALIZER;
+
+void
+        slab_init(const size_t n) {
+
+/*
+ * Description:
+ * Creates n thread caches.
+ *
+ * Parameters:
+ * n:           number of caches, one per thread using the allocator
+ *
+ */
+    if ((caches = (slab_cache_t *) calloc(n, sizeof(slab_cache_t))) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for slab caches\n");
+        exit(ENOMEM);
+    }
+    ncaches = n;
+}
+
+void
+        slab_destroy(void) {
+
+/*
+ * Description:
+ * Releases all chunks and caches. No object may be used afterwards.
+ *
+ */
+    slab_chunk_t    *cp, *next;
+
+    for (cp = chunks; cp != NULL; cp = next) {
+        next = cp->next;
+        free(cp);
+    }
+    chunks = NULL;
+    memset(depot, 0, sizeof(depot));
+    memset(depot_count, 0, sizeof(depot_count));
+    free(caches);
+    caches = NULL;
+    ncaches = 0;
+}
+
+static unsigned int
+        slab_class(const size_t size) {
+
+    unsigned int    c = 0;
+    size_t          s = (size_t) 1 << SLAB_MIN_SHIFT;
+
+    while (s < size + sizeof(slab_hdr_t)) {
+        s <<= 1;
+        c++;
+    }
+    return c;
+}
+
+static void *
+        slab_carve(slab_cache_t *sc, const unsigned int c) {
+
+/*
+ * Description:
+ * Carves a new object of size class c out of the cache's chunk, taking a new chunk if needed.
+ *
+ */
+    slab_chunk_t    *cp;
+    size_t          s = (size_t) 1 << (c + SLAB_MIN_SHIFT);
+    void            *p;
+
+    if (sc->chunk_left < s) {
+        if ((cp = (slab_chunk_t *) malloc(SLAB_CHUNK_SIZE)) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for slab chunk\n");
+            exit(ENOMEM);
+        }
+        pthread_mutex_lock(&thr_slab);
+        cp->next = chunks;
+        chunks = cp;
+        pthread_mutex_unlock(&thr_slab);
+        sc->chunk = (char *) cp + sizeof(slab_hdr_t);
+        sc->chunk_left = SLAB_CHUNK_SIZE - sizeof(slab_hdr_t);
+    }
+    p = sc->chunk;
+    sc->chunk += s;
+    sc->chunk_left -= s;
+    return p;
+}
+
+void *
+        slab_alloc(const unsigned int cache, const size_t size) {
+
+/*
+ * Description:
+ * Allocates size bytes from a thread cache. Requests larger than the biggest size class are
+ * passed on to malloc.
+ *
+ * Parameters:
+ * cache:       cache of the calling thread
+ * size:        number of bytes needed
+ *
+ */
+    slab_cache_t    *sc = &caches[cache];
+    slab_hdr_t      *h, *last;
+    unsigned int    c, i;
+
+    c = slab_class(size);
+    if (c >= SLAB_CLASSES) {
+        if ((h = (slab_hdr_t *) malloc(sizeof(slab_hdr_t) + size)) == NULL) {
+            fprintf(stderr, "ERROR: No memory available for slab object\n");
+            exit(ENOMEM);
+        }
+        h->sclass = SLAB_LARGE;
+        return h + 1;
+    }
+    if (sc->free_list[c] == NULL && depot[c] != NULL) {
+        pthread_mutex_lock(&thr_slab);
+        if ((h = depot[c]) != NULL) {
+            for (i = 1, last = h; i < SLAB_CACHE_MAX / 2 && last->next != NULL; i++)
+                last = last->next;
+            depot[c] = last->next;
+            depot_count[c] -= i;
+            last->next = NULL;
+            sc->free_list[c] = h;
+            sc->free_count[c] = i;
+        }
+        pthread_mutex_unlock(&thr_slab);
+    }
+    if ((h = sc->free_list[c]) != NULL) {
+        sc->free_list[c] = h->next;
+        sc->free_count[c]--;
+    } else {
+        h = (slab_hdr_t *) slab_carve(sc, c);
+    }
+    h->sclass = (unsigned char) c;
+    return h + 1;
+}
+
+void
+        slab_free(const unsigned int cache, void *ptr) {
+
+/*
+ * Description:
+ * Returns an object to the cache of the calling thread, whichever thread allocated it.
+ *
+ * Parameters:
+ * cache:       cache of the calling thread
+ * ptr:         object returned by slab_alloc or NULL
+ *
+ */
+    slab_cache_t    *sc = &caches[cache];
+    slab_hdr_t      *h, *last;
+    unsigned int    c, i;
+
+    if (ptr == NULL)
+        return;
+    h = (slab_hdr_t *) ptr - 1;
+    if (h->sclass == SLAB_LARGE) {
+        free(h);
+        return;
+    }
+    c = h->sclass;
+    h->next = sc->free_list[c];
+    sc->free_list[c] = h;
+    if (++sc->free_count[c] > SLAB_CACHE_MAX) {
+        for (i = 1, last = h; i < SLAB_CACHE_MAX / 2; i++)
+            last = last->next;
+        sc->free_list[c] = last->next;
+        sc->free_count[c] -= i;
+        pthread_mutex_lock(&thr_slab);
+        last->next = depot[c];
+        depot[c] = h;
+        depot_count[c] += i;
+        pthread_mutex_unlock(&thr_slab);
+    }
+}
+
+char *
+        slab_strdup(const unsigned int cache, const char *s) {
+
+/*
+ * Description:
+ * strdup using a thread cache.
+ *
+ */
+    size_t  len = strlen(s) + 1;
+    char    *p;
+
+    p = (char *) slab_alloc(cache, len);
+    memcpy(p, s, len);
+    return p;
+}
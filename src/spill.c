@@ -0,0 +1,261 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * spill file of pending directories in bounded mode (option --spill)
+ *
+ * If the queued nodes exceed the limit of bounded mode, threads write pending directories of
+ * their private deqs to a temporary file in the log directory and threads running out of work
+ * read them back. A record is a spill_rec_t followed by the directory path. Records are read
+ * in the order they were written; once all of them have been read the file is truncated. The
+ * file is unlinked right after it has been created, so nothing is left behind if chuid stops.
+ */
+
+#include "chuid.h"
+
+typedef struct spill_rec {
+    int64_t             dirpos;
+    uint32_t            namelen;
+    int32_t             fs;
+} spill_rec_t;
+
+static pthread_mutex_t  thr_spill = PTHREAD_MUTEX_INITIALIZER;
+static int              spill_fd = -1;
+static char             *spill_path = NULL;
+static off_t            spill_rd = 0;
+static off_t            spill_wr = 0;
+static long             spill_pending = 0;
+static unsigned long    spill_total = 0;
+static short int        spill_failed = 0;
+
+static int
+        spill_io(const short int out, void *buf, const size_t len, const off_t off) {
+
+/*
+ * Description:
+ * Writes (out = 1) or reads len bytes at offset off of the spill file.
+ *
+ * Return value:
+ * 0 on success, -1 with errno set otherwise
+ *
+ */
+    size_t  done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        if (out)
+            n = pwrite(spill_fd, (char *) buf + done, len - done, off + (off_t) done);
+        else
+            n = pread(spill_fd, (char *) buf + done, len - done, off + (off_t) done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == 0)
+                errno = EIO;
+            return -1;
+        }
+        done += (size_t) n;
+    }
+    return 0;
+}
+
+void
+        spill_open(const char *dir) {
+
+/*
+ * Description:
+ * Creates the spill file in dir. Exits if it can't be created.
+ *
+ */
+    size_t  len = strlen(dir) + 20;
+
+    if ((spill_path = (char *) malloc(sizeof (char) * len)) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for spill file string\n");
+        exit(ENOMEM);
+    }
+    snprintf(spill_path, len, "%s/chuid_spill.XXXXXX", dir);
+    errno = 0;
+    if ((spill_fd = mkstemp(spill_path)) < 0) {
+        fprintf(stderr, "ERROR: Couldn't create spill file <%s>: %s\n", spill_path, strerror(errno));
+        exit(errno);
+    }
+    unlink(spill_path);
+}
+
+short int
+        spill_put(const queue_element_t *qe) {
+
+/*
+ * Description:
+ * Appends a pending directory to the spill file. Batches can't be spilled. After a write
+ * error a warning is logged and nothing is spilled any more.
+ *
+ * Return value:
+ * 1 if the directory has been written, 0 if it has to stay in memory
+ *
+ */
+    spill_rec_t rec;
+    size_t      plen = (qe->parent != NULL) ? strlen(qe->parent->name) : 0;
+    size_t      nlen = strlen(qe->name);
+    off_t       off;
+    short int   ok = 0;
+
+    if (spill_fd < 0 || qe->batch != NULL)
+        return 0;
+    memset(&rec, 0, sizeof (spill_rec_t));
+    rec.dirpos = (int64_t) qe->dirpos;
+/*
+ * an element queued in bounded mode holds its name only, the path of its parent is prepended
+ */
+    rec.namelen = (uint32_t) (nlen + ((qe->parent != NULL) ? plen + 1 : 0));
+    rec.fs = (qe->fs != NULL) ? (int32_t) qe->fs->index : -1;
+    pthread_mutex_lock(&thr_spill);
+    errno = 0;
+    if (!spill_failed) {
+        off = spill_wr + (off_t) sizeof (spill_rec_t);
+        if (spill_io(1, &rec, sizeof (spill_rec_t), spill_wr) == 0 &&
+            (qe->parent == NULL || (spill_io(1, (char *) qe->parent->name, plen, off) == 0 && spill_io(1, (char *) "/", 1, off + (off_t) plen) == 0)) &&
+            spill_io(1, (char *) qe->name, nlen, off + (off_t) (rec.namelen - nlen)) == 0) {
+            spill_wr += (off_t) (sizeof (spill_rec_t) + rec.namelen);
+            spill_pending++;
+            spill_total++;
+            ok = 1;
+        } else {
+            print_errno_r(WARNING, errno, "couldn't write spill file", spill_path);
+            spill_failed = 1;
+        }
+    }
+    pthread_mutex_unlock(&thr_spill);
+    return ok;
+}
+
+char *
+        spill_get(long *fs, long *dirpos) {
+
+/*
+ * Description:
+ * Reads the next pending directory from the spill file.
+ *
+ * Parameters:
+ * fs:          set to the index of the root of the directory, -1 if unknown
+ * dirpos:      set to the position to continue the directory at
+ *
+ * Return value:
+ * path of the directory (to be freed by the caller), NULL if the spill file is empty
+ *
+ */
+    spill_rec_t rec;
+    char        *name = NULL;
+
+    pthread_mutex_lock(&thr_spill);
+    if (spill_pending > 0) {
+        errno = 0;
+        if (spill_io(0, &rec, sizeof (spill_rec_t), spill_rd) != 0 ||
+            (name = (char *) malloc(rec.namelen + 1)) == NULL ||
+            spill_io(0, name, rec.namelen, spill_rd + (off_t) sizeof (spill_rec_t)) != 0) {
+            fprintf(stderr, "ERROR: Couldn't read spill file: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        name[rec.namelen] = '\0';
+        *fs = (long) rec.fs;
+        *dirpos = (long) rec.dirpos;
+        spill_rd += (off_t) (sizeof (spill_rec_t) + rec.namelen);
+        if (--spill_pending == 0) {
+            spill_rd = spill_wr = 0;
+            if (ftruncate(spill_fd, 0) != 0)
+                print_errno_r(WARNING, errno, "couldn't truncate spill file", spill_path);
+        }
+    }
+    pthread_mutex_unlock(&thr_spill);
+    return name;
+}
+
+long
+        spill_count(void) {
+
+/*
+ * Description:
+ * Returns the number of directories in the spill file.
+ *
+ */
+    long    n;
+
+    pthread_mutex_lock(&thr_spill);
+    n = spill_pending;
+    pthread_mutex_unlock(&thr_spill);
+    return n;
+}
+
+void
+        spill_scan(void (*fn)(const long fs, const long dirpos, const char *name)) {
+
+/*
+ * Description:
+ * Calls fn for every directory in the spill file, e.g. to add it to a checkpoint. The spill
+ * file is locked meanwhile.
+ *
+ */
+    spill_rec_t rec;
+    char        *name = NULL;
+    size_t      size = 0;
+    off_t       off;
+    long        i;
+
+    pthread_mutex_lock(&thr_spill);
+    for (i = 0, off = spill_rd; i < spill_pending; i++) {
+        errno = 0;
+        if (spill_io(0, &rec, sizeof (spill_rec_t), off) != 0) {
+            print_errno_r(WARNING, errno, "couldn't read spill file", spill_path);
+            break;
+        }
+        if (rec.namelen + 1 > size) {
+            size = rec.namelen + 1;
+            if ((name = (char *) realloc(name, size)) == NULL) {
+                fprintf(stderr, "ERROR: No memory available for spill record\n");
+                exit(ENOMEM);
+            }
+        }
+        if (spill_io(0, name, rec.namelen, off + (off_t) sizeof (spill_rec_t)) != 0) {
+            print_errno_r(WARNING, errno, "couldn't read spill file", spill_path);
+            break;
+        }
+        name[rec.namelen] = '\0';
+        fn((long) rec.fs, (long) rec.dirpos, name);
+        off += (off_t) (sizeof (spill_rec_t) + rec.namelen);
+    }
+    pthread_mutex_unlock(&thr_spill);
+    free(name);
+}
+
+unsigned long
+        spill_close(void) {
+
+/*
+ * Description:
+ * Closes and thereby removes the spill file.
+ *
+ * Return value:
+ * number of directories spilled during the scan
+ *
+ */
+    if (spill_fd >= 0)
+        close(spill_fd);
+    spill_fd = -1;
+    free(spill_path);
+    spill_path = NULL;
+    spill_rd = spill_wr = 0;
+    spill_pending = 0;
+    return spill_total;
+}
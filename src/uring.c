@@ -0,0 +1,217 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * minimal io_uring engine for batched statx calls (Linux only)
+ *
+ * Each thread owns one ring. The ring is set up and driven through the raw io_uring_setup and
+ * io_uring_enter system calls, so no liburing is needed. Only statx is submitted: io_uring
+ * has no operation to change the owner of a file, so ownership changes stay synchronous.
+ * Submission and completion rings are shared with the kernel; their head and tail indices are
+ * accessed with acquire/release semantics as documented in io_uring(7).
+ */
+
+#include "chuid.h"
+
+#ifdef HAVE_IO_URING
+
+static unsigned int
+        ring_load(const unsigned int *p) {
+
+    return atomic_load_explicit((_Atomic unsigned int *) p, memory_order_acquire);
+}
+
+static void
+        ring_store(unsigned int *p, const unsigned int v) {
+
+    atomic_store_explicit((_Atomic unsigned int *) p, v, memory_order_release);
+}
+
+int
+        uring_init(uring_t *r, const unsigned int entries) {
+
+/*
+ * Description:
+ * Sets up a ring for up to entries requests in flight plus the buffers for their results.
+ *
+ * Parameters:
+ * r:           ring to be initialized
+ * entries:     queue depth
+ *
+ * Return value:
+ * 0 on success, -1 with errno set if the kernel refuses io_uring
+ *
+ */
+    struct io_uring_params  p;
+    char                    *sq, *cq;
+    int                     err;
+
+    memset(r, 0, sizeof (uring_t));
+    memset(&p, 0, sizeof (struct io_uring_params));
+    r->fd = -1;
+    if ((r->fd = (int) syscall(SYS_io_uring_setup, entries, &p)) < 0)
+        return -1;
+    r->entries = p.sq_entries;
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size)
+            r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = r->sq_ring_size;
+    }
+    if ((r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING)) == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else if ((r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+        r->cq_ring = NULL;
+        goto fail;
+    }
+    r->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+    if ((r->sqes = (struct io_uring_sqe *) mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+    sq = (char *) r->sq_ring;
+    cq = (char *) r->cq_ring;
+    r->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned int *) (sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int *) (sq + p.sq_off.array);
+    r->cq_head = (unsigned int *) (cq + p.cq_off.head);
+    r->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned int *) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    if ((r->names = (const char **) malloc(r->entries * sizeof (char *))) == NULL ||
+        (r->types = (unsigned char *) malloc(r->entries * sizeof (unsigned char))) == NULL ||
+        (r->stx = (struct statx *) malloc(r->entries * sizeof (struct statx))) == NULL ||
+        (r->res = (int *) malloc(r->entries * sizeof (int))) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for io_uring buffers\n");
+        exit(ENOMEM);
+    }
+    return 0;
+
+fail:
+    err = errno;
+    uring_free(r);
+    errno = err;
+    return -1;
+}
+
+void
+        uring_free(uring_t *r) {
+
+/*
+ * Description:
+ * Unmaps and closes a ring. Safe to call for a ring whose setup failed.
+ *
+ */
+    if (r->sqes != NULL)
+        munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring != NULL && r->cq_ring != r->sq_ring && r->cq_ring != MAP_FAILED)
+        munmap(r->cq_ring, r->cq_ring_size);
+    if (r->sq_ring != NULL && r->sq_ring != MAP_FAILED)
+        munmap(r->sq_ring, r->sq_ring_size);
+    if (r->fd >= 0)
+        close(r->fd);
+    free(r->names);
+    free(r->types);
+    free(r->stx);
+    free(r->res);
+    memset(r, 0, sizeof (uring_t));
+    r->fd = -1;
+}
+
+int
+        uring_statx(uring_t *r, const int dfd, const unsigned int n) {
+
+/*
+ * Description:
+ * Submits statx (not following symbolic links) for r->names[0..n-1] relative to dfd and waits
+ * until all of them have completed. The result of request i is found in r->stx[i] if r->res[i]
+ * is 0; a negative r->res[i] is the negated error number. A request the kernel didn't
+ * complete keeps the value 1 in r->res[i] and has to be done synchronously by the caller.
+ *
+ * Parameters:
+ * r:           ring of the calling thread
+ * dfd:         directory the names are relative to
+ * n:           number of requests, at most r->entries
+ *
+ * Return value:
+ * 0 on success, -1 with errno set if io_uring_enter failed
+ *
+ */
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    unsigned int        i, tail, head, idx, done = 0, to_submit = n;
+    long                ret;
+
+    tail = *r->sq_tail;
+    for (i = 0; i < n; i++, tail++) {
+        idx = tail & r->sq_mask;
+        sqe = &r->sqes[idx];
+        memset(sqe, 0, sizeof (struct io_uring_sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = dfd;
+        sqe->addr = (unsigned long long) (uintptr_t) r->names[i];
+        sqe->len = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID | STATX_INO;
+        sqe->off = (unsigned long long) (uintptr_t) &r->stx[i];
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        sqe->user_data = i;
+        r->sq_array[idx] = idx;
+        r->res[i] = 1;
+    }
+    ring_store(r->sq_tail, tail);
+
+    while (done < n) {
+        ret = syscall(SYS_io_uring_enter, r->fd, to_submit, n - done, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        to_submit = ((unsigned long) ret >= to_submit) ? 0 : to_submit - (unsigned int) ret;
+        head = *r->cq_head;
+        while (head != ring_load(r->cq_tail)) {
+            cqe = &r->cqes[head & r->cq_mask];
+            if (cqe->user_data < n) {
+                r->res[cqe->user_data] = cqe->res;
+                done++;
+            }
+            head++;
+        }
+        ring_store(r->cq_head, head);
+    }
+    return 0;
+}
+
+void
+        statx_to_stat(const struct statx *stx, struct stat *statbuf) {
+
+/*
+ * Description:
+ * Copies the statx fields used for checking an entry into a struct stat.
+ *
+ */
+    memset(statbuf, 0, sizeof (struct stat));
+    statbuf->st_mode = (mode_t) stx->stx_mode;
+    statbuf->st_nlink = (nlink_t) stx->stx_nlink;
+    statbuf->st_uid = (uid_t) stx->stx_uid;
+    statbuf->st_gid = (gid_t) stx->stx_gid;
+    statbuf->st_ino = (ino_t) stx->stx_ino;
+    statbuf->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+}
+
+#endif /* HAVE_IO_URING */
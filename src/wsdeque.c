@@ -0,0 +1,192 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Chase-Lev work stealing deque of queue elements
+ *
+ * The owning thread pushes and takes elements at the bottom (LIFO, i.e. depth-first), any
+ * other thread steals the oldest element at the top, which is the root of the largest
+ * subtree still pending. Only a steal racing with the owner for the last element needs a
+ * compare-and-swap; no locks are taken. Memory orderings follow Le, Pop, Cohen and
+ * Zappa Nardelli, "Correct and Efficient Work-Stealing for Weak Memory Models" (PPoPP 2013).
+ * The circular array is grown by the owner only; replaced arrays are kept until ws_destroy
+ * since a thief may still be reading them.
+ */
+
+#include "chuid.h"
+
+#ifdef HAVE_STDATOMIC_H
+
+static ws_array_t *
+        ws_array_new(const long size, ws_array_t *prev) {
+
+    ws_array_t  *a;
+    long        i;
+
+    if ((a = (ws_array_t *) malloc(sizeof(ws_array_t))) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for work stealing deque\n");
+        exit(ENOMEM);
+    }
+    if ((a->buf = (_Atomic(queue_element_t *) *) malloc(sizeof(_Atomic(queue_element_t *)) * (size_t) size)) == NULL) {
+        fprintf(stderr, "ERROR: No memory available for work stealing deque\n");
+        exit(ENOMEM);
+    }
+    for (i = 0; i < size; i++)
+        atomic_init(&a->buf[i], NULL);
+    a->size = size;
+    a->prev = prev;
+    return a;
+}
+
+void
+        ws_init(ws_deque_t *dq, const long size) {
+
+/*
+ * Description:
+ * Initializes an empty deque.
+ *
+ * Parameters:
+ * dq:          deque
+ * size:        initial capacity, has to be a power of 2
+ *
+ */
+    atomic_init(&dq->top, 0);
+    atomic_init(&dq->bottom, 0);
+    atomic_init(&dq->array, ws_array_new(size, NULL));
+}
+
+void
+        ws_destroy(ws_deque_t *dq) {
+
+    ws_array_t  *a, *prev;
+
+    for (a = atomic_load_explicit(&dq->array, memory_order_relaxed); a != NULL; a = prev) {
+        prev = a->prev;
+        free(a->buf);
+        free(a);
+    }
+    atomic_store_explicit(&dq->array, NULL, memory_order_relaxed);
+}
+
+static ws_array_t *
+        ws_grow(ws_array_t *a, const long bottom, const long top) {
+
+    ws_array_t  *n;
+    long        i;
+
+    n = ws_array_new(2 * a->size, a);
+    for (i = top; i < bottom; i++)
+        atomic_store_explicit(&n->buf[i & (n->size - 1)], atomic_load_explicit(&a->buf[i & (a->size - 1)], memory_order_relaxed), memory_order_relaxed);
+    return n;
+}
+
+void
+        ws_push(ws_deque_t *dq, queue_element_t *qe) {
+
+/*
+ * Description:
+ * Pushes an element at the bottom. Owner only.
+ *
+ */
+    long        b, t;
+    ws_array_t  *a;
+
+    b = atomic_load_explicit(&dq->bottom, memory_order_relaxed);
+    t = atomic_load_explicit(&dq->top, memory_order_acquire);
+    a = atomic_load_explicit(&dq->array, memory_order_relaxed);
+    if (b - t > a->size - 1) {
+        a = ws_grow(a, b, t);
+        atomic_store_explicit(&dq->array, a, memory_order_release);
+    }
+    atomic_store_explicit(&a->buf[b & (a->size - 1)], qe, memory_order_relaxed);
+    atomic_store_explicit(&dq->bottom, b + 1, memory_order_release);
+}
+
+queue_element_t *
+        ws_take(ws_deque_t *dq) {
+
+/*
+ * Description:
+ * Takes the newest element from the bottom. Owner only.
+ *
+ * Return value:
+ * element or NULL if the deque is empty
+ *
+ */
+    long            b, t;
+    ws_array_t      *a;
+    queue_element_t *qe = NULL;
+
+    b = atomic_load_explicit(&dq->bottom, memory_order_relaxed) - 1;
+    a = atomic_load_explicit(&dq->array, memory_order_relaxed);
+    atomic_store_explicit(&dq->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    t = atomic_load_explicit(&dq->top, memory_order_relaxed);
+    if (t <= b) {
+        qe = atomic_load_explicit(&a->buf[b & (a->size - 1)], memory_order_relaxed);
+        if (t == b) {
+            /* last element: race against thieves */
+            if (!atomic_compare_exchange_strong_explicit(&dq->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+                qe = NULL;
+            atomic_store_explicit(&dq->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&dq->bottom, b + 1, memory_order_relaxed);
+    }
+    return qe;
+}
+
+queue_element_t *
+        ws_steal(ws_deque_t *dq) {
+
+/*
+ * Description:
+ * Steals the oldest element from the top. May be called by any thread.
+ *
+ * Return value:
+ * element or NULL if the deque is empty or the steal lost a race
+ *
+ */
+    long            b, t;
+    ws_array_t      *a;
+    queue_element_t *qe = NULL;
+
+    t = atomic_load_explicit(&dq->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    b = atomic_load_explicit(&dq->bottom, memory_order_acquire);
+    if (t < b) {
+        a = atomic_load_explicit(&dq->array, memory_order_acquire);
+        qe = atomic_load_explicit(&a->buf[t & (a->size - 1)], memory_order_relaxed);
+        if (!atomic_compare_exchange_strong_explicit(&dq->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+            return NULL;
+    }
+    return qe;
+}
+
+long
+        ws_size(ws_deque_t *dq) {
+
+/*
+ * Description:
+ * Returns the (approximate) number of elements, for statistics only.
+ *
+ */
+    long    n;
+
+    n = atomic_load_explicit(&dq->bottom, memory_order_relaxed) - atomic_load_explicit(&dq->top, memory_order_relaxed);
+    return (n > 0) ? n : 0;
+}
+
+#endif /* HAVE_STDATOMIC_H */